@@ -1,7 +1,43 @@
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
 #include <limits>
+#include <map>
 #include <mutex>
+#include <numeric>
 #include <random>
+#include <sstream>
 #include <thread>
+#include <unordered_set>
+
+#include <Eigen/Sparse>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+// FeatureKdTree has variables named near and far
+#undef near
+#undef far
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 #include "glad/gl.h"
 #include "imgui.h"
@@ -9,6 +45,7 @@
 #include "imgui_impl_opengl3.h"
 #include "nlohmann/json.hpp"
 #include "ugu/camera.h"
+#include "ugu/correspondence/correspondence_finder.h"
 #include "ugu/image_io.h"
 #include "ugu/inpaint/inpaint.h"
 #include "ugu/point.h"
@@ -20,6 +57,7 @@
 #include "ugu/timer.h"
 #include "ugu/util/image_util.h"
 #include "ugu/util/string_util.h"
+#include "ugu/util/thread_util.h"
 // #define GL_SILENCE_DEPRECATION
 // #if defined(IMGUI_IMPL_OPENGL_ES2)
 // #include <GLES2/gl2.h>
@@ -45,6 +83,352 @@ void WriteIdsJson(const std::string &path, const std::vector<uint32_t> &ids) {
   ofs << j;
 }
 
+#ifdef DEVENIR_USE_PROFILER
+// Scoped CPU spans from the main and algorithm threads, plus GPU spans
+// measured by timestamp queries. Spans older than kHistorySec are dropped.
+// GPU spans are put on their own track at the CPU time they were issued.
+class Profiler {
+ public:
+  static constexpr double kHistorySec = 10.0;
+  // Track of GPU spans. CPU threads are numbered from 1.
+  static constexpr uint32_t kGpuTid = 0;
+
+  struct Event {
+    const char *name;
+    uint32_t tid;
+    int64_t begin_us;
+    int64_t dur_us;
+  };
+
+  struct StageStat {
+    const char *name;
+    uint32_t tid;
+    double avg_ms;
+    double max_ms;
+  };
+
+  struct GpuQuery {
+    const char *name = nullptr;
+    int64_t begin_us = 0;
+    GLuint begin = 0;
+    GLuint end = 0;
+  };
+
+  Profiler() : origin_(std::chrono::steady_clock::now()) {}
+
+  int64_t NowUs() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - origin_)
+        .count();
+  }
+
+  uint32_t ThreadId() {
+    thread_local const uint32_t tid = next_tid_++;
+    return tid;
+  }
+
+  void SetThreadName(const std::string &name) {
+    const uint32_t tid = ThreadId();
+    std::lock_guard<std::mutex> lock(mtx_);
+    thread_names_[tid] = name;
+  }
+
+  void Record(const char *name, uint32_t tid, int64_t begin_us,
+              int64_t end_us) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    events_.push_back({name, tid, begin_us, end_us - begin_us});
+    const int64_t oldest = end_us - static_cast<int64_t>(kHistorySec * 1e6);
+    while (!events_.empty() &&
+           events_.front().begin_us + events_.front().dur_us < oldest) {
+      events_.pop_front();
+    }
+  }
+
+  // Timestamp queries need GL 3.3 or ARB_timer_query
+  void SetGpuTimerAvailable(bool available) { gpu_available_ = available; }
+  bool gpu_timer_available() const { return gpu_available_; }
+
+  // GL calls below must be made in the main thread
+  GpuQuery BeginGpu(const char *name) {
+    GpuQuery query;
+    if (!gpu_available_) {
+      return query;
+    }
+    query.name = name;
+    query.begin_us = NowUs();
+    query.begin = AcquireQuery();
+    query.end = AcquireQuery();
+    glQueryCounter(query.begin, GL_TIMESTAMP);
+    return query;
+  }
+
+  void EndGpu(const GpuQuery &query) {
+    if (query.name == nullptr) {
+      return;
+    }
+    glQueryCounter(query.end, GL_TIMESTAMP);
+    pending_.push_back(query);
+  }
+
+  // Records GPU spans whose results arrived. Queries complete in issue
+  // order, so polling stops at the first pending one.
+  void CollectGpu() {
+    while (!pending_.empty()) {
+      const GpuQuery &query = pending_.front();
+      GLint available = 0;
+      glGetQueryObjectiv(query.end, GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available) {
+        break;
+      }
+      GLuint64 begin_ns = 0, end_ns = 0;
+      glGetQueryObjectui64v(query.begin, GL_QUERY_RESULT, &begin_ns);
+      glGetQueryObjectui64v(query.end, GL_QUERY_RESULT, &end_ns);
+      const int64_t dur_us = static_cast<int64_t>((end_ns - begin_ns) / 1000);
+      Record(query.name, kGpuTid, query.begin_us, query.begin_us + dur_us);
+      free_queries_.push_back(query.begin);
+      free_queries_.push_back(query.end);
+      pending_.pop_front();
+    }
+  }
+
+  // Per-frame average and maximum of each stage over the last window_sec.
+  // Frames are counted by spans named frame_name.
+  std::vector<StageStat> Stats(double window_sec,
+                               const char *frame_name) const {
+    std::vector<StageStat> stats;
+    std::vector<double> totals;
+    std::vector<int64_t> counts;
+    int frame_num = 0;
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      const int64_t from = NowUs() - static_cast<int64_t>(window_sec * 1e6);
+      for (auto it = events_.rbegin(); it != events_.rend(); ++it) {
+        if (it->begin_us < from) {
+          break;
+        }
+        if (std::strcmp(it->name, frame_name) == 0) {
+          frame_num++;
+        }
+        size_t k = 0;
+        while (k < stats.size() && (stats[k].tid != it->tid ||
+                                    std::strcmp(stats[k].name, it->name))) {
+          k++;
+        }
+        if (k == stats.size()) {
+          stats.push_back({it->name, it->tid, 0.0, 0.0});
+          totals.push_back(0.0);
+        }
+        const double ms = it->dur_us / 1000.0;
+        totals[k] += ms;
+        stats[k].max_ms = std::max(stats[k].max_ms, ms);
+      }
+    }
+    for (size_t k = 0; k < stats.size(); k++) {
+      stats[k].avg_ms = totals[k] / std::max(frame_num, 1);
+    }
+    std::sort(stats.begin(), stats.end(),
+              [](const StageStat &a, const StageStat &b) {
+                return a.tid != b.tid ? a.tid < b.tid : a.avg_ms > b.avg_ms;
+              });
+    return stats;
+  }
+
+  // Writes the history in the Trace Event Format read by chrome://tracing
+  // and Perfetto
+  bool WriteChromeTrace(const std::string &path) const {
+    nlohmann::json trace_events = nlohmann::json::array();
+    {
+      std::lock_guard<std::mutex> lock(mtx_);
+      trace_events.push_back({{"name", "thread_name"},
+                              {"ph", "M"},
+                              {"pid", 0},
+                              {"tid", kGpuTid},
+                              {"args", {{"name", "GPU"}}}});
+      for (const auto &[tid, name] : thread_names_) {
+        trace_events.push_back({{"name", "thread_name"},
+                                {"ph", "M"},
+                                {"pid", 0},
+                                {"tid", tid},
+                                {"args", {{"name", name}}}});
+      }
+      for (const auto &e : events_) {
+        trace_events.push_back({{"name", e.name},
+                                {"cat", e.tid == kGpuTid ? "gpu" : "cpu"},
+                                {"ph", "X"},
+                                {"pid", 0},
+                                {"tid", e.tid},
+                                {"ts", e.begin_us},
+                                {"dur", e.dur_us}});
+      }
+    }
+    std::ofstream ofs(path);
+    if (!ofs) {
+      return false;
+    }
+    nlohmann::json j;
+    j["traceEvents"] = trace_events;
+    j["displayTimeUnit"] = "ms";
+    ofs << j;
+    return true;
+  }
+
+ private:
+  GLuint AcquireQuery() {
+    if (free_queries_.empty()) {
+      GLuint query = 0;
+      glGenQueries(1, &query);
+      return query;
+    }
+    GLuint query = free_queries_.back();
+    free_queries_.pop_back();
+    return query;
+  }
+
+  const std::chrono::steady_clock::time_point origin_;
+  std::atomic<uint32_t> next_tid_{1};
+  mutable std::mutex mtx_;
+  std::deque<Event> events_;
+  std::map<uint32_t, std::string> thread_names_;
+
+  bool gpu_available_ = false;
+  std::deque<GpuQuery> pending_;
+  std::vector<GLuint> free_queries_;
+};
+Profiler g_profiler;
+bool g_show_profiler = false;
+
+class ProfileScope {
+ public:
+  explicit ProfileScope(const char *name)
+      : name_(name), begin_us_(g_profiler.NowUs()) {}
+  ~ProfileScope() {
+    g_profiler.Record(name_, g_profiler.ThreadId(), begin_us_,
+                      g_profiler.NowUs());
+  }
+
+ private:
+  const char *name_;
+  int64_t begin_us_;
+};
+
+class GpuProfileScope {
+ public:
+  explicit GpuProfileScope(const char *name)
+      : query_(g_profiler.BeginGpu(name)) {}
+  ~GpuProfileScope() { g_profiler.EndGpu(query_); }
+
+ private:
+  Profiler::GpuQuery query_;
+};
+
+#define DEVENIR_CONCAT_IMPL(a, b) a##b
+#define DEVENIR_CONCAT(a, b) DEVENIR_CONCAT_IMPL(a, b)
+// name must be a string literal
+#define PROFILE_SCOPE(name) \
+  ProfileScope DEVENIR_CONCAT(profile_scope_, __LINE__)(name)
+#define PROFILE_GPU_SCOPE(name) \
+  GpuProfileScope DEVENIR_CONCAT(gpu_profile_scope_, __LINE__)(name)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_GPU_SCOPE(name)
+#endif
+
+// Per-face flags packed in 64-bit words. Converted to face ids only for json
+// and ugu APIs.
+class FaceMask {
+ public:
+  FaceMask() = default;
+  explicit FaceMask(size_t face_num) { Resize(face_num); }
+
+  void Resize(size_t face_num) {
+    size_ = face_num;
+    words_.resize((face_num + 63) / 64, 0);
+    if (size_ % 64 != 0) {
+      words_.back() &= (uint64_t(1) << (size_ % 64)) - 1;
+    }
+  }
+
+  size_t size() const { return size_; }
+
+  bool Test(uint32_t fid) const {
+    return fid < size_ && (words_[fid >> 6] >> (fid & 63)) & 1;
+  }
+
+  void Set(uint32_t fid, bool on = true) {
+    if (size_ <= fid) {
+      return;
+    }
+    const uint64_t bit = uint64_t(1) << (fid & 63);
+    if (on) {
+      words_[fid >> 6] |= bit;
+    } else {
+      words_[fid >> 6] &= ~bit;
+    }
+  }
+
+  void Reset() { std::fill(words_.begin(), words_.end(), 0); }
+
+  size_t bytes() const { return words_.capacity() * sizeof(uint64_t); }
+
+  bool Any() const {
+    return std::any_of(words_.begin(), words_.end(),
+                       [](uint64_t w) { return w != 0; });
+  }
+
+  size_t Count() const {
+    size_t count = 0;
+    for (const auto &w : words_) {
+      count += std::bitset<64>(w).count();
+    }
+    return count;
+  }
+
+  // Out of range ids are dropped
+  void SetIds(const std::vector<uint32_t> &ids) {
+    Reset();
+    for (const auto &fid : ids) {
+      Set(fid);
+    }
+  }
+
+  std::vector<uint32_t> ToIds() const {
+    std::vector<uint32_t> ids;
+    ids.reserve(Count());
+    for (size_t i = 0; i < words_.size(); i++) {
+      const uint64_t w = words_[i];
+      for (int bit = 0; bit < 64 && (w >> bit) != 0; bit++) {
+        if ((w >> bit) & 1) {
+          ids.push_back(static_cast<uint32_t>(i * 64 + bit));
+        }
+      }
+    }
+    return ids;
+  }
+
+  // Marks vertices touched by any masked face
+  std::vector<uint8_t> ToVertexMask(const std::vector<Eigen::Vector3i> &faces,
+                                    size_t vertex_num) const {
+    std::vector<uint8_t> masked(vertex_num, 0);
+    const size_t n = std::min(faces.size(), size_);
+    for (size_t fid = 0; fid < n; fid++) {
+      if (Test(static_cast<uint32_t>(fid))) {
+        for (int k = 0; k < 3; k++) {
+          masked[faces[fid][k]] = 1;
+        }
+      }
+    }
+    return masked;
+  }
+
+  bool operator==(const FaceMask &rhs) const {
+    return size_ == rhs.size_ && words_ == rhs.words_;
+  }
+
+ private:
+  std::vector<uint64_t> words_;
+  size_t size_ = 0;
+};
+
 Eigen::Vector2d g_prev_cursor_pos;
 Eigen::Vector2d g_cursor_pos;
 Eigen::Vector2d g_mouse_l_pressed_pos;
@@ -58,6 +442,13 @@ std::string g_error_message;
 
 std::string g_callback_message;
 bool g_callback_finished = true;
+// Outcome of the last algorithm run. Written by workers before they return to
+// HALTING, so it is valid once IsAnyAlgorithmRunning() is false.
+bool g_callback_succeeded = true;
+// Set outside the General window to open its "Algorithm Callback" popup
+bool g_open_callback_popup = false;
+// Set outside the General window to open its "Error" popup
+bool g_open_error_popup = false;
 
 bool g_to_process_drag_l = false;
 bool g_to_process_drag_m = false;
@@ -75,7 +466,26 @@ const double g_drag_point_pix_dist_th = 20.0;
 double g_mouse_wheel_yoffset = 0.0;
 bool g_to_process_wheel = false;
 
-const uint32_t MAX_N_SPLIT_WIDTH = 2;
+// Number of meshes a RendererGl can hold. Any number of meshes can be
+// loaded; each view gives slots to the meshes it shows, see
+// SplitViewInfo::slots.
+const size_t RENDERER_SLOT_NUM = 4;
+
+// Views are laid out in a grid of g_view_cols x g_view_rows, row-major
+const uint32_t MAX_N_VIEW_COLS = 4;
+const uint32_t MAX_N_VIEW_ROWS = 4;
+uint32_t g_view_cols = 2;
+uint32_t g_view_rows = 1;
+// Layout requested from UI, applied at the beginning of the next frame
+uint32_t g_pending_view_cols = 0;
+uint32_t g_pending_view_rows = 0;
+
+// Incremented when GL content changes in a way not covered by the per-mesh
+// revisions of Scene, so that cached view images are redrawn
+uint64_t g_render_revision = 0;
+// Unchanged views are restored from a cached image instead of being drawn.
+// Needs glBlitFramebuffer, i.e. desktop GL 3.0 or later.
+bool g_view_cache_available = false;
 
 int g_width = 1920;
 int g_height = 1080;
@@ -87,10 +497,6 @@ std::vector<SplitViewInfo> g_views;
 Eigen::Vector3f default_clear_color = {0.45f, 0.55f, 0.60f};
 Eigen::Vector3f default_wire_color = {0.1f, 0.1f, 0.1f};
 
-// Global geometry info
-std::vector<RenderableMeshPtr> g_meshes;
-std::vector<std::string> g_mesh_names;
-std::vector<std::string> g_mesh_paths;
 // std::vector<BvhPtr<Eigen::Vector3f, Eigen::Vector3i>> g_bvhs;
 
 struct CastRayResult {
@@ -98,18 +504,299 @@ struct CastRayResult {
   IntersectResult intersection;
 };
 
-std::unordered_map<RenderableMeshPtr, std::vector<CastRayResult>>
-    g_selected_positions;
+// Formatted rows of the point list, created on first display
+struct PointListCache {
+  uint64_t selected_revision = ~0ull;
+  uint64_t geometry_revision = ~0ull;
+  Eigen::Matrix4f model_matrix = Eigen::Matrix4f::Zero();
+  std::vector<std::string> rows;
+};
+
+Eigen::Vector3f GetPos(const CastRayResult &res);
+
+// Global geometry info. Per-mesh state is stored as dense arrays addressed
+// by the mesh index (== CastRayResult::min_geoid). RenderableMeshPtr
+// overloads resolve the index once and are meant for code outside of
+// per-frame and per-point loops.
+class Scene {
+ public:
+  uint32_t Add(const RenderableMeshPtr &mesh, const std::string &name,
+               const std::string &path) {
+    const auto id = static_cast<uint32_t>(meshes_.size());
+    ids_[mesh.get()] = id;
+    meshes_.push_back(mesh);
+    names_.push_back(name);
+    paths_.push_back(path);
+    model_matrices_.push_back(Eigen::Affine3f::Identity());
+    update_bvhs_.push_back(1);
+    geometry_revisions_.push_back(0);
+    uploaded_geometry_revisions_.push_back(0);
+    selected_positions_.emplace_back();
+    selected_points_.emplace_back();
+    selected_points_sources_.push_back({Eigen::Matrix4f::Identity(), 0});
+    selected_revisions_.push_back(0);
+    ignore_faces_.emplace_back(mesh->vertex_indices().size());
+    point_list_caches_.emplace_back();
+    return id;
+  }
+
+  void Clear() {
+    ids_.clear();
+    meshes_.clear();
+    names_.clear();
+    paths_.clear();
+    model_matrices_.clear();
+    update_bvhs_.clear();
+    geometry_revisions_.clear();
+    uploaded_geometry_revisions_.clear();
+    selected_positions_.clear();
+    selected_points_.clear();
+    selected_points_sources_.clear();
+    selected_revisions_.clear();
+    ignore_faces_.clear();
+    point_list_caches_.clear();
+  }
+
+  size_t size() const { return meshes_.size(); }
+  bool empty() const { return meshes_.empty(); }
+  const std::vector<RenderableMeshPtr> &meshes() const { return meshes_; }
+
+  uint32_t Id(const RenderableMeshPtr &mesh) const {
+    return ids_.at(mesh.get());
+  }
+
+  bool Has(const RenderableMeshPtr &mesh) const {
+    return ids_.count(mesh.get()) != 0;
+  }
+
+  const RenderableMeshPtr &mesh(size_t id) const { return meshes_[id]; }
+  const std::string &name(size_t id) const { return names_[id]; }
+  const std::string &path(size_t id) const { return paths_[id]; }
+
+  Eigen::Affine3f &model_matrix(size_t id) { return model_matrices_[id]; }
+  Eigen::Affine3f &model_matrix(const RenderableMeshPtr &mesh) {
+    return model_matrices_[Id(mesh)];
+  }
+
+  uint8_t &update_bvh(size_t id) { return update_bvhs_[id]; }
+  uint8_t &update_bvh(const RenderableMeshPtr &mesh) {
+    return update_bvhs_[Id(mesh)];
+  }
+
+  // Incremented whenever vertex positions of a mesh are overwritten
+  uint64_t &geometry_revision(size_t id) { return geometry_revisions_[id]; }
+  uint64_t &geometry_revision(const RenderableMeshPtr &mesh) {
+    return geometry_revisions_[Id(mesh)];
+  }
+
+  // Re-uploads vertex buffers if vertices were overwritten since the last
+  // upload. Must be called in the main thread.
+  void UploadChangedGeometry(size_t id) {
+    if (uploaded_geometry_revisions_[id] == geometry_revisions_[id]) {
+      return;
+    }
+    PROFILE_SCOPE("UploadChangedGeometry");
+    meshes_[id]->UpdateMesh();
+    uploaded_geometry_revisions_[id] = geometry_revisions_[id];
+  }
+
+  const std::vector<CastRayResult> &selected_positions(size_t id) const {
+    return selected_positions_[id];
+  }
+  const std::vector<CastRayResult> &selected_positions(
+      const RenderableMeshPtr &mesh) const {
+    return selected_positions_[Id(mesh)];
+  }
+
+  // World positions of selected_positions, in the form renderers take
+  const std::vector<Eigen::Vector3f> &selected_points(size_t id) const {
+    return selected_points_[id];
+  }
+
+  // Edits of selected positions. Single point edits touch only the edited
+  // element so that adding or dragging a landmark does not depend on the
+  // number of landmarks.
+  void AddSelectedPosition(size_t id, const CastRayResult &res) {
+    RefreshSelectedPoints(id);
+    selected_positions_[id].push_back(res);
+    selected_points_[id].push_back(GetPos(res));
+    selected_revisions_[id]++;
+  }
+  void SetSelectedPosition(size_t id, size_t idx, const CastRayResult &res) {
+    RefreshSelectedPoints(id);
+    selected_positions_[id][idx] = res;
+    selected_points_[id][idx] = GetPos(res);
+    selected_revisions_[id]++;
+  }
+  void RemoveSelectedPosition(size_t id, size_t idx) {
+    selected_positions_[id].erase(selected_positions_[id].begin() + idx);
+    selected_points_[id].erase(selected_points_[id].begin() + idx);
+    selected_revisions_[id]++;
+  }
+  void SetSelectedPositions(size_t id,
+                            const std::vector<CastRayResult> &results) {
+    selected_positions_[id] = results;
+    UpdateSelectedPoints(id);
+  }
+
+  // Recomputes world positions after the model matrix or vertices changed
+  void UpdateSelectedPoints(size_t id) {
+    auto &points = selected_points_[id];
+    points.resize(selected_positions_[id].size());
+    for (size_t i = 0; i < points.size(); i++) {
+      points[i] = GetPos(selected_positions_[id][i]);
+    }
+    selected_points_sources_[id] = {model_matrices_[id].matrix(),
+                                    geometry_revisions_[id]};
+    selected_revisions_[id]++;
+  }
+
+  // Recomputes world positions only if the model matrix or vertices changed
+  // since the last computation. Algorithms move meshes without touching
+  // selections, so this is checked every frame.
+  void RefreshSelectedPoints(size_t id) {
+    auto &source = selected_points_sources_[id];
+    if (source.geometry_revision == geometry_revisions_[id] &&
+        source.model_matrix == model_matrices_[id].matrix()) {
+      return;
+    }
+    if (selected_positions_[id].empty()) {
+      source = {model_matrices_[id].matrix(), geometry_revisions_[id]};
+      return;
+    }
+    UpdateSelectedPoints(id);
+  }
+
+  // Incremented whenever selected_positions of a mesh is edited
+  uint64_t &selected_revision(size_t id) { return selected_revisions_[id]; }
+  uint64_t &selected_revision(const RenderableMeshPtr &mesh) {
+    return selected_revisions_[Id(mesh)];
+  }
+
+  FaceMask &ignore_faces(size_t id) { return ignore_faces_[id]; }
+  FaceMask &ignore_faces(const RenderableMeshPtr &mesh) {
+    return ignore_faces_[Id(mesh)];
+  }
+
+  PointListCache &point_list_cache(size_t id) {
+    return point_list_caches_[id];
+  }
+
+ private:
+  std::unordered_map<const RenderableMesh *, uint32_t> ids_;
+  std::vector<RenderableMeshPtr> meshes_;
+  std::vector<std::string> names_;
+  std::vector<std::string> paths_;
+  std::vector<Eigen::Affine3f> model_matrices_;
+  std::vector<uint8_t> update_bvhs_;
+  std::vector<uint64_t> geometry_revisions_;
+  std::vector<uint64_t> uploaded_geometry_revisions_;
+  std::vector<std::vector<CastRayResult>> selected_positions_;
+  std::vector<std::vector<Eigen::Vector3f>> selected_points_;
+  // Model matrix and geometry revision selected_points_ were computed with
+  struct SelectedPointsSource {
+    Eigen::Matrix4f model_matrix;
+    uint64_t geometry_revision;
+  };
+  std::vector<SelectedPointsSource> selected_points_sources_;
+  std::vector<uint64_t> selected_revisions_;
+  std::vector<FaceMask> ignore_faces_;
+  std::vector<PointListCache> point_list_caches_;
+};
+Scene g_scene;
+
+// Correspondence index over world space vertices of a mesh
+struct CorrespIndex {
+  std::vector<Eigen::Vector3f> vertices;
+  CorrespFinderPtr finder;
+};
+using CorrespIndexPtr = std::shared_ptr<const CorrespIndex>;
+
+// Keeps correspondence indices of meshes between jobs, so that jobs against
+// an unchanged target skip building them. An index is rebuilt once its mesh
+// is edited (geometry_revision) or moved (model matrix).
+class CorrespIndexCache {
+ public:
+  CorrespIndexPtr Get(const RenderableMeshPtr &mesh,
+                      const Eigen::Affine3f &trans, uint64_t revision,
+                      int nn_num) {
+    PROFILE_SCOPE("CorrespIndexCache::Get");
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (auto it = entries_.begin(); it != entries_.end();) {
+      const auto &entry = it->second;
+      // Addresses of freed meshes may be reused
+      const bool stale =
+          entry.mesh.expired() ||
+          (it->first.first == mesh.get() &&
+           (entry.geometry_revision != revision ||
+            entry.model_matrix != trans.matrix()));
+      it = stale ? entries_.erase(it) : std::next(it);
+    }
+
+    auto &entry = entries_[{mesh.get(), nn_num}];
+    if (entry.index == nullptr) {
+      auto index = std::make_shared<CorrespIndex>();
+      for (const auto &v : mesh->vertices()) {
+        index->vertices.push_back(trans * v);
+      }
+      index->finder = KDTreeCorrespFinder::Create(
+          static_cast<uint32_t>(std::max(1, nn_num)));
+      index->finder->Init(index->vertices, mesh->vertex_indices());
+      entry.mesh = mesh;
+      entry.model_matrix = trans.matrix();
+      entry.geometry_revision = revision;
+      entry.index = index;
+    }
+    return entry.index;
+  }
+
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    entries_.clear();
+  }
 
-std::unordered_map<RenderableMeshPtr, Eigen::Affine3f> g_model_matrices;
-std::unordered_map<RenderableMeshPtr, bool> g_update_bvh;
-std::unordered_map<RenderableMeshPtr, std::vector<uint32_t>> g_ignore_poly_ids;
+ private:
+  struct Entry {
+    std::weak_ptr<RenderableMesh> mesh;
+    Eigen::Matrix4f model_matrix;
+    uint64_t geometry_revision = 0;
+    CorrespIndexPtr index;
+  };
+  std::mutex mtx_;
+  std::map<std::pair<const RenderableMesh *, int>, Entry> entries_;
+};
+CorrespIndexCache g_corresp_indices;
+
+enum class FaceSelectTool { NONE, BRUSH, LASSO };
+
+// Painting ignore faces with the left button. Faces are picked from the
+// face_id G-buffer of the view, read once per stroke.
+struct FaceSelectData {
+  FaceSelectTool tool = FaceSelectTool::NONE;
+  int brush_radius = 15;
+  bool erase = false;
+  bool show = true;
+  Eigen::Vector3f color = {255.f, 0.f, 255.f};
+
+  bool begin_stroke = false;
+  bool end_stroke = false;
+  bool stroking = false;
+  uint32_t view_id = ~0u;
+  GBuffer gbuf;
+  Eigen::Vector2d prev_pos;
+  std::vector<Eigen::Vector2f> lasso;
+
+  // Incremented whenever an ignore-face mask is edited, so that views
+  // rebuild their FaceSelectionOverlay
+  uint64_t revision = 0;
+};
+FaceSelectData g_face_select_data;
 
 bool g_first_frame = true;
 
 Eigen::Vector3f GetPos(const IntersectResult &intersection, uint32_t geoid) {
-  const auto &mesh = g_meshes.at(geoid);
-  const auto &trans = g_model_matrices.at(mesh);
+  const auto &mesh = g_scene.mesh(geoid);
+  const auto &trans = g_scene.model_matrix(geoid);
   const auto &face = mesh->vertex_indices()[intersection.fid];
   const auto &v0 = mesh->vertices()[face[0]];
   const auto &v1 = mesh->vertices()[face[1]];
@@ -135,27 +822,80 @@ std::vector<Eigen::Vector3f> ExtractPos(
   return poss;
 }
 
+enum class IcpSampling { ALL, UNIFORM, NORMAL_SPACE, CURVATURE };
+
+template <int Dim>
+class FeatureKdTree;
+
 struct IcpData {
   RenderableMeshPtr src_mesh;
+  // dst_points are vertices of dst_mesh at this revision and transform
+  RenderableMeshPtr dst_mesh;
+  Eigen::Affine3f dst_trans = Eigen::Affine3f::Identity();
+  uint64_t dst_revision = 0;
   std::vector<Eigen::Vector3f> src_points;
   std::vector<Eigen::Vector3f> dst_points;
   std::vector<Eigen::Vector3f> src_normals;
   std::vector<Eigen::Vector3f> dst_normals;
+  std::vector<Eigen::Vector3i> src_faces;
   std::vector<Eigen::Vector3i> dst_faces;
   IcpTerminateCriteria terminate_criteria;
   IcpCorrespCriteria corresp_criteria;
   IcpOutput output;
   bool with_scale = false;
   CorrespFinderPtr corresp_finder = nullptr;
+  // dst search structures. Built once per run on the worker by
+  // PrepareIcpDst() and shared by RigidIcp() and the specialized kernels
+  std::shared_ptr<FeatureKdTree<3>> dst_tree;
+  std::vector<Eigen::Vector3f> dst_face_normals;
   IcpCallbackFunc callback = nullptr;
   IcpCorrespType corresp_type = IcpCorrespType::kPointToPlane;
   IcpLossType loss_type = IcpLossType::kPointToPlane;
+
+  // src subsampling. With coarse_to_fine, levels run from
+  // sample_num / 4^(level_num - 1) samples up to sample_num, each starting
+  // from the previous level's result once it converges.
+  IcpSampling sampling = IcpSampling::ALL;
+  int sample_num = 5000;
+  bool coarse_to_fine = true;
+  int level_num = 3;
+  std::string level_label;
+  Eigen::Affine3f level_trans = Eigen::Affine3f::Identity();
+
+  // Use the kernel specialized for (corresp_type, loss_type, with_scale)
+  // instead of RigidIcp()
+  bool specialized = false;
+  bool benchmark = false;
+  int benchmark_iter = 10;
+};
+
+// Coarse alignment without hand-placed correspondences. Sizes <= 0 are
+// relative to the dst bounding box diagonal.
+struct GlobalAlignData {
+  RenderableMeshPtr src_mesh;
+  RenderableMeshPtr dst_mesh;
+  float voxel_size = -1.f;  // <= 0: diagonal / 50
+  float feature_radius = 5.f;  // x voxel_size
+  float inlier_dist = 1.5f;  // x voxel_size
+  int ransac_iter = 100000;
+  bool with_scale = false;
+  bool run_icp = true;
+
+  Eigen::Affine3f src2dst = Eigen::Affine3f::Identity();
+  size_t inlier_num = 0;
+  size_t corresp_num = 0;
 };
 
+enum class NonrigidIcpEngine { PER_VERTEX, DEFORMATION_GRAPH };
+
 struct NonrigidIcpData {
   RenderableMeshPtr src_mesh;
   RenderableMeshPtr dst_mesh;
 
+  NonrigidIcpEngine engine = NonrigidIcpEngine::PER_VERTEX;
+  int graph_node_num = 2000;
+  int graph_sample_num = 20000;
+
   bool check_self_itersection = false;
   float angle_rad_th = 0.65f;
   float dist_th = -1.f;
@@ -171,13 +911,258 @@ struct NonrigidIcpData {
 
   int max_internal_iter = 10;
   double min_frobenius_norm_diff = 2.0;
+
+  // Register to each target in sequence_paths after the selected target.
+  // Stiffness of each frame goes from sequence_max_alpha down to min_alpha,
+  // so sequence_max_alpha is kept >= min_alpha.
+  bool sequence_mode = false;
+  std::vector<std::string> sequence_paths;
+  std::string sequence_output_dir = ".";
+  double sequence_max_alpha = 1.0;
+  int sequence_step = 3;
 };
 
-struct TextransData {
+// UV-texel -> target-surface correspondence of texture transfer.
+// Texture flows from dst_mesh to src_mesh's UV space. Per-texel arrays are
+// stored as SoA over valid texels only so that any number of maps can be
+// gathered in a single pass.
+struct TextransCorresp {
   RenderableMeshPtr src_mesh;
   RenderableMeshPtr dst_mesh;
+  Eigen::Matrix4f src_trans = Eigen::Matrix4f::Identity();
+  Eigen::Matrix4f dst_trans = Eigen::Matrix4f::Identity();
+  uint64_t src_revision = 0;
+  uint64_t dst_revision = 0;
+  Eigen::Vector2i size = {0, 0};
+  FaceMask src_ignore_faces;
+
+  Image1b mask;
+  std::vector<uint32_t> texel_ids;  // y * width + x
+  std::vector<Eigen::Vector2f> dst_uvs;
+  std::vector<int> dst_material_ids;
+
+  bool IsValidFor(const RenderableMeshPtr &src, const Eigen::Affine3f &src_T,
+                  const RenderableMeshPtr &dst, const Eigen::Affine3f &dst_T,
+                  const Eigen::Vector2i &size_) const {
+    return src_mesh == src && dst_mesh == dst &&
+           src_trans == src_T.matrix() && dst_trans == dst_T.matrix() &&
+           src_revision == g_scene.geometry_revision(src) &&
+           dst_revision == g_scene.geometry_revision(dst) && size == size_ &&
+           src_ignore_faces == g_scene.ignore_faces(src);
+  }
+
+  void Clear() {
+    src_mesh = nullptr;
+    dst_mesh = nullptr;
+    mask = Image1b();
+    texel_ids.clear();
+    dst_uvs.clear();
+    dst_material_ids.clear();
+  }
+};
+
+// A texture set to be transferred. textures[i] is used for faces of
+// dst_mesh with material id i. Textures are held in float within the range
+// of depth (0-255 for CV_8U, 0-65535 for CV_16U, as stored for CV_32F) so
+// that normal and displacement maps keep the precision of their files.
+// Single channel maps are replicated to 3 channels.
+struct TextransMap {
+  std::string name;
+  int depth = CV_8U;
+  int channels = 3;
+  std::vector<Image3f> textures;
+};
+
+enum class TextransInpaintMethod { UGU, PUSH_PULL };
+
+// Settings of TextransData. The worker reads a copy taken at job start.
+struct TextransOptions {
   Eigen::Vector2i dst_size = {1024, 1024};
-  TexTransNoCorrespOutput output;
+  int nn_num = 10;
+  // Process UV space tile by tile and stream results to their files
+  // instead of holding full resolution images. The correspondence is not
+  // cached in this mode.
+  bool tiled = false;
+  int tile_size = 512;
+  int preview_size = 2048;
+  TextransInpaintMethod inpaint_method = TextransInpaintMethod::UGU;
+  // Push-pull fills texels within this distance (pixels) from charts only.
+  // Non-positive value fills the whole texture.
+  int inpaint_margin = 16;
+  // Copy texels across UV seams before push-pull
+  bool inpaint_seam_aware = true;
+  // Transfer per-vertex attributes instead of textures
+  bool vertex_mode = false;
+  bool vertex_colors = true;
+  bool vertex_normals = false;
+  // JSON of {"name": [value per dst vertex], ...}
+  std::string vertex_channels_path;
+  // Additional maps, one per line: "name=path_mat0;path_mat1;..."
+  std::string extra_maps;
+};
+
+struct TextransData : TextransOptions {
+  RenderableMeshPtr src_mesh;
+  RenderableMeshPtr dst_mesh;
+  TextransCorresp corresp;
+  std::vector<std::string> output_names;
+  std::vector<Image3b> outputs;
+};
+
+struct NonrigidIcpSweepResult {
+  NonrigidIcpData params;
+  bool succeeded = false;
+  double msec = 0.0;
+  double landmark_rms = -1.0;
+  double surface_rms = -1.0;
+  double surface_max = -1.0;
+};
+
+// Parameter grids as comma separated values. All combinations are run
+// concurrently with the other fields of g_nonrigidicp_data.
+struct NonrigidIcpSweepData {
+  RenderableMeshPtr src_mesh;
+  RenderableMeshPtr dst_mesh;
+  std::string max_alphas = "10.0";
+  std::string min_alphas = "0.1";
+  std::string betas = "100.0";
+  std::string gammas = "1.0";
+  std::string steps = "5,10";
+  std::string nn_nums = "10";
+  std::string angle_rad_ths = "0.65";
+  std::string dist_ths = "-1.0";
+  int num_threads = 4;
+  std::mutex results_mtx;
+  std::vector<NonrigidIcpSweepResult> results;
+};
+
+struct DeviationStats {
+  size_t count = 0;
+  double mean = 0.0;
+  double rms = 0.0;
+  double p50 = 0.0;
+  double p90 = 0.0;
+  double p95 = 0.0;
+  double p99 = 0.0;
+  double max = 0.0;
+};
+
+// Point-to-surface distances from src vertices to dst surface and the
+// reverse, both in world coordinates.
+struct DeviationData {
+  RenderableMeshPtr src_mesh;
+  RenderableMeshPtr dst_mesh;
+  bool bidirectional = true;
+  bool colorize = true;
+  float color_max = -1.f;  // <= 0: p95 of src
+  bool track_nonrigidicp = false;
+  std::string export_path = "deviation.json";
+
+  std::vector<float> src_dists;
+  std::vector<float> dst_dists;
+  DeviationStats src_stats;
+  DeviationStats dst_stats;
+  double hausdorff = 0.0;
+  double msec = 0.0;
+
+  RenderableMeshPtr colorized_mesh;
+  std::vector<Eigen::Vector3f> original_colors;
+};
+
+// Decimated copies of a mesh, ordered from fine to coarse
+struct LodProxies {
+  uint64_t geometry_revision = 0;
+  std::vector<RenderableMeshPtr> levels;
+};
+
+struct LodJob {
+  RenderableMeshPtr mesh;
+  uint64_t geometry_revision = 0;
+  MeshPtr snapshot;
+  int min_level_face_num = 0;
+  int max_level_num = 0;
+};
+
+// Level-of-detail proxies of large meshes, built by LodProcess() in the
+// background and drawn instead of the originals while the camera of a view
+// moves. Picking, face selection and still frames use the originals.
+struct LodData {
+  bool enable = true;
+  int min_face_num = 200000;  // Smaller meshes are always drawn as is
+  int min_level_face_num = 5000;
+  int max_level_num = 3;
+  float faces_per_pixel = 0.5f;  // Budget over the projected bounding sphere
+  float settle_sec = 0.3f;  // Full resolution once the camera stops
+
+  // Guarded by lod_mtx
+  std::deque<LodJob> jobs;
+  std::vector<std::pair<RenderableMeshPtr, LodProxies>> finished;
+  bool building = false;
+
+  // Main thread only
+  std::unordered_map<RenderableMeshPtr, LodProxies> proxies;
+  std::unordered_map<RenderableMeshPtr, uint64_t> requested;
+};
+
+// Grid used to decimate a mesh on import. Points on the decimated mesh are
+// mapped back to the original OBJ with it, see ReprojectToStreamSource().
+struct StreamSource {
+  std::string path;
+  Eigen::Vector3d origin = Eigen::Vector3d::Zero();
+  double cell_size = 0.0;
+  size_t face_num = 0;  // Triangles of the original
+};
+
+// Import of OBJs too large to load as is
+struct StreamImportData {
+  bool enable = false;
+  int target_face_num = 1000000;
+  std::unordered_map<RenderableMeshPtr, StreamSource> sources;
+};
+
+// "Export on original" job. Points are in local coordinates of the decimated
+// mesh and written in world coordinates.
+struct ReprojectData {
+  StreamSource source;
+  Eigen::Affine3f trans = Eigen::Affine3f::Identity();
+  std::vector<Eigen::Vector3f> local_points;
+  std::string export_path;
+  PointOnFaceType pof_type = PointOnFaceType::POINT_ON_TRIANGLE;
+};
+
+#ifdef _WIN32
+using SocketHandle = SOCKET;
+const SocketHandle kInvalidSocket = INVALID_SOCKET;
+#else
+using SocketHandle = int;
+const SocketHandle kInvalidSocket = -1;
+#endif
+
+// A JSON line received by ServerProcess() and the connection it came from
+struct ServerRequest {
+  uint64_t client = 0;
+  nlohmann::json body;
+};
+
+// Job server on a local socket. Clients send one JSON object per line and
+// get events of the request back as JSON lines. Jobs run one by one on the
+// algorithm thread, see ProcessServerRequests().
+struct ServerData {
+  // unix:<path> or tcp:[<host>:]<port>. Empty: disabled
+  std::string address;
+  // Load and export paths of jobs are relative to this. Empty: working
+  // directory.
+  std::string root;
+
+  // Guarded by server_mtx
+  std::deque<ServerRequest> requests;
+  std::deque<std::pair<uint64_t, std::string>> outbox;
+
+  // Main thread only
+  std::deque<ServerRequest> jobs;
+  ServerRequest active;
+  bool has_active = false;
+  std::string reported_message;
 };
 
 enum class AlgorithmStatus { STARTED, RUNNING, HALTING };
@@ -185,723 +1170,7475 @@ enum class AlgorithmStatus { STARTED, RUNNING, HALTING };
 IcpData g_icp_data;
 NonrigidIcpData g_nonrigidicp_data;
 TextransData g_textrans_data;
+NonrigidIcpSweepData g_nonrigidicp_sweep_data;
+GlobalAlignData g_global_align_data;
+DeviationData g_deviation_data;
+LodData g_lod_data;
+StreamImportData g_stream_import_data;
+ReprojectData g_reproject_data;
+ServerData g_server_data;
 AlgorithmStatus g_icp_run = AlgorithmStatus::HALTING;
 AlgorithmStatus g_nonrigidicp_run = AlgorithmStatus::HALTING;
 AlgorithmStatus g_textrans_run = AlgorithmStatus::HALTING;
+AlgorithmStatus g_nonrigidicp_sweep_run = AlgorithmStatus::HALTING;
+AlgorithmStatus g_deviation_run = AlgorithmStatus::HALTING;
+AlgorithmStatus g_global_align_run = AlgorithmStatus::HALTING;
+AlgorithmStatus g_reproject_run = AlgorithmStatus::HALTING;
+// Set by the texture transfer worker, consumed by the main thread
+std::atomic<bool> g_textrans_update_mesh{false};
+// Set from UI to stop a Nonrigid ICP sequence before its next frame
+std::atomic<bool> g_nonrigidicp_halt{false};
+bool g_deviation_update_mesh = false;
 bool g_algorithm_process_finish = false;
 Eigen::Affine3f g_icp_start_trans;
-std::mutex icp_mtx, nonrigidicp_mtx, nonrigidicp_update_mtx, textrans_mtx;
+std::mutex icp_mtx, nonrigidicp_mtx, nonrigidicp_update_mtx, textrans_mtx,
+    nonrigidicp_sweep_mtx, deviation_mtx, global_align_mtx, lod_mtx,
+    server_mtx, reproject_mtx;
 
 void IcpProcessCallback(const IcpTerminateCriteria &terminate_criteria,
                         const IcpOutput &output) {
-  g_callback_message = "ICP : " + std::to_string(output.loss_histroty.size()) +
-                       " / " + std::to_string(terminate_criteria.iter_max) +
-                       "   " + std::to_string(output.loss_histroty.back());
+  g_callback_message = "ICP" + g_icp_data.level_label + " : " +
+                       std::to_string(output.loss_histroty.size()) + " / " +
+                       std::to_string(terminate_criteria.iter_max) + "   " +
+                       std::to_string(output.loss_histroty.back());
 
   std::cout << g_callback_message << std::endl;
 
   const auto &last_trans = g_icp_data.output.transform_histry.back();
 
-  g_model_matrices[g_icp_data.src_mesh] =
-      last_trans.cast<float>() * g_icp_start_trans;
+  g_scene.model_matrix(g_icp_data.src_mesh) =
+      last_trans.cast<float>() * g_icp_data.level_trans * g_icp_start_trans;
 }
 
 void IcpFinishCallback(const Eigen::Affine3f &orignal_trans) {
   const auto &last_trans = g_icp_data.output.transform_histry.back();
 
-  g_model_matrices[g_icp_data.src_mesh] =
+  g_scene.model_matrix(g_icp_data.src_mesh) =
       last_trans.cast<float>() * orignal_trans;
-  g_update_bvh[g_icp_data.src_mesh] = true;
+  g_scene.update_bvh(g_icp_data.src_mesh) = true;
 
+  g_callback_succeeded = true;
   g_callback_finished = true;
 }
 
-void IcpProcess() {
-  std::lock_guard<std::mutex> lock(icp_mtx);
-  if (g_icp_run == AlgorithmStatus::STARTED) {
-    g_icp_run = AlgorithmStatus::RUNNING;
+// KD-tree for nearest neighbor search over fixed dimension features such as
+// positions and descriptors
+template <int Dim>
+class FeatureKdTree {
+ public:
+  using Feature = Eigen::Matrix<float, Dim, 1>;
+
+  explicit FeatureKdTree(const std::vector<Feature> &features)
+      : features_(features) {
+    ids_.resize(features.size());
+    std::iota(ids_.begin(), ids_.end(), 0);
+    nodes_.reserve(features.size());
+    root_ = Build(0, ids_.size());
+  }
 
-    g_icp_start_trans = g_model_matrices[g_icp_data.src_mesh];
+  int Nearest(const Feature &query, float *sq_dist = nullptr) const {
+    int best = -1;
+    float best_sq = std::numeric_limits<float>::max();
+    Search(root_, query, best, best_sq);
+    if (sq_dist != nullptr) {
+      *sq_dist = best_sq;
+    }
+    return best;
+  }
 
-    Timer timer;
-    timer.Start();
+ private:
+  struct Node {
+    uint32_t id;
+    int axis;
+    int left = -1;
+    int right = -1;
+  };
+  const std::vector<Feature> &features_;
+  std::vector<uint32_t> ids_;
+  std::vector<Node> nodes_;
+  int root_ = -1;
+
+  int Build(size_t st, size_t ed) {
+    if (st >= ed) {
+      return -1;
+    }
+    // Split on the axis of largest spread
+    Feature lo = features_[ids_[st]];
+    Feature hi = lo;
+    for (size_t i = st + 1; i < ed; i++) {
+      lo = lo.cwiseMin(features_[ids_[i]]);
+      hi = hi.cwiseMax(features_[ids_[i]]);
+    }
+    int axis = 0;
+    (hi - lo).maxCoeff(&axis);
+    const size_t mid = (st + ed) / 2;
+    std::nth_element(ids_.begin() + st, ids_.begin() + mid, ids_.begin() + ed,
+                     [&](uint32_t a, uint32_t b) {
+                       return features_[a][axis] < features_[b][axis];
+                     });
+    const int index = static_cast<int>(nodes_.size());
+    nodes_.push_back({ids_[mid], axis});
+    const int left = Build(st, mid);
+    const int right = Build(mid + 1, ed);
+    nodes_[index].left = left;
+    nodes_[index].right = right;
+    return index;
+  }
 
-    RigidIcp(
-        g_icp_data.src_points, g_icp_data.dst_points, g_icp_data.src_normals,
-        g_icp_data.dst_normals, g_icp_data.dst_faces, g_icp_data.corresp_type,
-        g_icp_data.loss_type, g_icp_data.terminate_criteria,
-        g_icp_data.corresp_criteria, g_icp_data.output, g_icp_data.with_scale,
-        nullptr, g_icp_data.corresp_finder, -1, g_icp_data.callback);
+  void Search(int index, const Feature &query, int &best,
+              float &best_sq) const {
+    if (index < 0) {
+      return;
+    }
+    const Node &node = nodes_[index];
+    const float sq = (features_[node.id] - query).squaredNorm();
+    if (sq < best_sq) {
+      best_sq = sq;
+      best = static_cast<int>(node.id);
+    }
+    const float diff = query[node.axis] - features_[node.id][node.axis];
+    const int near = diff < 0.f ? node.left : node.right;
+    const int far = diff < 0.f ? node.right : node.left;
+    Search(near, query, best, best_sq);
+    if (diff * diff < best_sq) {
+      Search(far, query, best, best_sq);
+    }
+  }
+};
 
-    timer.End();
-    g_callback_message =
-        "ICP took " + std::to_string(timer.elapsed_msec() / 1000) + " sec.";
+// Indices of up to max_num src points in sampling priority order, so that
+// any prefix is a valid sample set for coarse-to-fine levels.
+std::vector<uint32_t> SampleIcpPoints(
+    const std::vector<Eigen::Vector3f> &points,
+    const std::vector<Eigen::Vector3f> &normals,
+    const std::vector<Eigen::Vector3i> &faces, IcpSampling sampling,
+    size_t max_num) {
+  const size_t n = points.size();
+  std::vector<uint32_t> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::mt19937 engine(0);
+
+  if (sampling == IcpSampling::ALL || n <= max_num) {
+    if (sampling != IcpSampling::ALL) {
+      std::shuffle(order.begin(), order.end(), engine);
+    }
+    return order;
+  }
 
-    std::cout << g_callback_message << std::endl;
+  if (sampling == IcpSampling::UNIFORM || normals.size() != n) {
+    // Partial Fisher-Yates
+    for (size_t i = 0; i < max_num; i++) {
+      std::uniform_int_distribution<size_t> dist(i, n - 1);
+      std::swap(order[i], order[dist(engine)]);
+    }
+    order.resize(max_num);
+    return order;
+  }
 
-    IcpFinishCallback(g_icp_start_trans);
+  if (sampling == IcpSampling::NORMAL_SPACE) {
+    // Bucket normals by polar/azimuth angles and draw round robin so that
+    // every normal direction is equally represented (Rusinkiewicz 2001)
+    constexpr int kPolarBins = 8;
+    constexpr int kAzimuthBins = 16;
+    constexpr float kPi = 3.14159265358979f;
+    std::vector<std::vector<uint32_t>> buckets(kPolarBins * kAzimuthBins);
+    for (uint32_t i = 0; i < n; i++) {
+      const Eigen::Vector3f &nor = normals[i];
+      const float polar = std::acos(std::clamp(nor.z(), -1.f, 1.f));
+      const float azimuth = std::atan2(nor.y(), nor.x()) + kPi;
+      const int pb = std::min(static_cast<int>(polar / kPi * kPolarBins),
+                              kPolarBins - 1);
+      const int ab =
+          std::min(static_cast<int>(azimuth / (2.f * kPi) * kAzimuthBins),
+                   kAzimuthBins - 1);
+      buckets[pb * kAzimuthBins + ab].push_back(i);
+    }
+    for (auto &bucket : buckets) {
+      std::shuffle(bucket.begin(), bucket.end(), engine);
+    }
+    order.clear();
+    for (size_t round = 0; order.size() < max_num; round++) {
+      for (const auto &bucket : buckets) {
+        if (round < bucket.size() && order.size() < max_num) {
+          order.push_back(bucket[round]);
+        }
+      }
+    }
+    return order;
+  }
 
-    g_icp_run = AlgorithmStatus::HALTING;
+  // CURVATURE: normal variation along incident edges as curvature proxy,
+  // weighted sampling without replacement (Efraimidis-Spirakis)
+  std::vector<float> curvatures(n, 0.f);
+  std::vector<int> valences(n, 0);
+  for (const auto &face : faces) {
+    for (int j = 0; j < 3; j++) {
+      const int a = face[j];
+      const int b = face[(j + 1) % 3];
+      const float c = (normals[a] - normals[b]).norm();
+      curvatures[a] += c;
+      curvatures[b] += c;
+      valences[a]++;
+      valences[b]++;
+    }
   }
+  std::vector<float> keys(n);
+  std::uniform_real_distribution<float> dist(1e-6f, 1.f);
+  for (size_t i = 0; i < n; i++) {
+    const float w =
+        (0 < valences[i] ? curvatures[i] / valences[i] : 0.f) + 1e-3f;
+    keys[i] = std::pow(dist(engine), 1.f / w);
+  }
+  auto compare = [&](uint32_t a, uint32_t b) { return keys[a] > keys[b]; };
+  std::nth_element(order.begin(), order.begin() + max_num, order.end(),
+                   compare);
+  order.resize(max_num);
+  std::sort(order.begin(), order.end(), compare);
+  return order;
 }
 
-void NonrigidIcpProcess() {
-  std::lock_guard<std::mutex> lock(nonrigidicp_mtx);
-  if (g_nonrigidicp_run == AlgorithmStatus::STARTED) {
-    g_nonrigidicp_run = AlgorithmStatus::RUNNING;
-
-    Timer timer;
-    timer.Start();
-
-    ugu::NonRigidIcp nicp;
-    nicp.SetSrc(*g_nonrigidicp_data.src_mesh.get(),
-                g_model_matrices[g_nonrigidicp_data.src_mesh]);
-    auto transed_dst_mesh = Mesh::Create(
-        *std::static_pointer_cast<Mesh>(g_nonrigidicp_data.dst_mesh));
-    transed_dst_mesh->Transform(g_model_matrices[g_nonrigidicp_data.dst_mesh]);
-    nicp.SetDst(*transed_dst_mesh);
-
-    nicp.Init(g_nonrigidicp_data.check_self_itersection,
-              g_nonrigidicp_data.angle_rad_th,
-              g_nonrigidicp_data.dst_check_geometry_border,
-              g_nonrigidicp_data.src_check_geometry_border);
-
-    nicp.SetCorrespDistTh(g_nonrigidicp_data.dist_th);
-    nicp.SetCorrespNnNum(g_nonrigidicp_data.nn_num);
-
-    const auto &fid_vec = g_ignore_poly_ids.at(g_nonrigidicp_data.src_mesh);
-    std::set<uint32_t> ignore_face_ids(fid_vec.begin(), fid_vec.end());
-    nicp.SetIgnoreFaceIds(ignore_face_ids);
-
-    std::vector<PointOnFace> src_landmarks;
-    for (const auto &res :
-         g_selected_positions.at(g_nonrigidicp_data.src_mesh)) {
-      PointOnFace pof;
-      pof.fid = res.intersection.fid;
-      pof.u = res.intersection.u;
-      pof.v = res.intersection.v;
-      src_landmarks.push_back(pof);
-    }
-    std::vector<double> betas(src_landmarks.size(), g_nonrigidicp_data.beta);
-    nicp.SetSrcLandmarks(src_landmarks, betas);
-    nicp.SetDstLandmarkPositions(
-        ExtractPos(g_selected_positions.at(g_nonrigidicp_data.dst_mesh)));
-
-    auto update_mesh = [&](bool update_base = false) {
-      ugu::MeshPtr deformed = Mesh::Create(*nicp.GetDeformedSrc());
-      deformed->Transform(
-          g_model_matrices[g_nonrigidicp_data.src_mesh].inverse());
-      deformed->CalcNormal();
+// Builds the dst search structures of g_icp_data unless this run already has
+// them. Must be called with icp_mtx locked.
+void PrepareIcpDst() {
+  const auto &dst_points = g_icp_data.dst_points;
+  const auto &dst_faces = g_icp_data.dst_faces;
+  if (g_icp_data.corresp_finder == nullptr && !dst_faces.empty()) {
+    // Same approximation as RigidIcp()'s default approx_nn_num
+    g_icp_data.corresp_finder =
+        g_corresp_indices
+            .Get(g_icp_data.dst_mesh, g_icp_data.dst_trans,
+                 g_icp_data.dst_revision, 10)
+            ->finder;
+  }
+  if (g_icp_data.dst_tree == nullptr) {
+    g_icp_data.dst_tree = std::make_shared<FeatureKdTree<3>>(dst_points);
+  }
+  if (g_icp_data.dst_face_normals.size() != dst_faces.size()) {
+    g_icp_data.dst_face_normals.resize(dst_faces.size());
+    for (size_t i = 0; i < dst_faces.size(); i++) {
+      const auto &f = dst_faces[i];
+      g_icp_data.dst_face_normals[i] =
+          (dst_points[f[1]] - dst_points[f[0]])
+              .cross(dst_points[f[2]] - dst_points[f[0]])
+              .normalized();
+    }
+  }
+}
 
-      auto fnum = static_cast<int>(
-          g_nonrigidicp_data.src_mesh->vertex_indices().size());
-      {
-        std::lock_guard<std::mutex> lock_update(nonrigidicp_update_mtx);
+// Rigid ICP with the correspondence, loss and scale handling resolved at
+// compile time. Matches are stored column-major (one column per coordinate)
+// and each thread chunk reduces its rows with Eigen block expressions, so
+// the accumulation is vectorized over points. Correspondences use the same
+// finder and criteria as RigidIcp().
+template <IcpCorrespType kCorresp, IcpLossType kLoss, bool kWithScale>
+void SpecializedRigidIcp(const std::vector<Eigen::Vector3f> &src_points,
+                         const std::vector<Eigen::Vector3f> &src_normals,
+                         const IcpData &data, IcpOutput &output,
+                         const IcpCallbackFunc &callback) {
+  constexpr bool kToSurface = kCorresp == IcpCorrespType::kPointToPlane;
+  constexpr bool kToPlane = kLoss == IcpLossType::kPointToPlane;
+  constexpr int kParamNum = kWithScale ? 7 : 6;
+  using Vec = Eigen::Matrix<double, kParamNum, 1>;
+  using Mat = Eigen::Matrix<double, kParamNum, kParamNum>;
+  using Points = Eigen::Matrix<double, Eigen::Dynamic, 3>;
+  using Jacobian = Eigen::Matrix<double, Eigen::Dynamic, kParamNum>;
+
+  const size_t n = src_points.size();
+  const bool has_src_normals = src_normals.size() == n;
+  const auto &dst_points = data.dst_points;
+  const auto &dst_normals = data.dst_normals;
+  const bool has_dst_normals = dst_normals.size() == dst_points.size();
+  const auto &dst_tree = data.dst_tree;
+  const auto &dst_finder = data.corresp_finder;
+  const auto &dst_face_normals = data.dst_face_normals;
+  if (dst_tree == nullptr || (kToSurface && dst_finder == nullptr)) {
+    LOGE("ICP dst is not prepared\n");
+    return;
+  }
 
-        bool to_split_uv = g_nonrigidicp_data.src_mesh->HasIndepentUv();
-        if (to_split_uv) {
-          for (int i = 0; i < fnum; i++) {
-            const auto &face = g_nonrigidicp_data.src_mesh->vertex_indices()[i];
-            for (int j = 0; j < 3; j++) {
-              uint32_t index = i * 3 + j;
-              g_nonrigidicp_data.src_mesh->renderable_vertices[index].pos =
-                  deformed->vertices()[face[j]];
+  // Invalid rows stay zero so they drop out of every reduction
+  Points P(n, 3), Q(n, 3), N(n, 3);
+  Eigen::VectorXd valid(n);
+  Jacobian J;
+  Eigen::VectorXd r;
+  if constexpr (kToPlane) {
+    J.resize(n, kParamNum);
+    r.resize(n);
+  }
 
-              g_nonrigidicp_data.src_mesh->renderable_vertices[index].nor =
-                  deformed->normals()[face[j]];
-            }
-          }
-        } else {
-          for (int i = 0; i < fnum; i++) {
-            const auto &face = g_nonrigidicp_data.src_mesh->vertex_indices()[i];
-            for (int j = 0; j < 3; j++) {
-              g_nonrigidicp_data.src_mesh->renderable_vertices[face[j]].pos =
-                  deformed->vertices()[face[j]];
+  const float sq_dist_th = 0.f < data.corresp_criteria.dist_th
+                               ? std::pow(data.corresp_criteria.dist_th, 2.f)
+                               : std::numeric_limits<float>::max();
+  const float cos_normal_th = std::cos(data.corresp_criteria.normal_th);
+  const bool test_normal =
+      has_src_normals && 0.f < data.corresp_criteria.normal_th;
+  const bool test_nearest = data.corresp_criteria.test_nearest;
+
+  // Point-to-point needs first and second moments, point-to-plane the
+  // normal equations
+  struct Accum {
+    Mat JtJ = Mat::Zero();
+    Vec Jtr = Vec::Zero();
+    Eigen::Vector3d sum_p = Eigen::Vector3d::Zero();
+    Eigen::Vector3d sum_q = Eigen::Vector3d::Zero();
+    Eigen::Matrix3d sum_qp = Eigen::Matrix3d::Zero();
+    double sum_pp = 0.0;
+    double loss = 0.0;
+    double count = 0.0;
+  };
+  const size_t chunk_num =
+      std::max(1u, std::thread::hardware_concurrency()) * 4;
+  const size_t chunk_size = (n + chunk_num - 1) / chunk_num;
+  std::vector<Accum> accums(chunk_num);
+
+  Eigen::Affine3d T = Eigen::Affine3d::Identity();
+  output.loss_histroty.clear();
+  output.transform_histry.clear();
+  for (int iter = 0; iter < data.terminate_criteria.iter_max; iter++) {
+    const Eigen::Matrix3f R = T.linear().cast<float>();
+    const Eigen::Vector3f t = T.translation().cast<float>();
+    const Eigen::Matrix3f normal_R = R.inverse().transpose();
+
+    parallel_for(size_t(0), n, [&](size_t i) {
+      const Eigen::Vector3f p = R * src_points[i] + t;
+      auto invalidate = [&]() {
+        valid[i] = 0.0;
+        P.row(i).setZero();
+        Q.row(i).setZero();
+        N.row(i).setZero();
+      };
 
-              g_nonrigidicp_data.src_mesh->renderable_vertices[face[j]].nor =
-                  deformed->normals()[face[j]];
-            }
+      Eigen::Vector3f q = Eigen::Vector3f::Zero();
+      Eigen::Vector3f q_normal = Eigen::Vector3f::Zero();
+      float sq_dist = std::numeric_limits<float>::max();
+      if constexpr (kToSurface) {
+        const Corresp corresp = dst_finder->Find(p, Eigen::Vector3f::Zero(),
+                                                 CorrespFinderMode::kMinDist);
+        if (0 <= corresp.fid) {
+          q = corresp.p;
+          q_normal = dst_face_normals[corresp.fid];
+          sq_dist = (q - p).squaredNorm();
+        }
+      }
+      if (!kToSurface || test_nearest) {
+        // The approximate surface query can miss a closer vertex
+        float sq_nearest = 0.f;
+        const int j = dst_tree->Nearest(p, &sq_nearest);
+        if (0 <= j && sq_nearest < sq_dist) {
+          q = dst_points[j];
+          sq_dist = sq_nearest;
+          if (has_dst_normals) {
+            q_normal = dst_normals[j];
           }
         }
       }
+      if (sq_dist == std::numeric_limits<float>::max() ||
+          sq_dist_th < sq_dist ||
+          (test_normal &&
+           (normal_R * src_normals[i]).normalized().dot(q_normal) <
+               cos_normal_th)) {
+        invalidate();
+        return;
+      }
+      valid[i] = 1.0;
+      P.row(i) = p.cast<double>().transpose();
+      Q.row(i) = q.cast<double>().transpose();
+      N.row(i) = q_normal.cast<double>().transpose();
+    });
+
+    parallel_for(size_t(0), chunk_num, [&](size_t c) {
+      Accum acc;
+      const size_t st = std::min(n, c * chunk_size);
+      const size_t len = std::min(n, st + chunk_size) - st;
+      if (len == 0) {
+        accums[c] = acc;
+        return;
+      }
+      const auto p = P.middleRows(st, len);
+      const auto q = Q.middleRows(st, len);
+      if constexpr (kToPlane) {
+        const auto nor = N.middleRows(st, len);
+        auto j = J.middleRows(st, len);
+        auto res = r.segment(st, len);
+        res = (p - q).cwiseProduct(nor).rowwise().sum();
+        // Columns of p x n, then n, then p . n for scale
+        j.col(0) = p.col(1).cwiseProduct(nor.col(2)) -
+                   p.col(2).cwiseProduct(nor.col(1));
+        j.col(1) = p.col(2).cwiseProduct(nor.col(0)) -
+                   p.col(0).cwiseProduct(nor.col(2));
+        j.col(2) = p.col(0).cwiseProduct(nor.col(1)) -
+                   p.col(1).cwiseProduct(nor.col(0));
+        j.template middleCols<3>(3) = nor;
+        if constexpr (kWithScale) {
+          j.col(6) = p.cwiseProduct(nor).rowwise().sum();
+        }
+        acc.JtJ.noalias() = j.transpose() * j;
+        acc.Jtr.noalias() = j.transpose() * res;
+        acc.loss = res.squaredNorm();
+      } else {
+        acc.sum_p = p.colwise().sum().transpose();
+        acc.sum_q = q.colwise().sum().transpose();
+        acc.sum_qp.noalias() = q.transpose() * p;
+        acc.sum_pp = p.squaredNorm();
+        acc.loss = (p - q).squaredNorm();
+      }
+      acc.count = valid.segment(st, len).sum();
+      accums[c] = acc;
+    });
+
+    Accum total;
+    for (const auto &acc : accums) {
+      total.JtJ += acc.JtJ;
+      total.Jtr += acc.Jtr;
+      total.sum_p += acc.sum_p;
+      total.sum_q += acc.sum_q;
+      total.sum_qp += acc.sum_qp;
+      total.sum_pp += acc.sum_pp;
+      total.loss += acc.loss;
+      total.count += acc.count;
+    }
+    if (total.count < 3.0) {
+      LOGE("Too few correspondences %d\n", static_cast<int>(total.count));
+      break;
+    }
+    const double cnt = total.count;
+
+    Eigen::Affine3d delta = Eigen::Affine3d::Identity();
+    if constexpr (kToPlane) {
+      const Vec x = total.JtJ.ldlt().solve(-total.Jtr);
+      const Eigen::Vector3d omega = x.template head<3>();
+      const double angle = omega.norm();
+      Eigen::Matrix3d dR = Eigen::Matrix3d::Identity();
+      if (0.0 < angle) {
+        dR = Eigen::AngleAxisd(angle, omega / angle).toRotationMatrix();
+      }
+      double scale = 1.0;
+      if constexpr (kWithScale) {
+        scale += x[6];
+      }
+      delta.linear() = scale * dR;
+      delta.translation() = x.template segment<3>(3);
+    } else {
+      // Umeyama
+      const Eigen::Vector3d mu_p = total.sum_p / cnt;
+      const Eigen::Vector3d mu_q = total.sum_q / cnt;
+      const Eigen::Matrix3d cov = total.sum_qp / cnt - mu_q * mu_p.transpose();
+      Eigen::JacobiSVD<Eigen::Matrix3d> svd(
+          cov, Eigen::ComputeFullU | Eigen::ComputeFullV);
+      Eigen::Vector3d d(1.0, 1.0, 1.0);
+      if ((svd.matrixU() * svd.matrixV().transpose()).determinant() < 0.0) {
+        d[2] = -1.0;
+      }
+      const Eigen::Matrix3d dR =
+          svd.matrixU() * d.asDiagonal() * svd.matrixV().transpose();
+      double scale = 1.0;
+      if constexpr (kWithScale) {
+        const double var_p = total.sum_pp / cnt - mu_p.squaredNorm();
+        if (0.0 < var_p) {
+          scale = svd.singularValues().dot(d) / var_p;
+        }
+      }
+      delta.linear() = scale * dR;
+      delta.translation() = mu_q - scale * dR * mu_p;
+    }
+    T = delta * T;
 
-      // OpenGL APIs MUST NOT BE CALLED IN SUB THREADS
+    output.loss_histroty.push_back(total.loss / cnt);
+    output.transform_histry.push_back(T);
+    if (callback) {
+      callback(data.terminate_criteria, output);
+    }
 
-      // g_nonrigidicp_data.src_mesh->UpdateMesh();
+    const double loss = output.loss_histroty.back();
+    if (loss < data.terminate_criteria.loss_min) {
+      break;
+    }
+    if (2 <= output.loss_histroty.size() &&
+        std::abs(output.loss_histroty[output.loss_histroty.size() - 2] -
+                 loss) < data.terminate_criteria.loss_eps) {
+      break;
+    }
+  }
+}
 
-      if (update_base) {
-        g_nonrigidicp_data.src_mesh->set_vertices(deformed->vertices());
-        g_nonrigidicp_data.src_mesh->CalcNormal();
-      }
-    };
+using SpecializedRigidIcpFunc = void (*)(const std::vector<Eigen::Vector3f> &,
+                                         const std::vector<Eigen::Vector3f> &,
+                                         const IcpData &, IcpOutput &,
+                                         const IcpCallbackFunc &);
+
+// Chosen once per run
+SpecializedRigidIcpFunc SelectSpecializedRigidIcp(IcpCorrespType corresp,
+                                                  IcpLossType loss,
+                                                  bool with_scale) {
+  using C = IcpCorrespType;
+  using L = IcpLossType;
+  const bool to_surface = corresp == C::kPointToPlane;
+  const bool to_plane = loss == L::kPointToPlane;
+  if (to_surface) {
+    if (to_plane) {
+      return with_scale
+                 ? SpecializedRigidIcp<C::kPointToPlane, L::kPointToPlane, true>
+                 : SpecializedRigidIcp<C::kPointToPlane, L::kPointToPlane,
+                                       false>;
+    }
+    return with_scale
+               ? SpecializedRigidIcp<C::kPointToPlane, L::kPointToPoint, true>
+               : SpecializedRigidIcp<C::kPointToPlane, L::kPointToPoint, false>;
+  }
+  if (to_plane) {
+    return with_scale
+               ? SpecializedRigidIcp<C::kPointToPoint, L::kPointToPlane, true>
+               : SpecializedRigidIcp<C::kPointToPoint, L::kPointToPlane, false>;
+  }
+  return with_scale
+             ? SpecializedRigidIcp<C::kPointToPoint, L::kPointToPoint, true>
+             : SpecializedRigidIcp<C::kPointToPoint, L::kPointToPoint, false>;
+}
 
-    for (int i = 1; i <= g_nonrigidicp_data.step; ++i) {
-      double alpha =
-          g_nonrigidicp_data.max_alpha -
-          i * (g_nonrigidicp_data.max_alpha - g_nonrigidicp_data.min_alpha) /
-              g_nonrigidicp_data.step;
+void RunRigidIcp(const std::vector<Eigen::Vector3f> &src_points,
+                 const std::vector<Eigen::Vector3f> &src_normals) {
+  if (g_icp_data.specialized) {
+    SelectSpecializedRigidIcp(g_icp_data.corresp_type, g_icp_data.loss_type,
+                              g_icp_data.with_scale)(
+        src_points, src_normals, g_icp_data, g_icp_data.output,
+        g_icp_data.callback);
+    return;
+  }
+  RigidIcp(src_points, g_icp_data.dst_points, src_normals,
+           g_icp_data.dst_normals, g_icp_data.dst_faces,
+           g_icp_data.corresp_type, g_icp_data.loss_type,
+           g_icp_data.terminate_criteria, g_icp_data.corresp_criteria,
+           g_icp_data.output, g_icp_data.with_scale, nullptr,
+           g_icp_data.corresp_finder, -1, g_icp_data.callback);
+}
 
-      g_callback_message = "NonRigid-ICP : " + std::to_string(i) + " / " +
-                           std::to_string(g_nonrigidicp_data.step) +
-                           "  with alpha " + std::to_string(alpha);
+void IcpProcess() {
+  std::lock_guard<std::mutex> lock(icp_mtx);
+  if (g_icp_run == AlgorithmStatus::STARTED) {
+    g_icp_run = AlgorithmStatus::RUNNING;
+    PROFILE_SCOPE("IcpProcess");
+
+    g_icp_start_trans = g_scene.model_matrix(g_icp_data.src_mesh);
+    g_icp_data.level_trans = Eigen::Affine3f::Identity();
+    g_icp_data.level_label.clear();
+    PrepareIcpDst();
+
+    if (g_icp_data.benchmark) {
+      // Fixed iterations of both paths without touching the model matrix
+      const auto criteria = g_icp_data.terminate_criteria;
+      const auto callback = g_icp_data.callback;
+      const bool specialized = g_icp_data.specialized;
+      g_icp_data.terminate_criteria.iter_max = g_icp_data.benchmark_iter;
+      g_icp_data.terminate_criteria.loss_min = -1.0;
+      g_icp_data.terminate_criteria.loss_eps = -1.0;
+      // Time between iteration callbacks so that per-call setup such as
+      // RigidIcp()'s own tree builds is not counted
+      std::vector<std::chrono::steady_clock::time_point> stamps;
+      g_icp_data.callback = [&](const IcpTerminateCriteria &,
+                                const IcpOutput &) {
+        stamps.push_back(std::chrono::steady_clock::now());
+      };
+      double msec_per_iter[2] = {0.0, 0.0};
+      for (int k = 0; k < 2; k++) {
+        g_callback_message = std::string("ICP benchmark : ") +
+                             (k == 0 ? "generic" : "specialized");
+        g_icp_data.specialized = k == 1;
+        g_icp_data.output.loss_histroty.clear();
+        g_icp_data.output.transform_histry.clear();
+        stamps.clear();
+        const auto start = std::chrono::steady_clock::now();
+        RunRigidIcp(g_icp_data.src_points, g_icp_data.src_normals);
+        if (stamps.empty()) {
+          continue;
+        }
+        // With a single iteration the setup cannot be separated
+        const auto first = 2 <= stamps.size() ? stamps.front() : start;
+        const size_t iters = std::max(size_t(1), stamps.size() - 1);
+        msec_per_iter[k] =
+            std::chrono::duration<double, std::milli>(stamps.back() - first)
+                .count() /
+            iters;
+      }
+      g_icp_data.terminate_criteria = criteria;
+      g_icp_data.callback = callback;
+      g_icp_data.specialized = specialized;
+      g_icp_data.benchmark = false;
+
+      g_callback_message =
+          "ICP per iteration: generic " + std::to_string(msec_per_iter[0]) +
+          " ms, specialized " + std::to_string(msec_per_iter[1]) + " ms";
       std::cout << g_callback_message << std::endl;
+      g_callback_succeeded = true;
+      g_callback_finished = true;
+      g_icp_run = AlgorithmStatus::HALTING;
+      return;
+    }
+
+    Timer timer;
+    timer.Start();
+
+    if (g_icp_data.sampling == IcpSampling::ALL) {
+      RunRigidIcp(g_icp_data.src_points, g_icp_data.src_normals);
+    } else {
+      const size_t sample_num =
+          static_cast<size_t>(std::max(g_icp_data.sample_num, 3));
+      const auto order = SampleIcpPoints(
+          g_icp_data.src_points, g_icp_data.src_normals, g_icp_data.src_faces,
+          g_icp_data.sampling, sample_num);
+
+      std::vector<size_t> level_sizes = {order.size()};
+      if (g_icp_data.coarse_to_fine) {
+        for (int l = 1; l < g_icp_data.level_num; l++) {
+          const size_t coarser = level_sizes.back() / 4;
+          if (coarser < 64) {
+            break;
+          }
+          level_sizes.push_back(coarser);
+        }
+        std::reverse(level_sizes.begin(), level_sizes.end());
+      }
 
-      nicp.Registrate(alpha, g_nonrigidicp_data.gamma,
-                      g_nonrigidicp_data.max_internal_iter,
-                      g_nonrigidicp_data.min_frobenius_norm_diff);
+      const bool has_normals =
+          g_icp_data.src_normals.size() == g_icp_data.src_points.size();
+      for (size_t l = 0; l < level_sizes.size(); l++) {
+        const auto &level_trans = g_icp_data.level_trans;
+        const Eigen::Matrix3f normal_trans =
+            level_trans.linear().inverse().transpose();
+        std::vector<Eigen::Vector3f> points(level_sizes[l]);
+        std::vector<Eigen::Vector3f> normals;
+        for (size_t i = 0; i < level_sizes[l]; i++) {
+          points[i] = level_trans * g_icp_data.src_points[order[i]];
+        }
+        if (has_normals) {
+          normals.resize(level_sizes[l]);
+          for (size_t i = 0; i < level_sizes[l]; i++) {
+            normals[i] =
+                (normal_trans * g_icp_data.src_normals[order[i]]).normalized();
+          }
+        }
 
-      update_mesh();
+        g_icp_data.level_label = " level " + std::to_string(l + 1) + "/" +
+                                 std::to_string(level_sizes.size()) + " (" +
+                                 std::to_string(level_sizes[l]) + " pts)";
+        g_icp_data.output.loss_histroty.clear();
+        g_icp_data.output.transform_histry.clear();
+        RunRigidIcp(points, normals);
+
+        if (!g_icp_data.output.transform_histry.empty()) {
+          g_icp_data.level_trans =
+              g_icp_data.output.transform_histry.back().cast<float>() *
+              level_trans;
+        }
+      }
+      // Fold all levels into the last transform for IcpFinishCallback
+      g_icp_data.output.transform_histry.clear();
+      g_icp_data.output.transform_histry.push_back(
+          g_icp_data.level_trans.cast<double>());
+      g_icp_data.level_trans = Eigen::Affine3f::Identity();
     }
 
     timer.End();
-    g_callback_message = "NonRigid-ICP took " +
-                         std::to_string(timer.elapsed_msec() / 1000) + " sec.";
+    g_callback_message =
+        "ICP took " + std::to_string(timer.elapsed_msec() / 1000) + " sec.";
 
     std::cout << g_callback_message << std::endl;
 
-    update_mesh(true);
+    IcpFinishCallback(g_icp_start_trans);
 
-    // ugu::MeshPtr deformed = nicp.GetDeformedSrc();
-    // deformed->Transform(
-    //     g_model_matrices[g_nonrigidicp_data.src_mesh].inverse());
+    g_icp_run = AlgorithmStatus::HALTING;
+  }
+}
 
-    // deformed->WriteObj("./", "out");
+std::vector<Eigen::Vector3f> TransformPoints(
+    const std::vector<Eigen::Vector3f> &points, const Eigen::Affine3f &T,
+    bool is_normal = false) {
+  std::vector<Eigen::Vector3f> transed;
+  Eigen::Affine3f T_ = T;
+  if (is_normal) {
+    // Remove translation
+    T_.matrix().block(0, 3, 3, 1).setConstant(0.f);
+  }
+  for (const auto &p : points) {
+    Eigen::Vector3f t = T_ * p;
+    if (is_normal) {
+      t.normalize();
+    }
+    transed.push_back(t);
+  }
+  return transed;
+}
 
-    g_update_bvh[g_nonrigidicp_data.src_mesh] = true;
+// Must be called with icp_mtx locked
+void PrepareRigidIcp(const RenderableMeshPtr &src_mesh,
+                     const RenderableMeshPtr &dst_mesh) {
+  g_icp_data.src_mesh = src_mesh;
+  g_icp_data.dst_mesh = dst_mesh;
+  g_icp_data.dst_trans = g_scene.model_matrix(dst_mesh);
+  g_icp_data.dst_revision = g_scene.geometry_revision(dst_mesh);
+  g_icp_data.src_points =
+      TransformPoints(src_mesh->vertices(), g_scene.model_matrix(src_mesh));
+  g_icp_data.dst_points =
+      TransformPoints(dst_mesh->vertices(), g_icp_data.dst_trans);
+
+  g_icp_data.src_normals =
+      TransformPoints(src_mesh->normals(), g_scene.model_matrix(src_mesh),
+                      true);
+  g_icp_data.dst_normals =
+      TransformPoints(dst_mesh->normals(), g_scene.model_matrix(dst_mesh),
+                      true);
+
+  g_icp_data.src_faces = src_mesh->vertex_indices();
+  g_icp_data.dst_faces = dst_mesh->vertex_indices();
+  g_icp_data.corresp_finder = nullptr;
+  g_icp_data.dst_tree = nullptr;
+  g_icp_data.dst_face_normals.clear();
+
+  // Drop src vertices on ignored faces and remap the remaining faces
+  const auto &ignore_faces = g_scene.ignore_faces(src_mesh);
+  if (ignore_faces.Any()) {
+    const auto ignored = ignore_faces.ToVertexMask(
+        g_icp_data.src_faces, g_icp_data.src_points.size());
+    const bool has_normals =
+        g_icp_data.src_normals.size() == g_icp_data.src_points.size();
+    std::vector<int> remap(ignored.size(), -1);
+    size_t kept = 0;
+    for (size_t i = 0; i < ignored.size(); i++) {
+      if (ignored[i]) {
+        continue;
+      }
+      remap[i] = static_cast<int>(kept);
+      g_icp_data.src_points[kept] = g_icp_data.src_points[i];
+      if (has_normals) {
+        g_icp_data.src_normals[kept] = g_icp_data.src_normals[i];
+      }
+      kept++;
+    }
+    g_icp_data.src_points.resize(kept);
+    if (has_normals) {
+      g_icp_data.src_normals.resize(kept);
+    }
+    std::vector<Eigen::Vector3i> kept_faces;
+    for (const auto &f : g_icp_data.src_faces) {
+      if (0 <= remap[f[0]] && 0 <= remap[f[1]] && 0 <= remap[f[2]]) {
+        kept_faces.emplace_back(remap[f[0]], remap[f[1]], remap[f[2]]);
+      }
+    }
+    g_icp_data.src_faces = std::move(kept_faces);
+  }
 
-    g_callback_finished = true;
-    g_nonrigidicp_run = AlgorithmStatus::HALTING;
+  g_icp_data.callback = IcpProcessCallback;
+  g_icp_data.output.loss_histroty.clear();
+  g_icp_data.output.transform_histry.clear();
+}
+
+constexpr int kGridKeyBits = 21;
+
+// Cell index of a uniform grid packed into 63 bits. Cells up to 2^20 away
+// from the origin along each axis are distinct; farther ones are clamped.
+uint64_t GridKey(const Eigen::Vector3i &index) {
+  constexpr int64_t kBias = int64_t(1) << (kGridKeyBits - 1);
+  constexpr int64_t kMax = (int64_t(1) << kGridKeyBits) - 1;
+  uint64_t key = 0;
+  for (int k = 0; k < 3; k++) {
+    const int64_t biased =
+        std::clamp(static_cast<int64_t>(index[k]) + kBias, int64_t(0), kMax);
+    key |= static_cast<uint64_t>(biased) << (kGridKeyBits * k);
   }
+  return key;
 }
 
-void TextransProcess() {
-  std::lock_guard<std::mutex> lock(textrans_mtx);
-  if (g_textrans_run == AlgorithmStatus::STARTED) {
-    g_textrans_run = AlgorithmStatus::RUNNING;
+// Cell of p on a uniform grid whose cell (0, 0, 0) starts at origin
+uint64_t GridKey(const Eigen::Vector3f &p, const Eigen::Vector3d &origin,
+                 double cell_size) {
+  Eigen::Vector3i index;
+  for (int k = 0; k < 3; k++) {
+    index[k] = static_cast<int>(
+        std::clamp(std::floor((p[k] - origin[k]) / cell_size), -1e9, 1e9));
+  }
+  return GridKey(index);
+}
 
-    Timer timer;
-    timer.Start();
+// Faces as sortable and hashable keys. Vertex ids are not packed into one
+// integer since meshes may have more than 2^21 vertices.
+using FaceKey = std::array<int, 3>;
 
-    Image3f src_tex;
-    g_textrans_data.dst_mesh->materials()[0].diffuse_tex.convertTo(
-        src_tex, CV_32FC3, 1.0, 0.0);
-    TexTransNoCorresp(
-        src_tex,
-        *std::static_pointer_cast<Mesh>(g_textrans_data.dst_mesh).get(),
-        g_model_matrices[g_textrans_data.dst_mesh],
-        *std::static_pointer_cast<Mesh>(g_textrans_data.src_mesh).get(),
-        g_model_matrices[g_textrans_data.src_mesh], g_textrans_data.dst_size[1],
-        g_textrans_data.dst_size[0], g_textrans_data.output);
+struct FaceKeyHash {
+  size_t operator()(const FaceKey &key) const {
+    uint64_t h = 0;
+    for (const int v : key) {
+      h = h * 0x100000001b3ull ^ static_cast<uint32_t>(v);
+    }
+    return static_cast<size_t>(h ^ (h >> 32));
+  }
+};
 
-    ugu::Image1b inpaint_mask;
-    ugu::Not(g_textrans_data.output.dst_mask, &inpaint_mask);
-    ugu::Image3b dst_tex_vis;
-    ugu::ConvertTo(g_textrans_data.output.dst_tex, &dst_tex_vis);
-    ugu::Image3b dst_tex_vis_inpainted = dst_tex_vis.clone();
-    ugu::Inpaint(inpaint_mask, dst_tex_vis_inpainted, 3.f);
-
-    auto mats = g_textrans_data.src_mesh->materials();
-    mats[0].diffuse_tex = dst_tex_vis_inpainted;
-    mats[0].diffuse_texname = "transferred.png";
-    mats[0].diffuse_texpath = "transferred.png";
-    g_textrans_data.src_mesh->set_materials(mats);
+FaceKey MakeFaceKey(const Eigen::Vector3i &f) { return {f[0], f[1], f[2]}; }
+
+// Hashed uniform grid for fixed radius neighbor queries
+class PointGrid {
+ public:
+  void Build(const std::vector<Eigen::Vector3f> &points, float cell_size) {
+    points_ = &points;
+    cell_size_ = cell_size;
+    cells_.clear();
+    for (size_t i = 0; i < points.size(); i++) {
+      cells_[GridKey(Index(points[i]))].push_back(static_cast<uint32_t>(i));
+    }
+  }
 
-    timer.End();
-    g_callback_message = "Texture transfer took " +
-                         std::to_string(timer.elapsed_msec() / 1000) + " sec.";
+  void Radius(const Eigen::Vector3f &p, float radius,
+              std::vector<uint32_t> &neighbors) const {
+    neighbors.clear();
+    const float sq_radius = radius * radius;
+    const int r = static_cast<int>(std::ceil(radius / cell_size_));
+    const Eigen::Vector3i center = Index(p);
+    for (int z = -r; z <= r; z++) {
+      for (int y = -r; y <= r; y++) {
+        for (int x = -r; x <= r; x++) {
+          auto it = cells_.find(GridKey(center + Eigen::Vector3i(x, y, z)));
+          if (it == cells_.end()) {
+            continue;
+          }
+          for (const auto &i : it->second) {
+            if (((*points_)[i] - p).squaredNorm() <= sq_radius) {
+              neighbors.push_back(i);
+            }
+          }
+        }
+      }
+    }
+  }
 
-    std::cout << g_callback_message << std::endl;
+ private:
+  const std::vector<Eigen::Vector3f> *points_ = nullptr;
+  float cell_size_ = 1.f;
+  std::unordered_map<uint64_t, std::vector<uint32_t>> cells_;
 
-    g_callback_finished = true;
-    g_textrans_run = AlgorithmStatus::HALTING;
+  Eigen::Vector3i Index(const Eigen::Vector3f &p) const {
+    return Eigen::Vector3i(static_cast<int>(std::floor(p.x() / cell_size_)),
+                           static_cast<int>(std::floor(p.y() / cell_size_)),
+                           static_cast<int>(std::floor(p.z() / cell_size_)));
+  }
+};
+
+// Averages points and normals per voxel
+void VoxelDownsample(const std::vector<Eigen::Vector3f> &points,
+                     const std::vector<Eigen::Vector3f> &normals,
+                     float voxel_size, std::vector<Eigen::Vector3f> &out_points,
+                     std::vector<Eigen::Vector3f> &out_normals) {
+  std::unordered_map<uint64_t, uint32_t> voxel2id;
+  std::vector<int> counts;
+  out_points.clear();
+  out_normals.clear();
+  for (size_t i = 0; i < points.size(); i++) {
+    const Eigen::Vector3f &p = points[i];
+    const uint64_t key = GridKey(p, Eigen::Vector3d::Zero(), voxel_size);
+    auto it = voxel2id.find(key);
+    if (it == voxel2id.end()) {
+      voxel2id[key] = static_cast<uint32_t>(out_points.size());
+      out_points.push_back(p);
+      out_normals.push_back(normals[i]);
+      counts.push_back(1);
+    } else {
+      out_points[it->second] += p;
+      out_normals[it->second] += normals[i];
+      counts[it->second]++;
+    }
+  }
+  for (size_t i = 0; i < out_points.size(); i++) {
+    out_points[i] /= static_cast<float>(counts[i]);
+    out_normals[i].normalize();
   }
 }
 
-void AlgorithmProcess() {
-  while (!g_algorithm_process_finish) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+// Fast Point Feature Histograms (Rusu et al. 2009), 3 x 11 bins
+constexpr int kFpfhBins = 11;
+constexpr int kFpfhDim = kFpfhBins * 3;
+using Fpfh = Eigen::Matrix<float, kFpfhDim, 1>;
+
+std::vector<Fpfh> ComputeFpfh(const std::vector<Eigen::Vector3f> &points,
+                              const std::vector<Eigen::Vector3f> &normals,
+                              float radius) {
+  constexpr float kPi = 3.14159265358979f;
+  PointGrid grid;
+  grid.Build(points, radius);
+
+  const size_t n = points.size();
+  std::vector<std::vector<uint32_t>> neighbors(n);
+  std::vector<Fpfh> spfh(n, Fpfh::Zero());
+  auto bin = [](float v, float lo, float hi) {
+    const int b = static_cast<int>((v - lo) / (hi - lo) * kFpfhBins);
+    return std::clamp(b, 0, kFpfhBins - 1);
+  };
+  auto spfh_func = [&](size_t i) {
+    grid.Radius(points[i], radius, neighbors[i]);
+    int count = 0;
+    for (const auto &j : neighbors[i]) {
+      Eigen::Vector3f dp = points[j] - points[i];
+      const float d = dp.norm();
+      if (j == i || d <= 0.f) {
+        continue;
+      }
+      dp /= d;
+      // Source is the point whose normal is more aligned with the line
+      Eigen::Vector3f u = normals[i];
+      Eigen::Vector3f nt = normals[j];
+      if (std::abs(normals[i].dot(dp)) < std::abs(normals[j].dot(dp))) {
+        u = normals[j];
+        nt = normals[i];
+        dp = -dp;
+      }
+      Eigen::Vector3f v = dp.cross(u);
+      const float v_norm = v.norm();
+      if (v_norm <= 0.f) {
+        continue;
+      }
+      v /= v_norm;
+      const Eigen::Vector3f w = u.cross(v);
+      spfh[i][bin(v.dot(nt), -1.f, 1.f)] += 1.f;
+      spfh[i][kFpfhBins + bin(u.dot(dp), -1.f, 1.f)] += 1.f;
+      spfh[i][2 * kFpfhBins +
+              bin(std::atan2(w.dot(nt), u.dot(nt)), -kPi, kPi)] += 1.f;
+      count++;
+    }
+    if (0 < count) {
+      spfh[i] *= 100.f / count;
+    }
+  };
+  parallel_for(size_t(0), n, spfh_func);
+
+  std::vector<Fpfh> fpfh(n, Fpfh::Zero());
+  auto fpfh_func = [&](size_t i) {
+    Fpfh sum = Fpfh::Zero();
+    int count = 0;
+    for (const auto &j : neighbors[i]) {
+      const float d = (points[j] - points[i]).norm();
+      if (j == i || d <= 0.f) {
+        continue;
+      }
+      sum += spfh[j] / d;
+      count++;
+    }
+    fpfh[i] = spfh[i];
+    if (0 < count) {
+      fpfh[i] += sum / static_cast<float>(count);
+    }
+    // Each sub-histogram sums to 100
+    for (int k = 0; k < 3; k++) {
+      auto block = fpfh[i].segment<kFpfhBins>(k * kFpfhBins);
+      const float block_sum = block.sum();
+      if (0.f < block_sum) {
+        block *= 100.f / block_sum;
+      }
+    }
+  };
+  parallel_for(size_t(0), n, fpfh_func);
 
-    IcpProcess();
+  return fpfh;
+}
 
-    NonrigidIcpProcess();
+// Returns false if no consistent transform is found. data.voxel_size must be
+// resolved to a positive size.
+bool EstimateGlobalAlignment(const std::vector<Eigen::Vector3f> &src_points,
+                             const std::vector<Eigen::Vector3f> &src_normals,
+                             const std::vector<Eigen::Vector3f> &dst_points,
+                             const std::vector<Eigen::Vector3f> &dst_normals,
+                             GlobalAlignData &data) {
+  std::vector<Eigen::Vector3f> src_down, src_down_normals, dst_down,
+      dst_down_normals;
+  VoxelDownsample(src_points, src_normals, data.voxel_size, src_down,
+                  src_down_normals);
+  VoxelDownsample(dst_points, dst_normals, data.voxel_size, dst_down,
+                  dst_down_normals);
+  if (src_down.size() < 3 || dst_down.size() < 3) {
+    return false;
+  }
 
-    TextransProcess();
+  g_callback_message = "Global alignment : descriptors";
+  const float radius = data.feature_radius * data.voxel_size;
+  std::vector<Fpfh> src_features, dst_features;
+  std::thread src_thread([&]() {
+    src_features = ComputeFpfh(src_down, src_down_normals, radius);
+  });
+  dst_features = ComputeFpfh(dst_down, dst_down_normals, radius);
+  src_thread.join();
+
+  // Mutual nearest neighbors in feature space
+  g_callback_message = "Global alignment : matching";
+  FeatureKdTree<kFpfhDim> src_tree(src_features);
+  FeatureKdTree<kFpfhDim> dst_tree(dst_features);
+  std::vector<int> src2dst(src_down.size(), -1);
+  parallel_for(size_t(0), src_down.size(), [&](size_t i) {
+    const int j = dst_tree.Nearest(src_features[i]);
+    if (0 <= j && src_tree.Nearest(dst_features[j]) == static_cast<int>(i)) {
+      src2dst[i] = j;
+    }
+  });
+  std::vector<Eigen::Vector3f> corresp_src, corresp_dst;
+  for (size_t i = 0; i < src2dst.size(); i++) {
+    if (0 <= src2dst[i]) {
+      corresp_src.push_back(src_down[i]);
+      corresp_dst.push_back(dst_down[src2dst[i]]);
+    }
+  }
+  data.corresp_num = corresp_src.size();
+  if (corresp_src.size() < 3) {
+    return false;
   }
-}
 
-void Draw(GLFWwindow *window);
+  g_callback_message = "Global alignment : RANSAC with " +
+                       std::to_string(corresp_src.size()) +
+                       " correspondences";
+  const float sq_inlier_th =
+      std::pow(data.inlier_dist * data.voxel_size, 2.f);
+  auto estimate = [&](const std::vector<Eigen::Vector3f> &src,
+                      const std::vector<Eigen::Vector3f> &dst) {
+    return data.with_scale
+               ? FindSimilarityTransformFrom3dCorrespondences(src, dst)
+               : FindRigidTransformFrom3dCorrespondences(src, dst);
+  };
+  auto count_inliers = [&](const Eigen::Affine3f &T) {
+    size_t count = 0;
+    for (size_t i = 0; i < corresp_src.size(); i++) {
+      if ((T * corresp_src[i] - corresp_dst[i]).squaredNorm() <=
+          sq_inlier_th) {
+        count++;
+      }
+    }
+    return count;
+  };
 
-auto GetWidthHeightForView() {
-  return std::make_pair(static_cast<uint32_t>(g_width / g_views.size()),
-                        static_cast<uint32_t>(g_height));
-}
+  const unsigned int num_threads =
+      std::max(1u, std::thread::hardware_concurrency());
+  const int iter_per_thread =
+      std::max(1, data.ransac_iter / static_cast<int>(num_threads));
+  std::vector<Eigen::Affine3f> best_trans(num_threads,
+                                          Eigen::Affine3f::Identity());
+  std::vector<size_t> best_counts(num_threads, 0);
+  auto ransac_func = [&](size_t t) {
+    std::mt19937 engine(static_cast<uint32_t>(t));
+    std::uniform_int_distribution<size_t> dist(0, corresp_src.size() - 1);
+    std::vector<Eigen::Vector3f> sample_src(3), sample_dst(3);
+    for (int iter = 0; iter < iter_per_thread; iter++) {
+      size_t ids[3] = {dist(engine), dist(engine), dist(engine)};
+      if (ids[0] == ids[1] || ids[1] == ids[2] || ids[0] == ids[2]) {
+        continue;
+      }
+      // Edge length consistency prunes most wrong samples cheaply. The
+      // dst / src length ratios of all edges must agree with each other and,
+      // without scale, with 1.
+      float ratio_min = data.with_scale ? std::numeric_limits<float>::max()
+                                        : 1.f;
+      float ratio_max = data.with_scale ? 0.f : 1.f;
+      bool consistent = true;
+      for (int k = 0; k < 3 && consistent; k++) {
+        const size_t a = ids[k];
+        const size_t b = ids[(k + 1) % 3];
+        const float ls = (corresp_src[a] - corresp_src[b]).norm();
+        const float ld = (corresp_dst[a] - corresp_dst[b]).norm();
+        consistent = 0.f < ls && 0.f < ld;
+        ratio_min = std::min(ratio_min, ld / ls);
+        ratio_max = std::max(ratio_max, ld / ls);
+      }
+      if (!consistent || ratio_min < 0.9f * ratio_max) {
+        continue;
+      }
+      for (int k = 0; k < 3; k++) {
+        sample_src[k] = corresp_src[ids[k]];
+        sample_dst[k] = corresp_dst[ids[k]];
+      }
+      const Eigen::Affine3f T = estimate(sample_src, sample_dst).cast<float>();
+      const size_t count = count_inliers(T);
+      if (best_counts[t] < count) {
+        best_counts[t] = count;
+        best_trans[t] = T;
+      }
+    }
+  };
+  parallel_for(size_t(0), size_t(num_threads), ransac_func);
 
-bool IsCursorOnView(uint32_t vidx) {
-  uint32_t x = static_cast<uint32_t>(g_cursor_pos.x());
-  uint32_t unit_w = g_width / static_cast<uint32_t>(g_views.size());
+  const size_t best =
+      std::max_element(best_counts.begin(), best_counts.end()) -
+      best_counts.begin();
+  if (best_counts[best] < 3) {
+    return false;
+  }
 
-  if (unit_w * vidx <= x && x < unit_w * (vidx + 1)) {
-    return true;
+  // Refit on all inliers
+  std::vector<Eigen::Vector3f> inlier_src, inlier_dst;
+  for (size_t i = 0; i < corresp_src.size(); i++) {
+    if ((best_trans[best] * corresp_src[i] - corresp_dst[i]).squaredNorm() <=
+        sq_inlier_th) {
+      inlier_src.push_back(corresp_src[i]);
+      inlier_dst.push_back(corresp_dst[i]);
+    }
+  }
+  data.src2dst = estimate(inlier_src, inlier_dst).cast<float>();
+  data.inlier_num = count_inliers(data.src2dst);
+  if (data.inlier_num < best_counts[best]) {
+    data.src2dst = best_trans[best];
+    data.inlier_num = best_counts[best];
   }
 
-  return false;
+  return true;
 }
 
-template <typename T>
-int CalcFillDigits(const T &point_num) {
-  return std::max(
-      2, static_cast<int>(std::log10(static_cast<double>(point_num)) + 1));
+void GlobalAlignProcess() {
+  std::lock_guard<std::mutex> lock(global_align_mtx);
+  if (g_global_align_run == AlgorithmStatus::STARTED) {
+    g_global_align_run = AlgorithmStatus::RUNNING;
+    PROFILE_SCOPE("GlobalAlignProcess");
+
+    Timer timer;
+    timer.Start();
+
+    // The UI edits g_global_align_data while this runs, so a copy with the
+    // resolved voxel size is used and only results are written back
+    GlobalAlignData data = g_global_align_data;
+    const Eigen::Affine3f src_trans = g_scene.model_matrix(data.src_mesh);
+    const Eigen::Affine3f dst_trans = g_scene.model_matrix(data.dst_mesh);
+    auto src_points = TransformPoints(data.src_mesh->vertices(), src_trans);
+    auto src_normals =
+        TransformPoints(data.src_mesh->normals(), src_trans, true);
+    auto dst_points = TransformPoints(data.dst_mesh->vertices(), dst_trans);
+    auto dst_normals =
+        TransformPoints(data.dst_mesh->normals(), dst_trans, true);
+
+    if (data.voxel_size <= 0.f) {
+      Eigen::Vector3f bb_max = Eigen::Vector3f::Constant(
+          std::numeric_limits<float>::lowest());
+      Eigen::Vector3f bb_min =
+          Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+      for (const auto &p : dst_points) {
+        bb_max = bb_max.cwiseMax(p);
+        bb_min = bb_min.cwiseMin(p);
+      }
+      data.voxel_size = (bb_max - bb_min).norm() / 50.f;
+    }
+
+    bool ret = src_normals.size() == src_points.size() &&
+               dst_normals.size() == dst_points.size() &&
+               0.f < data.voxel_size &&
+               EstimateGlobalAlignment(src_points, src_normals, dst_points,
+                                       dst_normals, data);
+    g_global_align_data.src2dst = data.src2dst;
+    g_global_align_data.inlier_num = data.inlier_num;
+    g_global_align_data.corresp_num = data.corresp_num;
+
+    timer.End();
+    if (ret) {
+      g_scene.model_matrix(data.src_mesh) = data.src2dst * src_trans;
+      g_scene.update_bvh(data.src_mesh) = true;
+      g_callback_message =
+          "Global alignment took " + std::to_string(timer.elapsed_msec()) +
+          " ms. " + std::to_string(data.inlier_num) + " / " +
+          std::to_string(data.corresp_num) + " inliers";
+    } else {
+      g_callback_message = "Global alignment failed";
+    }
+    std::cout << g_callback_message << std::endl;
+
+    if (ret && data.run_icp) {
+      // IcpProcess() picks it up in the next loop and finishes the popup
+      std::lock_guard<std::mutex> lock_icp(icp_mtx);
+      PrepareRigidIcp(data.src_mesh, data.dst_mesh);
+      g_icp_run = AlgorithmStatus::STARTED;
+    } else {
+      g_callback_succeeded = ret;
+      g_callback_finished = true;
+    }
+
+    g_global_align_run = AlgorithmStatus::HALTING;
+  }
 }
 
-struct SplitViewInfo {
-  RendererGlPtr renderer;
-  PinholeCameraPtr camera;
-  Eigen::Vector2i offset = {0, 0};
-  std::unordered_map<RenderableMeshPtr, int> selected_point_idx;
-  uint32_t id = ~0u;
-  double trans_speed = 0.0;
-  double wheel_speed = 0.0;
-  double rotate_speed = 0.0;
-  Eigen::Translation3d offset_to_rot_center = {0.0, 0.0, 0.0};
+// Embedded deformation graph. One affine per graph node is optimized with
+// the same stiffness, landmark and correspondence terms as ugu::NonRigidIcp
+// (Amberg et al. 2007) and blended to vertices (Sumner et al. 2007), so the
+// solve size depends on the node count instead of the vertex count.
+class DeformationGraph {
+ public:
+  static constexpr int kSkinNn = 4;
+
+  void SetSrc(const Mesh &src, const Eigen::Affine3f &trans) {
+    src_ = Mesh::Create(src);
+    src_->Transform(trans);
+    src_->CalcNormal();
+    deformed_ = Mesh::Create(*src_);
+  }
 
-  void Init(uint32_t vidx) {
-    std::lock_guard<std::mutex> lock(views_mtx);
+  void SetDst(const Mesh &dst) {
+    dst_ = Mesh::Create(dst);
+    dst_->CalcFaceNormal();
+  }
 
-    auto [w, h] = GetWidthHeightForView();
+  void SetIgnoreFaces(const FaceMask &ignore_faces) {
+    ignore_faces_ = ignore_faces;
+  }
+
+  void SetSrcLandmarks(const std::vector<PointOnFace> &landmarks,
+                       const std::vector<double> &betas) {
+    src_landmarks_ = landmarks;
+    betas_ = betas;
+  }
+
+  void SetDstLandmarkPositions(const std::vector<Eigen::Vector3f> &positions) {
+    dst_landmark_positions_ = positions;
+  }
+
+  // Optional. finder must be built on dst with corresp_nn_num of Init() and
+  // may be shared by graphs running in parallel. Init() builds one if unset.
+  void SetDstCorrespFinder(const CorrespFinderPtr &finder) {
+    corresp_finder_ = finder;
+  }
+
+  bool Init(int node_num, int sample_num, float angle_rad_th, float dist_th,
+            int corresp_nn_num) {
+    angle_rad_th_ = angle_rad_th;
+    dist_th_ = dist_th;
+
+    const auto &verts = src_->vertices();
+    const auto &faces = src_->vertex_indices();
+    if (verts.empty() || faces.empty()) {
+      return false;
+    }
+
+    // Node spacing so that each node covers about area / node_num
+    double area = 0.0;
+    for (const auto &f : faces) {
+      area += 0.5 * (verts[f[1]] - verts[f[0]])
+                        .cross(verts[f[2]] - verts[f[0]])
+                        .norm();
+    }
+    spacing_ = static_cast<float>(
+        std::sqrt(area / std::max(1, node_num)));
+    if (spacing_ <= 0.f) {
+      return false;
+    }
+
+    // Voxel grid sampling of nodes
+    grid_.clear();
+    nodes_.clear();
+    for (const auto &v : verts) {
+      auto &cell = grid_[GridKey(GridIndex(v))];
+      if (cell.empty()) {
+        cell.push_back(static_cast<int>(nodes_.size()));
+        nodes_.push_back(v);
+      }
+    }
+
+    // Skinning weights for all vertices
+    skin_ids_.resize(verts.size());
+    skin_weights_.resize(verts.size());
+    parallel_for(size_t(0), verts.size(), [&](size_t i) {
+      ComputeSkin(verts[i], skin_ids_[i], skin_weights_[i]);
+    });
+
+    // Graph edges to nearest nodes
+    std::set<std::pair<int, int>> edge_set;
+    for (int j = 0; j < static_cast<int>(nodes_.size()); j++) {
+      std::array<int, kSkinNn> ids;
+      std::array<float, kSkinNn> weights;
+      ComputeSkin(nodes_[j], ids, weights, j);
+      for (const auto &k : ids) {
+        if (k < 0) {
+          continue;
+        }
+        edge_set.insert({std::min(j, k), std::max(j, k)});
+      }
+    }
+    edges_.assign(edge_set.begin(), edge_set.end());
+
+    // Vertices used for the data term
+    const std::vector<uint8_t> ignored =
+        ignore_faces_.ToVertexMask(faces, verts.size());
+    const size_t stride =
+        std::max(size_t(1), verts.size() / std::max(1, sample_num));
+    samples_.clear();
+    for (size_t i = 0; i < verts.size(); i += stride) {
+      if (!ignored[i]) {
+        samples_.push_back(static_cast<int>(i));
+      }
+    }
+
+    landmark_skin_ids_.clear();
+    landmark_skin_weights_.clear();
+    landmark_positions_.clear();
+    for (const auto &pof : src_landmarks_) {
+      const auto &f = faces[pof.fid];
+      Eigen::Vector3f p = pof.u * (verts[f[1]] - verts[f[0]]) +
+                          pof.v * (verts[f[2]] - verts[f[0]]) + verts[f[0]];
+      landmark_positions_.push_back(p);
+      landmark_skin_ids_.push_back({});
+      landmark_skin_weights_.push_back({});
+      ComputeSkin(p, landmark_skin_ids_.back(), landmark_skin_weights_.back());
+    }
+
+    if (corresp_finder_ == nullptr) {
+      corresp_finder_ = KDTreeCorrespFinder::Create(
+          static_cast<uint32_t>(std::max(1, corresp_nn_num)));
+      corresp_finder_->Init(dst_->vertices(), dst_->vertex_indices());
+    }
+
+    X_ = Eigen::MatrixXd::Zero(4 * nodes_.size(), 3);
+    for (size_t j = 0; j < nodes_.size(); j++) {
+      X_.block<3, 3>(4 * j, 0).setIdentity();
+    }
+
+    return true;
+  }
+
+  bool Registrate(double alpha, double gamma, int max_iter,
+                  double min_frobenius_norm_diff) {
+    const auto &verts = src_->vertices();
+    const Eigen::Index n = static_cast<Eigen::Index>(nodes_.size()) * 4;
+
+    // Samples without a correspondence stay in A as zero rows, so the
+    // pattern of AtA does not change between iterations and is analyzed
+    // once. It is checked anyway since factorize() requires the same one.
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> solver;
+    Eigen::Index analyzed_nnz = -1;
+    for (int iter = 0; iter < max_iter; iter++) {
+      // Correspondences of deformed samples
+      std::vector<Eigen::Vector3f> targets(samples_.size());
+      std::vector<uint8_t> valid(samples_.size(), 0);
+      parallel_for(size_t(0), samples_.size(), [&](size_t s) {
+        const int i = samples_[s];
+        Eigen::Vector3f p, nor;
+        Deform(verts[i], src_->normals()[i], skin_ids_[i], skin_weights_[i],
+               p, nor);
+        Corresp corresp =
+            corresp_finder_->Find(p, nor, CorrespFinderMode::kMinDist);
+        if (corresp.fid < 0) {
+          return;
+        }
+        if (0.f < dist_th_ && dist_th_ < corresp.abs_dist) {
+          return;
+        }
+        const Eigen::Vector3f &dst_n = dst_->face_normals()[corresp.fid];
+        float cos = std::clamp(nor.dot(dst_n), -1.f, 1.f);
+        if (angle_rad_th_ < std::acos(cos)) {
+          return;
+        }
+        targets[s] = corresp.p;
+        valid[s] = 1;
+      });
+
+      std::vector<Eigen::Triplet<double>> triplets;
+      std::vector<Eigen::Vector3d> rhs;
+      Eigen::Index row = 0;
+
+      auto add_point = [&](const Eigen::Vector3f &v,
+                           const std::array<int, kSkinNn> &ids,
+                           const std::array<float, kSkinNn> &weights,
+                           double w, const Eigen::Vector3f &target) {
+        for (int k = 0; k < kSkinNn; k++) {
+          if (ids[k] < 0) {
+            continue;
+          }
+          const double wk = w * weights[k];
+          for (int c = 0; c < 3; c++) {
+            triplets.emplace_back(row, 4 * ids[k] + c, wk * v[c]);
+          }
+          triplets.emplace_back(row, 4 * ids[k] + 3, wk);
+        }
+        rhs.push_back(w * target.cast<double>());
+        row++;
+      };
+
+      for (size_t s = 0; s < samples_.size(); s++) {
+        const int i = samples_[s];
+        add_point(verts[i], skin_ids_[i], skin_weights_[i],
+                  valid[s] ? 1.0 : 0.0,
+                  valid[s] ? targets[s] : Eigen::Vector3f::Zero());
+      }
+
+      const size_t landmark_num =
+          std::min(landmark_positions_.size(), dst_landmark_positions_.size());
+      for (size_t l = 0; l < landmark_num; l++) {
+        add_point(landmark_positions_[l], landmark_skin_ids_[l],
+                  landmark_skin_weights_[l], betas_[l],
+                  dst_landmark_positions_[l]);
+      }
+
+      for (const auto &[j, k] : edges_) {
+        for (int r = 0; r < 4; r++) {
+          const double g = r < 3 ? alpha : alpha * gamma;
+          triplets.emplace_back(row, 4 * j + r, g);
+          triplets.emplace_back(row, 4 * k + r, -g);
+          rhs.push_back(Eigen::Vector3d::Zero());
+          row++;
+        }
+      }
+
+      Eigen::SparseMatrix<double> A(row, n);
+      A.setFromTriplets(triplets.begin(), triplets.end());
+      Eigen::MatrixXd B(row, 3);
+      for (Eigen::Index r = 0; r < row; r++) {
+        B.row(r) = rhs[r].transpose();
+      }
+
+      // Small damping keeps nodes without data and edges solvable
+      const double eps = 1e-6;
+      Eigen::SparseMatrix<double> AtA = A.transpose() * A;
+      Eigen::SparseMatrix<double> I(n, n);
+      I.setIdentity();
+      AtA += eps * I;
+      Eigen::MatrixXd AtB = A.transpose() * B + eps * X_;
+
+      if (analyzed_nnz != AtA.nonZeros()) {
+        solver.analyzePattern(AtA);
+        analyzed_nnz = AtA.nonZeros();
+      }
+      solver.factorize(AtA);
+      if (solver.info() != Eigen::Success) {
+        LOGE("DeformationGraph: decomposition failed\n");
+        return false;
+      }
+      Eigen::MatrixXd X = solver.solve(AtB);
+
+      double diff = (X - X_).norm();
+      X_ = X;
+      if (diff < min_frobenius_norm_diff) {
+        break;
+      }
+    }
+
+    UpdateDeformed();
+
+    return true;
+  }
+
+  MeshPtr GetDeformedSrc() const { return deformed_; }
+
+  size_t node_num() const { return nodes_.size(); }
+
+ private:
+  MeshPtr src_, dst_, deformed_;
+  FaceMask ignore_faces_;
+  std::vector<PointOnFace> src_landmarks_;
+  std::vector<double> betas_;
+  std::vector<Eigen::Vector3f> dst_landmark_positions_;
+  float angle_rad_th_ = 0.65f;
+  float dist_th_ = -1.f;
+
+  float spacing_ = 0.f;
+  std::unordered_map<uint64_t, std::vector<int>> grid_;
+  std::vector<Eigen::Vector3f> nodes_;
+  std::vector<std::pair<int, int>> edges_;
+  std::vector<std::array<int, kSkinNn>> skin_ids_;
+  std::vector<std::array<float, kSkinNn>> skin_weights_;
+  std::vector<int> samples_;
+  std::vector<Eigen::Vector3f> landmark_positions_;
+  std::vector<std::array<int, kSkinNn>> landmark_skin_ids_;
+  std::vector<std::array<float, kSkinNn>> landmark_skin_weights_;
+  CorrespFinderPtr corresp_finder_;
+  Eigen::MatrixXd X_;  // Stacked 4x3 affine per node
+
+  Eigen::Vector3i GridIndex(const Eigen::Vector3f &p) const {
+    return Eigen::Vector3i(static_cast<int>(std::floor(p.x() / spacing_)),
+                           static_cast<int>(std::floor(p.y() / spacing_)),
+                           static_cast<int>(std::floor(p.z() / spacing_)));
+  }
+
+  // Weights by distance to the (kSkinNn + 1)-th nearest node
+  void ComputeSkin(const Eigen::Vector3f &p, std::array<int, kSkinNn> &ids,
+                   std::array<float, kSkinNn> &weights,
+                   int exclude = -1) const {
+    constexpr int K = kSkinNn + 1;
+    std::array<int, K> nn_ids;
+    std::array<float, K> nn_dists;
+    nn_ids.fill(-1);
+    nn_dists.fill(std::numeric_limits<float>::max());
+
+    const Eigen::Vector3i center = GridIndex(p);
+    const int max_ring = 4;
+    for (int ring = 0; ring <= max_ring; ring++) {
+      for (int z = -ring; z <= ring; z++) {
+        for (int y = -ring; y <= ring; y++) {
+          for (int x = -ring; x <= ring; x++) {
+            if (std::max({std::abs(x), std::abs(y), std::abs(z)}) != ring) {
+              continue;
+            }
+            auto it = grid_.find(GridKey(center + Eigen::Vector3i(x, y, z)));
+            if (it == grid_.end()) {
+              continue;
+            }
+            for (const auto &j : it->second) {
+              if (j == exclude) {
+                continue;
+              }
+              float d = (nodes_[j] - p).norm();
+              for (int k = 0; k < K; k++) {
+                if (d < nn_dists[k]) {
+                  for (int m = K - 1; k < m; m--) {
+                    nn_dists[m] = nn_dists[m - 1];
+                    nn_ids[m] = nn_ids[m - 1];
+                  }
+                  nn_dists[k] = d;
+                  nn_ids[k] = j;
+                  break;
+                }
+              }
+            }
+          }
+        }
+      }
+      // Nodes outside the searched cube are farther than ring * spacing
+      if (0 <= nn_ids[K - 1] && nn_dists[K - 1] <= ring * spacing_) {
+        break;
+      }
+    }
+
+    float d_max = nn_dists[K - 1];
+    if (nn_ids[K - 1] < 0) {
+      d_max = 0.f;
+      for (int k = 0; k < kSkinNn; k++) {
+        if (0 <= nn_ids[k]) {
+          d_max = std::max(d_max, nn_dists[k]);
+        }
+      }
+      d_max = d_max * 1.5f + std::numeric_limits<float>::epsilon();
+    }
+
+    float sum = 0.f;
+    for (int k = 0; k < kSkinNn; k++) {
+      ids[k] = nn_ids[k];
+      if (nn_ids[k] < 0) {
+        weights[k] = 0.f;
+        continue;
+      }
+      float w = 1.f - nn_dists[k] / d_max;
+      weights[k] = w * w;
+      sum += weights[k];
+    }
+    for (int k = 0; k < kSkinNn; k++) {
+      weights[k] = sum > 0.f ? weights[k] / sum : (k == 0 ? 1.f : 0.f);
+    }
+  }
+
+  void Deform(const Eigen::Vector3f &v, const Eigen::Vector3f &nor,
+              const std::array<int, kSkinNn> &ids,
+              const std::array<float, kSkinNn> &weights, Eigen::Vector3f &p,
+              Eigen::Vector3f &deformed_nor) const {
+    Eigen::Vector4d vh(v.x(), v.y(), v.z(), 1.0);
+    Eigen::Vector3d p_ = Eigen::Vector3d::Zero();
+    Eigen::Matrix3d L = Eigen::Matrix3d::Zero();
+    for (int k = 0; k < kSkinNn; k++) {
+      if (ids[k] < 0) {
+        continue;
+      }
+      const auto &Xj = X_.block<4, 3>(4 * ids[k], 0);
+      p_ += weights[k] * (Xj.transpose() * vh);
+      L += weights[k] * Xj.block<3, 3>(0, 0).transpose();
+    }
+    p = p_.cast<float>();
+    deformed_nor = (L * nor.cast<double>()).normalized().cast<float>();
+  }
+
+  void UpdateDeformed() {
+    const auto &verts = src_->vertices();
+    const auto &normals = src_->normals();
+    std::vector<Eigen::Vector3f> deformed_verts(verts.size());
+    parallel_for(size_t(0), verts.size(), [&](size_t i) {
+      Eigen::Vector3f nor;
+      Deform(verts[i], normals[i], skin_ids_[i], skin_weights_[i],
+             deformed_verts[i], nor);
+    });
+    deformed_->set_vertices(deformed_verts);
+    deformed_->CalcNormal();
+  }
+};
+
+// Inputs of non-rigid registration. Meshes are in world coordinates.
+struct NonrigidIcpInput {
+  MeshPtr src;
+  MeshPtr dst;
+  FaceMask ignore_faces;
+  std::vector<PointOnFace> src_landmarks;
+  std::vector<Eigen::Vector3f> dst_landmark_positions;
+};
+
+using NonrigidStepCallback =
+    std::function<void(int step, double alpha, const MeshPtr &deformed)>;
+
+// Run the stiffness schedule from max_alpha to params.min_alpha in step
+// steps. Returns the deformed src in world coordinates or nullptr.
+// dst_finder, built on input.dst with params.nn_num, saves rebuilding the
+// index when many registrations share dst. ugu::NonRigidIcp always builds
+// its own, so only the deformation graph uses it.
+MeshPtr RegistrateNonrigid(const NonrigidIcpInput &input,
+                           const NonrigidIcpData &params, double max_alpha,
+                           int step, const NonrigidStepCallback &callback,
+                           const CorrespFinderPtr &dst_finder = nullptr) {
+  const bool use_graph =
+      params.engine == NonrigidIcpEngine::DEFORMATION_GRAPH;
+  ugu::NonRigidIcp nicp;
+  DeformationGraph graph;
+
+  std::vector<double> betas(input.src_landmarks.size(), params.beta);
+
+  if (use_graph) {
+    graph.SetSrc(*input.src, Eigen::Affine3f::Identity());
+    graph.SetDst(*input.dst);
+    graph.SetIgnoreFaces(input.ignore_faces);
+    graph.SetSrcLandmarks(input.src_landmarks, betas);
+    graph.SetDstLandmarkPositions(input.dst_landmark_positions);
+    graph.SetDstCorrespFinder(dst_finder);
+    if (!graph.Init(params.graph_node_num, params.graph_sample_num,
+                    params.angle_rad_th, params.dist_th, params.nn_num)) {
+      return nullptr;
+    }
+  } else {
+    nicp.SetSrc(*input.src, Eigen::Affine3f::Identity());
+    nicp.SetDst(*input.dst);
+
+    nicp.Init(params.check_self_itersection, params.angle_rad_th,
+              params.dst_check_geometry_border,
+              params.src_check_geometry_border);
+
+    nicp.SetCorrespDistTh(params.dist_th);
+    nicp.SetCorrespNnNum(params.nn_num);
+
+    if (input.ignore_faces.Any()) {
+      // ugu::NonRigidIcp takes ids
+      const auto ids = input.ignore_faces.ToIds();
+      nicp.SetIgnoreFaceIds(std::set<uint32_t>(ids.begin(), ids.end()));
+    }
+
+    nicp.SetSrcLandmarks(input.src_landmarks, betas);
+    nicp.SetDstLandmarkPositions(input.dst_landmark_positions);
+  }
+
+  for (int i = 1; i <= step; ++i) {
+    double alpha = max_alpha - i * (max_alpha - params.min_alpha) / step;
+
+    if (use_graph) {
+      graph.Registrate(alpha, params.gamma, params.max_internal_iter,
+                       params.min_frobenius_norm_diff);
+    } else {
+      nicp.Registrate(alpha, params.gamma, params.max_internal_iter,
+                      params.min_frobenius_norm_diff);
+    }
+
+    if (callback) {
+      callback(i, alpha,
+               use_graph ? graph.GetDeformedSrc() : nicp.GetDeformedSrc());
+    }
+  }
+
+  return Mesh::Create(use_graph ? *graph.GetDeformedSrc()
+                                : *nicp.GetDeformedSrc());
+}
+
+// Closest point of triangle (a, b, c) to p (Ericson, "Real-Time Collision
+// Detection", 5.1.5)
+Eigen::Vector3f ClosestPointOnTriangle(const Eigen::Vector3f &p,
+                                       const Eigen::Vector3f &a,
+                                       const Eigen::Vector3f &b,
+                                       const Eigen::Vector3f &c) {
+  const Eigen::Vector3f ab = b - a, ac = c - a, ap = p - a;
+  const float d1 = ab.dot(ap), d2 = ac.dot(ap);
+  if (d1 <= 0.f && d2 <= 0.f) {
+    return a;
+  }
+  const Eigen::Vector3f bp = p - b;
+  const float d3 = ab.dot(bp), d4 = ac.dot(bp);
+  if (0.f <= d3 && d4 <= d3) {
+    return b;
+  }
+  const float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.f && 0.f <= d1 && d3 <= 0.f) {
+    return a + d1 / (d1 - d3) * ab;
+  }
+  const Eigen::Vector3f cp = p - c;
+  const float d5 = ab.dot(cp), d6 = ac.dot(cp);
+  if (0.f <= d6 && d5 <= d6) {
+    return c;
+  }
+  const float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.f && 0.f <= d2 && d6 <= 0.f) {
+    return a + d2 / (d2 - d6) * ac;
+  }
+  const float va = d3 * d6 - d5 * d4;
+  if (va <= 0.f && 0.f <= d4 - d3 && 0.f <= d5 - d6) {
+    return b + (d4 - d3) / ((d4 - d3) + (d5 - d6)) * (c - b);
+  }
+  const float denom = 1.f / (va + vb + vc);
+  return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+// Bounding volume hierarchy over triangles for exact closest point queries.
+// Keeps references to vertices and faces.
+class TriangleBvh {
+ public:
+  TriangleBvh(const std::vector<Eigen::Vector3f> &vertices,
+              const std::vector<Eigen::Vector3i> &faces)
+      : vertices_(vertices), faces_(faces) {
+    ids_.resize(faces.size());
+    std::iota(ids_.begin(), ids_.end(), 0);
+    centroids_.resize(faces.size());
+    for (size_t i = 0; i < faces.size(); i++) {
+      centroids_[i] = (vertices[faces[i][0]] + vertices[faces[i][1]] +
+                       vertices[faces[i][2]]) /
+                      3.f;
+    }
+    root_ = Build(0, ids_.size());
+  }
+
+  // Face id of the closest point on the surface to query, -1 without faces
+  int Closest(const Eigen::Vector3f &query, Eigen::Vector3f *closest = nullptr,
+              float *sq_dist = nullptr) const {
+    int best = -1;
+    float best_sq = std::numeric_limits<float>::max();
+    Eigen::Vector3f best_p = Eigen::Vector3f::Zero();
+    Search(root_, query, best, best_sq, best_p);
+    if (closest != nullptr) {
+      *closest = best_p;
+    }
+    if (sq_dist != nullptr) {
+      *sq_dist = best_sq;
+    }
+    return best;
+  }
+
+ private:
+  static constexpr size_t kLeafSize = 4;
+  struct Node {
+    Eigen::AlignedBox3f box;
+    uint32_t st;
+    uint32_t ed;
+    int left = -1;
+    int right = -1;
+  };
+  const std::vector<Eigen::Vector3f> &vertices_;
+  const std::vector<Eigen::Vector3i> &faces_;
+  std::vector<Eigen::Vector3f> centroids_;
+  std::vector<uint32_t> ids_;
+  std::vector<Node> nodes_;
+  int root_ = -1;
+
+  int Build(size_t st, size_t ed) {
+    if (st >= ed) {
+      return -1;
+    }
+    Eigen::AlignedBox3f box, centroid_box;
+    for (size_t i = st; i < ed; i++) {
+      const auto &f = faces_[ids_[i]];
+      for (int k = 0; k < 3; k++) {
+        box.extend(vertices_[f[k]]);
+      }
+      centroid_box.extend(centroids_[ids_[i]]);
+    }
+    const int index = static_cast<int>(nodes_.size());
+    nodes_.push_back(
+        {box, static_cast<uint32_t>(st), static_cast<uint32_t>(ed)});
+    if (ed - st <= kLeafSize) {
+      return index;
+    }
+    // Median split on the axis of largest centroid spread
+    int axis = 0;
+    centroid_box.sizes().maxCoeff(&axis);
+    const size_t mid = (st + ed) / 2;
+    std::nth_element(ids_.begin() + st, ids_.begin() + mid, ids_.begin() + ed,
+                     [&](uint32_t a, uint32_t b) {
+                       return centroids_[a][axis] < centroids_[b][axis];
+                     });
+    const int left = Build(st, mid);
+    const int right = Build(mid, ed);
+    nodes_[index].left = left;
+    nodes_[index].right = right;
+    return index;
+  }
+
+  void Search(int index, const Eigen::Vector3f &query, int &best,
+              float &best_sq, Eigen::Vector3f &best_p) const {
+    if (index < 0) {
+      return;
+    }
+    const Node &node = nodes_[index];
+    if (best_sq <= node.box.squaredExteriorDistance(query)) {
+      return;
+    }
+    if (node.left < 0) {
+      for (uint32_t i = node.st; i < node.ed; i++) {
+        const auto &f = faces_[ids_[i]];
+        const Eigen::Vector3f p = ClosestPointOnTriangle(
+            query, vertices_[f[0]], vertices_[f[1]], vertices_[f[2]]);
+        const float sq = (p - query).squaredNorm();
+        if (sq < best_sq) {
+          best_sq = sq;
+          best = static_cast<int>(ids_[i]);
+          best_p = p;
+        }
+      }
+      return;
+    }
+    // Nearer box first so that the other one is more likely pruned
+    const float sq_left = nodes_[node.left].box.squaredExteriorDistance(query);
+    const float sq_right =
+        nodes_[node.right].box.squaredExteriorDistance(query);
+    const int near = sq_left <= sq_right ? node.left : node.right;
+    const int far = sq_left <= sq_right ? node.right : node.left;
+    Search(near, query, best, best_sq, best_p);
+    Search(far, query, best, best_sq, best_p);
+  }
+};
+
+// Unsigned distance to the closest point on the surface of bvh for each
+// point. Negative if not found.
+std::vector<float> ComputeSurfaceDistances(
+    const TriangleBvh &bvh, const std::vector<Eigen::Vector3f> &points,
+    int num_threads = -1) {
+  std::vector<float> dists(points.size(), -1.f);
+  auto func = [&](size_t i) {
+    float sq_dist = 0.f;
+    if (0 <= bvh.Closest(points[i], nullptr, &sq_dist)) {
+      dists[i] = std::sqrt(sq_dist);
+    }
+  };
+  parallel_for(size_t(0), points.size(), func, num_threads);
+  return dists;
+}
+
+DeviationStats ComputeDeviationStats(const std::vector<float> &dists) {
+  DeviationStats stats;
+  std::vector<float> valid;
+  valid.reserve(dists.size());
+  for (const auto &d : dists) {
+    if (0.f <= d) {
+      valid.push_back(d);
+    }
+  }
+  if (valid.empty()) {
+    return stats;
+  }
+
+  stats.count = valid.size();
+  double sum = 0.0;
+  double sq_sum = 0.0;
+  for (const auto &d : valid) {
+    sum += d;
+    sq_sum += static_cast<double>(d) * d;
+  }
+  stats.mean = sum / stats.count;
+  stats.rms = std::sqrt(sq_sum / stats.count);
+
+  // Ascending percentiles so that each nth_element works on the remainder
+  auto percentile = [&](double ratio, size_t from) {
+    size_t n = std::min(static_cast<size_t>(ratio * (valid.size() - 1)),
+                        valid.size() - 1);
+    n = std::max(n, from);
+    std::nth_element(valid.begin() + from, valid.begin() + n, valid.end());
+    return n;
+  };
+  size_t n = percentile(0.5, 0);
+  stats.p50 = valid[n];
+  n = percentile(0.9, n);
+  stats.p90 = valid[n];
+  n = percentile(0.95, n);
+  stats.p95 = valid[n];
+  n = percentile(0.99, n);
+  stats.p99 = valid[n];
+  stats.max = *std::max_element(valid.begin() + n, valid.end());
+
+  return stats;
+}
+
+// Blue (0) -> green -> red (max_dist)
+Eigen::Vector3f DeviationColor(float dist, float max_dist) {
+  if (dist < 0.f) {
+    return {128.f, 128.f, 128.f};
+  }
+  const float t = std::clamp(dist / std::max(max_dist, 1e-10f), 0.f, 1.f);
+  Eigen::Vector3f col;
+  if (t < 0.5f) {
+    col = {0.f, 2.f * t, 1.f - 2.f * t};
+  } else {
+    col = {2.f * t - 1.f, 2.f - 2.f * t, 0.f};
+  }
+  return col * 255.f;
+}
+
+std::string DeviationStatsToString(const DeviationStats &stats) {
+  std::stringstream ss;
+  ss << "rms " << stats.rms << " p50 " << stats.p50 << " p95 " << stats.p95
+     << " max " << stats.max;
+  return ss.str();
+}
+
+NonrigidIcpInput MakeNonrigidIcpInput(const RenderableMeshPtr &src_mesh,
+                                      const RenderableMeshPtr &dst_mesh) {
+  NonrigidIcpInput input;
+  input.src = Mesh::Create(*std::static_pointer_cast<Mesh>(src_mesh));
+  input.src->Transform(g_scene.model_matrix(src_mesh));
+  input.dst = Mesh::Create(*std::static_pointer_cast<Mesh>(dst_mesh));
+  input.dst->Transform(g_scene.model_matrix(dst_mesh));
+
+  input.ignore_faces = g_scene.ignore_faces(src_mesh);
+
+  for (const auto &res : g_scene.selected_positions(src_mesh)) {
+    PointOnFace pof;
+    pof.fid = res.intersection.fid;
+    pof.u = res.intersection.u;
+    pof.v = res.intersection.v;
+    input.src_landmarks.push_back(pof);
+  }
+  input.dst_landmark_positions =
+      ExtractPos(g_scene.selected_positions(dst_mesh));
+
+  return input;
+}
+
+MeshPtr LoadObjMesh(const std::string &path) {
+  auto mesh = Mesh::Create();
+  if (!mesh->LoadObj(path, ExtractDir(path))) {
+    return nullptr;
+  }
+  return mesh;
+}
+
+void NonrigidIcpProcess() {
+  std::lock_guard<std::mutex> lock(nonrigidicp_mtx);
+  if (g_nonrigidicp_run == AlgorithmStatus::STARTED) {
+    g_nonrigidicp_run = AlgorithmStatus::RUNNING;
+    PROFILE_SCOPE("NonrigidIcpProcess");
+
+    Timer timer;
+    timer.Start();
+
+    const Eigen::Affine3f src_trans =
+        g_scene.model_matrix(g_nonrigidicp_data.src_mesh);
+    const Eigen::Affine3f dst_trans =
+        g_scene.model_matrix(g_nonrigidicp_data.dst_mesh);
+
+    NonrigidIcpInput input = MakeNonrigidIcpInput(
+        g_nonrigidicp_data.src_mesh, g_nonrigidicp_data.dst_mesh);
+
+    auto update_mesh = [&](const MeshPtr &deformed_wld,
+                           bool update_base = false) {
+      ugu::MeshPtr deformed = Mesh::Create(*deformed_wld);
+      deformed->Transform(src_trans.inverse());
+      deformed->CalcNormal();
+
+      auto fnum = static_cast<int>(
+          g_nonrigidicp_data.src_mesh->vertex_indices().size());
+      {
+        std::lock_guard<std::mutex> lock_update(nonrigidicp_update_mtx);
+
+        bool to_split_uv = g_nonrigidicp_data.src_mesh->HasIndepentUv();
+        if (to_split_uv) {
+          for (int i = 0; i < fnum; i++) {
+            const auto &face = g_nonrigidicp_data.src_mesh->vertex_indices()[i];
+            for (int j = 0; j < 3; j++) {
+              uint32_t index = i * 3 + j;
+              g_nonrigidicp_data.src_mesh->renderable_vertices[index].pos =
+                  deformed->vertices()[face[j]];
+
+              g_nonrigidicp_data.src_mesh->renderable_vertices[index].nor =
+                  deformed->normals()[face[j]];
+            }
+          }
+        } else {
+          for (int i = 0; i < fnum; i++) {
+            const auto &face = g_nonrigidicp_data.src_mesh->vertex_indices()[i];
+            for (int j = 0; j < 3; j++) {
+              g_nonrigidicp_data.src_mesh->renderable_vertices[face[j]].pos =
+                  deformed->vertices()[face[j]];
+
+              g_nonrigidicp_data.src_mesh->renderable_vertices[face[j]].nor =
+                  deformed->normals()[face[j]];
+            }
+          }
+        }
+
+        // Under the lock since DrawViews() reads vertices for selected points
+        if (update_base) {
+          g_nonrigidicp_data.src_mesh->set_vertices(deformed->vertices());
+          g_nonrigidicp_data.src_mesh->CalcNormal();
+          g_scene.geometry_revision(g_nonrigidicp_data.src_mesh)++;
+        }
+      }
+
+      // OpenGL APIs MUST NOT BE CALLED IN SUB THREADS
+
+      // g_nonrigidicp_data.src_mesh->UpdateMesh();
+    };
+
+    std::string label = "NonRigid-ICP";
+    int step_num = g_nonrigidicp_data.step;
+    MeshPtr current_dst = input.dst;
+    std::unique_ptr<TriangleBvh> deviation_bvh;
+    MeshPtr deviation_dst;
+    auto step_callback = [&](int i, double alpha, const MeshPtr &deformed) {
+      g_callback_message = label + " : " + std::to_string(i) + " / " +
+                           std::to_string(step_num) +
+                           "  with alpha " + std::to_string(alpha);
+      if (g_deviation_data.track_nonrigidicp) {
+        if (deviation_dst != current_dst) {
+          // Target changes per frame in sequence mode
+          deviation_dst = current_dst;
+          deviation_bvh = std::make_unique<TriangleBvh>(
+              deviation_dst->vertices(), deviation_dst->vertex_indices());
+        }
+        auto stats = ComputeDeviationStats(
+            ComputeSurfaceDistances(*deviation_bvh, deformed->vertices()));
+        g_callback_message += "\n  " + DeviationStatsToString(stats);
+      }
+      std::cout << g_callback_message << std::endl;
+
+      update_mesh(deformed);
+    };
+
+    // Kept for later jobs against the same target
+    CorrespFinderPtr dst_finder;
+    if (g_nonrigidicp_data.engine == NonrigidIcpEngine::DEFORMATION_GRAPH) {
+      dst_finder = g_corresp_indices
+                       .Get(g_nonrigidicp_data.dst_mesh, dst_trans,
+                            g_scene.geometry_revision(
+                                g_nonrigidicp_data.dst_mesh),
+                            g_nonrigidicp_data.nn_num)
+                       ->finder;
+    }
+    MeshPtr deformed = RegistrateNonrigid(
+        input, g_nonrigidicp_data, g_nonrigidicp_data.max_alpha,
+        g_nonrigidicp_data.step, step_callback, dst_finder);
+
+    // Sequence frame stopped at, if any
+    int halted_frame = -1;
+    if (deformed != nullptr && g_nonrigidicp_data.sequence_mode &&
+        !g_nonrigidicp_data.sequence_paths.empty()) {
+      // Warm start each frame from the previous result with a short
+      // low-stiffness schedule. Landmarks are only used for the first
+      // frame. The next frame is loaded while the current one is solved.
+      const auto &paths = g_nonrigidicp_data.sequence_paths;
+      NonrigidIcpInput frame_input;
+      frame_input.ignore_faces = input.ignore_faces;
+      std::future<MeshPtr> next_frame =
+          std::async(std::launch::async, LoadObjMesh, paths[0]);
+      const double frame_max_alpha =
+          std::max(g_nonrigidicp_data.sequence_max_alpha,
+                   g_nonrigidicp_data.min_alpha);
+      for (size_t f = 0; f < paths.size(); f++) {
+        if (g_nonrigidicp_halt) {
+          halted_frame = static_cast<int>(f);
+          break;
+        }
+        MeshPtr frame = next_frame.get();
+        if (f + 1 < paths.size()) {
+          next_frame =
+              std::async(std::launch::async, LoadObjMesh, paths[f + 1]);
+        }
+        if (frame == nullptr) {
+          LOGE("Failed to load %s\n", paths[f].c_str());
+          continue;
+        }
+        frame->Transform(dst_trans);
+
+        label = "Sequence " + std::to_string(f + 1) + " / " +
+                std::to_string(paths.size());
+        step_num = g_nonrigidicp_data.sequence_step;
+        frame_input.src = deformed;
+        frame_input.dst = frame;
+        current_dst = frame;
+        MeshPtr frame_deformed = RegistrateNonrigid(
+            frame_input, g_nonrigidicp_data, frame_max_alpha,
+            g_nonrigidicp_data.sequence_step, step_callback);
+        if (frame_deformed == nullptr) {
+          LOGE("Failed to register %s\n", paths[f].c_str());
+          continue;
+        }
+        deformed = frame_deformed;
+
+        // Write in the coordinates of the frame file
+        auto out = Mesh::Create(*deformed);
+        out->Transform(dst_trans.inverse());
+        out->WriteObj(g_nonrigidicp_data.sequence_output_dir + "/" +
+                      ExtractFilename(paths[f], true) + "_registered.obj");
+      }
+    }
+
+    timer.End();
+    g_callback_message = "NonRigid-ICP took " +
+                         std::to_string(timer.elapsed_msec() / 1000) + " sec.";
+    if (0 <= halted_frame) {
+      g_callback_message += " Stopped before sequence frame " +
+                            std::to_string(halted_frame + 1) + ".";
+    }
+
+    std::cout << g_callback_message << std::endl;
+
+    if (deformed != nullptr) {
+      update_mesh(deformed, true);
+      g_callback_succeeded = true;
+    } else {
+      g_callback_message = "NonRigid-ICP failed";
+      g_callback_succeeded = false;
+    }
+
+    // ugu::MeshPtr deformed = nicp.GetDeformedSrc();
+    // deformed->Transform(
+    //     g_scene.model_matrix(g_nonrigidicp_data.src_mesh).inverse());
+
+    // deformed->WriteObj("./", "out");
+
+    g_scene.update_bvh(g_nonrigidicp_data.src_mesh) = true;
+
+    g_callback_finished = true;
+    g_nonrigidicp_run = AlgorithmStatus::HALTING;
+  }
+}
+
+std::vector<double> ParseSweepValues(const std::string &str) {
+  std::vector<double> values;
+  std::istringstream iss(str);
+  std::string token;
+  while (std::getline(iss, token, ',')) {
+    try {
+      values.push_back(std::stod(token));
+    } catch (const std::exception &) {
+      LOGE("Invalid value %s\n", token.c_str());
+    }
+  }
+  return values;
+}
+
+std::vector<NonrigidIcpData> MakeSweepParams(const NonrigidIcpData &base,
+                                             const NonrigidIcpSweepData &d) {
+  std::vector<NonrigidIcpData> params_list = {base};
+  auto expand = [&](const std::string &str, auto setter) {
+    auto values = ParseSweepValues(str);
+    if (values.empty()) {
+      return;
+    }
+    std::vector<NonrigidIcpData> expanded;
+    for (const auto &params : params_list) {
+      for (const auto &v : values) {
+        NonrigidIcpData p = params;
+        setter(p, v);
+        expanded.push_back(p);
+      }
+    }
+    params_list = std::move(expanded);
+  };
+  expand(d.max_alphas, [](NonrigidIcpData &p, double v) { p.max_alpha = v; });
+  expand(d.min_alphas, [](NonrigidIcpData &p, double v) { p.min_alpha = v; });
+  expand(d.betas, [](NonrigidIcpData &p, double v) { p.beta = v; });
+  expand(d.gammas, [](NonrigidIcpData &p, double v) { p.gamma = v; });
+  expand(d.steps, [](NonrigidIcpData &p, double v) {
+    p.step = std::max(1, static_cast<int>(v));
+  });
+  expand(d.nn_nums, [](NonrigidIcpData &p, double v) {
+    p.nn_num = std::max(1, static_cast<int>(v));
+  });
+  expand(d.angle_rad_ths, [](NonrigidIcpData &p, double v) {
+    p.angle_rad_th = static_cast<float>(v);
+  });
+  expand(d.dist_ths, [](NonrigidIcpData &p, double v) {
+    p.dist_th = static_cast<float>(v);
+  });
+  return params_list;
+}
+
+void WriteSweepCsv(const std::string &path,
+                   const std::vector<NonrigidIcpSweepResult> &results) {
+  std::ofstream ofs(path);
+  ofs << "max_alpha,min_alpha,beta,gamma,step,nn_num,angle_rad_th,dist_th,"
+         "succeeded,msec,landmark_rms,surface_rms,surface_max\n";
+  for (const auto &r : results) {
+    const auto &p = r.params;
+    ofs << p.max_alpha << "," << p.min_alpha << "," << p.beta << ","
+        << p.gamma << "," << p.step << "," << p.nn_num << ","
+        << p.angle_rad_th << "," << p.dist_th << "," << r.succeeded << ","
+        << r.msec << "," << r.landmark_rms << "," << r.surface_rms << ","
+        << r.surface_max << "\n";
+  }
+}
+
+void NonrigidIcpSweepProcess() {
+  std::lock_guard<std::mutex> lock(nonrigidicp_sweep_mtx);
+  if (g_nonrigidicp_sweep_run == AlgorithmStatus::STARTED) {
+    g_nonrigidicp_sweep_run = AlgorithmStatus::RUNNING;
+    PROFILE_SCOPE("NonrigidIcpSweepProcess");
+
+    Timer timer;
+    timer.Start();
+
+    auto &sweep = g_nonrigidicp_sweep_data;
+    const auto params_list = MakeSweepParams(g_nonrigidicp_data, sweep);
+
+    // Shared read-only by all configurations
+    const NonrigidIcpInput input =
+        MakeNonrigidIcpInput(sweep.src_mesh, sweep.dst_mesh);
+    const Eigen::Affine3f dst_trans = g_scene.model_matrix(sweep.dst_mesh);
+    const uint64_t dst_revision = g_scene.geometry_revision(sweep.dst_mesh);
+    auto dst_finder =
+        g_corresp_indices.Get(sweep.dst_mesh, dst_trans, dst_revision, 10)
+            ->finder;
+    // Correspondence indices differ only by nn_num, so one is taken per
+    // distinct value instead of per configuration. PER_VERTEX runs
+    // ugu::NonRigidIcp, which builds its own index in Init() and cannot
+    // take one.
+    std::map<int, CorrespFinderPtr> corresp_finders;
+    for (const auto &params : params_list) {
+      if (params.engine != NonrigidIcpEngine::DEFORMATION_GRAPH ||
+          corresp_finders.count(params.nn_num) != 0) {
+        continue;
+      }
+      corresp_finders[params.nn_num] =
+          g_corresp_indices
+              .Get(sweep.dst_mesh, dst_trans, dst_revision, params.nn_num)
+              ->finder;
+    }
+    const size_t max_eval_num = 20000;
+    const size_t eval_stride =
+        std::max(size_t(1), input.src->vertices().size() / max_eval_num);
+
+    {
+      std::lock_guard<std::mutex> lock_results(sweep.results_mtx);
+      sweep.results.clear();
+    }
+
+    std::atomic_size_t next{0};
+    std::atomic_size_t done{0};
+    std::mutex message_mtx;
+    auto worker = [&]() {
+      for (size_t i = next++; i < params_list.size(); i = next++) {
+        NonrigidIcpSweepResult result;
+        result.params = params_list[i];
+
+        Timer config_timer;
+        config_timer.Start();
+        const auto finder = corresp_finders.find(result.params.nn_num);
+        MeshPtr deformed = RegistrateNonrigid(
+            input, result.params, result.params.max_alpha, result.params.step,
+            nullptr,
+            finder != corresp_finders.end() ? finder->second : nullptr);
+        config_timer.End();
+        result.msec = config_timer.elapsed_msec();
+        result.succeeded = deformed != nullptr;
+
+        if (deformed != nullptr) {
+          const auto &verts = deformed->vertices();
+          const auto &faces = deformed->vertex_indices();
+          const size_t landmark_num = std::min(
+              input.src_landmarks.size(), input.dst_landmark_positions.size());
+          double landmark_sum = 0.0;
+          size_t valid_num = 0;
+          for (size_t l = 0; l < landmark_num; l++) {
+            // Landmarks may be stale if src was edited after picking
+            const auto &pof = input.src_landmarks[l];
+            if (faces.size() <= pof.fid) {
+              continue;
+            }
+            const auto &f = faces[pof.fid];
+            Eigen::Vector3f p = pof.u * (verts[f[1]] - verts[f[0]]) +
+                                pof.v * (verts[f[2]] - verts[f[0]]) +
+                                verts[f[0]];
+            landmark_sum +=
+                (p - input.dst_landmark_positions[l]).squaredNorm();
+            valid_num++;
+          }
+          if (0 < valid_num) {
+            result.landmark_rms = std::sqrt(landmark_sum / valid_num);
+          }
+
+          double sum = 0.0;
+          double max_dist = 0.0;
+          size_t count = 0;
+          for (size_t v = 0; v < verts.size(); v += eval_stride) {
+            Corresp corresp =
+                dst_finder->Find(verts[v], Eigen::Vector3f::Zero(),
+                                 CorrespFinderMode::kMinDist);
+            if (corresp.fid < 0) {
+              continue;
+            }
+            sum += corresp.abs_dist * corresp.abs_dist;
+            max_dist =
+                std::max(max_dist, static_cast<double>(corresp.abs_dist));
+            count++;
+          }
+          if (0 < count) {
+            result.surface_rms = std::sqrt(sum / count);
+            result.surface_max = max_dist;
+          }
+        }
+
+        {
+          std::lock_guard<std::mutex> lock_results(sweep.results_mtx);
+          sweep.results.push_back(result);
+        }
+        std::lock_guard<std::mutex> lock_message(message_mtx);
+        g_callback_message = "NonRigid-ICP sweep : " +
+                             std::to_string(++done) + " / " +
+                             std::to_string(params_list.size());
+        std::cout << g_callback_message << std::endl;
+      }
+    };
+
+    // Each configuration runs parallel_for inside, so more configurations
+    // than cores at once only adds contention and memory
+    std::vector<std::thread> workers;
+    const int max_threads = std::max(
+        1, std::min(static_cast<int>(params_list.size()),
+                    static_cast<int>(std::thread::hardware_concurrency())));
+    const int num_threads = std::clamp(sweep.num_threads, 1, max_threads);
+    for (int t = 0; t < num_threads; t++) {
+      workers.emplace_back(worker);
+    }
+    for (auto &w : workers) {
+      w.join();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock_results(sweep.results_mtx);
+      std::sort(sweep.results.begin(), sweep.results.end(),
+                [](const NonrigidIcpSweepResult &a,
+                   const NonrigidIcpSweepResult &b) {
+                  // Failed configurations go last
+                  constexpr double kInvalid =
+                      std::numeric_limits<double>::max();
+                  return (a.surface_rms < 0.0 ? kInvalid : a.surface_rms) <
+                         (b.surface_rms < 0.0 ? kInvalid : b.surface_rms);
+                });
+      WriteSweepCsv("nonrigid_icp_sweep.csv", sweep.results);
+    }
+
+    timer.End();
+    g_callback_message = "NonRigid-ICP sweep took " +
+                         std::to_string(timer.elapsed_msec() / 1000) +
+                         " sec. Written to nonrigid_icp_sweep.csv";
+    std::cout << g_callback_message << std::endl;
+
+    g_callback_succeeded = true;
+    g_callback_finished = true;
+    g_nonrigidicp_sweep_run = AlgorithmStatus::HALTING;
+  }
+}
+
+// Same texel center convention as ugu's texture transfer
+inline float TexelU2X(float u, int w) { return u * w - 0.5f; }
+inline float TexelV2Y(float v, int h) { return (1.f - v) * h - 0.5f; }
+inline float TexelX2U(float x, int w) { return (x + 0.5f) / w; }
+inline float TexelY2V(float y, int h) { return 1.f - (y + 0.5f) / h; }
+
+Eigen::Vector3f Barycentric(const Eigen::Vector3f &p, const Eigen::Vector3f &a,
+                            const Eigen::Vector3f &b,
+                            const Eigen::Vector3f &c) {
+  Eigen::Vector3f v0 = b - a, v1 = c - a, v2 = p - a;
+  float d00 = v0.dot(v0);
+  float d01 = v0.dot(v1);
+  float d11 = v1.dot(v1);
+  float d20 = v2.dot(v0);
+  float d21 = v2.dot(v1);
+  float denom = d00 * d11 - d01 * d01;
+  if (std::abs(denom) < std::numeric_limits<float>::epsilon()) {
+    return {1.f, 0.f, 0.f};
+  }
+  float v = (d11 * d20 - d01 * d21) / denom;
+  float w = (d00 * d21 - d01 * d20) / denom;
+  return {1.f - v - w, v, w};
+}
+
+// Pixel is Vec3b or Vec3f
+template <typename Pixel>
+Eigen::Vector3f SampleBilinear(const Image<Pixel> &img, float x, float y) {
+  x = std::clamp(x, 0.f, static_cast<float>(img.cols - 1));
+  y = std::clamp(y, 0.f, static_cast<float>(img.rows - 1));
+  int x0 = static_cast<int>(x);
+  int y0 = static_cast<int>(y);
+  int x1 = std::min(x0 + 1, img.cols - 1);
+  int y1 = std::min(y0 + 1, img.rows - 1);
+  float fx = x - x0;
+  float fy = y - y0;
+  const auto &c00 = img.template at<Pixel>(y0, x0);
+  const auto &c01 = img.template at<Pixel>(y0, x1);
+  const auto &c10 = img.template at<Pixel>(y1, x0);
+  const auto &c11 = img.template at<Pixel>(y1, x1);
+  Eigen::Vector3f col;
+  for (int c = 0; c < 3; c++) {
+    col[c] = (1.f - fy) * ((1.f - fx) * c00[c] + fx * c01[c]) +
+             fy * ((1.f - fx) * c10[c] + fx * c11[c]);
+  }
+  return col;
+}
+
+// Rasterize UV triangles of mesh into texels inside [x0, x1) x [y0, y1) and
+// output world positions of covered texels. The first face covering a texel
+// wins.
+void RasterizeUvPositions(const Mesh &mesh, const Eigen::Affine3f &trans,
+                          int width, int height, int x0, int y0, int x1,
+                          int y1, const std::vector<uint32_t> &fids,
+                          std::vector<uint32_t> &texel_ids,
+                          std::vector<Eigen::Vector3f> &positions) {
+  const int tile_w = x1 - x0;
+  std::vector<uint8_t> covered(static_cast<size_t>(tile_w) * (y1 - y0), 0);
+  const auto &uvs = mesh.uv();
+  const auto &uv_faces = mesh.uv_indices();
+  const auto &verts = mesh.vertices();
+  const auto &faces = mesh.vertex_indices();
+
+  for (const auto &fid : fids) {
+    const auto &uv_face = uv_faces[fid];
+    Eigen::Vector2f p[3];
+    for (int k = 0; k < 3; k++) {
+      p[k].x() = TexelU2X(uvs[uv_face[k]].x(), width);
+      p[k].y() = TexelV2Y(uvs[uv_face[k]].y(), height);
+    }
+    float area = (p[1] - p[0]).x() * (p[2] - p[0]).y() -
+                 (p[1] - p[0]).y() * (p[2] - p[0]).x();
+    if (std::abs(area) < std::numeric_limits<float>::epsilon()) {
+      continue;
+    }
+
+    int bb_x0 = std::max(x0, static_cast<int>(std::floor(
+                                 std::min({p[0].x(), p[1].x(), p[2].x()}))));
+    int bb_y0 = std::max(y0, static_cast<int>(std::floor(
+                                 std::min({p[0].y(), p[1].y(), p[2].y()}))));
+    int bb_x1 = std::min(x1 - 1, static_cast<int>(std::ceil(std::max(
+                                     {p[0].x(), p[1].x(), p[2].x()}))));
+    int bb_y1 = std::min(y1 - 1, static_cast<int>(std::ceil(std::max(
+                                     {p[0].y(), p[1].y(), p[2].y()}))));
+
+    const auto &face = faces[fid];
+    for (int y = bb_y0; y <= bb_y1; y++) {
+      for (int x = bb_x0; x <= bb_x1; x++) {
+        uint8_t &c = covered[static_cast<size_t>(y - y0) * tile_w + (x - x0)];
+        if (c != 0) {
+          continue;
+        }
+        const float px = static_cast<float>(x);
+        const float py = static_cast<float>(y);
+        float w0 = ((p[1].x() - px) * (p[2].y() - py) -
+                    (p[1].y() - py) * (p[2].x() - px)) /
+                   area;
+        float w1 = ((p[2].x() - px) * (p[0].y() - py) -
+                    (p[2].y() - py) * (p[0].x() - px)) /
+                   area;
+        float w2 = 1.f - w0 - w1;
+        const float eps = -1e-4f;
+        if (w0 < eps || w1 < eps || w2 < eps) {
+          continue;
+        }
+        c = 1;
+        Eigen::Vector3f pos = w0 * verts[face[0]] + w1 * verts[face[1]] +
+                              w2 * verts[face[2]];
+        texel_ids.push_back(static_cast<uint32_t>(y * width + x));
+        positions.push_back(trans * pos);
+      }
+    }
+  }
+}
+
+// Closest point on a mesh as face id and barycentric coordinates
+struct SurfacePoint {
+  int fid = -1;
+  Eigen::Vector3f bary = {1.f, 0.f, 0.f};
+};
+
+SurfacePoint FindClosestSurfacePoint(
+    const CorrespFinderPtr &finder, const std::vector<Eigen::Vector3i> &faces,
+    const std::vector<Eigen::Vector3f> &transed_verts,
+    const Eigen::Vector3f &p) {
+  SurfacePoint sp;
+  Corresp corresp =
+      finder->Find(p, Eigen::Vector3f::Zero(), CorrespFinderMode::kMinDist);
+  if (corresp.fid < 0) {
+    return sp;
+  }
+  const auto &face = faces[corresp.fid];
+  sp.fid = corresp.fid;
+  sp.bary = Barycentric(corresp.p, transed_verts[face[0]],
+                        transed_verts[face[1]], transed_verts[face[2]]);
+  return sp;
+}
+
+// Exact version for callers that must not snap to a wrong nearby face
+SurfacePoint FindClosestSurfacePoint(
+    const TriangleBvh &bvh, const std::vector<Eigen::Vector3i> &faces,
+    const std::vector<Eigen::Vector3f> &transed_verts,
+    const Eigen::Vector3f &p) {
+  SurfacePoint sp;
+  Eigen::Vector3f closest;
+  const int fid = bvh.Closest(p, &closest);
+  if (fid < 0) {
+    return sp;
+  }
+  const auto &face = faces[fid];
+  sp.fid = fid;
+  sp.bary = Barycentric(closest, transed_verts[face[0]],
+                        transed_verts[face[1]], transed_verts[face[2]]);
+  return sp;
+}
+
+// Find UVs on dst_mesh for world positions by the closest point query
+void FindClosestUvs(const Mesh &dst_mesh,
+                    const std::vector<Eigen::Vector3f> &transed_dst_verts,
+                    const CorrespFinderPtr &finder,
+                    const std::vector<Eigen::Vector3f> &positions,
+                    std::vector<Eigen::Vector2f> &dst_uvs,
+                    std::vector<int> &dst_material_ids,
+                    int num_threads = -1) {
+  const auto &faces = dst_mesh.vertex_indices();
+  const auto &uvs = dst_mesh.uv();
+  const auto &uv_faces = dst_mesh.uv_indices();
+  const auto &material_ids = dst_mesh.material_ids();
+  dst_uvs.resize(positions.size());
+  dst_material_ids.resize(positions.size());
+  parallel_for(size_t(0), positions.size(), [&](size_t i) {
+    SurfacePoint sp =
+        FindClosestSurfacePoint(finder, faces, transed_dst_verts, positions[i]);
+    if (sp.fid < 0) {
+      dst_uvs[i] = {-1.f, -1.f};
+      dst_material_ids[i] = -1;
+      return;
+    }
+    const auto &uv_face = uv_faces[sp.fid];
+    dst_uvs[i] = sp.bary[0] * uvs[uv_face[0]] + sp.bary[1] * uvs[uv_face[1]] +
+                 sp.bary[2] * uvs[uv_face[2]];
+    dst_material_ids[i] = material_ids.empty() ? 0 : material_ids[sp.fid];
+  }, num_threads);
+}
+
+bool BuildTextransCorresp(const RenderableMeshPtr &src_mesh,
+                          const Eigen::Affine3f &src_trans,
+                          const RenderableMeshPtr &dst_mesh,
+                          const Eigen::Affine3f &dst_trans,
+                          const Eigen::Vector2i &size, int nn_num,
+                          TextransCorresp &corresp) {
+  corresp.Clear();
+  if (src_mesh->uv().empty() || dst_mesh->uv().empty()) {
+    return false;
+  }
+
+  const int w = size[0];
+  const int h = size[1];
+
+  // Ignored src faces are left untransferred. The mask is copied since the
+  // scene may be edited while the worker runs.
+  const FaceMask ignore_faces = g_scene.ignore_faces(src_mesh);
+  std::vector<uint32_t> fids;
+  fids.reserve(src_mesh->vertex_indices().size());
+  for (uint32_t fid = 0; fid < src_mesh->vertex_indices().size(); fid++) {
+    if (!ignore_faces.Test(fid)) {
+      fids.push_back(fid);
+    }
+  }
+  std::vector<Eigen::Vector3f> positions;
+  RasterizeUvPositions(*src_mesh, src_trans, w, h, 0, 0, w, h, fids,
+                       corresp.texel_ids, positions);
+
+  const auto dst_index = g_corresp_indices.Get(
+      dst_mesh, dst_trans, g_scene.geometry_revision(dst_mesh), nn_num);
+  FindClosestUvs(*dst_mesh, dst_index->vertices, dst_index->finder, positions,
+                 corresp.dst_uvs, corresp.dst_material_ids);
+
+  corresp.mask = Image1b::zeros(h, w);
+  for (size_t i = 0; i < corresp.texel_ids.size(); i++) {
+    if (corresp.dst_material_ids[i] < 0) {
+      continue;
+    }
+    const int x = static_cast<int>(corresp.texel_ids[i] % w);
+    const int y = static_cast<int>(corresp.texel_ids[i] / w);
+    corresp.mask.at<uint8_t>(y, x) = 255;
+  }
+
+  corresp.src_mesh = src_mesh;
+  corresp.dst_mesh = dst_mesh;
+  corresp.src_trans = src_trans.matrix();
+  corresp.dst_trans = dst_trans.matrix();
+  corresp.src_revision = g_scene.geometry_revision(src_mesh);
+  corresp.dst_revision = g_scene.geometry_revision(dst_mesh);
+  corresp.size = size;
+  corresp.src_ignore_faces = ignore_faces;
+
+  return true;
+}
+
+// Upper bound of values of depth. Float maps are not bounded and use 1.
+float TextransDepthMax(int depth) {
+  if (depth == CV_8U) {
+    return 255.f;
+  }
+  if (depth == CV_16U) {
+    return 65535.f;
+  }
+  return 1.f;
+}
+
+Image3f ToFloatImage(const Image3b &img) {
+  Image3f out = Image3f::zeros(img.rows, img.cols);
+  parallel_for(0, img.rows, [&](int y) {
+    for (int x = 0; x < img.cols; x++) {
+      const auto &src = img.at<Vec3b>(y, x);
+      auto &dst = out.at<Vec3f>(y, x);
+      for (int c = 0; c < 3; c++) {
+        dst[c] = src[c];
+      }
+    }
+  });
+  return out;
+}
+
+// 8-bit image for display. Float maps are assumed to be in [0, 1].
+Image3b ToPreviewImage(const Image3f &img, int depth) {
+  const float scale = 255.f / TextransDepthMax(depth);
+  Image3b out = Image3b::zeros(img.rows, img.cols);
+  parallel_for(0, img.rows, [&](int y) {
+    for (int x = 0; x < img.cols; x++) {
+      const auto &src = img.at<Vec3f>(y, x);
+      auto &dst = out.at<Vec3b>(y, x);
+      for (int c = 0; c < 3; c++) {
+        dst[c] = static_cast<uint8_t>(
+            std::clamp(src[c] * scale + 0.5f, 0.f, 255.f));
+      }
+    }
+  });
+  return out;
+}
+
+// Loads a texture with the depth of the file. Gray images are replicated to
+// 3 channels and alpha is dropped. Returns an empty image on failure.
+Image3f LoadTextransTexture(const std::string &path, int &depth,
+                            int &channels) {
+  ImageBase raw = imread(path, IMREAD_UNCHANGED);
+  if (raw.empty()) {
+    return Image3f();
+  }
+  depth = raw.depth();
+  if (depth != CV_8U && depth != CV_16U && depth != CV_32F) {
+    LOGE("%s: only 8-bit, 16-bit and float images are supported\n",
+         path.c_str());
+    return Image3f();
+  }
+  const int raw_channels = raw.channels();
+  channels = raw_channels < 3 ? 1 : 3;
+
+  Image3f tex = Image3f::zeros(raw.rows, raw.cols);
+  parallel_for(0, raw.rows, [&](int y) {
+    for (int x = 0; x < raw.cols; x++) {
+      auto &dst = tex.at<Vec3f>(y, x);
+      for (int c = 0; c < 3; c++) {
+        const int i = x * raw_channels + (channels == 1 ? 0 : c);
+        if (depth == CV_8U) {
+          dst[c] = raw.ptr<uint8_t>(y)[i];
+        } else if (depth == CV_16U) {
+          dst[c] = raw.ptr<uint16_t>(y)[i];
+        } else {
+          dst[c] = raw.ptr<float>(y)[i];
+        }
+      }
+    }
+  });
+  return tex;
+}
+
+// Gather all maps through the correspondence in one pass over texels.
+// Outputs are in the depth of each map.
+std::vector<Image3f> GatherTextransMaps(const std::vector<TextransMap> &maps,
+                                        const std::vector<uint32_t> &texel_ids,
+                                        const std::vector<Eigen::Vector2f> &uvs,
+                                        const std::vector<int> &material_ids,
+                                        int width, int height,
+                                        int num_threads = -1) {
+  std::vector<Image3f> outputs;
+  for (size_t k = 0; k < maps.size(); k++) {
+    outputs.push_back(Image3f::zeros(height, width));
+  }
+
+  parallel_for(size_t(0), texel_ids.size(), [&](size_t i) {
+    const int mid = material_ids[i];
+    if (mid < 0) {
+      return;
+    }
+    const int x = static_cast<int>(texel_ids[i] % width);
+    const int y = static_cast<int>(texel_ids[i] / width);
+    for (size_t k = 0; k < maps.size(); k++) {
+      if (static_cast<int>(maps[k].textures.size()) <= mid ||
+          maps[k].textures[mid].empty()) {
+        continue;
+      }
+      const auto &tex = maps[k].textures[mid];
+      Eigen::Vector3f col =
+          SampleBilinear(tex, TexelU2X(uvs[i].x(), tex.cols),
+                         TexelV2Y(uvs[i].y(), tex.rows));
+      auto &out = outputs[k].at<Vec3f>(y, x);
+      for (int c = 0; c < 3; c++) {
+        out[c] = col[c];
+      }
+    }
+  }, num_threads);
+
+  return outputs;
+}
+
+std::vector<TextransMap> CollectTextransMaps(const Mesh &dst_mesh,
+                                             const std::string &extra_maps) {
+  std::vector<TextransMap> maps;
+
+  TextransMap diffuse;
+  diffuse.name = "diffuse";
+  for (const auto &mat : dst_mesh.materials()) {
+    diffuse.textures.push_back(mat.diffuse_tex.empty()
+                                   ? Image3f()
+                                   : ToFloatImage(mat.diffuse_tex));
+  }
+  maps.push_back(diffuse);
+
+  std::istringstream iss(extra_maps);
+  std::string line;
+  while (std::getline(iss, line)) {
+    auto pos = line.find('=');
+    if (pos == std::string::npos) {
+      continue;
+    }
+    TextransMap map;
+    map.name = line.substr(0, pos);
+    std::istringstream paths(line.substr(pos + 1));
+    std::string path;
+    bool first = true;
+    while (std::getline(paths, path, ';')) {
+      int depth = CV_8U;
+      int channels = 3;
+      Image3f tex = LoadTextransTexture(path, depth, channels);
+      if (tex.empty()) {
+        LOGE("Failed to load %s\n", path.c_str());
+      } else if (first) {
+        // The first texture decides the format of the output
+        map.depth = depth;
+        map.channels = channels;
+        first = false;
+      } else if (depth != map.depth) {
+        const float scale =
+            TextransDepthMax(map.depth) / TextransDepthMax(depth);
+        parallel_for(0, tex.rows, [&](int y) {
+          for (int x = 0; x < tex.cols; x++) {
+            auto &col = tex.at<Vec3f>(y, x);
+            for (int c = 0; c < 3; c++) {
+              col[c] *= scale;
+            }
+          }
+        });
+      }
+      map.textures.push_back(tex);
+    }
+    maps.push_back(map);
+  }
+
+  return maps;
+}
+
+// Mark invalid texels whose Chebyshev distance to a valid texel is within
+// margin by separable running max
+std::vector<uint8_t> ComputeInpaintTargets(const Image1b &valid_mask,
+                                           int margin) {
+  const int w = valid_mask.cols;
+  const int h = valid_mask.rows;
+  std::vector<uint8_t> horizontal(static_cast<size_t>(w) * h, 0);
+  std::vector<uint8_t> targets(static_cast<size_t>(w) * h, 0);
+
+  parallel_for(0, h, [&](int y) {
+    int last_valid = std::numeric_limits<int>::min() / 2;
+    for (int x = 0; x < w; x++) {
+      if (valid_mask.at<uint8_t>(y, x) != 0) {
+        last_valid = x;
+      }
+      horizontal[y * w + x] = (x - last_valid) <= margin ? 1 : 0;
+    }
+    last_valid = std::numeric_limits<int>::max() / 2;
+    for (int x = w - 1; 0 <= x; x--) {
+      if (valid_mask.at<uint8_t>(y, x) != 0) {
+        last_valid = x;
+      }
+      if ((last_valid - x) <= margin) {
+        horizontal[y * w + x] = 1;
+      }
+    }
+  });
+
+  parallel_for(0, w, [&](int x) {
+    int last = std::numeric_limits<int>::min() / 2;
+    for (int y = 0; y < h; y++) {
+      if (horizontal[y * w + x] != 0) {
+        last = y;
+      }
+      targets[y * w + x] = (y - last) <= margin ? 1 : 0;
+    }
+    last = std::numeric_limits<int>::max() / 2;
+    for (int y = h - 1; 0 <= y; y--) {
+      if (horizontal[y * w + x] != 0) {
+        last = y;
+      }
+      if ((last - y) <= margin) {
+        targets[y * w + x] = 1;
+      }
+    }
+  });
+
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      if (valid_mask.at<uint8_t>(y, x) != 0) {
+        targets[y * w + x] = 0;
+      }
+    }
+  }
+
+  return targets;
+}
+
+// Copy texels from the opposite side of UV seams into the gutter of each
+// chart so that filtering across seams reads consistent colors.
+// valid_mask is updated for filled texels. Seam sides are rasterized in
+// parallel and applied in edge order, so where gutters overlap the first
+// side wins as in a sequential pass.
+void DilateAcrossUvSeams(const Mesh &mesh, int margin, Image1b &valid_mask,
+                         Image3f &img) {
+  const int w = img.cols;
+  const int h = img.rows;
+  const auto &faces = mesh.vertex_indices();
+  const auto &uv_faces = mesh.uv_indices();
+  const auto &uvs = mesh.uv();
+
+  // Half edges sorted by (smaller vid, larger vid) so that both faces of an
+  // edge are adjacent
+  struct HalfEdge {
+    uint64_t key;
+    uint32_t fid;
+    int k;
+  };
+  std::vector<HalfEdge> half_edges(faces.size() * 3);
+  parallel_for(size_t(0), faces.size(), [&](size_t fid) {
+    for (int k = 0; k < 3; k++) {
+      const uint64_t v0 = static_cast<uint64_t>(faces[fid][k]);
+      const uint64_t v1 = static_cast<uint64_t>(faces[fid][(k + 1) % 3]);
+      half_edges[fid * 3 + k] = {(std::min(v0, v1) << 32) | std::max(v0, v1),
+                                 static_cast<uint32_t>(fid), k};
+    }
+  });
+  std::sort(half_edges.begin(), half_edges.end(),
+            [](const HalfEdge &a, const HalfEdge &b) {
+              return a.key != b.key ? a.key < b.key : a.fid < b.fid;
+            });
+  // Manifold edges as the index of their first half edge
+  std::vector<size_t> edges;
+  for (size_t i = 0; i < half_edges.size();) {
+    size_t j = i + 1;
+    while (j < half_edges.size() && half_edges[j].key == half_edges[i].key) {
+      j++;
+    }
+    if (j - i == 2) {
+      edges.push_back(i);
+    }
+    i = j;
+  }
+
+  auto to_pix = [&](int uv_id) {
+    return Eigen::Vector2f(TexelU2X(uvs[uv_id].x(), w),
+                           TexelV2Y(uvs[uv_id].y(), h));
+  };
+
+  auto outward = [](const Eigen::Vector2f &e0, const Eigen::Vector2f &e1,
+                    const Eigen::Vector2f &opposite) {
+    Eigen::Vector2f d = (e1 - e0).normalized();
+    Eigen::Vector2f n(-d.y(), d.x());
+    if (n.dot(opposite - e0) > 0.f) {
+      n = -n;
+    }
+    return n;
+  };
+
+  // Only texels invalid before dilation are written and only valid ones are
+  // read, so sides can run concurrently on the original mask
+  const Image1b org_valid_mask = valid_mask.clone();
+  // (destination, source) texel indices per side
+  std::vector<std::vector<std::pair<uint32_t, uint32_t>>> copies(
+      edges.size() * 2);
+  parallel_for(size_t(0), copies.size(), [&](size_t i) {
+    const size_t side = i % 2;
+    const auto &ea = half_edges[edges[i / 2] + side];
+    const auto &eb = half_edges[edges[i / 2] + 1 - side];
+    const uint32_t fa = ea.fid, fb = eb.fid;
+    const int ka = ea.k, kb = eb.k;
+    const int a_vid0 = faces[fa][ka];
+    const int a_uv0 = uv_faces[fa][ka];
+    const int a_uv1 = uv_faces[fa][(ka + 1) % 3];
+    const int a_uv2 = uv_faces[fa][(ka + 2) % 3];
+    // Match endpoints of the other face by vertex ids
+    const bool same_dir = faces[fb][kb] == a_vid0;
+    const int b_k0 = same_dir ? kb : (kb + 1) % 3;
+    const int b_k1 = same_dir ? (kb + 1) % 3 : kb;
+    const int b_uv0 = uv_faces[fb][b_k0];
+    const int b_uv1 = uv_faces[fb][b_k1];
+    const int b_uv2 = uv_faces[fb][(kb + 2) % 3];
+
+    const Eigen::Vector2f a0 = to_pix(a_uv0), a1 = to_pix(a_uv1);
+    const Eigen::Vector2f b0 = to_pix(b_uv0), b1 = to_pix(b_uv1);
+    if ((a0 - b0).norm() < 0.5f && (a1 - b1).norm() < 0.5f) {
+      // Not a seam
+      return;
+    }
+    const float a_len2 = (a1 - a0).squaredNorm();
+    const float a_len = std::sqrt(a_len2);
+    const float b_len = (b1 - b0).norm();
+    if (a_len < 1e-3f || b_len < 1e-3f) {
+      return;
+    }
+    const Eigen::Vector2f na = outward(a0, a1, to_pix(a_uv2));
+    const Eigen::Vector2f nb = outward(b0, b1, to_pix(b_uv2));
+    const float scale = b_len / a_len;
+
+    const Eigen::Vector2f bb_min = a0.cwiseMin(a1);
+    const Eigen::Vector2f bb_max = a0.cwiseMax(a1);
+    const int bb_x0 =
+        std::max(0, static_cast<int>(std::floor(bb_min.x())) - margin);
+    const int bb_y0 =
+        std::max(0, static_cast<int>(std::floor(bb_min.y())) - margin);
+    const int bb_x1 =
+        std::min(w - 1, static_cast<int>(std::ceil(bb_max.x())) + margin);
+    const int bb_y1 =
+        std::min(h - 1, static_cast<int>(std::ceil(bb_max.y())) + margin);
+    for (int y = bb_y0; y <= bb_y1; y++) {
+      for (int x = bb_x0; x <= bb_x1; x++) {
+        if (org_valid_mask.at<uint8_t>(y, x) != 0) {
+          continue;
+        }
+        const Eigen::Vector2f p(static_cast<float>(x), static_cast<float>(y));
+        const float t = (p - a0).dot(a1 - a0) / a_len2;
+        const float d = (p - a0).dot(na);
+        if (t < 0.f || 1.f < t || d <= 0.f || margin < d) {
+          continue;
+        }
+        const Eigen::Vector2f q = b0 + t * (b1 - b0) - d * scale * nb;
+        const int qx = static_cast<int>(std::round(q.x()));
+        const int qy = static_cast<int>(std::round(q.y()));
+        if (qx < 0 || w <= qx || qy < 0 || h <= qy ||
+            org_valid_mask.at<uint8_t>(qy, qx) == 0) {
+          continue;
+        }
+        copies[i].emplace_back(static_cast<uint32_t>(y * w + x),
+                               static_cast<uint32_t>(qy * w + qx));
+      }
+    }
+  });
+
+  for (const auto &side_copies : copies) {
+    for (const auto &[dst, src] : side_copies) {
+      const int y = static_cast<int>(dst / w), x = static_cast<int>(dst % w);
+      if (valid_mask.at<uint8_t>(y, x) != 0) {
+        continue;
+      }
+      img.at<Vec3f>(y, x) = img.at<Vec3f>(src / w, src % w);
+      valid_mask.at<uint8_t>(y, x) = 255;
+    }
+  }
+}
+
+// Push-pull inpainting over a mip pyramid. Only target texels of level 0
+// are written.
+void InpaintPushPull(const Image1b &valid_mask, Image3f &img, int margin) {
+  const int w = img.cols;
+  const int h = img.rows;
+
+  std::vector<uint8_t> targets;
+  if (0 < margin) {
+    targets = ComputeInpaintTargets(valid_mask, margin);
+  }
+
+  struct Level {
+    int w, h;
+    std::vector<Eigen::Vector3f> col;
+    std::vector<uint8_t> valid;
+  };
+  std::vector<Level> levels(1);
+  levels[0].w = w;
+  levels[0].h = h;
+  levels[0].col.resize(static_cast<size_t>(w) * h);
+  levels[0].valid.resize(static_cast<size_t>(w) * h);
+  parallel_for(0, h, [&](int y) {
+    for (int x = 0; x < w; x++) {
+      const auto &c = img.at<Vec3f>(y, x);
+      levels[0].col[y * w + x] = Eigen::Vector3f(c[0], c[1], c[2]);
+      levels[0].valid[y * w + x] = valid_mask.at<uint8_t>(y, x) != 0 ? 1 : 0;
+    }
+  });
+
+  // Pull
+  while (1 < levels.back().w || 1 < levels.back().h) {
+    const Level &fine = levels.back();
+    Level coarse;
+    coarse.w = (fine.w + 1) / 2;
+    coarse.h = (fine.h + 1) / 2;
+    coarse.col.resize(static_cast<size_t>(coarse.w) * coarse.h);
+    coarse.valid.resize(static_cast<size_t>(coarse.w) * coarse.h);
+    parallel_for(0, coarse.h, [&](int y) {
+      for (int x = 0; x < coarse.w; x++) {
+        Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+        int count = 0;
+        for (int dy = 0; dy < 2; dy++) {
+          for (int dx = 0; dx < 2; dx++) {
+            const int fx = 2 * x + dx;
+            const int fy = 2 * y + dy;
+            if (fine.w <= fx || fine.h <= fy || !fine.valid[fy * fine.w + fx]) {
+              continue;
+            }
+            sum += fine.col[fy * fine.w + fx];
+            count++;
+          }
+        }
+        coarse.col[y * coarse.w + x] =
+            0 < count ? Eigen::Vector3f(sum / static_cast<float>(count))
+                      : Eigen::Vector3f::Zero();
+        coarse.valid[y * coarse.w + x] = 0 < count ? 1 : 0;
+      }
+    });
+    levels.push_back(std::move(coarse));
+  }
+
+  // Push
+  for (int l = static_cast<int>(levels.size()) - 2; 0 <= l; l--) {
+    Level &fine = levels[l];
+    const Level &coarse = levels[l + 1];
+    parallel_for(0, fine.h, [&](int y) {
+      for (int x = 0; x < fine.w; x++) {
+        const int index = y * fine.w + x;
+        if (fine.valid[index]) {
+          continue;
+        }
+        if (l == 0 && !targets.empty() && !targets[index]) {
+          continue;
+        }
+        // Bilinear from the coarser level
+        float cx = std::clamp((x + 0.5f) * 0.5f - 0.5f, 0.f,
+                              static_cast<float>(coarse.w - 1));
+        float cy = std::clamp((y + 0.5f) * 0.5f - 0.5f, 0.f,
+                              static_cast<float>(coarse.h - 1));
+        int x0 = static_cast<int>(cx);
+        int y0 = static_cast<int>(cy);
+        int x1 = std::min(x0 + 1, coarse.w - 1);
+        int y1 = std::min(y0 + 1, coarse.h - 1);
+        float fx = cx - x0;
+        float fy = cy - y0;
+        fine.col[index] =
+            (1.f - fy) * ((1.f - fx) * coarse.col[y0 * coarse.w + x0] +
+                          fx * coarse.col[y0 * coarse.w + x1]) +
+            fy * ((1.f - fx) * coarse.col[y1 * coarse.w + x0] +
+                  fx * coarse.col[y1 * coarse.w + x1]);
+        fine.valid[index] = 1;
+        if (l == 0) {
+          auto &c = img.at<Vec3f>(y, x);
+          for (int k = 0; k < 3; k++) {
+            c[k] = fine.col[index][k];
+          }
+        }
+      }
+    });
+  }
+}
+
+// Inpaint transferred texture with the method selected in the options.
+// mesh is used for UV seams and may be nullptr. ugu::Inpaint() works on
+// 8-bit images only, so maps of other depths always use push-pull.
+void InpaintTransferred(const TextransOptions &options,
+                        const Image1b &valid_mask, Image3f &img, int depth,
+                        const Mesh *mesh) {
+  if (options.inpaint_method == TextransInpaintMethod::UGU &&
+      depth == CV_8U) {
+    ugu::Image1b inpaint_mask;
+    ugu::Not(valid_mask, &inpaint_mask);
+    Image3b img_8u = ToPreviewImage(img, depth);
+    ugu::Inpaint(inpaint_mask, img_8u, 3.f);
+    img = ToFloatImage(img_8u);
+    return;
+  }
+
+  Image1b filled_mask = valid_mask.clone();
+  if (mesh != nullptr && options.inpaint_seam_aware &&
+      0 < options.inpaint_margin) {
+    DilateAcrossUvSeams(*mesh, options.inpaint_margin, filled_mask, img);
+  }
+  InpaintPushPull(filled_mask, img, options.inpaint_margin);
+}
+
+// Binary PNM whose rows are written tile by tile from worker threads. 8 and
+// 16-bit maps go to PPM (P6) or PGM (P5) and float maps to PFM. Only the
+// first channel is written for single channel maps.
+class TiledPnmWriter {
+ public:
+  static std::string Extension(int depth, int channels) {
+    if (depth == CV_32F) {
+      return ".pfm";
+    }
+    return channels == 1 ? ".pgm" : ".ppm";
+  }
+
+  bool Open(const std::string &path, int width, int height, int depth,
+            int channels) {
+    width_ = width;
+    height_ = height;
+    depth_ = depth;
+    channels_ = channels == 1 ? 1 : 3;
+    sample_bytes_ = depth == CV_32F ? 4 : (depth == CV_16U ? 2 : 1);
+    ofs_.open(path, std::ios::binary);
+    if (!ofs_.is_open()) {
+      return false;
+    }
+    std::string header;
+    if (depth == CV_32F) {
+      // Negative scale for little-endian
+      header = std::string(channels_ == 1 ? "Pf" : "PF") + "\n" +
+               std::to_string(width) + " " + std::to_string(height) +
+               "\n-1.0\n";
+    } else {
+      header = std::string(channels_ == 1 ? "P5" : "P6") + "\n" +
+               std::to_string(width) + " " + std::to_string(height) + "\n" +
+               (depth == CV_16U ? "65535" : "255") + "\n";
+    }
+    ofs_.write(header.data(), header.size());
+    header_size_ = header.size();
+    // Extend to the final size. Untouched regions stay zero.
+    const std::streamoff total =
+        static_cast<std::streamoff>(header_size_) +
+        static_cast<std::streamoff>(width) * height * channels_ *
+            sample_bytes_;
+    ofs_.seekp(total - 1);
+    ofs_.put(0);
+    return ofs_.good();
+  }
+
+  void WriteTile(const Image3f &tile, int x0, int y0) {
+    const size_t pixel_bytes = static_cast<size_t>(channels_) * sample_bytes_;
+    std::vector<char> row(tile.cols * pixel_bytes);
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (int y = 0; y < tile.rows; y++) {
+      for (int x = 0; x < tile.cols; x++) {
+        const auto &col = tile.at<Vec3f>(y, x);
+        for (int c = 0; c < channels_; c++) {
+          EncodeSample(col[c], &row[x * pixel_bytes + c * sample_bytes_]);
+        }
+      }
+      // PFM rows go from bottom to top
+      const int file_y = depth_ == CV_32F ? height_ - 1 - (y0 + y) : y0 + y;
+      const std::streamoff offset =
+          static_cast<std::streamoff>(header_size_) +
+          (static_cast<std::streamoff>(file_y) * width_ + x0) *
+              static_cast<std::streamoff>(pixel_bytes);
+      ofs_.seekp(offset);
+      ofs_.write(row.data(), row.size());
+    }
+  }
+
+ private:
+  // Integer samples are big-endian as PNM requires
+  void EncodeSample(float v, char *dst) const {
+    if (depth_ == CV_32F) {
+      uint32_t bits;
+      std::memcpy(&bits, &v, sizeof(bits));
+      for (int b = 0; b < 4; b++) {
+        dst[b] = static_cast<char>((bits >> (8 * b)) & 0xff);
+      }
+    } else if (depth_ == CV_16U) {
+      const auto u = static_cast<uint16_t>(std::clamp(v + 0.5f, 0.f, 65535.f));
+      dst[0] = static_cast<char>(u >> 8);
+      dst[1] = static_cast<char>(u & 0xff);
+    } else {
+      dst[0] = static_cast<char>(
+          static_cast<uint8_t>(std::clamp(v + 0.5f, 0.f, 255.f)));
+    }
+  }
+
+  std::ofstream ofs_;
+  std::mutex mtx_;
+  size_t header_size_ = 0;
+  int width_ = 0;
+  int height_ = 0;
+  int depth_ = CV_8U;
+  int channels_ = 3;
+  int sample_bytes_ = 1;
+};
+
+// Full resolution maps of both tiled and non-tiled transfer are written
+// here in the depth of each map
+std::string TransferredMapPath(const std::string &name, int depth,
+                               int channels) {
+  return "transferred_" + name + TiledPnmWriter::Extension(depth, channels);
+}
+
+// Returns the written path or empty on failure
+std::string WriteTransferredMap(const std::string &name, const Image3f &img,
+                                int depth, int channels) {
+  const std::string path = TransferredMapPath(name, depth, channels);
+  TiledPnmWriter writer;
+  if (!writer.Open(path, img.cols, img.rows, depth, channels)) {
+    return "";
+  }
+  writer.WriteTile(img, 0, 0);
+  return path;
+}
+
+// Texture transfer over tiles of UV space. Only the tiles being processed
+// are held in memory. Each tile is transferred and inpainted with a halo of
+// neighboring texels that is cropped afterwards, so that inpainting does not
+// show tile borders. Full resolution results go to TransferredMapPath() and
+// downsampled previews are returned.
+bool TransferTexturesTiled(const RenderableMeshPtr &src_mesh,
+                           const Eigen::Affine3f &src_trans,
+                           const RenderableMeshPtr &dst_mesh,
+                           const Eigen::Affine3f &dst_trans,
+                           const TextransOptions &options,
+                           const std::vector<TextransMap> &maps,
+                           std::vector<Image3b> &previews) {
+  if (src_mesh->uv().empty() || dst_mesh->uv().empty()) {
+    return false;
+  }
+
+  const int w = options.dst_size[0];
+  const int h = options.dst_size[1];
+  const int tile_size = options.tile_size;
+  const int tiles_x = (w + tile_size - 1) / tile_size;
+  const int tiles_y = (h + tile_size - 1) / tile_size;
+
+  // Push-pull with a margin fills nothing farther than the margin, so that
+  // much context is enough. Methods filling everything get a fixed halo.
+  const bool fill_all =
+      options.inpaint_method == TextransInpaintMethod::UGU ||
+      options.inpaint_margin <= 0;
+  const int halo =
+      std::min(fill_all ? 32 : options.inpaint_margin, tile_size);
+
+  // Bin faces to tiles by UV bounding boxes
+  std::vector<std::vector<uint32_t>> tile_fids(
+      static_cast<size_t>(tiles_x) * tiles_y);
+  const auto &uvs = src_mesh->uv();
+  const auto &uv_faces = src_mesh->uv_indices();
+  // Copied since the scene may be edited while the worker runs
+  const FaceMask ignore_faces = g_scene.ignore_faces(src_mesh);
+  for (size_t fid = 0; fid < uv_faces.size(); fid++) {
+    if (ignore_faces.Test(static_cast<uint32_t>(fid))) {
+      continue;
+    }
+    float min_x = std::numeric_limits<float>::max();
+    float min_y = std::numeric_limits<float>::max();
+    float max_x = std::numeric_limits<float>::lowest();
+    float max_y = std::numeric_limits<float>::lowest();
+    for (int k = 0; k < 3; k++) {
+      const auto &uv = uvs[uv_faces[fid][k]];
+      min_x = std::min(min_x, TexelU2X(uv.x(), w));
+      max_x = std::max(max_x, TexelU2X(uv.x(), w));
+      min_y = std::min(min_y, TexelV2Y(uv.y(), h));
+      max_y = std::max(max_y, TexelV2Y(uv.y(), h));
+    }
+    // Faces in the halo of a tile are binned to it as well
+    int tx0 = std::clamp(
+        static_cast<int>(std::floor(min_x - halo)) / tile_size, 0,
+        tiles_x - 1);
+    int tx1 = std::clamp(
+        static_cast<int>(std::ceil(max_x + halo)) / tile_size, 0,
+        tiles_x - 1);
+    int ty0 = std::clamp(
+        static_cast<int>(std::floor(min_y - halo)) / tile_size, 0,
+        tiles_y - 1);
+    int ty1 = std::clamp(
+        static_cast<int>(std::ceil(max_y + halo)) / tile_size, 0,
+        tiles_y - 1);
+    for (int ty = ty0; ty <= ty1; ty++) {
+      for (int tx = tx0; tx <= tx1; tx++) {
+        tile_fids[ty * tiles_x + tx].push_back(static_cast<uint32_t>(fid));
+      }
+    }
+  }
+
+  const auto dst_index = g_corresp_indices.Get(
+      dst_mesh, dst_trans, g_scene.geometry_revision(dst_mesh),
+      options.nn_num);
+
+  std::vector<std::unique_ptr<TiledPnmWriter>> writers;
+  for (const auto &map : maps) {
+    const std::string path =
+        TransferredMapPath(map.name, map.depth, map.channels);
+    writers.push_back(std::make_unique<TiledPnmWriter>());
+    if (!writers.back()->Open(path, w, h, map.depth, map.channels)) {
+      LOGE("Failed to open %s\n", path.c_str());
+      return false;
+    }
+  }
+
+  const float preview_scale =
+      std::min(1.f, static_cast<float>(options.preview_size) / std::max(w, h));
+  const int preview_w = std::max(1, static_cast<int>(w * preview_scale));
+  const int preview_h = std::max(1, static_cast<int>(h * preview_scale));
+  previews.clear();
+  for (size_t k = 0; k < maps.size(); k++) {
+    previews.push_back(Image3b::zeros(preview_h, preview_w));
+  }
+
+  // Nearest neighbor downsampling of tile at (x0, y0) for preview
+  auto write_preview = [&](size_t k, const Image3f &tile, int x0, int y0) {
+    const float scale = 255.f / TextransDepthMax(maps[k].depth);
+    const int px0 = static_cast<int>(std::ceil(x0 * preview_scale));
+    const int py0 = static_cast<int>(std::ceil(y0 * preview_scale));
+    for (int py = py0; py < preview_h; py++) {
+      const int y = static_cast<int>(py / preview_scale) - y0;
+      if (y < 0) {
+        continue;
+      }
+      if (tile.rows <= y) {
+        break;
+      }
+      for (int px = px0; px < preview_w; px++) {
+        const int x = static_cast<int>(px / preview_scale) - x0;
+        if (x < 0) {
+          continue;
+        }
+        if (tile.cols <= x) {
+          break;
+        }
+        const auto &col = tile.at<Vec3f>(y, x);
+        auto &preview = previews[k].at<Vec3b>(py, px);
+        for (int c = 0; c < 3; c++) {
+          preview[c] = static_cast<uint8_t>(
+              std::clamp(col[c] * scale + 0.5f, 0.f, 255.f));
+        }
+      }
+    }
+  };
+
+  // Sums of transferred texels per map for tiles without any
+  std::vector<Eigen::Vector3d> color_sums(maps.size(),
+                                          Eigen::Vector3d::Zero());
+  size_t color_count = 0;
+  std::vector<int> empty_tiles;
+  std::mutex empty_mtx;
+
+  std::atomic_int done_num{0};
+  std::mutex message_mtx;
+  const int tile_num = tiles_x * tiles_y;
+  parallel_for(0, tile_num, [&](int tile_id) {
+    const int x0 = (tile_id % tiles_x) * tile_size;
+    const int y0 = (tile_id / tiles_x) * tile_size;
+    const int x1 = std::min(x0 + tile_size, w);
+    const int y1 = std::min(y0 + tile_size, h);
+    // Tile with halo
+    const int hx0 = std::max(x0 - halo, 0);
+    const int hy0 = std::max(y0 - halo, 0);
+    const int hx1 = std::min(x1 + halo, w);
+    const int hy1 = std::min(y1 + halo, h);
+    const int hw = hx1 - hx0;
+    const int hh = hy1 - hy0;
+
+    std::vector<uint32_t> texel_ids;
+    std::vector<Eigen::Vector3f> positions;
+    RasterizeUvPositions(*src_mesh, src_trans, w, h, hx0, hy0, hx1, hy1,
+                         tile_fids[tile_id], texel_ids, positions);
+
+    std::vector<Eigen::Vector2f> dst_uvs;
+    std::vector<int> dst_material_ids;
+    FindClosestUvs(*dst_mesh, dst_index->vertices, dst_index->finder,
+                   positions, dst_uvs, dst_material_ids, 1);
+
+    Image1b valid_mask = Image1b::zeros(hh, hw);
+    bool any_valid = false;
+    for (size_t i = 0; i < texel_ids.size(); i++) {
+      const int x = static_cast<int>(texel_ids[i] % w) - hx0;
+      const int y = static_cast<int>(texel_ids[i] / w) - hy0;
+      texel_ids[i] = static_cast<uint32_t>(y * hw + x);
+      if (0 <= dst_material_ids[i]) {
+        valid_mask.at<uint8_t>(y, x) = 255;
+        any_valid = true;
+      }
+    }
+
+    if (any_valid) {
+      auto tiles = GatherTextransMaps(maps, texel_ids, dst_uvs,
+                                      dst_material_ids, hw, hh, 1);
+
+      // Mean of texels inside the tile. The halo belongs to other tiles.
+      std::vector<Eigen::Vector3d> sums(maps.size(), Eigen::Vector3d::Zero());
+      size_t count = 0;
+      for (int y = y0 - hy0; y < y1 - hy0; y++) {
+        for (int x = x0 - hx0; x < x1 - hx0; x++) {
+          if (valid_mask.at<uint8_t>(y, x) == 0) {
+            continue;
+          }
+          for (size_t k = 0; k < maps.size(); k++) {
+            const auto &col = tiles[k].at<Vec3f>(y, x);
+            sums[k] += Eigen::Vector3d(col[0], col[1], col[2]);
+          }
+          count++;
+        }
+      }
+
+      for (size_t k = 0; k < maps.size(); k++) {
+        // UV seams are not followed across tiles
+        InpaintTransferred(options, valid_mask, tiles[k], maps[k].depth,
+                           nullptr);
+        Image3f cropped = Image3f::zeros(y1 - y0, x1 - x0);
+        for (int y = 0; y < cropped.rows; y++) {
+          for (int x = 0; x < cropped.cols; x++) {
+            cropped.at<Vec3f>(y, x) =
+                tiles[k].at<Vec3f>(y + y0 - hy0, x + x0 - hx0);
+          }
+        }
+        writers[k]->WriteTile(cropped, x0, y0);
+        write_preview(k, cropped, x0, y0);
+      }
+
+      std::lock_guard<std::mutex> lock(empty_mtx);
+      for (size_t k = 0; k < maps.size(); k++) {
+        color_sums[k] += sums[k];
+      }
+      color_count += count;
+    } else {
+      std::lock_guard<std::mutex> lock(empty_mtx);
+      empty_tiles.push_back(tile_id);
+    }
+
+    done_num++;
+    std::lock_guard<std::mutex> lock(message_mtx);
+    g_callback_message = "Texture transfer : tile " +
+                         std::to_string(done_num.load()) + " / " +
+                         std::to_string(tile_num);
+  });
+
+  // Without a margin the non-tiled path fills texels far from charts too.
+  // Push-pull converges to the mean of transferred texels there, which is
+  // used for tiles with nothing to inpaint from. Otherwise they stay zero.
+  if (fill_all && 0 < color_count) {
+    for (size_t k = 0; k < maps.size(); k++) {
+      const Eigen::Vector3d mean = color_sums[k] / color_count;
+      Vec3f col;
+      for (int c = 0; c < 3; c++) {
+        col[c] = static_cast<float>(mean[c]);
+      }
+      for (const auto &tile_id : empty_tiles) {
+        const int x0 = (tile_id % tiles_x) * tile_size;
+        const int y0 = (tile_id / tiles_x) * tile_size;
+        const int x1 = std::min(x0 + tile_size, w);
+        const int y1 = std::min(y0 + tile_size, h);
+        Image3f tile = Image3f::zeros(y1 - y0, x1 - x0);
+        for (int y = 0; y < tile.rows; y++) {
+          for (int x = 0; x < tile.cols; x++) {
+            tile.at<Vec3f>(y, x) = col;
+          }
+        }
+        writers[k]->WriteTile(tile, x0, y0);
+        write_preview(k, tile, x0, y0);
+      }
+    }
+  }
+
+  return true;
+}
+
+// Per-vertex attribute transfer from dst_mesh to src_mesh. Each src vertex
+// takes barycentric interpolation at the exact closest point on dst_mesh.
+bool TransferVertexAttributes(const RenderableMeshPtr &src_mesh,
+                              const Eigen::Affine3f &src_trans,
+                              const RenderableMeshPtr &dst_mesh,
+                              const Eigen::Affine3f &dst_trans,
+                              const TextransOptions &options) {
+  const auto &src_verts = src_mesh->vertices();
+  const auto &dst_faces = dst_mesh->vertex_indices();
+  const auto &dst_colors = dst_mesh->vertex_colors();
+  const auto &dst_normals = dst_mesh->normals();
+  const auto &dst_uvs = dst_mesh->uv();
+  const auto &dst_uv_faces = dst_mesh->uv_indices();
+  const auto &dst_material_ids = dst_mesh->material_ids();
+  const auto &dst_materials = dst_mesh->materials();
+  const bool normal_per_vertex =
+      dst_normals.size() == dst_mesh->vertices().size();
+
+  std::vector<std::string> channel_names;
+  std::vector<std::vector<float>> dst_channels;
+  if (!options.vertex_channels_path.empty()) {
+    try {
+      nlohmann::json j;
+      std::ifstream ifs(options.vertex_channels_path);
+      ifs >> j;
+      for (auto it = j.begin(); it != j.end(); ++it) {
+        std::vector<float> values = it.value();
+        if (values.size() != dst_mesh->vertices().size()) {
+          LOGE("%s has %d values but dst has %d vertices\n", it.key().c_str(),
+               static_cast<int>(values.size()),
+               static_cast<int>(dst_mesh->vertices().size()));
+          continue;
+        }
+        channel_names.push_back(it.key());
+        dst_channels.push_back(std::move(values));
+      }
+    } catch (const std::exception &) {
+      LOGE("Failed to load %s\n",
+           options.vertex_channels_path.c_str());
+    }
+  }
+
+  std::vector<Eigen::Vector3f> transed_dst_verts;
+  transed_dst_verts.reserve(dst_mesh->vertices().size());
+  for (const auto &v : dst_mesh->vertices()) {
+    transed_dst_verts.push_back(dst_trans * v);
+  }
+  const TriangleBvh bvh(transed_dst_verts, dst_faces);
+
+  // dst local normal -> src local normal
+  const Eigen::Matrix3f normal_trans = src_trans.linear().transpose() *
+                                       dst_trans.linear().inverse().transpose();
+
+  // Vertices on ignored src faces keep their attributes
+  const auto ignored = g_scene.ignore_faces(src_mesh).ToVertexMask(
+      src_mesh->vertex_indices(), src_verts.size());
+  std::vector<Eigen::Vector3f> colors = src_mesh->vertex_colors();
+  colors.resize(src_verts.size(), Eigen::Vector3f::Zero());
+  std::vector<Eigen::Vector3f> normals = src_mesh->normals();
+  normals.resize(src_verts.size(), Eigen::Vector3f::UnitZ());
+  std::vector<std::vector<float>> channels(
+      dst_channels.size(), std::vector<float>(src_verts.size(), 0.f));
+
+  parallel_for(size_t(0), src_verts.size(), [&](size_t i) {
+    if (ignored[i]) {
+      return;
+    }
+    SurfacePoint sp = FindClosestSurfacePoint(bvh, dst_faces,
+                                              transed_dst_verts,
+                                              src_trans * src_verts[i]);
+    if (sp.fid < 0) {
+      return;
+    }
+    const auto &face = dst_faces[sp.fid];
+
+    if (options.vertex_colors) {
+      if (!dst_colors.empty()) {
+        colors[i] = sp.bary[0] * dst_colors[face[0]] +
+                    sp.bary[1] * dst_colors[face[1]] +
+                    sp.bary[2] * dst_colors[face[2]];
+      } else if (!dst_uvs.empty()) {
+        // Sample texture when dst has no vertex colors
+        const auto &uv_face = dst_uv_faces[sp.fid];
+        Eigen::Vector2f uv = sp.bary[0] * dst_uvs[uv_face[0]] +
+                             sp.bary[1] * dst_uvs[uv_face[1]] +
+                             sp.bary[2] * dst_uvs[uv_face[2]];
+        const int mid =
+            dst_material_ids.empty() ? 0 : dst_material_ids[sp.fid];
+        const auto &tex = dst_materials[mid].diffuse_tex;
+        if (!tex.empty()) {
+          colors[i] = SampleBilinear(tex, TexelU2X(uv.x(), tex.cols),
+                                     TexelV2Y(uv.y(), tex.rows));
+        }
+      }
+    }
+
+    if (options.vertex_normals && !dst_normals.empty()) {
+      Eigen::Vector3f n = Eigen::Vector3f::Zero();
+      for (int k = 0; k < 3; k++) {
+        const int nid = normal_per_vertex
+                            ? face[k]
+                            : dst_mesh->normal_indices()[sp.fid][k];
+        n += sp.bary[k] * dst_normals[nid];
+      }
+      normals[i] = (normal_trans * n).normalized();
+    }
+
+    for (size_t c = 0; c < dst_channels.size(); c++) {
+      channels[c][i] = sp.bary[0] * dst_channels[c][face[0]] +
+                       sp.bary[1] * dst_channels[c][face[1]] +
+                       sp.bary[2] * dst_channels[c][face[2]];
+    }
+  });
+
+  if (!channel_names.empty()) {
+    nlohmann::json j;
+    for (size_t c = 0; c < channel_names.size(); c++) {
+      j[channel_names[c]] = channels[c];
+    }
+    std::ofstream ofs("transferred_vertex_attributes.json");
+    ofs << j;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock_update(nonrigidicp_update_mtx);
+    if (options.vertex_colors) {
+      src_mesh->set_vertex_colors(colors);
+    }
+    if (options.vertex_normals) {
+      src_mesh->set_normals(normals);
+    }
+
+    const auto &faces = src_mesh->vertex_indices();
+    const bool to_split_uv = src_mesh->HasIndepentUv();
+    for (size_t i = 0; i < faces.size(); i++) {
+      for (int j = 0; j < 3; j++) {
+        const auto vid = faces[i][j];
+        auto &v = src_mesh->renderable_vertices[to_split_uv ? i * 3 + j : vid];
+        if (options.vertex_colors) {
+          v.col = colors[vid];
+        }
+        if (options.vertex_normals) {
+          v.nor = normals[vid];
+        }
+      }
+    }
+  }
+  // UpdateMesh() is called in the main thread
+  g_textrans_update_mesh = true;
+
+  return true;
+}
+
+void TextransProcess() {
+  std::lock_guard<std::mutex> lock(textrans_mtx);
+  if (g_textrans_run == AlgorithmStatus::STARTED) {
+    g_textrans_run = AlgorithmStatus::RUNNING;
+    PROFILE_SCOPE("TextransProcess");
+
+    Timer timer;
+    timer.Start();
+
+    // Settings are copied since the UI may edit them while running
+    const TextransOptions options = g_textrans_data;
+    const RenderableMeshPtr src_mesh = g_textrans_data.src_mesh;
+    const RenderableMeshPtr dst_mesh = g_textrans_data.dst_mesh;
+    auto &corresp = g_textrans_data.corresp;
+    const Eigen::Affine3f src_trans = g_scene.model_matrix(src_mesh);
+    const Eigen::Affine3f dst_trans = g_scene.model_matrix(dst_mesh);
+
+    if (g_textrans_data.vertex_mode) {
+      g_callback_message = "Vertex attribute transfer : running";
+      TransferVertexAttributes(src_mesh, src_trans, dst_mesh, dst_trans,
+                               options);
+      timer.End();
+      g_callback_message = "Vertex attribute transfer took " +
+                           std::to_string(timer.elapsed_msec()) + " ms.";
+      std::cout << g_callback_message << std::endl;
+
+      g_callback_succeeded = true;
+      g_callback_finished = true;
+      g_textrans_run = AlgorithmStatus::HALTING;
+      return;
+    }
+
+    auto maps = CollectTextransMaps(*dst_mesh, options.extra_maps);
+
+    if (g_textrans_data.tiled) {
+      std::vector<Image3b> previews;
+      if (TransferTexturesTiled(src_mesh, src_trans, dst_mesh, dst_trans,
+                                options, maps, previews)) {
+        g_textrans_data.output_names.clear();
+        for (const auto &map : maps) {
+          g_textrans_data.output_names.push_back(map.name);
+        }
+        g_textrans_data.outputs = previews;
+
+        auto mats = src_mesh->materials();
+        mats[0].diffuse_tex = previews[0];
+        mats[0].diffuse_texname = "transferred_preview.png";
+        mats[0].diffuse_texpath = "transferred_preview.png";
+        src_mesh->set_materials(mats);
+
+        timer.End();
+        g_callback_message = "Tiled texture transfer took " +
+                             std::to_string(timer.elapsed_msec() / 1000) +
+                             " sec.";
+        g_callback_succeeded = true;
+      } else {
+        g_callback_message = "Tiled texture transfer failed";
+        g_callback_succeeded = false;
+      }
+      std::cout << g_callback_message << std::endl;
+
+      g_callback_finished = true;
+      g_textrans_run = AlgorithmStatus::HALTING;
+      return;
+    }
+
+    if (!corresp.IsValidFor(src_mesh, src_trans, dst_mesh, dst_trans,
+                            options.dst_size)) {
+      g_callback_message = "Texture transfer : finding correspondence";
+      if (!BuildTextransCorresp(src_mesh, src_trans, dst_mesh, dst_trans,
+                                options.dst_size, options.nn_num, corresp)) {
+        g_callback_message = "Texture transfer needs UVs on both meshes";
+        g_callback_succeeded = false;
+        g_callback_finished = true;
+        g_textrans_run = AlgorithmStatus::HALTING;
+        return;
+      }
+    }
+
+    g_callback_message = "Texture transfer : gathering";
+    auto outputs = GatherTextransMaps(
+        maps, corresp.texel_ids, corresp.dst_uvs, corresp.dst_material_ids,
+        options.dst_size[0], options.dst_size[1]);
+
+    g_textrans_data.output_names.clear();
+    g_textrans_data.outputs.clear();
+    for (size_t k = 0; k < maps.size(); k++) {
+      InpaintTransferred(options, corresp.mask, outputs[k], maps[k].depth,
+                         src_mesh.get());
+      g_textrans_data.output_names.push_back(maps[k].name);
+      g_textrans_data.outputs.push_back(
+          ToPreviewImage(outputs[k], maps[k].depth));
+      if (WriteTransferredMap(maps[k].name, outputs[k], maps[k].depth,
+                              maps[k].channels)
+              .empty()) {
+        LOGE("Failed to write transferred_%s\n", maps[k].name.c_str());
+      }
+    }
+
+    auto mats = src_mesh->materials();
+    mats[0].diffuse_tex = g_textrans_data.outputs[0];
+    mats[0].diffuse_texname = "transferred.png";
+    mats[0].diffuse_texpath = "transferred.png";
+    src_mesh->set_materials(mats);
+
+    timer.End();
+    g_callback_message = "Texture transfer took " +
+                         std::to_string(timer.elapsed_msec() / 1000) + " sec.";
+
+    std::cout << g_callback_message << std::endl;
+
+    g_callback_succeeded = true;
+    g_callback_finished = true;
+    g_textrans_run = AlgorithmStatus::HALTING;
+  }
+}
+
+void ColorizeDeviation(const RenderableMeshPtr &mesh,
+                       const std::vector<float> &dists, float max_dist) {
+  std::lock_guard<std::mutex> lock_update(nonrigidicp_update_mtx);
+  auto &data = g_deviation_data;
+  if (data.colorized_mesh != mesh) {
+    data.colorized_mesh = mesh;
+    data.original_colors.resize(mesh->renderable_vertices.size());
+    for (size_t i = 0; i < mesh->renderable_vertices.size(); i++) {
+      data.original_colors[i] = mesh->renderable_vertices[i].col;
+    }
+  }
+
+  const auto &faces = mesh->vertex_indices();
+  const bool to_split_uv = mesh->HasIndepentUv();
+  for (size_t i = 0; i < faces.size(); i++) {
+    for (int j = 0; j < 3; j++) {
+      const auto vid = faces[i][j];
+      auto &v = mesh->renderable_vertices[to_split_uv ? i * 3 + j : vid];
+      v.col = DeviationColor(dists[vid], max_dist);
+    }
+  }
+  // UpdateMesh() is called in the main thread
+  g_deviation_update_mesh = true;
+}
+
+void RestoreDeviationColors() {
+  std::lock_guard<std::mutex> lock_update(nonrigidicp_update_mtx);
+  auto &data = g_deviation_data;
+  if (data.colorized_mesh == nullptr) {
+    return;
+  }
+  auto &mesh = data.colorized_mesh;
+  if (mesh->renderable_vertices.size() == data.original_colors.size()) {
+    for (size_t i = 0; i < mesh->renderable_vertices.size(); i++) {
+      mesh->renderable_vertices[i].col = data.original_colors[i];
+    }
+  }
+  mesh->UpdateMesh();
+  g_render_revision++;
+  data.colorized_mesh = nullptr;
+  data.original_colors.clear();
+}
+
+bool ExportDeviation(const std::string &path, const DeviationData &data) {
+  std::ofstream ofs(path);
+  if (!ofs) {
+    return false;
+  }
+  auto stats_json = [](const DeviationStats &stats) {
+    nlohmann::json j;
+    j["count"] = stats.count;
+    j["mean"] = stats.mean;
+    j["rms"] = stats.rms;
+    j["p50"] = stats.p50;
+    j["p90"] = stats.p90;
+    j["p95"] = stats.p95;
+    j["p99"] = stats.p99;
+    j["max"] = stats.max;
+    return j;
+  };
+  nlohmann::json j;
+  j["hausdorff"] = data.hausdorff;
+  j["src_to_dst"] = stats_json(data.src_stats);
+  j["src_to_dst"]["distances"] = data.src_dists;
+  if (data.bidirectional) {
+    j["dst_to_src"] = stats_json(data.dst_stats);
+    j["dst_to_src"]["distances"] = data.dst_dists;
+  }
+  ofs << j;
+  return true;
+}
+
+void DeviationProcess() {
+  std::lock_guard<std::mutex> lock(deviation_mtx);
+  if (g_deviation_run == AlgorithmStatus::STARTED) {
+    g_deviation_run = AlgorithmStatus::RUNNING;
+    PROFILE_SCOPE("DeviationProcess");
+
+    Timer timer;
+    timer.Start();
+
+    auto &data = g_deviation_data;
+    auto src = Mesh::Create(*std::static_pointer_cast<Mesh>(data.src_mesh));
+    src->Transform(g_scene.model_matrix(data.src_mesh));
+    auto dst = Mesh::Create(*std::static_pointer_cast<Mesh>(data.dst_mesh));
+    dst->Transform(g_scene.model_matrix(data.dst_mesh));
+
+    // Exact closest points. An approximate finder would bias the maximum
+    // and the high percentiles.
+    const TriangleBvh dst_bvh(dst->vertices(), dst->vertex_indices());
+    data.src_dists = ComputeSurfaceDistances(dst_bvh, src->vertices());
+    data.src_stats = ComputeDeviationStats(data.src_dists);
+    data.hausdorff = data.src_stats.max;
+
+    data.dst_dists.clear();
+    data.dst_stats = DeviationStats();
+    if (data.bidirectional) {
+      const TriangleBvh src_bvh(src->vertices(), src->vertex_indices());
+      data.dst_dists = ComputeSurfaceDistances(src_bvh, dst->vertices());
+      data.dst_stats = ComputeDeviationStats(data.dst_dists);
+      data.hausdorff = std::max(data.hausdorff, data.dst_stats.max);
+    }
+
+    timer.End();
+    data.msec = timer.elapsed_msec();
+
+    if (data.colorize) {
+      const float max_dist = 0.f < data.color_max
+                                 ? data.color_max
+                                 : static_cast<float>(data.src_stats.p95);
+      ColorizeDeviation(data.src_mesh, data.src_dists, max_dist);
+    }
+
+    if (!data.export_path.empty() &&
+        !ExportDeviation(data.export_path, data)) {
+      LOGE("Failed to write %s\n", data.export_path.c_str());
+    }
+
+    g_callback_message = "Deviation took " + std::to_string(data.msec) +
+                         " ms.\n  src->dst " +
+                         DeviationStatsToString(data.src_stats) +
+                         "\n  Hausdorff " + std::to_string(data.hausdorff);
+    std::cout << g_callback_message << std::endl;
+
+    g_callback_succeeded = true;
+    g_callback_finished = true;
+    g_deviation_run = AlgorithmStatus::HALTING;
+  }
+}
+
+// Whether GridKey() gives p its own cell instead of clamping it to the border
+bool IsInGrid(const Eigen::Vector3f &p, const Eigen::Vector3d &origin,
+              double cell_size) {
+  constexpr double kBias = static_cast<double>(int64_t(1)
+                                               << (kGridKeyBits - 1));
+  for (int k = 0; k < 3; k++) {
+    const double g = std::floor((p[k] - origin[k]) / cell_size);
+    if (!(-kBias <= g && g < kBias)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Minimizer of x^T A x + 2 b^T x closest to mean. Directions with small
+// singular values (flat or straight parts) keep the mean.
+Eigen::Vector3d QuadricMinimizer(const Eigen::Matrix3d &A,
+                                 const Eigen::Vector3d &b,
+                                 const Eigen::Vector3d &mean) {
+  Eigen::JacobiSVD<Eigen::Matrix3d> svd(A, Eigen::ComputeFullU);
+  const Eigen::Vector3d &sv = svd.singularValues();
+  const Eigen::Matrix3d &U = svd.matrixU();
+  const Eigen::Vector3d r = -(A * mean + b);
+  Eigen::Vector3d x = mean;
+  for (int k = 0; k < 3; k++) {
+    if (sv[0] * 1e-3 < sv[k]) {
+      x += U.col(k) * (U.col(k).dot(r) / sv[k]);
+    }
+  }
+  return x;
+}
+
+// Plane (n, d) of a triangle scaled by sqrt(area), so that summing q q^T
+// gives the area weighted quadric
+Eigen::Vector4d ScaledPlane(const Eigen::Vector3f &v0_,
+                            const Eigen::Vector3f &v1_,
+                            const Eigen::Vector3f &v2_) {
+  const Eigen::Vector3d v0 = v0_.cast<double>();
+  const Eigen::Vector3d cross =
+      (v1_.cast<double>() - v0).cross(v2_.cast<double>() - v0);
+  const double len = cross.norm();
+  if (len <= 0.0) {
+    return Eigen::Vector4d::Zero();
+  }
+  const Eigen::Vector3d n = cross / len;
+  const double w = std::sqrt(0.5 * len);
+  Eigen::Vector4d q;
+  q << w * n, -w * n.dot(v0);
+  return q;
+}
+
+// Vertex clustering with quadric error metrics (Lindstrom, "Out-of-Core
+// Simplification of Large Polygonal Models", 2000). Vertices are merged per
+// cell of a uniform grid sized for target_face_num, and each cluster is
+// placed at the minimizer of the area weighted plane quadrics of the faces
+// around it. Except for sorting cell keys and bucketing corners, every pass
+// runs in parallel over faces, vertices or clusters.
+// uv and vertex colors are averaged per cluster, so uv seams get blurred.
+// The result is meant for display only.
+RenderableMeshPtr DecimateQuadricClustering(const Mesh &src,
+                                            size_t target_face_num) {
+  PROFILE_SCOPE("DecimateQuadricClustering");
+  const auto &vertices = src.vertices();
+  const auto &faces = src.vertex_indices();
+  const auto &uv = src.uv();
+  const auto &uv_faces = src.uv_indices();
+  const auto &colors = src.vertex_colors();
+  const auto &material_ids = src.material_ids();
+  const size_t face_num = faces.size();
+  if (vertices.empty() || face_num == 0 || target_face_num == 0) {
+    return nullptr;
+  }
+  const bool has_uv = !uv.empty() && uv_faces.size() == face_num;
+  const bool has_colors = colors.size() == vertices.size();
+  const bool has_material_ids = material_ids.size() == face_num;
+
+  std::vector<Eigen::Vector4d> planes(face_num);
+  parallel_for(size_t(0), face_num, [&](size_t i) {
+    planes[i] = ScaledPlane(vertices[faces[i][0]], vertices[faces[i][1]],
+                            vertices[faces[i][2]]);
+  });
+  double area = 0.0;
+  for (const auto &q : planes) {
+    area += q.head<3>().squaredNorm();
+  }
+
+  Eigen::Vector3f bb_min = vertices[0];
+  Eigen::Vector3f bb_max = vertices[0];
+  for (const auto &v : vertices) {
+    bb_min = bb_min.cwiseMin(v);
+    bb_max = bb_max.cwiseMax(v);
+  }
+
+  // A cell holds about one output vertex, and a closed surface has about
+  // twice as many faces as vertices
+  constexpr uint64_t kMaxClusterNum = uint64_t(1) << kGridKeyBits;
+  const double extent = (bb_max - bb_min).maxCoeff();
+  double cell_size = std::sqrt(2.0 * area / target_face_num);
+  cell_size = std::max(cell_size, extent / (kMaxClusterNum / 2 - 1));
+  if (!(0.0 < cell_size)) {
+    return nullptr;
+  }
+
+  const Eigen::Vector3d origin = bb_min.cast<double>();
+  std::vector<uint64_t> keys(vertices.size());
+  parallel_for(size_t(0), vertices.size(), [&](size_t i) {
+    keys[i] = GridKey(vertices[i], origin, cell_size);
+  });
+  std::vector<uint64_t> cells = keys;
+  std::sort(cells.begin(), cells.end());
+  cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+  const size_t cluster_num = cells.size();
+  std::vector<uint32_t> clusters(vertices.size());
+  parallel_for(size_t(0), vertices.size(), [&](size_t i) {
+    clusters[i] = static_cast<uint32_t>(
+        std::lower_bound(cells.begin(), cells.end(), keys[i]) -
+        cells.begin());
+  });
+
+  // Face corners bucketed by cluster
+  std::vector<uint32_t> corner_begin(cluster_num + 1, 0);
+  for (const auto &f : faces) {
+    for (int k = 0; k < 3; k++) {
+      corner_begin[clusters[f[k]] + 1]++;
+    }
+  }
+  std::partial_sum(corner_begin.begin(), corner_begin.end(),
+                   corner_begin.begin());
+  std::vector<uint32_t> corners(face_num * 3);
+  {
+    std::vector<uint32_t> cursor(corner_begin.begin(), corner_begin.end() - 1);
+    for (size_t i = 0; i < face_num; i++) {
+      for (int k = 0; k < 3; k++) {
+        corners[cursor[clusters[faces[i][k]]]++] =
+            static_cast<uint32_t>(i * 3 + k);
+      }
+    }
+  }
+
+  std::vector<Eigen::Vector3f> out_vertices(cluster_num);
+  std::vector<Eigen::Vector2f> out_uv(has_uv ? cluster_num : 0);
+  std::vector<Eigen::Vector3f> out_colors(has_colors ? cluster_num : 0);
+  parallel_for(size_t(0), cluster_num, [&](size_t c) {
+    Eigen::Matrix3d A = Eigen::Matrix3d::Zero();
+    Eigen::Vector3d b = Eigen::Vector3d::Zero();
+    Eigen::Vector3d mean = Eigen::Vector3d::Zero();
+    Eigen::Vector2d uv_sum = Eigen::Vector2d::Zero();
+    Eigen::Vector3d color_sum = Eigen::Vector3d::Zero();
+    for (uint32_t j = corner_begin[c]; j < corner_begin[c + 1]; j++) {
+      const uint32_t fid = corners[j] / 3;
+      const uint32_t k = corners[j] % 3;
+      const auto &q = planes[fid];
+      A += q.head<3>() * q.head<3>().transpose();
+      b += q[3] * q.head<3>();
+      const int vid = faces[fid][k];
+      mean += vertices[vid].cast<double>();
+      if (has_uv) {
+        uv_sum += uv[uv_faces[fid][k]].cast<double>();
+      }
+      if (has_colors) {
+        color_sum += colors[vid].cast<double>();
+      }
+    }
+    const double n = static_cast<double>(corner_begin[c + 1] - corner_begin[c]);
+    mean /= n;
+    out_vertices[c] = QuadricMinimizer(A, b, mean).cast<float>();
+    if (has_uv) {
+      out_uv[c] = (uv_sum / n).cast<float>();
+    }
+    if (has_colors) {
+      out_colors[c] = (color_sum / n).cast<float>();
+    }
+  });
+
+  // Faces collapsed to edges or points are dropped, and so are duplicates
+  // with the same orientation
+  std::vector<Eigen::Vector3i> mapped(face_num);
+  parallel_for(size_t(0), face_num, [&](size_t i) {
+    Eigen::Vector3i f(clusters[faces[i][0]], clusters[faces[i][1]],
+                      clusters[faces[i][2]]);
+    if (f[0] == f[1] || f[1] == f[2] || f[2] == f[0]) {
+      f.setConstant(-1);
+    } else {
+      // Smallest index first, keeping the orientation
+      while (f[1] < f[0] || f[2] < f[0]) {
+        f = Eigen::Vector3i(f[1], f[2], f[0]);
+      }
+    }
+    mapped[i] = f;
+  });
+  std::vector<std::pair<FaceKey, uint32_t>> kept;
+  for (size_t i = 0; i < face_num; i++) {
+    const auto &f = mapped[i];
+    if (f[0] < 0) {
+      continue;
+    }
+    kept.emplace_back(MakeFaceKey(f), static_cast<uint32_t>(i));
+  }
+  std::sort(kept.begin(), kept.end());
+  kept.erase(std::unique(kept.begin(), kept.end(),
+                         [](const auto &a, const auto &b) {
+                           return a.first == b.first;
+                         }),
+             kept.end());
+
+  std::vector<Eigen::Vector3i> out_faces(kept.size());
+  std::vector<int> out_material_ids(kept.size(), 0);
+  for (size_t i = 0; i < kept.size(); i++) {
+    out_faces[i] = mapped[kept[i].second];
+    if (has_material_ids) {
+      out_material_ids[i] = material_ids[kept[i].second];
+    }
+  }
+
+  auto mesh = RenderableMesh::Create();
+  mesh->set_vertices(out_vertices);
+  mesh->set_vertex_indices(out_faces);
+  if (has_uv) {
+    mesh->set_uv(out_uv);
+    mesh->set_uv_indices(out_faces);
+  }
+  if (has_colors) {
+    mesh->set_vertex_colors(out_colors);
+  }
+  mesh->set_materials(src.materials());
+  mesh->set_material_ids(out_material_ids);
+  mesh->CalcNormal();
+  mesh->CalcStats();
+  return mesh;
+}
+
+// Each level has 1/8 of the faces of the previous one, down to
+// min_level_face_num. All levels are decimated from the original so that
+// errors do not accumulate.
+LodProxies BuildLodProxies(const LodJob &job) {
+  PROFILE_SCOPE("BuildLodProxies");
+  Timer timer;
+  timer.Start();
+
+  LodProxies lod;
+  lod.geometry_revision = job.geometry_revision;
+  const size_t face_num = job.snapshot->vertex_indices().size();
+  size_t prev_face_num = face_num;
+  for (size_t target = face_num / 8;
+       static_cast<size_t>(job.min_level_face_num) <= target &&
+       lod.levels.size() < static_cast<size_t>(job.max_level_num);
+       target /= 8) {
+    auto proxy = DecimateQuadricClustering(*job.snapshot, target);
+    if (proxy == nullptr) {
+      break;
+    }
+    const size_t proxy_face_num = proxy->vertex_indices().size();
+    if (proxy_face_num == 0 || prev_face_num <= proxy_face_num) {
+      continue;
+    }
+    lod.levels.push_back(proxy);
+    prev_face_num = proxy_face_num;
+  }
+
+  timer.End();
+  std::cout << "LOD: " << lod.levels.size() << " levels of " << face_num
+            << " faces in " << timer.elapsed_msec() << " ms" << std::endl;
+  return lod;
+}
+
+void LodProcess() {
+#ifdef DEVENIR_USE_PROFILER
+  g_profiler.SetThreadName("lod");
+#endif
+  while (!g_algorithm_process_finish) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    LodJob job;
+    {
+      std::lock_guard<std::mutex> lock(lod_mtx);
+      if (g_lod_data.jobs.empty()) {
+        continue;
+      }
+      job = std::move(g_lod_data.jobs.front());
+      g_lod_data.jobs.pop_front();
+      g_lod_data.building = true;
+    }
+
+    LodProxies lod = BuildLodProxies(job);
+
+    std::lock_guard<std::mutex> lock(lod_mtx);
+    g_lod_data.finished.emplace_back(job.mesh, std::move(lod));
+    g_lod_data.building = false;
+  }
+}
+
+void CloseSocket(SocketHandle socket) {
+#ifdef _WIN32
+  closesocket(socket);
+#else
+  close(socket);
+#endif
+}
+
+bool SendAll(SocketHandle socket, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    const auto size =
+        send(socket, data.data() + sent, static_cast<int>(data.size() - sent),
+             0);
+    if (size <= 0) {
+      return false;
+    }
+    sent += static_cast<size_t>(size);
+  }
+  return true;
+}
+
+// Listens on "tcp:[<host>:]<port>" or "unix:<path>" (not on Windows). TCP
+// binds 127.0.0.1 unless an IPv4 host is given.
+SocketHandle OpenServerSocket(const std::string &address) {
+  SocketHandle listen_socket = kInvalidSocket;
+  if (address.rfind("tcp:", 0) == 0) {
+    std::string host = "127.0.0.1";
+    std::string port_str = address.substr(4);
+    const size_t colon = port_str.rfind(':');
+    if (colon != std::string::npos) {
+      host = port_str.substr(0, colon);
+      port_str = port_str.substr(colon + 1);
+    }
+    const int port = std::atoi(port_str.c_str());
+    if (port <= 0 || 65535 < port) {
+      return kInvalidSocket;
+    }
+#ifdef _WIN32
+    WSADATA wsa_data;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+      return kInvalidSocket;
+    }
+#endif
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket == kInvalidSocket) {
+      return kInvalidSocket;
+    }
+    const int reuse = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR,
+               reinterpret_cast<const char *>(&reuse), sizeof(reuse));
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ||
+        bind(listen_socket, reinterpret_cast<const sockaddr *>(&addr),
+             sizeof(addr)) != 0) {
+      CloseSocket(listen_socket);
+      return kInvalidSocket;
+    }
+  } else if (address.rfind("unix:", 0) == 0) {
+#ifdef _WIN32
+    return kInvalidSocket;
+#else
+    const std::string path = address.substr(5);
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    if (path.empty() || sizeof(addr.sun_path) <= path.size()) {
+      return kInvalidSocket;
+    }
+    // Socket left by a previous run. Other files are never removed.
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+      unlink(path.c_str());
+    }
+    listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_socket == kInvalidSocket) {
+      return kInvalidSocket;
+    }
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    if (bind(listen_socket, reinterpret_cast<const sockaddr *>(&addr),
+             sizeof(addr)) != 0) {
+      CloseSocket(listen_socket);
+      return kInvalidSocket;
+    }
+#endif
+  } else {
+    return kInvalidSocket;
+  }
+
+  if (listen(listen_socket, 8) != 0) {
+    CloseSocket(listen_socket);
+    return kInvalidSocket;
+  }
+#ifndef _WIN32
+  // A client closing early must not terminate the process in send()
+  std::signal(SIGPIPE, SIG_IGN);
+#endif
+  return listen_socket;
+}
+
+// Longest request line. Clients sending more without a newline are dropped
+// instead of growing their buffer without bound.
+constexpr size_t kMaxServerLineSize = 1 << 20;
+
+// Owns all connections. Splits received data into JSON lines for the main
+// thread and sends queued events back.
+void ServerProcess(SocketHandle listen_socket) {
+#ifdef DEVENIR_USE_PROFILER
+  g_profiler.SetThreadName("server");
+#endif
+  struct Client {
+    SocketHandle socket = kInvalidSocket;
+    std::string received;
+  };
+  std::map<uint64_t, Client> clients;
+  uint64_t next_client = 0;
+
+  while (!g_algorithm_process_finish) {
+    fd_set read_set;
+    FD_ZERO(&read_set);
+    FD_SET(listen_socket, &read_set);
+    SocketHandle max_socket = listen_socket;
+    for (const auto &[id, client] : clients) {
+      FD_SET(client.socket, &read_set);
+      max_socket = std::max(max_socket, client.socket);
+    }
+    timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 50000;
+    const int ready = select(static_cast<int>(max_socket) + 1, &read_set,
+                             nullptr, nullptr, &timeout);
+
+    if (0 < ready && FD_ISSET(listen_socket, &read_set)) {
+      const SocketHandle socket = accept(listen_socket, nullptr, nullptr);
+      if (socket != kInvalidSocket) {
+        clients[next_client++].socket = socket;
+      }
+    }
+
+    std::vector<ServerRequest> received;
+    std::deque<std::pair<uint64_t, std::string>> outbox;
+    for (auto it = clients.begin(); 0 < ready && it != clients.end();) {
+      auto &client = it->second;
+      if (!FD_ISSET(client.socket, &read_set)) {
+        ++it;
+        continue;
+      }
+      char buf[4096];
+      const auto size =
+          recv(client.socket, buf, static_cast<int>(sizeof(buf)), 0);
+      if (size <= 0) {
+        CloseSocket(client.socket);
+        it = clients.erase(it);
+        continue;
+      }
+      client.received.append(buf, static_cast<size_t>(size));
+      size_t pos;
+      while ((pos = client.received.find('\n')) != std::string::npos) {
+        const std::string line = client.received.substr(0, pos);
+        client.received.erase(0, pos + 1);
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+          continue;
+        }
+        ServerRequest request;
+        request.client = it->first;
+        try {
+          request.body = nlohmann::json::parse(line);
+        } catch (const std::exception &e) {
+          nlohmann::json event = {{"event", "error"}, {"message", e.what()}};
+          outbox.emplace_back(it->first, event.dump() + "\n");
+          continue;
+        }
+        received.push_back(std::move(request));
+      }
+      if (kMaxServerLineSize < client.received.size()) {
+        const nlohmann::json event = {{"event", "error"},
+                                      {"message", "Request line too long"}};
+        SendAll(client.socket, event.dump() + "\n");
+        CloseSocket(client.socket);
+        it = clients.erase(it);
+        continue;
+      }
+      ++it;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(server_mtx);
+      for (auto &request : received) {
+        g_server_data.requests.push_back(std::move(request));
+      }
+      while (!g_server_data.outbox.empty()) {
+        outbox.push_back(std::move(g_server_data.outbox.front()));
+        g_server_data.outbox.pop_front();
+      }
+    }
+
+    for (const auto &[id, line] : outbox) {
+      auto it = clients.find(id);
+      if (it != clients.end() && !SendAll(it->second.socket, line)) {
+        CloseSocket(it->second.socket);
+        clients.erase(it);
+      }
+    }
+  }
+
+  for (const auto &[id, client] : clients) {
+    CloseSocket(client.socket);
+  }
+  CloseSocket(listen_socket);
+#ifdef _WIN32
+  WSACleanup();
+#else
+  if (g_server_data.address.rfind("unix:", 0) == 0) {
+    unlink(g_server_data.address.substr(5).c_str());
+  }
+#endif
+}
+
+void ReprojectProcess();
+
+void AlgorithmProcess() {
+#ifdef DEVENIR_USE_PROFILER
+  g_profiler.SetThreadName("algorithm");
+#endif
+  while (!g_algorithm_process_finish) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    IcpProcess();
+
+    NonrigidIcpProcess();
+
+    TextransProcess();
+
+    GlobalAlignProcess();
+
+    NonrigidIcpSweepProcess();
+
+    DeviationProcess();
+
+    ReprojectProcess();
+  }
+}
+
+void Draw(GLFWwindow *window);
+
+auto GetWidthHeightForView() {
+  return std::make_pair(static_cast<uint32_t>(g_width / g_view_cols),
+                        static_cast<uint32_t>(g_height / g_view_rows));
+}
+
+// Top-left corner of view in window coordinates (y down)
+Eigen::Vector2i GetViewOffset(uint32_t vidx) {
+  auto [w, h] = GetWidthHeightForView();
+  return {static_cast<int>((vidx % g_view_cols) * w),
+          static_cast<int>((vidx / g_view_cols) * h)};
+}
+
+bool IsCursorOnView(uint32_t vidx) {
+  if (g_cursor_pos.x() < 0.0 || g_cursor_pos.y() < 0.0) {
+    return false;
+  }
+  uint32_t x = static_cast<uint32_t>(g_cursor_pos.x());
+  uint32_t y = static_cast<uint32_t>(g_cursor_pos.y());
+  auto [w, h] = GetWidthHeightForView();
+  const Eigen::Vector2i offset = GetViewOffset(vidx);
+  const uint32_t left = static_cast<uint32_t>(offset.x());
+  const uint32_t top = static_cast<uint32_t>(offset.y());
+
+  if (left <= x && x < left + w && top <= y && y < top + h) {
+    return true;
+  }
+
+  return false;
+}
+
+// FNV-1a, only used to detect changes
+uint64_t HashBytes(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+template <typename T>
+uint64_t HashValue(uint64_t hash, const T &value) {
+  return HashBytes(hash, &value, sizeof(T));
+}
+
+// Copy of the last image drawn into a view region of the default
+// framebuffer. GL objects are released explicitly since views may outlive
+// the context at exit.
+struct ViewImageCache {
+  GLuint fbo = 0;
+  GLuint rbo = 0;
+  uint32_t width = 0;
+  uint32_t height = 0;
+
+  bool IsValid(uint32_t w, uint32_t h) const {
+    return fbo != 0 && width == w && height == h;
+  }
+
+  void Store(int x, int y, uint32_t w, uint32_t h) {
+    if (!IsValid(w, h)) {
+      Release();
+      glGenRenderbuffers(1, &rbo);
+      glBindRenderbuffer(GL_RENDERBUFFER, rbo);
+      glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, static_cast<GLsizei>(w),
+                            static_cast<GLsizei>(h));
+      glBindRenderbuffer(GL_RENDERBUFFER, 0);
+      glGenFramebuffers(1, &fbo);
+      glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                GL_RENDERBUFFER, rbo);
+      width = w;
+      height = h;
+    }
+    const GLint iw = static_cast<GLint>(w);
+    const GLint ih = static_cast<GLint>(h);
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+    glBlitFramebuffer(x, y, x + iw, y + ih, 0, 0, iw, ih, GL_COLOR_BUFFER_BIT,
+                      GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+
+  void Restore(int x, int y) const {
+    const GLint iw = static_cast<GLint>(width);
+    const GLint ih = static_cast<GLint>(height);
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, iw, ih, x, y, x + iw, y + ih, GL_COLOR_BUFFER_BIT,
+                      GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+
+  void Release() {
+    if (fbo != 0) {
+      glDeleteFramebuffers(1, &fbo);
+      glDeleteRenderbuffers(1, &rbo);
+    }
+    fbo = 0;
+    rbo = 0;
+    width = 0;
+    height = 0;
+  }
+};
+
+// Ignore faces shown in a view. Pixels are tinted by the face_id G-buffer,
+// so the tint covers exactly the selected faces even where they share
+// vertices with others. Drawn by ImGui over the view.
+struct FaceSelectionOverlay {
+  GLuint tex = 0;
+  bool visible = false;
+  // SplitViewInfo::draw_count and FaceSelectData::revision it was made from
+  uint64_t draw_count = ~0ull;
+  uint64_t mask_revision = ~0ull;
+
+  void Upload(const std::vector<uint8_t> &rgba, int w, int h) {
+    if (tex == 0) {
+      glGenTextures(1, &tex);
+      glBindTexture(GL_TEXTURE_2D, tex);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                 rgba.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+
+  void Release() {
+    if (tex != 0) {
+      glDeleteTextures(1, &tex);
+    }
+    tex = 0;
+    visible = false;
+    draw_count = ~0ull;
+  }
+};
+
+template <typename T>
+int CalcFillDigits(const T &point_num) {
+  return std::max(
+      2, static_cast<int>(std::log10(static_cast<double>(point_num)) + 1));
+}
+
+struct SplitViewInfo {
+  RendererGlPtr renderer;
+  PinholeCameraPtr camera;
+  Eigen::Vector2i offset = {0, 0};
+  std::unordered_map<RenderableMeshPtr, int> selected_point_idx;
+  uint32_t id = ~0u;
+  double trans_speed = 0.0;
+  double wheel_speed = 0.0;
+  double rotate_speed = 0.0;
+  Eigen::Translation3d offset_to_rot_center = {0.0, 0.0, 0.0};
+  // Scene::selected_revision last handed to renderer, per mesh index
+  std::vector<uint64_t> uploaded_selected_revisions;
+  // Camera pose at the last draw and when it last changed
+  Eigen::Matrix4d drawn_c2w = Eigen::Matrix4d::Zero();
+  double moved_time = 0.0;
+  // Image of the last draw, restored while RenderSignature() is unchanged
+  ViewImageCache image_cache;
+  // Incremented whenever renderer draws, i.e. its G-buffer changes
+  uint64_t draw_count = 0;
+  FaceSelectionOverlay selection_overlay;
+  uint64_t drawn_signature = 0;
+  // Hash of the labels last handed to renderer
+  uint64_t texts_signature = 0;
+  // Meshes registered to renderer, at most RENDERER_SLOT_NUM. RendererGl
+  // cannot unregister a mesh, so slots of hidden meshes are freed by
+  // re-submitting the others when another mesh is shown.
+  std::vector<RenderableMeshPtr> slots;
+  // Draws the shown meshes while LOD proxies are in use, so that proxies do
+  // not take slots of renderer. lod_slots holds the meshes or proxies drawn
+  // recently.
+  RendererGlPtr lod_renderer;
+  std::vector<RenderableMeshPtr> lod_slots;
+
+  void Init(uint32_t vidx) {
+    std::lock_guard<std::mutex> lock(views_mtx);
+
+    auto [w, h] = GetWidthHeightForView();
+
+    id = vidx;
+
+    offset = GetViewOffset(vidx);
+
+    camera = std::make_shared<PinholeCamera>(w, h, 45.f);
+    renderer = std::make_shared<RendererGl>();
+    renderer->SetSize(static_cast<uint32_t>(w), static_cast<uint32_t>(h));
+    renderer->SetCamera(camera);
+    renderer->Init();
+
+    renderer->SetBackgroundColor(default_clear_color);
+    renderer->SetWireColor(default_wire_color);
+
+    renderer->SetShowWire(false);
+    renderer->SetFlatNormal(true);
+
+    lod_renderer = std::make_shared<RendererGl>();
+    lod_renderer->SetSize(static_cast<uint32_t>(w), static_cast<uint32_t>(h));
+    lod_renderer->SetCamera(camera);
+    lod_renderer->Init();
+  }
+
+  void Reset() {
+    PROFILE_SCOPE("SplitViewInfo::Reset");
+    std::lock_guard<std::mutex> lock(views_mtx);
+
+    auto [w, h] = GetWidthHeightForView();
+
+    camera->set_size(w, h);
+    camera->set_fov_y(45.0f);
+    camera->set_principal_point({w / 2.f, h / 2.f});
+    camera->set_c2w(Eigen::Affine3d::Identity());
+
+    renderer->SetSize(w, h);
+
+    offset = GetViewOffset(id);
+    g_render_revision++;
+
+    // Only size dependent targets are re-created. Meshes stay registered.
+    renderer->Init();
+    lod_renderer->SetSize(w, h);
+    lod_renderer->Init();
+  }
+
+  bool HasSlot(const RenderableMeshPtr &mesh) const {
+    return std::find(slots.begin(), slots.end(), mesh) != slots.end();
+  }
+
+  // Meshes without a slot are hidden
+  bool IsShown(const RenderableMeshPtr &mesh) const {
+    return HasSlot(mesh) && renderer->GetVisibility(mesh);
+  }
+
+  // Returns false if mesh cannot be shown since every slot holds a shown
+  // mesh
+  bool SetShown(const RenderableMeshPtr &mesh, bool shown) {
+    if (!shown) {
+      if (HasSlot(mesh)) {
+        renderer->SetVisibility(mesh, false);
+      }
+      return true;
+    }
+    if (!HasSlot(mesh)) {
+      if (!FreeSlot()) {
+        return false;
+      }
+      renderer->SetMesh(mesh, g_scene.model_matrix(mesh), true);
+      slots.push_back(mesh);
+      SyncSelectedPositions();
+      renderer->Init();
+    }
+    renderer->SetVisibility(mesh, true);
+    g_render_revision++;
+    return true;
+  }
+
+  // Makes sure that a slot is free. Meshes hidden or removed from the scene
+  // give up their slots.
+  bool FreeSlot() {
+    if (slots.size() < RENDERER_SLOT_NUM) {
+      return true;
+    }
+    std::vector<RenderableMeshPtr> kept;
+    for (const auto &mesh : slots) {
+      if (g_scene.Has(mesh) && renderer->GetVisibility(mesh)) {
+        kept.push_back(mesh);
+      }
+    }
+    if (RENDERER_SLOT_NUM <= kept.size()) {
+      return false;
+    }
+    SubmitGl(kept);
+    return true;
+  }
+
+  // Tears down all GL state of renderer and registers meshes as shown
+  void SubmitGl(const std::vector<RenderableMeshPtr> &meshes) {
+    PROFILE_SCOPE("SplitViewInfo::SubmitGl");
+    std::vector<Eigen::Vector3f> pos_cols;
+    for (const auto &mesh : meshes) {
+      pos_cols.push_back(renderer->GetSelectedPositionColor(mesh));
+    }
+    renderer->ClearGlState();
+    slots.clear();
+    for (size_t i = 0; i < meshes.size(); i++) {
+      renderer->SetMesh(meshes[i], g_scene.model_matrix(meshes[i]), true);
+      renderer->SetVisibility(meshes[i], true);
+      renderer->AddSelectedPositionColor(meshes[i], pos_cols[i]);
+      slots.push_back(meshes[i]);
+    }
+    uploaded_selected_revisions.clear();
+  }
+
+  // Shows meshes added to the scene from first_gidx on while slots are
+  // left. Returns the number of meshes left hidden.
+  size_t AddMeshesGl(size_t first_gidx) {
+    PROFILE_SCOPE("SplitViewInfo::AddMeshesGl");
+    size_t hidden_num = 0;
+    for (size_t i = first_gidx; i < g_scene.size(); i++) {
+      if (slots.size() < RENDERER_SLOT_NUM) {
+        renderer->SetMesh(g_scene.mesh(i), g_scene.model_matrix(i), true);
+        slots.push_back(g_scene.mesh(i));
+      } else {
+        hidden_num++;
+      }
+    }
+    SyncSelectedPositions();
+    renderer->Init();
+    g_render_revision++;
+    return hidden_num;
+  }
+
+  // Re-submits the shown meshes still in the scene. Needed when meshes are
+  // removed from the scene.
+  void ResetGl() {
+    PROFILE_SCOPE("SplitViewInfo::ResetGl");
+    std::vector<RenderableMeshPtr> kept;
+    for (const auto &mesh : slots) {
+      if (g_scene.Has(mesh) && renderer->GetVisibility(mesh)) {
+        kept.push_back(mesh);
+      }
+    }
+    SubmitGl(kept);
+    SyncSelectedPositions();
+    renderer->Init();
+
+    lod_renderer->ClearGlState();
+    lod_slots.clear();
+    lod_renderer->Init();
+    g_render_revision++;
+  }
+
+  // Chooses LOD proxies for shown meshes while the camera moves. Levels are
+  // chosen so that faces do not exceed faces_per_pixel times the projected
+  // area of the bounding sphere. Returns (mesh, mesh or proxy to draw) for
+  // every shown mesh, or nothing if no proxy is chosen.
+  std::vector<std::pair<RenderableMeshPtr, RenderableMeshPtr>> SelectLod() {
+    std::vector<std::pair<RenderableMeshPtr, RenderableMeshPtr>> drawn;
+    const double now = glfwGetTime();
+    if (camera->c2w().matrix() != drawn_c2w) {
+      drawn_c2w = camera->c2w().matrix();
+      moved_time = now;
+    }
+    const auto &lod = g_lod_data;
+    if (!lod.enable || lod.proxies.empty() ||
+        lod.settle_sec < now - moved_time ||
+        g_face_select_data.tool != FaceSelectTool::NONE) {
+      return drawn;
+    }
+    PROFILE_SCOPE("SelectLod");
+
+    const auto &stats = renderer->GetTransedStats();
+    const Eigen::Vector3f cam_pos = camera->c2w().translation().cast<float>();
+    const float focal =
+        camera->height() * 0.5f / std::tan(camera->fov_y() * 0.5f * pi / 180.f);
+    const float max_area = static_cast<float>(camera->width()) *
+                           static_cast<float>(camera->height());
+    bool has_proxy = false;
+    for (const auto &mesh : slots) {
+      if (!IsShown(mesh)) {
+        continue;
+      }
+      drawn.emplace_back(mesh, mesh);
+      const auto proxies = lod.proxies.find(mesh);
+      const auto it = stats.find(mesh);
+      if (proxies == lod.proxies.end() || it == stats.end() ||
+          proxies->second.geometry_revision !=
+              g_scene.geometry_revision(mesh) ||
+          (g_nonrigidicp_run != AlgorithmStatus::HALTING &&
+           g_nonrigidicp_data.src_mesh == mesh)) {
+        continue;
+      }
+      const auto &bb_max = it->second.bb_max;
+      const auto &bb_min = it->second.bb_min;
+      const float radius = 0.5f * (bb_max - bb_min).norm();
+      const float dist = (it->second.center - cam_pos).norm();
+      const float pix_radius =
+          radius < dist ? radius * focal / dist : camera->height();
+      const float area =
+          std::min<float>(pi * pix_radius * pix_radius, max_area);
+      const float budget = lod.faces_per_pixel * area;
+      if (mesh->vertex_indices().size() <= budget) {
+        continue;
+      }
+      const auto &levels = proxies->second.levels;
+      RenderableMeshPtr proxy = levels.back();
+      for (const auto &level : levels) {
+        if (level->vertex_indices().size() <= budget) {
+          proxy = level;
+          break;
+        }
+      }
+      drawn.back().second = proxy;
+      has_proxy = true;
+    }
+    if (!has_proxy) {
+      drawn.clear();
+    }
+    return drawn;
+  }
+
+  // Draws the result of SelectLod() with lod_renderer. Shown meshes fit in
+  // its slots, so GL state is re-created only if the meshes and proxies to
+  // draw do not fit next to the ones drawn before.
+  void DrawLod(
+      const std::vector<std::pair<RenderableMeshPtr, RenderableMeshPtr>>
+          &drawn) {
+    PROFILE_SCOPE("SplitViewInfo::DrawLod");
+    const auto registered = [&](const RenderableMeshPtr &geo) {
+      return std::find(lod_slots.begin(), lod_slots.end(), geo) !=
+             lod_slots.end();
+    };
+    size_t missing_num = 0;
+    for (const auto &[mesh, geo] : drawn) {
+      missing_num += registered(geo) ? 0 : 1;
+    }
+    if (RENDERER_SLOT_NUM < lod_slots.size() + missing_num) {
+      lod_renderer->ClearGlState();
+      lod_slots.clear();
+    }
+    for (const auto &[mesh, geo] : drawn) {
+      // Also updates model matrices of registered ones
+      lod_renderer->SetMesh(geo, g_scene.model_matrix(mesh), false);
+      if (!registered(geo)) {
+        lod_slots.push_back(geo);
+      }
+    }
+    if (missing_num != 0) {
+      lod_renderer->Init();
+    }
+    for (const auto &geo : lod_slots) {
+      lod_renderer->SetVisibility(geo, false);
+    }
+    for (const auto &[mesh, geo] : drawn) {
+      lod_renderer->SetVisibility(geo, true);
+      lod_renderer->AddSelectedPositions(
+          geo, g_scene.selected_points(g_scene.Id(mesh)));
+      lod_renderer->AddSelectedPositionColor(
+          geo, renderer->GetSelectedPositionColor(mesh));
+    }
+
+    float near_z, far_z;
+    renderer->GetNearFar(near_z, far_z);
+    lod_renderer->SetNearFar(near_z, far_z);
+    lod_renderer->SetShowWire(renderer->GetShowWire());
+    lod_renderer->SetFlatNormal(renderer->GetFlatNormal());
+    lod_renderer->SetBackgroundColor(renderer->GetBackgroundColor());
+    lod_renderer->SetWireColor(renderer->GetWireColor());
+    lod_renderer->Draw();
+  }
+
+  // Rebuilds selection_overlay if renderer drew or masks were edited since
+  // the last build. Hidden after a draw by lod_renderer, since the G-buffer
+  // of renderer is then older than the image.
+  void UpdateSelectionOverlay(bool drew_lod) {
+    auto &overlay = selection_overlay;
+    const auto &data = g_face_select_data;
+    std::unordered_map<int, const FaceMask *> id2mask;
+    for (const auto &mesh : slots) {
+      if (data.show && IsShown(mesh) && g_scene.ignore_faces(mesh).Any()) {
+        id2mask[static_cast<int>(renderer->GetMeshId(mesh))] =
+            &g_scene.ignore_faces(mesh);
+      }
+    }
+    if (drew_lod || id2mask.empty()) {
+      overlay.visible = false;
+      overlay.draw_count = ~0ull;
+      return;
+    }
+    if (overlay.draw_count == draw_count &&
+        overlay.mask_revision == data.revision) {
+      return;
+    }
+    PROFILE_SCOPE("SplitViewInfo::UpdateSelectionOverlay");
+    GBuffer gbuf;
+    renderer->ReadGbuf();
+    renderer->GetGbuf(gbuf);
+    const int w = gbuf.face_id.cols;
+    const int h = gbuf.face_id.rows;
+    std::vector<uint8_t> rgba(static_cast<size_t>(w) * h * 4, 0);
+    const std::array<uint8_t, 4> col = {
+        static_cast<uint8_t>(data.color.x()),
+        static_cast<uint8_t>(data.color.y()),
+        static_cast<uint8_t>(data.color.z()), 160};
+    parallel_for(0, h, [&](int y) {
+      for (int x = 0; x < w; x++) {
+        const int fid = gbuf.face_id.at<int>(y, x);
+        if (fid < 0) {
+          continue;
+        }
+        const auto it = id2mask.find(gbuf.geo_id.at<int>(y, x));
+        if (it != id2mask.end() &&
+            it->second->Test(static_cast<uint32_t>(fid))) {
+          std::copy(col.begin(), col.end(),
+                    rgba.begin() + (static_cast<size_t>(y) * w + x) * 4);
+        }
+      }
+    });
+    overlay.Upload(rgba, w, h);
+    overlay.visible = true;
+    overlay.draw_count = draw_count;
+    overlay.mask_revision = data.revision;
+  }
+
+  // Hands selected points edited since the last call to the renderer. Edits
+  // are coalesced so that many drag events in a frame result in one upload
+  // per edited mesh.
+  void SyncSelectedPositions() {
+    uploaded_selected_revisions.resize(g_scene.size(), ~0ull);
+    for (size_t i = 0; i < g_scene.size(); i++) {
+      const uint64_t revision = g_scene.selected_revision(i);
+      if (uploaded_selected_revisions[i] == revision ||
+          !HasSlot(g_scene.mesh(i))) {
+        continue;
+      }
+      PROFILE_SCOPE("AddSelectedPositions");
+      renderer->AddSelectedPositions(g_scene.mesh(i),
+                                     g_scene.selected_points(i));
+      uploaded_selected_revisions[i] = revision;
+    }
+  }
+
+  // Hash of everything the image drawn by renderer depends on. lod is the
+  // result of SelectLod() for this frame.
+  uint64_t RenderSignature(
+      const std::vector<std::pair<RenderableMeshPtr, RenderableMeshPtr>> &lod)
+      const {
+    uint64_t hash = 14695981039346656037ull;
+    hash = HashValue(hash, g_render_revision);
+    hash = HashBytes(hash, camera->c2w().matrix().data(), sizeof(double) * 16);
+    hash = HashValue(hash, camera->fov_y());
+    hash = HashValue(hash, camera->width());
+    hash = HashValue(hash, camera->height());
+    hash = HashBytes(hash, offset.data(), sizeof(int) * 2);
+    float near_z, far_z;
+    renderer->GetNearFar(near_z, far_z);
+    hash = HashValue(hash, near_z);
+    hash = HashValue(hash, far_z);
+    hash = HashValue(hash, renderer->GetShowWire());
+    hash = HashValue(hash, renderer->GetFlatNormal());
+    const Eigen::Vector3f bkg_col = renderer->GetBackgroundColor();
+    const Eigen::Vector3f wire_col = renderer->GetWireColor();
+    hash = HashBytes(hash, bkg_col.data(), sizeof(float) * 3);
+    hash = HashBytes(hash, wire_col.data(), sizeof(float) * 3);
+    hash = HashValue(hash, texts_signature);
+    for (size_t i = 0; i < g_scene.size(); i++) {
+      const auto &mesh = g_scene.mesh(i);
+      const bool shown = IsShown(mesh);
+      hash = HashValue(hash, shown);
+      if (!shown) {
+        continue;
+      }
+      const Eigen::Vector3f pos_col = renderer->GetSelectedPositionColor(mesh);
+      hash = HashBytes(hash, g_scene.model_matrix(i).matrix().data(),
+                       sizeof(float) * 16);
+      hash = HashValue(hash, g_scene.geometry_revision(i));
+      hash = HashValue(hash, g_scene.selected_revision(i));
+      hash = HashBytes(hash, pos_col.data(), sizeof(float) * 3);
+    }
+    for (const auto &[mesh, proxy] : lod) {
+      hash = HashValue(hash, mesh.get());
+      hash = HashValue(hash, proxy.get());
+    }
+    return hash;
+  }
+
+  void SetDefaultDragSpeed() {
+    Eigen::Vector3f bb_max, bb_min;
+    renderer->GetMergedBoundingBox(bb_max, bb_min);
+
+    rotate_speed = ugu::pi / 180 * 10;
+    wheel_speed = (bb_max - bb_min).maxCoeff() / 20;
+    trans_speed = (bb_max - bb_min).maxCoeff() / g_height;
+  }
+
+  void SetDefaultDragSpeed(RenderableMeshPtr target) {
+    auto stats = target->GetStatsWithTransform(g_scene.model_matrix(target));
+    Eigen::Vector3f bb_max = stats.bb_max;
+    Eigen::Vector3f bb_min = stats.bb_min;
+
+    rotate_speed = ugu::pi / 180 * 10;
+    wheel_speed = (bb_max - bb_min).maxCoeff() / 20;
+    trans_speed = (bb_max - bb_min).maxCoeff() / g_height;
+  }
+
+  void SetProperCameraForTargetMesh(RenderableMeshPtr target) {
+    auto stats = target->GetStatsWithTransform(g_scene.model_matrix(target));
+    float z_trans = (stats.bb_max - stats.bb_min).maxCoeff() * 2.0f;
+    float near_z = static_cast<float>(z_trans * 0.5f / 10);
+    float far_z = static_cast<float>(z_trans * 2.f * 10);
+    renderer->SetNearFar(near_z, far_z);
+
+    Eigen::Vector3f view_dir =
+        camera->c2w().matrix().block(0, 2, 3, 1).cast<float>();
+    Eigen::Vector3f up = camera->c2w().matrix().block(0, 1, 3, 1).cast<float>();
+
+    float max_len = (stats.bb_max - stats.bb_min).maxCoeff();
+    Eigen::Vector3f pos = stats.center + max_len * 2.f * view_dir;
+    Eigen::Matrix4f T;
+    c2w(pos, stats.center, up, &T, true);
+
+    Eigen::Affine3d c2w;
+    c2w.matrix() = T.cast<double>();
+    camera->set_c2w(c2w);
+
+    SetDefaultDragSpeed(target);
+  }
+
+  CastRayResult CastRay() {
+    // Cast ray
+    Eigen::Vector3f dir_c_cv;
+    // Substract offset to align cursor pos on window to corresponding positon
+    // on framebuffer
+    camera->ray_c(static_cast<float>(g_cursor_pos[0] - offset.x()),
+                  static_cast<float>(g_cursor_pos[1] - offset.y()), &dir_c_cv);
+
+    const Eigen::Affine3d ray_offset =
+        Eigen::Affine3d(Eigen::AngleAxisd(pi, Eigen::Vector3d::UnitX()))
+            .inverse();
+    Eigen::Vector3f dir_c_gl =
+        (dir_c_cv.transpose() * ray_offset.rotation().cast<float>());
+    Eigen::Vector3f dir_w_gl =
+        camera->c2w().rotation().cast<float>() * dir_c_gl;
+
+    size_t min_geoid = ~0u;
+    // float min_geo_dist = std::numeric_limits<float>::max();
+    IntersectResult min_intersect;
+    min_intersect.t = std::numeric_limits<float>::max();
+    Eigen::Vector3f min_geo_dist_pos =
+        Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+
+    Ray ray;
+    ray.dir = dir_w_gl;
+    ray.org = camera->c2w().translation().cast<float>();
+    auto results_all = renderer->Intersect(ray);
+
+    for (size_t geoid = 0; geoid < g_scene.size(); geoid++) {
+      if (!IsShown(g_scene.mesh(geoid))) {
+        continue;
+      }
+      // Renderer ids are slot indices, not scene indices
+      const std::vector<IntersectResult> &results =
+          results_all[renderer->GetMeshId(g_scene.mesh(geoid))];
+      if (!results.empty()) {
+        if (results[0].t < min_intersect.t) {
+          min_geoid = geoid;
+          min_intersect = results[0];
+          min_geo_dist_pos = results[0].t * ray.dir + ray.org;
+        }
+      }
+    }
+
+    if (min_geoid != ~0u) {
+      // std::cout << "closest geo: " << min_geoid << std::endl;
+    }
+
+    CastRayResult result;
+    result.min_geoid = min_geoid;
+    result.intersection = min_intersect;
+    // result.min_geo_dist_pos = min_geo_dist_pos;
+
+    return result;
+  }
+
+  auto FindClosestSelectedPoint(const Eigen::Vector2d &cursor_pos) {
+    PROFILE_SCOPE("FindClosestSelectedPoint");
+    bool not_close = true;
+    size_t closest_selected_id = ~0u;
+    double min_dist = std::numeric_limits<double>::max();
+    uint32_t min_geoid = ~0u;
+    // RenderableMeshPtr closest_mesh = nullptr;
+    float near_z, far_z;
+    renderer->GetNearFar(near_z, far_z);
+    Eigen::Matrix4f view_mat = camera->c2w().inverse().matrix().cast<float>();
+    Eigen::Matrix4f prj_mat = camera->ProjectionMatrixOpenGl(near_z, far_z);
+    for (size_t k = 0; k < g_scene.size(); k++) {
+      const auto &mesh = g_scene.mesh(k);
+      if (!IsShown(mesh)) {
+        continue;
+      }
+      const auto &points = g_scene.selected_points(k);
+      for (size_t i = 0; i < points.size(); i++) {
+        const auto &p_wld = points[i];
+        auto [front_id, results_all] = renderer->TestVisibility(p_wld);
+        if (front_id == ~0u) {
+          continue;
+        }
+
+        if (renderer->GetMeshId(mesh) != front_id) {
+          continue;
+        }
+
+        Eigen::Vector4f p_cam =
+            view_mat * Eigen::Vector4f(p_wld.x(), p_wld.y(), p_wld.z(), 1.f);
+        Eigen::Vector4f p_ndc = prj_mat * p_cam;
+        p_ndc /= p_ndc.w();  // NDC [-1:1]
+
+        // [-1:1],[-1:1] -> [0:w], [0:h]
+        Eigen::Vector2d p_gl_frag =
+            Eigen::Vector2d(((p_ndc.x() + 1.f) / 2.f) * camera->width(),
+                            ((p_ndc.y() + 1.f) / 2.f) * camera->height());
+
+        p_gl_frag.y() = camera->height() - p_gl_frag.y();
+
+        // Add offset
+        p_gl_frag += offset.cast<double>();
+
+        double dist = (p_gl_frag - cursor_pos).norm();
+        if (dist < g_drag_point_pix_dist_th && dist < min_dist) {
+          not_close = false;
+          min_dist = dist;
+          closest_selected_id = i;
+          min_geoid = static_cast<uint32_t>(k);
+        }
+      }
+    }
+
+    return std::make_tuple(!not_close, min_geoid, closest_selected_id,
+                           min_dist);
+  }
+};
+
+// Input record/replay. Arguments of GLFW callbacks are stored with the frame
+// they arrived in. Replay feeds them through the ImGui GLFW backend at the
+// same frames, so ImGui and the callbacks below see the recorded stream.
+enum class InputEventType {
+  CURSOR_POS,
+  MOUSE_BUTTON,
+  SCROLL,
+  KEY,
+  CHAR,
+  CURSOR_ENTER,
+  DROP,
+  WINDOW_SIZE
+};
+
+const std::array<const char *, 8> g_input_event_names = {
+    "cursor_pos", "mouse_button", "scroll", "key",
+    "char",       "cursor_enter", "drop",   "window_size"};
+
+struct InputEvent {
+  uint64_t frame = 0;
+  InputEventType type = InputEventType::CURSOR_POS;
+  std::array<double, 4> args = {0.0, 0.0, 0.0, 0.0};
+  std::vector<std::string> paths;
+};
+
+struct InputRecordData {
+  bool recording = false;
+  bool replaying = false;
+  std::string record_path;
+  std::string replay_path;
+  std::string frame_times_path = "frame_times.csv";
+  // Replay fails if the 95th percentile frame time exceeds this. <= 0: off
+  double frame_budget_ms = -1.0;
+  // Frames drawn after the last event so that triggered work finishes
+  uint64_t settle_frames = 60;
+
+  int width = 0;
+  int height = 0;
+  std::vector<InputEvent> events;
+  size_t next_event = 0;
+  std::vector<double> frame_ms;
+};
+InputRecordData g_input_record;
+uint64_t g_frame_count = 0;
+
+void RecordInput(InputEventType type, std::array<double, 4> args,
+                 const std::vector<std::string> &paths = {}) {
+  if (!g_input_record.recording) {
+    return;
+  }
+  InputEvent event;
+  event.frame = g_frame_count;
+  event.type = type;
+  event.args = args;
+  event.paths = paths;
+  g_input_record.events.push_back(event);
+}
+
+bool WriteInputRecord(const std::string &path, const InputRecordData &data) {
+  nlohmann::json j;
+  j["width"] = data.width;
+  j["height"] = data.height;
+  j["events"] = nlohmann::json::array();
+  for (const auto &event : data.events) {
+    nlohmann::json e;
+    e["frame"] = event.frame;
+    e["type"] = g_input_event_names[static_cast<size_t>(event.type)];
+    e["args"] = event.args;
+    if (!event.paths.empty()) {
+      e["paths"] = event.paths;
+    }
+    j["events"].push_back(e);
+  }
+  std::ofstream ofs(path);
+  if (!ofs) {
+    return false;
+  }
+  ofs << j.dump(1);
+  return true;
+}
+
+bool LoadInputRecord(const std::string &path, InputRecordData &data) {
+  std::ifstream ifs(path);
+  if (!ifs) {
+    return false;
+  }
+  try {
+    nlohmann::json j;
+    ifs >> j;
+    data.width = j.at("width");
+    data.height = j.at("height");
+    data.events.clear();
+    for (const auto &e : j.at("events")) {
+      InputEvent event;
+      event.frame = e.at("frame");
+      const std::string type = e.at("type");
+      const auto it = std::find(g_input_event_names.begin(),
+                                g_input_event_names.end(), type);
+      if (it == g_input_event_names.end()) {
+        return false;
+      }
+      event.type = static_cast<InputEventType>(
+          std::distance(g_input_event_names.begin(), it));
+      event.args = e.at("args");
+      if (e.contains("paths")) {
+        event.paths = e.at("paths").get<std::vector<std::string>>();
+      }
+      data.events.push_back(event);
+    }
+  } catch (const std::exception &e) {
+    std::cout << e.what() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static void glfw_error_callback(int error, const char *description) {
+  fprintf(stderr, "Glfw Error %d: %s\n", error, description);
+}
+
+void Clear() {
+  g_scene.Clear();
+  g_corresp_indices.Clear();
+  if (g_textrans_run == AlgorithmStatus::HALTING) {
+    g_textrans_data.corresp.Clear();
+  }
+  if (g_deviation_run == AlgorithmStatus::HALTING) {
+    g_deviation_data.colorized_mesh = nullptr;
+    g_deviation_data.original_colors.clear();
+  }
+  g_face_select_data.revision++;
+  g_face_select_data.stroking = false;
+  g_lod_data.proxies.clear();
+  g_lod_data.requested.clear();
+  g_stream_import_data.sources.clear();
+  {
+    std::lock_guard<std::mutex> lock(lod_mtx);
+    g_lod_data.jobs.clear();
+  }
+  for (auto &view : g_views) {
+    view.ResetGl();
+  }
+}
+
+void key_callback(GLFWwindow *pwin, int key, int scancode, int action,
+                  int mods) {
+  (void)pwin, (void)scancode, (void)mods;
+  RecordInput(InputEventType::KEY, {static_cast<double>(key),
+                                    static_cast<double>(scancode),
+                                    static_cast<double>(action),
+                                    static_cast<double>(mods)});
+  if (key == GLFW_KEY_UP && action == GLFW_PRESS) {
+    // printf("key up\n");
+  }
+  if (key == GLFW_KEY_DOWN && action == GLFW_PRESS) {
+    // printf("key down\n");
+  }
+  if (key == GLFW_KEY_LEFT && action == GLFW_PRESS) {
+    // printf("key left\n");
+  }
+  if (key == GLFW_KEY_RIGHT && action == GLFW_PRESS) {
+    // printf("key right\n");
+  }
+
+  if (key >= GLFW_KEY_A && key <= GLFW_KEY_Z) {
+    if (action == GLFW_PRESS) {
+      // const char *key_name = glfwGetKeyName(key, 0);
+      // printf("key - %s\n", key_name);
+    }
+  }
+  if (key == GLFW_KEY_R) {
+    if (action == GLFW_PRESS) {
+      if (!ImGui::GetIO().WantCaptureKeyboard) {
+        Clear();
+      }
+    }
+  }
+#ifdef DEVENIR_USE_PROFILER
+  if (key == GLFW_KEY_F11 && action == GLFW_PRESS) {
+    g_show_profiler = !g_show_profiler;
+  }
+  if (key == GLFW_KEY_F12 && action == GLFW_PRESS) {
+    const std::string path = "devenir_trace.json";
+    if (g_profiler.WriteChromeTrace(path)) {
+      std::cout << "Wrote " << path << std::endl;
+    } else {
+      std::cout << "Failed to write " << path << std::endl;
+    }
+  }
+#endif
+}
+
+void mouse_button_callback(GLFWwindow *pwin, int button, int action, int mods) {
+  (void)pwin, (void)mods;
+  RecordInput(InputEventType::MOUSE_BUTTON,
+              {static_cast<double>(button), static_cast<double>(action),
+               static_cast<double>(mods), 0.0});
+
+  if (button == GLFW_MOUSE_BUTTON_LEFT) {
+    g_mouse_l_pressed = action == GLFW_PRESS;
+    if (g_face_select_data.tool != FaceSelectTool::NONE) {
+      g_face_select_data.begin_stroke = g_mouse_l_pressed;
+      g_face_select_data.end_stroke = !g_mouse_l_pressed;
+    }
+    if (g_mouse_l_pressed) {
+      g_mouse_l_pressed_pos = g_cursor_pos;
+    } else {
+      g_mouse_l_released_pos = g_cursor_pos;
+
+      if ((g_mouse_l_pressed_pos - g_mouse_l_released_pos).norm() > drag_th) {
+      }
+    }
+  }
+
+  if (button == GLFW_MOUSE_BUTTON_RIGHT) {
+    g_mouse_r_pressed = action == GLFW_PRESS;
+    if (g_mouse_r_pressed) {
+      g_mouse_r_pressed_pos = g_cursor_pos;
+    } else {
+      g_mouse_r_released_pos = g_cursor_pos;
+    }
+
+    if (g_mouse_r_pressed) {
+      bool not_close = false;
+      CastRayResult result;
+      // uint32_t min_geoid;
+      // double min_dist = std::numeric_limits<double>::max();
+      auto &this_view = g_views[g_subwindow_id];
+      result = this_view.CastRay();
+      if (result.min_geoid != ~0u &&
+          this_view.IsShown(g_scene.mesh(result.min_geoid))) {
+        auto [is_close, min_geoid_, id, min_dist_] =
+            this_view.FindClosestSelectedPoint(g_mouse_r_pressed_pos);
+        not_close = !is_close;
+
+        // min_dist = min_dist_;
+        // min_geoid = min_geoid_;
+      }
+
+      if (not_close) {
+        g_scene.AddSelectedPosition(result.min_geoid, result);
+
+        // std::cout << "added " << min_dist << std::endl;
+      } else {
+        // std::cout << "ignored " << min_dist << std::endl;
+      }
+    }
+  }
+
+  if (button == GLFW_MOUSE_BUTTON_MIDDLE) {
+    g_mouse_m_pressed = action == GLFW_PRESS;
+    if (g_mouse_m_pressed) {
+      g_mouse_m_pressed_pos = g_cursor_pos;
+    } else {
+      g_mouse_m_released_pos = g_cursor_pos;
+
+      if ((g_mouse_m_pressed_pos - g_mouse_m_released_pos).norm() > drag_th) {
+      }
+    }
+  }
+}
+
+void mouse_wheel_callback(GLFWwindow *window, double xoffset, double yoffset) {
+  (void)window, (void)xoffset;
+  RecordInput(InputEventType::SCROLL, {xoffset, yoffset, 0.0, 0.0});
+
+  g_mouse_wheel_yoffset = yoffset;
+  g_to_process_wheel = true;
+}
+
+void cursor_pos_callback(GLFWwindow *window, double xoffset, double yoffset) {
+  (void)window;
+  RecordInput(InputEventType::CURSOR_POS, {xoffset, yoffset, 0.0, 0.0});
+  g_prev_cursor_pos = g_cursor_pos;
+
+  g_cursor_pos[0] = xoffset;
+  g_cursor_pos[1] = yoffset;
+  if (g_mouse_l_pressed) {
+    g_to_process_drag_l = true;
+  }
+  if (g_mouse_m_pressed) {
+    g_to_process_drag_m = true;
+  }
+  if (g_mouse_r_pressed) {
+    g_to_process_drag_r = true;
+  }
+
+  g_prev_subwindow_id = g_subwindow_id;
+  for (uint32_t vidx = 0; vidx < static_cast<uint32_t>(g_views.size());
+       vidx++) {
+    if (IsCursorOnView(vidx)) {
+      g_subwindow_id = vidx;
+      break;
+    }
+  }
+}
+
+template <typename T>
+size_t VectorBytes(const std::vector<T> &v) {
+  return v.capacity() * sizeof(T);
+}
+
+template <typename ImageT>
+size_t ImageBytes(const ImageT &image) {
+  return image.empty() ? 0 : image.total() * image.elemSize();
+}
+
+std::string FormatBytes(size_t bytes) {
+  const char *units[] = {"B", "KB", "MB", "GB"};
+  double value = static_cast<double>(bytes);
+  int unit = 0;
+  while (1024.0 <= value && unit < 3) {
+    value /= 1024.0;
+    unit++;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), unit == 0 ? "%.0f %s" : "%.1f %s", value,
+           units[unit]);
+  return buf;
+}
+
+// Bytes held for a mesh. GPU buffers are owned by ugu and estimated from the
+// renderable arrays uploaded to them. Renderer BVHs are not exposed.
+struct MeshMemory {
+  size_t geometry = 0;    // Mesh arrays
+  size_t textures = 0;    // Material images
+  size_t renderable = 0;  // RenderableMesh CPU vertex and index arrays
+  size_t gpu = 0;         // GL buffers and textures (estimate)
+  size_t app = 0;         // Per-mesh state held by this app
+
+  size_t total() const { return geometry + textures + renderable + gpu + app; }
+};
+
+MeshMemory ComputeMeshMemory(size_t gidx) {
+  MeshMemory memory;
+  const auto &mesh = g_scene.mesh(gidx);
+
+  memory.geometry = VectorBytes(mesh->vertices()) +
+                    VectorBytes(mesh->normals()) +
+                    VectorBytes(mesh->vertex_colors()) +
+                    VectorBytes(mesh->uv()) +
+                    VectorBytes(mesh->vertex_indices()) +
+                    VectorBytes(mesh->uv_indices()) +
+                    VectorBytes(mesh->normal_indices()) +
+                    VectorBytes(mesh->material_ids()) +
+                    VectorBytes(mesh->face_normals());
+  for (const auto &mat : mesh->materials()) {
+    memory.textures += ImageBytes(mat.diffuse_tex) + ImageBytes(mat.normal_tex);
+  }
+
+  // Every RendererGl uploads buffers and textures of the meshes it holds.
+  // Views do not share them since RendererGl keeps GL state per instance,
+  // so the estimate is multiplied by the number of renderers holding each
+  // mesh.
+  const auto held_num = [](const RenderableMeshPtr &m) {
+    size_t num = 0;
+    for (const auto &view : g_views) {
+      num += view.HasSlot(m) ? 1 : 0;
+      num += std::count(view.lod_slots.begin(), view.lod_slots.end(), m);
+    }
+    return num;
+  };
+  memory.renderable = VectorBytes(mesh->renderable_vertices) +
+                      VectorBytes(mesh->renderable_indices);
+  memory.gpu = (mesh->renderable_vertices.size() *
+                    sizeof(mesh->renderable_vertices[0]) +
+                mesh->renderable_indices.size() *
+                    sizeof(mesh->renderable_indices[0]) +
+                memory.textures) *
+               held_num(mesh);
+
+  memory.app = VectorBytes(g_scene.selected_positions(gidx)) +
+               VectorBytes(g_scene.selected_points(gidx)) +
+               g_scene.ignore_faces(gidx).bytes() +
+               VectorBytes(g_scene.point_list_cache(gidx).rows);
+  if (g_deviation_data.colorized_mesh == mesh) {
+    memory.app += VectorBytes(g_deviation_data.original_colors);
+  }
+  const auto lod = g_lod_data.proxies.find(mesh);
+  if (lod != g_lod_data.proxies.end()) {
+    for (const auto &level : lod->second.levels) {
+      const size_t renderable = VectorBytes(level->renderable_vertices) +
+                                VectorBytes(level->renderable_indices);
+      memory.app += VectorBytes(level->vertices()) +
+                    VectorBytes(level->normals()) +
+                    VectorBytes(level->uv()) +
+                    VectorBytes(level->vertex_indices()) +
+                    VectorBytes(level->uv_indices()) + renderable;
+      memory.gpu += renderable * held_num(level);
+    }
+  }
+
+  return memory;
+}
+
+// Replaces per-corner renderable vertices of a mesh with independent uv
+// indices by vertices unique on (position, uv, normal) index tuples, so that
+// RenderableMesh shares them through its index buffer. Vertices on uv seams
+// are duplicated: face ids are kept but vertex ids change.
+bool WeldIndependentUv(Mesh &mesh) {
+  if (!mesh.HasIndepentUv()) {
+    return false;
+  }
+
+  const auto &vertices = mesh.vertices();
+  const auto &colors = mesh.vertex_colors();
+  const auto &normals = mesh.normals();
+  const auto &uv = mesh.uv();
+  const auto &faces = mesh.vertex_indices();
+  const auto &uv_faces = mesh.uv_indices();
+  const auto &normal_faces = mesh.normal_indices();
+  const bool has_uv = uv_faces.size() == faces.size();
+  const bool has_normal_faces = normal_faces.size() == faces.size();
+
+  // Tuples of the same position are chained from heads[vid]. Most positions
+  // have one or two tuples.
+  struct Tuple {
+    int32_t uv;
+    int32_t normal;
+    int32_t next;
+  };
+  std::vector<int32_t> heads(vertices.size(), -1);
+  std::vector<int32_t> src_vids;
+  std::vector<Tuple> tuples;
+  src_vids.reserve(vertices.size());
+  tuples.reserve(vertices.size());
+
+  std::vector<Eigen::Vector3i> welded_faces(faces.size());
+  for (size_t i = 0; i < faces.size(); i++) {
+    for (int j = 0; j < 3; j++) {
+      const int32_t vid = faces[i][j];
+      const int32_t uvid = has_uv ? uv_faces[i][j] : -1;
+      const int32_t nid = has_normal_faces ? normal_faces[i][j] : vid;
+      int32_t t = heads[vid];
+      while (0 <= t && (tuples[t].uv != uvid || tuples[t].normal != nid)) {
+        t = tuples[t].next;
+      }
+      if (t < 0) {
+        t = static_cast<int32_t>(tuples.size());
+        tuples.push_back({uvid, nid, heads[vid]});
+        src_vids.push_back(vid);
+        heads[vid] = t;
+      }
+      welded_faces[i][j] = t;
+    }
+  }
+
+  const size_t welded_num = tuples.size();
+  std::vector<Eigen::Vector3f> welded_vertices(welded_num);
+  std::vector<Eigen::Vector3f> welded_colors;
+  std::vector<Eigen::Vector3f> welded_normals;
+  std::vector<Eigen::Vector2f> welded_uv;
+  if (colors.size() == vertices.size()) {
+    welded_colors.resize(welded_num);
+  }
+  if (has_normal_faces ? !normals.empty()
+                       : normals.size() == vertices.size()) {
+    welded_normals.resize(welded_num);
+  }
+  if (has_uv) {
+    welded_uv.resize(welded_num);
+  }
+  for (size_t t = 0; t < welded_num; t++) {
+    const int32_t vid = src_vids[t];
+    welded_vertices[t] = vertices[vid];
+    if (!welded_colors.empty()) {
+      welded_colors[t] = colors[vid];
+    }
+    if (!welded_normals.empty()) {
+      welded_normals[t] = normals[tuples[t].normal];
+    }
+    if (!welded_uv.empty()) {
+      welded_uv[t] = uv[tuples[t].uv];
+    }
+  }
+
+  mesh.set_vertices(welded_vertices);
+  mesh.set_vertex_colors(welded_colors);
+  mesh.set_normals(welded_normals);
+  mesh.set_uv(welded_uv);
+  mesh.set_vertex_indices(welded_faces);
+  mesh.set_normal_indices(welded_normals.empty()
+                              ? std::vector<Eigen::Vector3i>()
+                              : welded_faces);
+  if (has_uv) {
+    mesh.set_uv_indices(welded_faces);
+  }
+
+  return true;
+}
+
+bool g_weld_on_load = false;
+
+bool IsAnyAlgorithmRunning() {
+  for (const auto &run :
+       {g_icp_run, g_nonrigidicp_run, g_textrans_run, g_nonrigidicp_sweep_run,
+        g_deviation_run, g_global_align_run, g_reproject_run}) {
+    if (run != AlgorithmStatus::HALTING) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Renderable arrays are rebuilt from the welded mesh by uploading it again.
+// Other meshes keep their GL state.
+void WeldMesh(size_t gidx) {
+  const auto &mesh = g_scene.mesh(gidx);
+  if (!WeldIndependentUv(*mesh)) {
+    return;
+  }
+  g_scene.geometry_revision(gidx)++;
+  g_scene.update_bvh(gidx) = true;
+  if (g_deviation_data.colorized_mesh == mesh) {
+    g_deviation_data.colorized_mesh = nullptr;
+    g_deviation_data.original_colors.clear();
+  }
+  // BVHs are rebuilt by DrawViews() with update_bvh
+  g_scene.UploadChangedGeometry(gidx);
+  g_render_revision++;
+}
+
+// Corners of an OBJ face line as zero-based (v, vt) indices with vt = -1 if
+// absent. Relative indices are resolved with the counts read so far.
+bool ParseObjFace(const char *s, size_t v_num, size_t vt_num,
+                  std::vector<Eigen::Vector2i> &corners) {
+  corners.clear();
+  auto resolve = [](long index, size_t num) {
+    return static_cast<int>(index < 0 ? static_cast<long>(num) + index
+                                      : index - 1);
+  };
+  const char *p = s + 1;
+  while (true) {
+    while (*p == ' ' || *p == '\t') {
+      p++;
+    }
+    if (*p == '\0' || *p == '\r' || *p == '#') {
+      break;
+    }
+    char *end = nullptr;
+    const long v = std::strtol(p, &end, 10);
+    if (end == p) {
+      return false;
+    }
+    p = end;
+    Eigen::Vector2i corner(resolve(v, v_num), -1);
+    if (*p == '/') {
+      p++;
+      if (*p != '/') {
+        const long vt = std::strtol(p, &end, 10);
+        if (end != p) {
+          corner[1] = resolve(vt, vt_num);
+        }
+        p = end;
+      }
+      if (*p == '/') {
+        p++;
+        std::strtol(p, &end, 10);  // Normals are recomputed
+        p = end;
+      }
+    }
+    if (corner[0] < 0 || static_cast<int>(v_num) <= corner[0] ||
+        static_cast<int>(vt_num) <= corner[1]) {
+      return false;
+    }
+    corners.push_back(corner);
+  }
+  return 3 <= corners.size();
+}
+
+// Diffuse textures of an .mtl in the order of material names
+std::vector<ObjMaterial> LoadMtlDiffuse(
+    const std::string &path, std::unordered_map<std::string, int> &ids) {
+  std::vector<ObjMaterial> materials;
+  std::ifstream ifs(path);
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::istringstream iss(line);
+    std::string tag, value;
+    iss >> tag;
+    std::getline(iss >> std::ws, value);
+    if (!value.empty() && value.back() == '\r') {
+      value.pop_back();
+    }
+    if (tag == "newmtl") {
+      ids[value] = static_cast<int>(materials.size());
+      materials.emplace_back();
+      materials.back().name = value;
+    } else if (tag == "map_Kd" && !materials.empty()) {
+      auto &mat = materials.back();
+      mat.diffuse_texname = value;
+      mat.diffuse_texpath = ExtractDir(path) + "/" + value;
+      mat.diffuse_tex = imread<Image3b>(mat.diffuse_texpath);
+    }
+  }
+  return materials;
+}
+
+// Cell size giving about target_cluster_num occupied cells. Occupancy of a
+// surface scales with cell_size^-2, which drives a few secant steps on a
+// vertex subsample.
+double EstimateCellSize(const std::vector<Eigen::Vector3f> &vertices,
+                        const Eigen::Vector3d &origin, double extent,
+                        size_t target_cluster_num) {
+  constexpr size_t kMaxSampleNum = 8000000;
+  const size_t stride = std::max<size_t>(1, vertices.size() / kMaxSampleNum);
+  const size_t sample_num = vertices.size() / stride;
+  const double min_cell_size =
+      extent / ((uint64_t(1) << (kGridKeyBits - 1)) - 1);
+  double cell_size =
+      std::max(min_cell_size,
+               extent / std::sqrt(static_cast<double>(target_cluster_num)));
+  std::vector<uint64_t> keys(sample_num);
+  for (int iter = 0; iter < 4; iter++) {
+    parallel_for(size_t(0), sample_num, [&](size_t i) {
+      keys[i] = GridKey(vertices[i * stride], origin, cell_size);
+    });
+    std::sort(keys.begin(), keys.end());
+    const size_t occupied = static_cast<size_t>(
+        std::unique(keys.begin(), keys.end()) - keys.begin());
+    cell_size = std::max(
+        min_cell_size,
+        cell_size * std::sqrt(static_cast<double>(occupied) /
+                              static_cast<double>(target_cluster_num)));
+  }
+  return cell_size;
+}
+
+// Simplifies an OBJ while reading it in one pass, without holding its
+// faces. Memory is 16 bytes per input vertex and 8 per input uv plus the
+// output. The grid is fixed at the first face line, as scanners write all
+// vertices first. Loading fails if a later vertex is too far away for the
+// grid, e.g. another object of a multi-object OBJ. Triangles are fed to
+// per-cluster quadrics and placed as in DecimateQuadricClustering().
+RenderableMeshPtr LoadObjDecimated(const std::string &path,
+                                   size_t target_face_num,
+                                   StreamSource &source) {
+  PROFILE_SCOPE("LoadObjDecimated");
+  Timer timer;
+  timer.Start();
+
+  std::ifstream ifs(path);
+  if (!ifs) {
+    return nullptr;
+  }
+
+  struct Cluster {
+    Eigen::Matrix3d A = Eigen::Matrix3d::Zero();
+    Eigen::Vector3d b = Eigen::Vector3d::Zero();
+    Eigen::Vector3d pos_sum = Eigen::Vector3d::Zero();
+    Eigen::Vector2d uv_sum = Eigen::Vector2d::Zero();
+    Eigen::Vector3d color_sum = Eigen::Vector3d::Zero();
+    uint32_t count = 0;
+    uint32_t uv_count = 0;
+  };
+  std::vector<Eigen::Vector3f> vertices, colors;
+  std::vector<Eigen::Vector2f> uv;
+  std::vector<uint32_t> vertex_clusters;
+  std::unordered_map<uint64_t, uint32_t> key_to_cluster;
+  std::vector<Cluster> clusters;
+  std::unordered_set<FaceKey, FaceKeyHash> face_keys;
+  std::vector<Eigen::Vector3i> out_faces;
+  std::vector<int> out_material_ids;
+  std::vector<ObjMaterial> materials;
+  std::unordered_map<std::string, int> material_name_ids;
+  int material_id = 0;
+  bool grid_fixed = false;
+  size_t face_num = 0;
+  size_t out_of_grid_num = 0;
+
+  auto cluster_of = [&](const Eigen::Vector3f &p) {
+    const uint64_t key = GridKey(p, source.origin, source.cell_size);
+    const auto [it, inserted] = key_to_cluster.emplace(
+        key, static_cast<uint32_t>(clusters.size()));
+    if (inserted) {
+      clusters.emplace_back();
+    }
+    return it->second;
+  };
+
+  auto fix_grid = [&]() {
+    Eigen::Vector3f bb_min = vertices[0];
+    Eigen::Vector3f bb_max = vertices[0];
+    for (const auto &v : vertices) {
+      bb_min = bb_min.cwiseMin(v);
+      bb_max = bb_max.cwiseMax(v);
+    }
+    source.origin = bb_min.cast<double>();
+    source.cell_size =
+        EstimateCellSize(vertices, source.origin,
+                         std::max((bb_max - bb_min).maxCoeff(), 1e-6f),
+                         std::max<size_t>(1, target_face_num / 2));
+    vertex_clusters.resize(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) {
+      vertex_clusters[i] = cluster_of(vertices[i]);
+    }
+    grid_fixed = true;
+  };
+
+  std::string line;
+  std::vector<Eigen::Vector2i> corners;
+  while (std::getline(ifs, line)) {
+    const char *s = line.c_str();
+    if (s[0] == 'v' && s[1] == ' ') {
+      char *end = nullptr;
+      Eigen::Vector3f v, c;
+      v[0] = std::strtof(s + 2, &end);
+      v[1] = std::strtof(end, &end);
+      v[2] = std::strtof(end, &end);
+      vertices.push_back(v);
+      const char *col = end;
+      c[0] = std::strtof(col, &end);
+      if (end != col) {
+        c[1] = std::strtof(end, &end);
+        c[2] = std::strtof(end, &end);
+        colors.resize(vertices.size() - 1, Eigen::Vector3f::Zero());
+        colors.push_back(c * 255.f);
+      }
+      if (grid_fixed) {
+        // Would be merged into a border cell with unrelated vertices
+        if (!IsInGrid(v, source.origin, source.cell_size)) {
+          out_of_grid_num++;
+        }
+        vertex_clusters.push_back(cluster_of(v));
+      }
+    } else if (s[0] == 'v' && s[1] == 't' && s[2] == ' ') {
+      char *end = nullptr;
+      Eigen::Vector2f t;
+      t[0] = std::strtof(s + 3, &end);
+      t[1] = std::strtof(end, &end);
+      uv.push_back(t);
+    } else if (s[0] == 'f' && s[1] == ' ') {
+      if (!grid_fixed) {
+        if (vertices.empty()) {
+          return nullptr;
+        }
+        fix_grid();
+      }
+      if (!ParseObjFace(s, vertices.size(), uv.size(), corners)) {
+        LOGE("Invalid face: %s\n", line.c_str());
+        return nullptr;
+      }
+      // Fan triangulation, same as LoadObj()
+      for (size_t k = 1; k + 1 < corners.size(); k++) {
+        const std::array<Eigen::Vector2i, 3> tri = {corners[0], corners[k],
+                                                    corners[k + 1]};
+        face_num++;
+        const Eigen::Vector4d q =
+            ScaledPlane(vertices[tri[0][0]], vertices[tri[1][0]],
+                        vertices[tri[2][0]]);
+        Eigen::Vector3i f;
+        for (int j = 0; j < 3; j++) {
+          const int vid = tri[j][0];
+          f[j] = static_cast<int>(vertex_clusters[vid]);
+          auto &cluster = clusters[f[j]];
+          cluster.A += q.head<3>() * q.head<3>().transpose();
+          cluster.b += q[3] * q.head<3>();
+          cluster.pos_sum += vertices[vid].cast<double>();
+          cluster.count++;
+          if (0 <= tri[j][1]) {
+            cluster.uv_sum += uv[tri[j][1]].cast<double>();
+            cluster.uv_count++;
+          }
+          if (static_cast<size_t>(vid) < colors.size()) {
+            cluster.color_sum += colors[vid].cast<double>();
+          }
+        }
+        if (f[0] == f[1] || f[1] == f[2] || f[2] == f[0]) {
+          continue;
+        }
+        // Smallest index first, keeping the orientation
+        while (f[1] < f[0] || f[2] < f[0]) {
+          f = Eigen::Vector3i(f[1], f[2], f[0]);
+        }
+        if (!face_keys.insert(MakeFaceKey(f)).second) {
+          continue;
+        }
+        out_faces.push_back(f);
+        out_material_ids.push_back(material_id);
+      }
+    } else if (line.rfind("mtllib ", 0) == 0) {
+      std::string name = line.substr(7);
+      if (!name.empty() && name.back() == '\r') {
+        name.pop_back();
+      }
+      materials =
+          LoadMtlDiffuse(ExtractDir(path) + "/" + name, material_name_ids);
+    } else if (line.rfind("usemtl ", 0) == 0) {
+      std::string name = line.substr(7);
+      if (!name.empty() && name.back() == '\r') {
+        name.pop_back();
+      }
+      const auto it = material_name_ids.find(name);
+      material_id = it == material_name_ids.end() ? 0 : it->second;
+    }
+  }
+  if (out_of_grid_num != 0) {
+    LOGE("%d vertices after the first face are outside the decimation grid "
+         "of %s. Load it without stream import.\n",
+         static_cast<int>(out_of_grid_num), path.c_str());
+    return nullptr;
+  }
+  if (out_faces.empty()) {
+    return nullptr;
+  }
+  source.path = path;
+  source.face_num = face_num;
+
+  const size_t cluster_num = clusters.size();
+  const bool has_uv = !uv.empty();
+  const bool has_colors = !colors.empty();
+  std::vector<Eigen::Vector3f> out_vertices(cluster_num);
+  std::vector<Eigen::Vector2f> out_uv(has_uv ? cluster_num : 0);
+  std::vector<Eigen::Vector3f> out_colors(has_colors ? cluster_num : 0);
+  parallel_for(size_t(0), cluster_num, [&](size_t c) {
+    const auto &cluster = clusters[c];
+    if (cluster.count == 0) {
+      return;
+    }
+    const Eigen::Vector3d mean = cluster.pos_sum / cluster.count;
+    out_vertices[c] =
+        QuadricMinimizer(cluster.A, cluster.b, mean).cast<float>();
+    if (has_uv && 0 < cluster.uv_count) {
+      out_uv[c] = (cluster.uv_sum / cluster.uv_count).cast<float>();
+    }
+    if (has_colors) {
+      out_colors[c] = (cluster.color_sum / cluster.count).cast<float>();
+    }
+  });
+
+  auto mesh = RenderableMesh::Create();
+  mesh->set_vertices(out_vertices);
+  mesh->set_vertex_indices(out_faces);
+  if (has_uv) {
+    mesh->set_uv(out_uv);
+    mesh->set_uv_indices(out_faces);
+  }
+  if (has_colors) {
+    mesh->set_vertex_colors(out_colors);
+  }
+  if (materials.empty()) {
+    mesh->set_default_material();
+    std::fill(out_material_ids.begin(), out_material_ids.end(), 0);
+  } else {
+    mesh->set_materials(materials);
+  }
+  mesh->set_material_ids(out_material_ids);
+  mesh->CalcNormal();
+  mesh->CalcStats();
+
+  timer.End();
+  std::cout << "Decimated " << face_num << " faces to " << out_faces.size()
+            << " in " << timer.elapsed_msec() << " ms" << std::endl;
+  return mesh;
+}
+
+// Maps points in local coordinates of a decimated mesh to the closest
+// triangles of its original OBJ, streamed again. Only triangles with a
+// vertex in the grid cells around a point are tested. Points without such
+// a triangle get fid ~0u. progress receives the ratio of streamed triangles.
+std::vector<PointOnFace> ReprojectToStreamSource(
+    const StreamSource &source, const std::vector<Eigen::Vector3f> &points,
+    const std::function<void(double)> &progress = nullptr) {
+  PROFILE_SCOPE("ReprojectToStreamSource");
+  std::unordered_map<uint64_t, std::vector<uint32_t>> cell_points;
+  for (size_t i = 0; i < points.size(); i++) {
+    for (int z = -1; z <= 1; z++) {
+      for (int y = -1; y <= 1; y++) {
+        for (int x = -1; x <= 1; x++) {
+          const Eigen::Vector3f p =
+              points[i] + Eigen::Vector3f(x, y, z) *
+                              static_cast<float>(source.cell_size);
+          auto &ids = cell_points[GridKey(p, source.origin, source.cell_size)];
+          if (ids.empty() || ids.back() != i) {
+            ids.push_back(static_cast<uint32_t>(i));
+          }
+        }
+      }
+    }
+  }
+
+  std::vector<PointOnFace> pofs(points.size());
+  std::vector<float> min_sq_dists(points.size(),
+                                  std::numeric_limits<float>::max());
+  for (auto &pof : pofs) {
+    pof.fid = ~0u;
+  }
+
+  std::ifstream ifs(source.path);
+  std::vector<Eigen::Vector3f> vertices;
+  size_t vt_num = 0;
+  uint32_t fid = 0;
+  std::string line;
+  std::vector<Eigen::Vector2i> corners;
+  std::vector<uint32_t> candidates;
+  while (std::getline(ifs, line)) {
+    const char *s = line.c_str();
+    if (s[0] == 'v' && s[1] == ' ') {
+      char *end = nullptr;
+      Eigen::Vector3f v;
+      v[0] = std::strtof(s + 2, &end);
+      v[1] = std::strtof(end, &end);
+      v[2] = std::strtof(end, &end);
+      vertices.push_back(v);
+    } else if (s[0] == 'v' && s[1] == 't' && s[2] == ' ') {
+      vt_num++;
+    } else if (s[0] == 'f' && s[1] == ' ') {
+      if (!ParseObjFace(s, vertices.size(), vt_num, corners)) {
+        return {};
+      }
+      for (size_t k = 1; k + 1 < corners.size(); k++, fid++) {
+        if (progress && (fid & 0xfffff) == 0 && 0 < source.face_num) {
+          progress(static_cast<double>(fid) / source.face_num);
+        }
+        const Eigen::Vector3f &a = vertices[corners[0][0]];
+        const Eigen::Vector3f &b = vertices[corners[k][0]];
+        const Eigen::Vector3f &c = vertices[corners[k + 1][0]];
+        candidates.clear();
+        for (const auto *v : {&a, &b, &c}) {
+          const auto it = cell_points.find(
+              GridKey(*v, source.origin, source.cell_size));
+          if (it != cell_points.end()) {
+            candidates.insert(candidates.end(), it->second.begin(),
+                              it->second.end());
+          }
+        }
+        for (const auto &i : candidates) {
+          const Eigen::Vector3f q = ClosestPointOnTriangle(points[i], a, b, c);
+          const float sq_dist = (q - points[i]).squaredNorm();
+          if (min_sq_dists[i] <= sq_dist) {
+            continue;
+          }
+          min_sq_dists[i] = sq_dist;
+          const Eigen::Vector3f bary = Barycentric(q, a, b, c);
+          pofs[i].fid = fid;
+          pofs[i].u = bary[1];
+          pofs[i].v = bary[2];
+          pofs[i].pos = q;
+        }
+      }
+    }
+  }
+  return pofs;
+}
+
+void ReprojectProcess() {
+  std::lock_guard<std::mutex> lock(reproject_mtx);
+  if (g_reproject_run == AlgorithmStatus::STARTED) {
+    g_reproject_run = AlgorithmStatus::RUNNING;
+    PROFILE_SCOPE("ReprojectProcess");
+
+    Timer timer;
+    timer.Start();
+
+    auto &data = g_reproject_data;
+    const std::string label = "Export on original " + data.source.path;
+    auto pofs = ReprojectToStreamSource(
+        data.source, data.local_points, [&](double ratio) {
+          g_callback_message =
+              label + " : " + std::to_string(static_cast<int>(ratio * 100)) +
+              " %";
+          std::cout << g_callback_message << std::endl;
+        });
+
+    const int fill_digits_export = CalcFillDigits(data.local_points.size());
+    bool succeeded = pofs.size() == data.local_points.size();
+    for (size_t p_idx = 0; p_idx < pofs.size(); p_idx++) {
+      succeeded &= pofs[p_idx].fid != ~0u;
+      pofs[p_idx].name = zfill(p_idx, fill_digits_export);
+      pofs[p_idx].pos = data.trans * pofs[p_idx].pos;
+    }
+    timer.End();
+    if (succeeded) {
+      WritePoints(data.export_path, pofs, data.pof_type);
+      g_callback_message = "Exported " + std::to_string(pofs.size()) +
+                           " points on " + data.source.path + " in " +
+                           std::to_string(timer.elapsed_msec() / 1000) +
+                           " sec.";
+    } else {
+      g_callback_message =
+          "Failed to reproject points to " + data.source.path;
+    }
+    std::cout << g_callback_message << std::endl;
+
+    g_callback_succeeded = succeeded;
+    g_callback_finished = true;
+    g_reproject_run = AlgorithmStatus::HALTING;
+  }
+}
+
+// Meshes without textures are shown with a distinct flat color each
+void SetDefaultTexture(const RenderableMeshPtr &mesh) {
+  auto mat = mesh->materials();
+  if (mat[0].diffuse_tex.empty()) {
+    mat[0].diffuse_tex = Image3b(1, 1);
+    auto &col = mat[0].diffuse_tex.at<Vec3b>(0, 0);
+
+    static uint32_t count = 0;
+    static Vec3b color_table[256] = {
+        {125, 125, 200}, {245, 156, 62}, {118, 184, 0}, {32, 33, 36}};
+    if (count == 0) {
+      size_t seed = 0;
+      std::uniform_int_distribution<int> dist(0, 255);
+      std::default_random_engine engine(static_cast<unsigned int>(seed));
+      for (int i = 4; i < 256; i++) {
+        color_table[i][0] = static_cast<uint8_t>(dist(engine));
+        color_table[i][1] = static_cast<uint8_t>(dist(engine));
+        color_table[i][2] = static_cast<uint8_t>(dist(engine));
+      }
+    }
+    col = color_table[count % 256];
+    count++;
+
+    mat[0].diffuse_texname = "tmp.png";
+    mat[0].diffuse_texpath = "tmp.png";
+    mesh->set_materials(mat);
+  }
+}
+
+void LoadMesh(const std::string &path) {
+  PROFILE_SCOPE("LoadMesh");
+  // Algorithms hold per-mesh state of the scene while running
+  if (IsAnyAlgorithmRunning()) {
+    LOGE("Cannot load %s while algorithms are running\n", path.c_str());
+    return;
+  }
+
+  auto ext = ugu::ExtractExt(path);
+  auto mesh = ugu::RenderableMesh::Create();
+  if ((ext == "obj" || ext == "OBJ") && g_stream_import_data.enable) {
+    StreamSource source;
+    mesh = LoadObjDecimated(
+        path, static_cast<size_t>(g_stream_import_data.target_face_num),
+        source);
+    if (mesh == nullptr) {
+      LOGE("Failed to load %s\n", path.c_str());
+      return;
+    }
+    SetDefaultTexture(mesh);
+    g_stream_import_data.sources[mesh] = source;
+    // No path so that sessions embed the decimated mesh
+    g_scene.Add(mesh, ugu::ExtractFilename(path, true) + " (decimated)", "");
+  } else if (ext == "obj" || ext == "OBJ") {
+    std::string obj_path = path;
+    std::string obj_dir = ExtractDir(obj_path);
+    if (!mesh->LoadObj(obj_path, obj_dir)) {
+      return;
+    }
+    if (g_weld_on_load) {
+      WeldIndependentUv(*mesh);
+    }
+
+    SetDefaultTexture(mesh);
+
+    g_scene.Add(mesh, ugu::ExtractFilename(obj_path, true), obj_path);
+  } else {
+    LOGE("Supported extensiton: .obj\n");
+    return;
+  }
+
+  const size_t gidx = g_scene.size() - 1;
+  for (auto &view : g_views) {
+    if (view.AddMeshesGl(gidx) != 0) {
+      std::cout << "All slots of view " << view.id
+                << " hold shown meshes. Hide one to show " << g_scene.name(gidx)
+                << std::endl;
+    }
+
+    // Reset camera pos
+
+    Eigen::Vector3f bb_max, bb_min;
+    view.renderer->GetMergedBoundingBox(bb_max, bb_min);
+    float z_trans = (bb_max - bb_min).maxCoeff() * 2.0f;
+    view.renderer->SetNearFar(static_cast<float>(z_trans * 0.5f / 10),
+                              static_cast<float>(z_trans * 2.f * 10));
+
+    Eigen::Affine3d c2w = Eigen::Affine3d::Identity();
+    c2w.translation() = Eigen::Vector3d(0, 0, z_trans);
+    view.camera->set_c2w(c2w);
+
+    view.SetDefaultDragSpeed();
+  }
+}
+
+// Read-only mapping of a whole file
+class MappedFile {
+ public:
+  MappedFile() = default;
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile() { Close(); }
+
+  bool Open(const std::string &path) {
+    Close();
+#ifdef _WIN32
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER size;
+    if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &size) ||
+        size.QuadPart == 0) {
+      Close();
+      return false;
+    }
+    mapping_ =
+        CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_ == nullptr) {
+      Close();
+      return false;
+    }
+    data_ = static_cast<const uint8_t *>(
+        MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    size_ = static_cast<size_t>(size.QuadPart);
+#else
+    fd_ = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd_ < 0 || fstat(fd_, &st) != 0 || st.st_size == 0) {
+      Close();
+      return false;
+    }
+    void *data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                      MAP_PRIVATE, fd_, 0);
+    data_ = data == MAP_FAILED ? nullptr : static_cast<const uint8_t *>(data);
+    size_ = static_cast<size_t>(st.st_size);
+#endif
+    if (data_ == nullptr) {
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  void Close() {
+#ifdef _WIN32
+    if (data_ != nullptr) {
+      UnmapViewOfFile(data_);
+    }
+    if (mapping_ != nullptr) {
+      CloseHandle(mapping_);
+    }
+    if (file_ != INVALID_HANDLE_VALUE) {
+      CloseHandle(file_);
+    }
+    mapping_ = nullptr;
+    file_ = INVALID_HANDLE_VALUE;
+#else
+    if (data_ != nullptr) {
+      munmap(const_cast<uint8_t *>(data_), size_);
+    }
+    if (0 <= fd_) {
+      close(fd_);
+    }
+    fd_ = -1;
+#endif
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = nullptr;
+#else
+  int fd_ = -1;
+#endif
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+};
 
-    id = vidx;
+// Session file layout:
+//   SessionHeader | JSON (json_size bytes) | padding | binary blocks
+// The JSON holds everything small and refers to large arrays as
+// {"offset", "size"} blocks relative to the first block. Blocks are 8-byte
+// aligned.
+struct SessionHeader {
+  char magic[8] = {'D', 'E', 'V', 'N', 'R', 'S', 'E', 'S'};
+  uint32_t version = 1;
+  uint32_t reserved = 0;
+  uint64_t json_size = 0;
+};
 
-    offset.x() = vidx * w;
-    offset.y() = 0;
+constexpr uint64_t kSessionBlockAlign = 8;
 
-    camera = std::make_shared<PinholeCamera>(w, h, 45.f);
-    renderer = std::make_shared<RendererGl>();
-    renderer->SetSize(static_cast<uint32_t>(w), static_cast<uint32_t>(h));
-    renderer->SetCamera(camera);
-    renderer->Init();
+uint64_t AlignSessionBlock(uint64_t size) {
+  return (size + kSessionBlockAlign - 1) / kSessionBlockAlign *
+         kSessionBlockAlign;
+}
 
-    renderer->SetBackgroundColor(default_clear_color);
-    renderer->SetWireColor(default_wire_color);
+class SessionBlockWriter {
+ public:
+  // data must stay alive until Write()
+  nlohmann::json Add(const void *data, size_t size) {
+    nlohmann::json block = {{"offset", size_}, {"size", size}};
+    chunks_.push_back({static_cast<const uint8_t *>(data), size});
+    size_ = AlignSessionBlock(size_ + size);
+    return block;
+  }
 
-    renderer->SetShowWire(false);
-    renderer->SetFlatNormal(true);
+  template <typename T>
+  nlohmann::json Add(const std::vector<T> &v) {
+    return Add(v.data(), v.size() * sizeof(T));
   }
 
-  void Reset() {
-    std::lock_guard<std::mutex> lock(views_mtx);
+  // For arrays converted at save time
+  nlohmann::json AddOwned(std::vector<uint8_t> &&bytes) {
+    owned_.push_back(std::move(bytes));
+    return Add(owned_.back());
+  }
 
-    auto [w, h] = GetWidthHeightForView();
+  bool Write(std::ofstream &ofs) const {
+    const char zeros[kSessionBlockAlign] = {};
+    for (const auto &[data, size] : chunks_) {
+      ofs.write(reinterpret_cast<const char *>(data), size);
+      ofs.write(zeros, AlignSessionBlock(size) - size);
+    }
+    return ofs.good();
+  }
 
-    camera->set_size(w, h);
-    camera->set_fov_y(45.0f);
-    camera->set_principal_point({w / 2.f, h / 2.f});
-    camera->set_c2w(Eigen::Affine3d::Identity());
+ private:
+  std::vector<std::pair<const uint8_t *, size_t>> chunks_;
+  std::deque<std::vector<uint8_t>> owned_;
+  uint64_t size_ = 0;
+};
 
-    renderer->SetSize(w, h);
+template <typename T>
+bool ReadSessionBlock(const nlohmann::json &block, const uint8_t *blocks,
+                      size_t blocks_size, std::vector<T> &out) {
+  const uint64_t offset = block.at("offset");
+  const uint64_t size = block.at("size");
+  if (blocks_size < offset || blocks_size - offset < size ||
+      size % sizeof(T) != 0) {
+    return false;
+  }
+  out.resize(size / sizeof(T));
+  if (size != 0) {
+    std::memcpy(static_cast<void *>(out.data()), blocks + offset, size);
+  }
+  return true;
+}
 
-    offset.x() = id * w;
-    offset.y() = 0;
+// Landmark on a face, as stored in session files
+struct SessionPoint {
+  uint32_t fid;
+  float u;
+  float v;
+};
 
-    ResetGl();
+template <typename T>
+void ReadParam(const nlohmann::json &j, const char *key, T &value) {
+  if (j.contains(key)) {
+    value = j.at(key).get<T>();
   }
+}
 
-  void ResetGl() {
-    std::unordered_map<RenderableMeshPtr, bool> visibility;
-    for (const auto &mesh : g_meshes) {
-      visibility[mesh] = renderer->GetVisibility(mesh);
+int g_src_id = -1;
+int g_dst_id = -1;
+
+nlohmann::json AlgorithmParamsToJson() {
+  nlohmann::json j;
+  j["src_id"] = g_src_id;
+  j["dst_id"] = g_dst_id;
+
+  const auto &icp = g_icp_data;
+  j["icp"] = {
+      {"iter_max", icp.terminate_criteria.iter_max},
+      {"loss_min", icp.terminate_criteria.loss_min},
+      {"loss_eps", icp.terminate_criteria.loss_eps},
+      {"test_nearest", icp.corresp_criteria.test_nearest},
+      {"normal_th", icp.corresp_criteria.normal_th},
+      {"dist_th", icp.corresp_criteria.dist_th},
+      {"with_scale", icp.with_scale},
+      {"corresp_type", static_cast<int>(icp.corresp_type)},
+      {"loss_type", static_cast<int>(icp.loss_type)},
+      {"sampling", static_cast<int>(icp.sampling)},
+      {"sample_num", icp.sample_num},
+      {"coarse_to_fine", icp.coarse_to_fine},
+      {"level_num", icp.level_num},
+      {"specialized", icp.specialized},
+      {"benchmark_iter", icp.benchmark_iter}};
+
+  const auto &align = g_global_align_data;
+  j["global_align"] = {{"voxel_size", align.voxel_size},
+                       {"feature_radius", align.feature_radius},
+                       {"inlier_dist", align.inlier_dist},
+                       {"ransac_iter", align.ransac_iter},
+                       {"with_scale", align.with_scale},
+                       {"run_icp", align.run_icp}};
+
+  const auto &nicp = g_nonrigidicp_data;
+  j["nonrigid_icp"] = {
+      {"engine", static_cast<int>(nicp.engine)},
+      {"graph_node_num", nicp.graph_node_num},
+      {"graph_sample_num", nicp.graph_sample_num},
+      {"check_self_itersection", nicp.check_self_itersection},
+      {"angle_rad_th", nicp.angle_rad_th},
+      {"dist_th", nicp.dist_th},
+      {"nn_num", nicp.nn_num},
+      {"dst_check_geometry_border", nicp.dst_check_geometry_border},
+      {"src_check_geometry_border", nicp.src_check_geometry_border},
+      {"max_alpha", nicp.max_alpha},
+      {"min_alpha", nicp.min_alpha},
+      {"beta", nicp.beta},
+      {"gamma", nicp.gamma},
+      {"step", nicp.step},
+      {"max_internal_iter", nicp.max_internal_iter},
+      {"min_frobenius_norm_diff", nicp.min_frobenius_norm_diff},
+      {"sequence_mode", nicp.sequence_mode},
+      {"sequence_paths", nicp.sequence_paths},
+      {"sequence_output_dir", nicp.sequence_output_dir},
+      {"sequence_max_alpha", nicp.sequence_max_alpha},
+      {"sequence_step", nicp.sequence_step}};
+
+  const auto &sweep = g_nonrigidicp_sweep_data;
+  j["nonrigid_icp_sweep"] = {
+      {"max_alphas", sweep.max_alphas}, {"min_alphas", sweep.min_alphas},
+      {"betas", sweep.betas},           {"gammas", sweep.gammas},
+      {"steps", sweep.steps},           {"nn_nums", sweep.nn_nums},
+      {"angle_rad_ths", sweep.angle_rad_ths},
+      {"dist_ths", sweep.dist_ths},     {"num_threads", sweep.num_threads}};
+
+  const auto &textrans = g_textrans_data;
+  j["textrans"] = {
+      {"dst_width", textrans.dst_size.x()},
+      {"dst_height", textrans.dst_size.y()},
+      {"nn_num", textrans.nn_num},
+      {"tiled", textrans.tiled},
+      {"tile_size", textrans.tile_size},
+      {"preview_size", textrans.preview_size},
+      {"inpaint_method", static_cast<int>(textrans.inpaint_method)},
+      {"inpaint_margin", textrans.inpaint_margin},
+      {"inpaint_seam_aware", textrans.inpaint_seam_aware},
+      {"vertex_mode", textrans.vertex_mode},
+      {"vertex_colors", textrans.vertex_colors},
+      {"vertex_normals", textrans.vertex_normals},
+      {"vertex_channels_path", textrans.vertex_channels_path},
+      {"extra_maps", textrans.extra_maps}};
+
+  const auto &deviation = g_deviation_data;
+  j["deviation"] = {{"bidirectional", deviation.bidirectional},
+                    {"colorize", deviation.colorize},
+                    {"color_max", deviation.color_max},
+                    {"track_nonrigidicp", deviation.track_nonrigidicp},
+                    {"export_path", deviation.export_path}};
+  return j;
+}
+
+// Reads keys of one settings section. Values outside the limits of the UI are
+// clamped, or rejected if strict.
+class ParamReader {
+ public:
+  ParamReader(const nlohmann::json &j, bool strict, std::string &error)
+      : j_(j), strict_(strict), error_(error) {}
+
+  template <typename T>
+  void Read(const char *key, T &value) {
+    if (j_.contains(key)) {
+      value = j_.at(key).get<T>();
     }
+  }
 
-    renderer->ClearGlState();
-    for (const auto &mesh : g_meshes) {
-      renderer->SetMesh(mesh, g_model_matrices.at(mesh), g_update_bvh.at(mesh));
-      renderer->AddSelectedPositions(mesh,
-                                     ExtractPos(g_selected_positions.at(mesh)));
-      renderer->SetVisibility(mesh, visibility[mesh]);
+  template <typename T>
+  void Read(const char *key, T &value, T min_value, T max_value) {
+    if (!j_.contains(key)) {
+      return;
     }
+    value = j_.at(key).get<T>();
+    if (value < min_value || max_value < value) {
+      if (strict_) {
+        error_ = std::string(key) + " must be in [" +
+                 std::to_string(min_value) + ", " +
+                 std::to_string(max_value) + "]";
+      }
+      value = std::clamp(value, min_value, max_value);
+    }
+  }
 
-    renderer->Init();
+  template <typename Enum>
+  void ReadEnum(const char *key, Enum &value, Enum last) {
+    int v = static_cast<int>(value);
+    Read(key, v, 0, static_cast<int>(last));
+    value = static_cast<Enum>(v);
   }
 
-  void SetDefaultDragSpeed() {
-    Eigen::Vector3f bb_max, bb_min;
-    renderer->GetMergedBoundingBox(bb_max, bb_min);
+  bool ok() const { return error_.empty(); }
 
-    rotate_speed = ugu::pi / 180 * 10;
-    wheel_speed = (bb_max - bb_min).maxCoeff() / 20;
-    trans_speed = (bb_max - bb_min).maxCoeff() / g_height;
+ private:
+  const nlohmann::json &j_;
+  bool strict_;
+  std::string &error_;
+};
+
+// Destination of settings read by ReadAlgorithmParams()
+struct AlgorithmParamsTarget {
+  int *src_id;
+  int *dst_id;
+  IcpData *icp;
+  GlobalAlignData *global_align;
+  NonrigidIcpData *nonrigid_icp;
+  NonrigidIcpSweepData *sweep;
+  TextransData *textrans;
+  DeviationData *deviation;
+};
+
+// Missing keys keep current values so that older files stay loadable
+bool ReadAlgorithmParams(const nlohmann::json &j, bool strict,
+                         const AlgorithmParamsTarget &target,
+                         std::string &error) {
+  error.clear();
+  ParamReader reader(j, strict, error);
+  reader.Read("src_id", *target.src_id);
+  reader.Read("dst_id", *target.dst_id);
+  if (*target.src_id < -1 ||
+      static_cast<int>(g_scene.size()) <= *target.src_id) {
+    *target.src_id = -1;
+  }
+  if (*target.dst_id < -1 ||
+      static_cast<int>(g_scene.size()) <= *target.dst_id) {
+    *target.dst_id = -1;
+  }
+  const int int_max = std::numeric_limits<int>::max();
+
+  if (j.contains("icp")) {
+    ParamReader p(j.at("icp"), strict, error);
+    auto &icp = *target.icp;
+    p.Read("iter_max", icp.terminate_criteria.iter_max, 1, int_max);
+    p.Read("loss_min", icp.terminate_criteria.loss_min);
+    p.Read("loss_eps", icp.terminate_criteria.loss_eps);
+    p.Read("test_nearest", icp.corresp_criteria.test_nearest);
+    p.Read("normal_th", icp.corresp_criteria.normal_th);
+    p.Read("dist_th", icp.corresp_criteria.dist_th);
+    p.Read("with_scale", icp.with_scale);
+    p.ReadEnum("corresp_type", icp.corresp_type,
+               IcpCorrespType::kPointToPlane);
+    p.ReadEnum("loss_type", icp.loss_type, IcpLossType::kPointToPlane);
+    p.ReadEnum("sampling", icp.sampling, IcpSampling::CURVATURE);
+    p.Read("sample_num", icp.sample_num, 3, int_max);
+    p.Read("coarse_to_fine", icp.coarse_to_fine);
+    p.Read("level_num", icp.level_num, 1, int_max);
+    p.Read("specialized", icp.specialized);
+    p.Read("benchmark_iter", icp.benchmark_iter, 1, int_max);
   }
 
-  void SetDefaultDragSpeed(RenderableMeshPtr target) {
-    auto stats = target->GetStatsWithTransform(g_model_matrices[target]);
-    Eigen::Vector3f bb_max = stats.bb_max;
-    Eigen::Vector3f bb_min = stats.bb_min;
+  if (j.contains("global_align")) {
+    ParamReader p(j.at("global_align"), strict, error);
+    auto &align = *target.global_align;
+    p.Read("voxel_size", align.voxel_size);
+    p.Read("feature_radius", align.feature_radius);
+    p.Read("inlier_dist", align.inlier_dist);
+    p.Read("ransac_iter", align.ransac_iter, 1, int_max);
+    p.Read("with_scale", align.with_scale);
+    p.Read("run_icp", align.run_icp);
+  }
 
-    rotate_speed = ugu::pi / 180 * 10;
-    wheel_speed = (bb_max - bb_min).maxCoeff() / 20;
-    trans_speed = (bb_max - bb_min).maxCoeff() / g_height;
+  if (j.contains("nonrigid_icp")) {
+    ParamReader p(j.at("nonrigid_icp"), strict, error);
+    auto &nicp = *target.nonrigid_icp;
+    p.ReadEnum("engine", nicp.engine, NonrigidIcpEngine::DEFORMATION_GRAPH);
+    p.Read("graph_node_num", nicp.graph_node_num, 4, int_max);
+    p.Read("graph_sample_num", nicp.graph_sample_num, 1, int_max);
+    p.Read("check_self_itersection", nicp.check_self_itersection);
+    p.Read("angle_rad_th", nicp.angle_rad_th);
+    p.Read("dist_th", nicp.dist_th);
+    p.Read("nn_num", nicp.nn_num, 1, int_max);
+    p.Read("dst_check_geometry_border", nicp.dst_check_geometry_border);
+    p.Read("src_check_geometry_border", nicp.src_check_geometry_border);
+    p.Read("max_alpha", nicp.max_alpha);
+    p.Read("min_alpha", nicp.min_alpha);
+    p.Read("beta", nicp.beta);
+    p.Read("gamma", nicp.gamma);
+    p.Read("step", nicp.step, 1, int_max);
+    p.Read("max_internal_iter", nicp.max_internal_iter, 1, int_max);
+    p.Read("min_frobenius_norm_diff", nicp.min_frobenius_norm_diff);
+    p.Read("sequence_mode", nicp.sequence_mode);
+    p.Read("sequence_paths", nicp.sequence_paths);
+    p.Read("sequence_output_dir", nicp.sequence_output_dir);
+    p.Read("sequence_max_alpha", nicp.sequence_max_alpha, nicp.min_alpha,
+           std::numeric_limits<double>::max());
+    nicp.sequence_max_alpha =
+        std::max(nicp.sequence_max_alpha, nicp.min_alpha);
+    p.Read("sequence_step", nicp.sequence_step, 1, int_max);
   }
 
-  void SetProperCameraForTargetMesh(RenderableMeshPtr target) {
-    auto stats = target->GetStatsWithTransform(g_model_matrices[target]);
-    float z_trans = (stats.bb_max - stats.bb_min).maxCoeff() * 2.0f;
-    float near_z = static_cast<float>(z_trans * 0.5f / 10);
-    float far_z = static_cast<float>(z_trans * 2.f * 10);
-    renderer->SetNearFar(near_z, far_z);
+  if (j.contains("nonrigid_icp_sweep")) {
+    ParamReader p(j.at("nonrigid_icp_sweep"), strict, error);
+    auto &sweep = *target.sweep;
+    p.Read("max_alphas", sweep.max_alphas);
+    p.Read("min_alphas", sweep.min_alphas);
+    p.Read("betas", sweep.betas);
+    p.Read("gammas", sweep.gammas);
+    p.Read("steps", sweep.steps);
+    p.Read("nn_nums", sweep.nn_nums);
+    p.Read("angle_rad_ths", sweep.angle_rad_ths);
+    p.Read("dist_ths", sweep.dist_ths);
+    p.Read("num_threads", sweep.num_threads, 1, int_max);
+  }
 
-    Eigen::Vector3f view_dir =
-        camera->c2w().matrix().block(0, 2, 3, 1).cast<float>();
-    Eigen::Vector3f up = camera->c2w().matrix().block(0, 1, 3, 1).cast<float>();
+  if (j.contains("textrans")) {
+    ParamReader p(j.at("textrans"), strict, error);
+    auto &textrans = *target.textrans;
+    p.Read("dst_width", textrans.dst_size.x(), 1, 16000);
+    p.Read("dst_height", textrans.dst_size.y(), 1, 16000);
+    p.Read("nn_num", textrans.nn_num, 1, int_max);
+    p.Read("tiled", textrans.tiled);
+    p.Read("tile_size", textrans.tile_size, 64, 4096);
+    p.Read("preview_size", textrans.preview_size, 64, 8192);
+    p.ReadEnum("inpaint_method", textrans.inpaint_method,
+               TextransInpaintMethod::PUSH_PULL);
+    p.Read("inpaint_margin", textrans.inpaint_margin);
+    p.Read("inpaint_seam_aware", textrans.inpaint_seam_aware);
+    p.Read("vertex_mode", textrans.vertex_mode);
+    p.Read("vertex_colors", textrans.vertex_colors);
+    p.Read("vertex_normals", textrans.vertex_normals);
+    p.Read("vertex_channels_path", textrans.vertex_channels_path);
+    p.Read("extra_maps", textrans.extra_maps);
+  }
 
-    float max_len = (stats.bb_max - stats.bb_min).maxCoeff();
-    Eigen::Vector3f pos = stats.center + max_len * 2.f * view_dir;
-    Eigen::Matrix4f T;
-    c2w(pos, stats.center, up, &T, true);
+  if (j.contains("deviation")) {
+    ParamReader p(j.at("deviation"), strict, error);
+    auto &deviation = *target.deviation;
+    p.Read("bidirectional", deviation.bidirectional);
+    p.Read("colorize", deviation.colorize);
+    p.Read("color_max", deviation.color_max);
+    p.Read("track_nonrigidicp", deviation.track_nonrigidicp);
+    p.Read("export_path", deviation.export_path);
+  }
 
-    Eigen::Affine3d c2w;
-    c2w.matrix() = T.cast<double>();
-    camera->set_c2w(c2w);
+  return reader.ok();
+}
 
-    SetDefaultDragSpeed(target);
+// Reads j into default instances only. Keys j has are checked the same way
+// as when applied, and missing ones do not matter.
+bool CheckAlgorithmParams(const nlohmann::json &j, bool strict,
+                          std::string &error) {
+  int src_id = -1;
+  int dst_id = -1;
+  IcpData icp;
+  GlobalAlignData global_align;
+  NonrigidIcpData nonrigid_icp;
+  NonrigidIcpSweepData sweep;
+  TextransData textrans;
+  DeviationData deviation;
+  try {
+    return ReadAlgorithmParams(
+        j, strict,
+        {&src_id, &dst_id, &icp, &global_align, &nonrigid_icp, &sweep,
+         &textrans, &deviation},
+        error);
+  } catch (const std::exception &e) {
+    error = e.what();
+    return false;
   }
+}
 
-  CastRayResult CastRay() {
-    // Cast ray
-    Eigen::Vector3f dir_c_cv;
-    // Substract offset to align cursor pos on window to corresponding positon
-    // on framebuffer
-    camera->ray_c(static_cast<float>(g_cursor_pos[0] - offset.x()),
-                  static_cast<float>(g_cursor_pos[1] - offset.y()), &dir_c_cv);
+// Applies j to the algorithm settings only if all of it is valid
+bool AlgorithmParamsFromJson(const nlohmann::json &j, bool strict,
+                             std::string &error) {
+  if (!CheckAlgorithmParams(j, strict, error)) {
+    return false;
+  }
+  return ReadAlgorithmParams(
+      j, strict,
+      {&g_src_id, &g_dst_id, &g_icp_data, &g_global_align_data,
+       &g_nonrigidicp_data, &g_nonrigidicp_sweep_data, &g_textrans_data,
+       &g_deviation_data},
+      error);
+}
 
-    const Eigen::Affine3d ray_offset =
-        Eigen::Affine3d(Eigen::AngleAxisd(pi, Eigen::Vector3d::UnitX()))
-            .inverse();
-    Eigen::Vector3f dir_c_gl =
-        (dir_c_cv.transpose() * ray_offset.rotation().cast<float>());
-    Eigen::Vector3f dir_w_gl =
-        camera->c2w().rotation().cast<float>() * dir_c_gl;
+nlohmann::json MatrixToJson(const Eigen::Matrix4d &m) {
+  return std::vector<double>(m.data(), m.data() + 16);
+}
 
-    size_t min_geoid = ~0u;
-    // float min_geo_dist = std::numeric_limits<float>::max();
-    IntersectResult min_intersect;
-    min_intersect.t = std::numeric_limits<float>::max();
-    Eigen::Vector3f min_geo_dist_pos =
-        Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+Eigen::Matrix4d MatrixFromJson(const nlohmann::json &j) {
+  const std::vector<double> v = j;
+  Eigen::Matrix4d m = Eigen::Matrix4d::Identity();
+  if (v.size() == 16) {
+    m = Eigen::Map<const Eigen::Matrix4d>(v.data());
+  }
+  return m;
+}
 
-    Ray ray;
-    ray.dir = dir_w_gl;
-    ray.org = camera->c2w().translation().cast<float>();
-    auto results_all = renderer->Intersect(ray);
+// Meshes edited in this session (applied transforms, welding, Nonrigid ICP
+// results) are always embedded since their files are stale.
+bool SaveSession(const std::string &path, bool embed_meshes) {
+  Timer timer;
+  timer.Start();
 
-    for (size_t geoid = 0; geoid < g_meshes.size(); geoid++) {
-      if (!renderer->GetVisibility(g_meshes[geoid])) {
-        continue;
-      }
-      const std::vector<IntersectResult> &results = results_all[geoid];
-      if (!results.empty()) {
-        if (results[0].t < min_intersect.t) {
-          min_geoid = geoid;
-          min_intersect = results[0];
-          min_geo_dist_pos = results[0].t * ray.dir + ray.org;
+  SessionBlockWriter blocks;
+  nlohmann::json j;
+  j["meshes"] = nlohmann::json::array();
+  for (size_t i = 0; i < g_scene.size(); i++) {
+    const auto &mesh = g_scene.mesh(i);
+    nlohmann::json m;
+    m["name"] = g_scene.name(i);
+    m["path"] = g_scene.path(i);
+    m["model_matrix"] =
+        MatrixToJson(g_scene.model_matrix(i).matrix().cast<double>());
+
+    const bool embed = embed_meshes || g_scene.path(i).empty() ||
+                       g_scene.geometry_revision(i) != 0;
+    m["embedded"] = embed;
+    if (embed) {
+      m["vertices"] = blocks.Add(mesh->vertices());
+      m["normals"] = blocks.Add(mesh->normals());
+      m["vertex_colors"] = blocks.Add(mesh->vertex_colors());
+      m["uv"] = blocks.Add(mesh->uv());
+      m["vertex_indices"] = blocks.Add(mesh->vertex_indices());
+      m["uv_indices"] = blocks.Add(mesh->uv_indices());
+      m["normal_indices"] = blocks.Add(mesh->normal_indices());
+      m["material_ids"] = blocks.Add(mesh->material_ids());
+      m["materials"] = nlohmann::json::array();
+      for (const auto &mat : mesh->materials()) {
+        nlohmann::json mj = {{"name", mat.name},
+                             {"diffuse_texname", mat.diffuse_texname},
+                             {"diffuse_texpath", mat.diffuse_texpath}};
+        const auto &tex = mat.diffuse_tex;
+        if (!tex.empty()) {
+          const size_t row_bytes = tex.cols * sizeof(Vec3b);
+          std::vector<uint8_t> pixels(row_bytes * tex.rows);
+          for (int y = 0; y < tex.rows; y++) {
+            std::memcpy(pixels.data() + row_bytes * y, &tex.at<Vec3b>(y, 0),
+                        row_bytes);
+          }
+          mj["diffuse_tex"] = {{"rows", tex.rows},
+                               {"cols", tex.cols},
+                               {"pixels", blocks.AddOwned(std::move(pixels))}};
         }
+        m["materials"].push_back(mj);
       }
     }
 
-    if (min_geoid != ~0u) {
-      // std::cout << "closest geo: " << min_geoid << std::endl;
+    const auto &positions = g_scene.selected_positions(i);
+    std::vector<uint8_t> points(positions.size() * sizeof(SessionPoint));
+    for (size_t k = 0; k < positions.size(); k++) {
+      const SessionPoint p = {positions[k].intersection.fid,
+                              positions[k].intersection.u,
+                              positions[k].intersection.v};
+      std::memcpy(points.data() + k * sizeof(SessionPoint), &p, sizeof(p));
     }
+    m["points"] = blocks.AddOwned(std::move(points));
 
-    CastRayResult result;
-    result.min_geoid = min_geoid;
-    result.intersection = min_intersect;
-    // result.min_geo_dist_pos = min_geo_dist_pos;
+    const auto ignore_ids = g_scene.ignore_faces(i).ToIds();
+    std::vector<uint8_t> ignore(ignore_ids.size() * sizeof(uint32_t));
+    if (!ignore_ids.empty()) {
+      std::memcpy(ignore.data(), ignore_ids.data(), ignore.size());
+    }
+    m["ignore_faces"] = blocks.AddOwned(std::move(ignore));
+
+    const auto source = g_stream_import_data.sources.find(mesh);
+    if (source != g_stream_import_data.sources.end()) {
+      const auto &origin = source->second.origin;
+      m["stream_source"] = {{"path", source->second.path},
+                            {"origin", {origin.x(), origin.y(), origin.z()}},
+                            {"cell_size", source->second.cell_size},
+                            {"face_num", source->second.face_num}};
+    }
 
-    return result;
+    j["meshes"].push_back(m);
   }
 
-  auto FindClosestSelectedPoint(const Eigen::Vector2d &cursor_pos) {
-    bool not_close = true;
-    size_t closest_selected_id = ~0u;
-    double min_dist = std::numeric_limits<double>::max();
-    uint32_t min_geoid = ~0u;
-    // RenderableMeshPtr closest_mesh = nullptr;
+  j["views"] = nlohmann::json::array();
+  for (const auto &view : g_views) {
     float near_z, far_z;
-    renderer->GetNearFar(near_z, far_z);
-    Eigen::Matrix4f view_mat = camera->c2w().inverse().matrix().cast<float>();
-    Eigen::Matrix4f prj_mat = camera->ProjectionMatrixOpenGl(near_z, far_z);
-    for (size_t k = 0; k < g_meshes.size(); k++) {
-      const auto &mesh = g_meshes[k];
-      if (g_selected_positions.find(mesh) == g_selected_positions.end()) {
-        continue;
-      }
-      if (!renderer->GetVisibility(mesh)) {
-        continue;
-      }
-      for (size_t i = 0; i < g_selected_positions[mesh].size(); i++) {
-        const auto &p_wld = GetPos(g_selected_positions[mesh][i]);
-        auto [front_id, results_all] = renderer->TestVisibility(p_wld);
-        if (front_id == ~0u) {
-          continue;
-        }
-
-        if (renderer->GetMeshId(mesh) != front_id) {
-          continue;
-        }
-
-        Eigen::Vector4f p_cam =
-            view_mat * Eigen::Vector4f(p_wld.x(), p_wld.y(), p_wld.z(), 1.f);
-        Eigen::Vector4f p_ndc = prj_mat * p_cam;
-        p_ndc /= p_ndc.w();  // NDC [-1:1]
-
-        // [-1:1],[-1:1] -> [0:w], [0:h]
-        Eigen::Vector2d p_gl_frag =
-            Eigen::Vector2d(((p_ndc.x() + 1.f) / 2.f) * camera->width(),
-                            ((p_ndc.y() + 1.f) / 2.f) * camera->height());
-
-        p_gl_frag.y() = camera->height() - p_gl_frag.y();
-
-        // Add offset
-        p_gl_frag += offset.cast<double>();
-
-        double dist = (p_gl_frag - cursor_pos).norm();
-        if (dist < g_drag_point_pix_dist_th && dist < min_dist) {
-          not_close = false;
-          min_dist = dist;
-          closest_selected_id = i;
-          min_geoid = static_cast<uint32_t>(k);
-        }
-      }
+    view.renderer->GetNearFar(near_z, far_z);
+    std::vector<uint8_t> visibility;
+    for (const auto &mesh : g_scene.meshes()) {
+      visibility.push_back(view.IsShown(mesh) ? 1 : 0);
     }
-
-    return std::make_tuple(!not_close, min_geoid, closest_selected_id,
-                           min_dist);
+    const auto bkg = view.renderer->GetBackgroundColor();
+    j["views"].push_back(
+        {{"c2w", MatrixToJson(view.camera->c2w().matrix())},
+         {"fov_y", view.camera->fov_y()},
+         {"near", near_z},
+         {"far", far_z},
+         {"rot_center",
+          {view.offset_to_rot_center.x(), view.offset_to_rot_center.y(),
+           view.offset_to_rot_center.z()}},
+         {"trans_speed", view.trans_speed},
+         {"wheel_speed", view.wheel_speed},
+         {"rotate_speed", view.rotate_speed},
+         {"show_wire", view.renderer->GetShowWire()},
+         {"flat_normal", view.renderer->GetFlatNormal()},
+         {"background", {bkg.x(), bkg.y(), bkg.z()}},
+         {"visibility", visibility}});
   }
-};
 
-static void glfw_error_callback(int error, const char *description) {
-  fprintf(stderr, "Glfw Error %d: %s\n", error, description);
-}
+  j["params"] = AlgorithmParamsToJson();
 
-void Clear() {
-  g_meshes.clear();
-  g_mesh_names.clear();
-  g_mesh_paths.clear();
-  g_selected_positions.clear();
-  g_ignore_poly_ids.clear();
-  for (auto &view : g_views) {
-    view.ResetGl();
+  const std::string json_str = j.dump();
+  SessionHeader header;
+  header.json_size = json_str.size();
+
+  std::ofstream ofs(path, std::ios::binary);
+  if (!ofs) {
+    return false;
   }
+  ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  ofs.write(json_str.data(), json_str.size());
+  const uint64_t head_size = sizeof(header) + json_str.size();
+  const char zeros[kSessionBlockAlign] = {};
+  ofs.write(zeros, AlignSessionBlock(head_size) - head_size);
+  const bool ret = blocks.Write(ofs);
+
+  timer.End();
+  std::cout << "Saved session " << path << " in " << timer.elapsed_msec()
+            << " ms" << std::endl;
+  return ret;
 }
 
-void key_callback(GLFWwindow *pwin, int key, int scancode, int action,
-                  int mods) {
-  (void)pwin, (void)scancode, (void)mods;
-  if (key == GLFW_KEY_UP && action == GLFW_PRESS) {
-    // printf("key up\n");
-  }
-  if (key == GLFW_KEY_DOWN && action == GLFW_PRESS) {
-    // printf("key down\n");
-  }
-  if (key == GLFW_KEY_LEFT && action == GLFW_PRESS) {
-    // printf("key left\n");
-  }
-  if (key == GLFW_KEY_RIGHT && action == GLFW_PRESS) {
-    // printf("key right\n");
+// Meshes are decoded in parallel from the mapped file, or loaded from their
+// paths if not embedded. GL state is set up once after all meshes arrive.
+bool LoadSession(const std::string &path) {
+  if (IsAnyAlgorithmRunning()) {
+    std::cout << "Cannot open a session while algorithms are running"
+              << std::endl;
+    return false;
   }
+  Timer timer;
+  timer.Start();
 
-  if (key >= GLFW_KEY_A && key <= GLFW_KEY_Z) {
-    if (action == GLFW_PRESS) {
-      // const char *key_name = glfwGetKeyName(key, 0);
-      // printf("key - %s\n", key_name);
-    }
+  MappedFile file;
+  if (!file.Open(path) || file.size() < sizeof(SessionHeader)) {
+    std::cout << "Failed to open " << path << std::endl;
+    return false;
   }
-  if (key == GLFW_KEY_R) {
-    if (action == GLFW_PRESS) {
-      if (!ImGui::GetIO().WantCaptureKeyboard) {
-        Clear();
-      }
-    }
+  SessionHeader header;
+  std::memcpy(&header, file.data(), sizeof(header));
+  const SessionHeader expected;
+  if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+      header.version != expected.version ||
+      file.size() - sizeof(header) < header.json_size) {
+    std::cout << "Not a session file: " << path << std::endl;
+    return false;
   }
-}
-
-void mouse_button_callback(GLFWwindow *pwin, int button, int action, int mods) {
-  (void)pwin, (void)mods;
-
-  if (button == GLFW_MOUSE_BUTTON_LEFT) {
-    g_mouse_l_pressed = action == GLFW_PRESS;
-    if (g_mouse_l_pressed) {
-      g_mouse_l_pressed_pos = g_cursor_pos;
-    } else {
-      g_mouse_l_released_pos = g_cursor_pos;
-
-      if ((g_mouse_l_pressed_pos - g_mouse_l_released_pos).norm() > drag_th) {
-      }
+  const uint64_t blocks_offset =
+      std::min<uint64_t>(AlignSessionBlock(sizeof(header) + header.json_size),
+                         file.size());
+  const uint8_t *blocks = file.data() + blocks_offset;
+  const size_t blocks_size = file.size() - blocks_offset;
+
+  // Everything is parsed and validated before Clear() so that a broken or
+  // truncated file leaves the workspace untouched
+  nlohmann::json mesh_jsons, view_jsons, params;
+  try {
+    const nlohmann::json j = nlohmann::json::parse(
+        std::string(reinterpret_cast<const char *>(file.data()) +
+                        sizeof(header),
+                    header.json_size));
+    if (!j.is_object() || !j.contains("meshes") ||
+        !j.at("meshes").is_array()) {
+      std::cout << "No meshes in " << path << std::endl;
+      return false;
     }
+    mesh_jsons = j.at("meshes");
+    view_jsons = j.contains("views") && j.at("views").is_array()
+                     ? j.at("views")
+                     : nlohmann::json::array();
+    params = j.contains("params") ? j.at("params") : nlohmann::json::object();
+  } catch (const std::exception &e) {
+    std::cout << e.what() << std::endl;
+    return false;
   }
 
-  if (button == GLFW_MOUSE_BUTTON_RIGHT) {
-    g_mouse_r_pressed = action == GLFW_PRESS;
-    if (g_mouse_r_pressed) {
-      g_mouse_r_pressed_pos = g_cursor_pos;
-    } else {
-      g_mouse_r_released_pos = g_cursor_pos;
-    }
-
-    if (g_mouse_r_pressed) {
-      bool not_close = false;
-      CastRayResult result;
-      // uint32_t min_geoid;
-      // double min_dist = std::numeric_limits<double>::max();
-      auto &this_view = g_views[g_subwindow_id];
-      result = this_view.CastRay();
-      if (result.min_geoid != ~0u &&
-          this_view.renderer->GetVisibility(g_meshes[result.min_geoid])) {
-        auto [is_close, min_geoid_, id, min_dist_] =
-            this_view.FindClosestSelectedPoint(g_mouse_r_pressed_pos);
-        not_close = !is_close;
+  // Missing keys fall back to defaults of a freshly loaded mesh
+  struct SessionMeshState {
+    std::string name;
+    std::string path;
+    bool embedded = false;
+    Eigen::Affine3f model_matrix = Eigen::Affine3f::Identity();
+    bool has_stream_source = false;
+    StreamSource stream_source;
+  };
+  const size_t mesh_num = mesh_jsons.size();
+  std::vector<RenderableMeshPtr> meshes(mesh_num);
+  std::vector<SessionMeshState> mesh_states(mesh_num);
+  std::vector<std::vector<SessionPoint>> points(mesh_num);
+  std::vector<std::vector<uint32_t>> ignore_ids(mesh_num);
+  std::vector<uint8_t> decoded(mesh_num, 0);
+
+  auto decode_func = [&](size_t i) {
+    try {
+      const auto &m = mesh_jsons[i];
+      auto &state = mesh_states[i];
+      state.name = "mesh" + std::to_string(i);
+      ReadParam(m, "name", state.name);
+      ReadParam(m, "path", state.path);
+      ReadParam(m, "embedded", state.embedded);
+      if (m.contains("model_matrix")) {
+        state.model_matrix = Eigen::Affine3f(
+            MatrixFromJson(m.at("model_matrix")).cast<float>());
+      }
+      if (m.contains("stream_source")) {
+        const auto &sj = m.at("stream_source");
+        std::vector<double> origin;
+        ReadParam(sj, "origin", origin);
+        auto &source = state.stream_source;
+        ReadParam(sj, "path", source.path);
+        if (origin.size() == 3) {
+          source.origin = {origin[0], origin[1], origin[2]};
+        }
+        ReadParam(sj, "cell_size", source.cell_size);
+        ReadParam(sj, "face_num", source.face_num);
+        state.has_stream_source =
+            !source.path.empty() && 0.0 < source.cell_size;
+      }
 
-        // min_dist = min_dist_;
-        // min_geoid = min_geoid_;
+      auto mesh = RenderableMesh::Create();
+      if (state.embedded) {
+        std::vector<Eigen::Vector3f> vertices, normals, colors;
+        std::vector<Eigen::Vector2f> uv;
+        std::vector<Eigen::Vector3i> faces, uv_faces, normal_faces;
+        std::vector<int> material_ids;
+        if (!ReadSessionBlock(m.at("vertices"), blocks, blocks_size,
+                              vertices) ||
+            !ReadSessionBlock(m.at("normals"), blocks, blocks_size,
+                              normals) ||
+            !ReadSessionBlock(m.at("vertex_colors"), blocks, blocks_size,
+                              colors) ||
+            !ReadSessionBlock(m.at("uv"), blocks, blocks_size, uv) ||
+            !ReadSessionBlock(m.at("vertex_indices"), blocks, blocks_size,
+                              faces) ||
+            !ReadSessionBlock(m.at("uv_indices"), blocks, blocks_size,
+                              uv_faces) ||
+            !ReadSessionBlock(m.at("normal_indices"), blocks, blocks_size,
+                              normal_faces) ||
+            !ReadSessionBlock(m.at("material_ids"), blocks, blocks_size,
+                              material_ids)) {
+          return;
+        }
+        std::vector<ObjMaterial> materials;
+        for (const auto &mj : m.at("materials")) {
+          ObjMaterial mat;
+          mat.name = mj.at("name").get<std::string>();
+          mat.diffuse_texname = mj.at("diffuse_texname").get<std::string>();
+          mat.diffuse_texpath = mj.at("diffuse_texpath").get<std::string>();
+          if (mj.contains("diffuse_tex")) {
+            const auto &tj = mj.at("diffuse_tex");
+            const int rows = tj.at("rows");
+            const int cols = tj.at("cols");
+            std::vector<uint8_t> pixels;
+            const size_t row_bytes = cols * sizeof(Vec3b);
+            if (!ReadSessionBlock(tj.at("pixels"), blocks, blocks_size,
+                                  pixels) ||
+                pixels.size() != row_bytes * rows) {
+              return;
+            }
+            mat.diffuse_tex = Image3b::zeros(rows, cols);
+            for (int y = 0; y < rows; y++) {
+              std::memcpy(&mat.diffuse_tex.at<Vec3b>(y, 0),
+                          pixels.data() + row_bytes * y, row_bytes);
+            }
+          }
+          materials.push_back(mat);
+        }
+        mesh->set_vertices(vertices);
+        mesh->set_normals(normals);
+        mesh->set_vertex_colors(colors);
+        mesh->set_uv(uv);
+        mesh->set_vertex_indices(faces);
+        mesh->set_uv_indices(uv_faces);
+        mesh->set_normal_indices(normal_faces);
+        mesh->set_materials(materials);
+        mesh->set_material_ids(material_ids);
+        mesh->CalcFaceNormal();
+        mesh->CalcStats();
+      } else {
+        const std::string &obj_path = state.path;
+        if (!mesh->LoadObj(obj_path, ExtractDir(obj_path))) {
+          return;
+        }
       }
+      // Meshes without points or ignore faces may omit their blocks
+      if ((m.contains("points") &&
+           !ReadSessionBlock(m.at("points"), blocks, blocks_size,
+                             points[i])) ||
+          (m.contains("ignore_faces") &&
+           !ReadSessionBlock(m.at("ignore_faces"), blocks, blocks_size,
+                             ignore_ids[i]))) {
+        return;
+      }
+      meshes[i] = mesh;
+      decoded[i] = 1;
+    } catch (const std::exception &e) {
+      std::cout << e.what() << std::endl;
+    }
+  };
+  parallel_for(size_t(0), mesh_num, decode_func);
 
-      if (not_close) {
-        g_selected_positions[g_meshes[result.min_geoid]].push_back(result);
-        for (size_t vidx = 0; vidx < g_views.size(); vidx++) {
-          auto &view = g_views[vidx];
-          view.renderer->AddSelectedPositions(
-              g_meshes[result.min_geoid],
-              ExtractPos(g_selected_positions[g_meshes[result.min_geoid]]));
-        }
+  for (size_t i = 0; i < mesh_num; i++) {
+    if (!decoded[i]) {
+      std::cout << "Failed to decode mesh " << i << " of " << path
+                << std::endl;
+      return false;
+    }
+  }
 
-        // std::cout << "added " << min_dist << std::endl;
-      } else {
-        // std::cout << "ignored " << min_dist << std::endl;
+  // Views missing in the file keep their current settings
+  struct SessionViewState {
+    Eigen::Affine3d c2w;
+    float fov_y;
+    float near_z;
+    float far_z;
+    Eigen::Translation3d rot_center;
+    double trans_speed;
+    double wheel_speed;
+    double rotate_speed;
+    bool show_wire;
+    bool flat_normal;
+    Eigen::Vector3f background;
+    std::vector<uint8_t> visibility;
+  };
+  std::vector<SessionViewState> view_states;
+  try {
+    for (size_t vidx = 0; vidx < std::min(view_jsons.size(), g_views.size());
+         vidx++) {
+      const auto &v = view_jsons[vidx];
+      const auto &view = g_views[vidx];
+      SessionViewState state;
+      state.c2w = view.camera->c2w();
+      state.fov_y = view.camera->fov_y();
+      view.renderer->GetNearFar(state.near_z, state.far_z);
+      state.rot_center = view.offset_to_rot_center;
+      state.trans_speed = view.trans_speed;
+      state.wheel_speed = view.wheel_speed;
+      state.rotate_speed = view.rotate_speed;
+      state.show_wire = view.renderer->GetShowWire();
+      state.flat_normal = view.renderer->GetFlatNormal();
+      state.background = view.renderer->GetBackgroundColor();
+
+      if (v.contains("c2w")) {
+        state.c2w = Eigen::Affine3d(MatrixFromJson(v.at("c2w")));
+      }
+      ReadParam(v, "fov_y", state.fov_y);
+      ReadParam(v, "near", state.near_z);
+      ReadParam(v, "far", state.far_z);
+      std::vector<double> center;
+      ReadParam(v, "rot_center", center);
+      if (center.size() == 3) {
+        state.rot_center =
+            Eigen::Translation3d(center[0], center[1], center[2]);
+      }
+      ReadParam(v, "trans_speed", state.trans_speed);
+      ReadParam(v, "wheel_speed", state.wheel_speed);
+      ReadParam(v, "rotate_speed", state.rotate_speed);
+      ReadParam(v, "show_wire", state.show_wire);
+      ReadParam(v, "flat_normal", state.flat_normal);
+      std::vector<float> bkg;
+      ReadParam(v, "background", bkg);
+      if (bkg.size() == 3) {
+        state.background = {bkg[0], bkg[1], bkg[2]};
       }
+      ReadParam(v, "visibility", state.visibility);
+      view_states.push_back(state);
     }
+  } catch (const std::exception &e) {
+    std::cout << e.what() << std::endl;
+    return false;
+  }
+  std::string params_error;
+  if (!CheckAlgorithmParams(params, false, params_error)) {
+    std::cout << "Invalid algorithm settings in " << path << ": "
+              << params_error << std::endl;
+    return false;
   }
 
-  if (button == GLFW_MOUSE_BUTTON_MIDDLE) {
-    g_mouse_m_pressed = action == GLFW_PRESS;
-    if (g_mouse_m_pressed) {
-      g_mouse_m_pressed_pos = g_cursor_pos;
-    } else {
-      g_mouse_m_released_pos = g_cursor_pos;
+  Clear();
+  for (size_t i = 0; i < mesh_num; i++) {
+    const auto &state = mesh_states[i];
+    if (!state.embedded) {
+      SetDefaultTexture(meshes[i]);
+    }
+    const uint32_t gidx = g_scene.Add(meshes[i], state.name, state.path);
+    g_scene.model_matrix(gidx) = state.model_matrix;
+    g_scene.ignore_faces(gidx).SetIds(ignore_ids[i]);
+    g_face_select_data.revision++;
+    if (state.has_stream_source) {
+      g_stream_import_data.sources[meshes[i]] = state.stream_source;
+    }
 
-      if ((g_mouse_m_pressed_pos - g_mouse_m_released_pos).norm() > drag_th) {
+    std::vector<CastRayResult> results;
+    const size_t face_num = meshes[i]->vertex_indices().size();
+    for (const auto &p : points[i]) {
+      if (face_num <= p.fid) {
+        continue;
       }
+      CastRayResult res{};
+      res.min_geoid = gidx;
+      res.intersection.fid = p.fid;
+      res.intersection.u = p.u;
+      res.intersection.v = p.v;
+      results.push_back(res);
     }
+    g_scene.SetSelectedPositions(gidx, results);
   }
-}
 
-void mouse_wheel_callback(GLFWwindow *window, double xoffset, double yoffset) {
-  (void)window, (void)xoffset;
+  for (size_t vidx = 0; vidx < g_views.size(); vidx++) {
+    auto &view = g_views[vidx];
+    view.AddMeshesGl(0);
+    if (view_states.size() <= vidx) {
+      view.SetDefaultDragSpeed();
+      continue;
+    }
+    const auto &state = view_states[vidx];
+    view.camera->set_c2w(state.c2w);
+    view.camera->set_fov_y(state.fov_y);
+    view.renderer->SetNearFar(state.near_z, state.far_z);
+    view.offset_to_rot_center = state.rot_center;
+    view.trans_speed = state.trans_speed;
+    view.wheel_speed = state.wheel_speed;
+    view.rotate_speed = state.rotate_speed;
+    view.renderer->SetShowWire(state.show_wire);
+    view.renderer->SetFlatNormal(state.flat_normal);
+    view.renderer->SetBackgroundColor(state.background);
+    // Hidden meshes first so that their slots go to the shown ones
+    const auto &visibility = state.visibility;
+    const size_t num = std::min(visibility.size(), g_scene.size());
+    for (size_t i = 0; i < num; i++) {
+      if (visibility[i] == 0) {
+        view.SetShown(g_scene.mesh(i), false);
+      }
+    }
+    for (size_t i = 0; i < num; i++) {
+      if (visibility[i] != 0) {
+        view.SetShown(g_scene.mesh(i), true);
+      }
+    }
+  }
 
-  g_mouse_wheel_yoffset = yoffset;
-  g_to_process_wheel = true;
+  // Checked above, so this does not fail
+  AlgorithmParamsFromJson(params, false, params_error);
+
+  timer.End();
+  std::cout << "Loaded session " << path << " (" << mesh_num << " meshes) in "
+            << timer.elapsed_msec() << " ms" << std::endl;
+  return true;
 }
 
-void cursor_pos_callback(GLFWwindow *window, double xoffset, double yoffset) {
-  (void)window;
-  g_prev_cursor_pos = g_cursor_pos;
+// Model matrices and BVH updates are handed to renderers every frame in
+// DrawViews(), so only vertex buffers and selected points need refreshing
+// after an algorithm has finished
+void RefreshChangedMeshes() {
+  for (size_t gidx = 0; gidx < g_scene.size(); gidx++) {
+    g_scene.UploadChangedGeometry(gidx);
+    g_scene.UpdateSelectedPoints(gidx);
+  }
+}
 
-  g_cursor_pos[0] = xoffset;
-  g_cursor_pos[1] = yoffset;
-  if (g_mouse_l_pressed) {
-    g_to_process_drag_l = true;
+// Queues event for the client of request, tagged with the id of request
+void SendServerEvent(const ServerRequest &request, const std::string &event,
+                     nlohmann::json fields = nlohmann::json::object()) {
+  if (request.body.contains("id")) {
+    fields["id"] = request.body.at("id");
   }
-  if (g_mouse_m_pressed) {
-    g_to_process_drag_m = true;
+  fields["event"] = event;
+  std::lock_guard<std::mutex> lock(server_mtx);
+  g_server_data.outbox.emplace_back(request.client, fields.dump() + "\n");
+}
+
+nlohmann::json ServerStatusJson() {
+  nlohmann::json meshes = nlohmann::json::array();
+  for (size_t i = 0; i < g_scene.size(); i++) {
+    const auto &mesh = g_scene.mesh(i);
+    meshes.push_back({{"index", i},
+                      {"name", g_scene.name(i)},
+                      {"path", g_scene.path(i)},
+                      {"vertices", mesh->vertices().size()},
+                      {"faces", mesh->vertex_indices().size()}});
   }
-  if (g_mouse_r_pressed) {
-    g_to_process_drag_r = true;
+  const auto &data = g_server_data;
+  nlohmann::json j = {{"meshes", meshes},
+                      {"running", IsAnyAlgorithmRunning()},
+                      {"message", g_callback_message},
+                      {"queued", data.jobs.size()}};
+  if (data.has_active) {
+    j["active"] = data.active.body;
   }
+  return j;
+}
 
-  g_prev_subwindow_id = g_subwindow_id;
-  for (uint32_t vidx = 0; vidx < static_cast<uint32_t>(g_views.size());
-       vidx++) {
-    if (IsCursorOnView(vidx)) {
-      g_subwindow_id = vidx;
-      break;
-    }
+// Reads "src" and "dst" of a job as indices of loaded meshes
+bool ReadServerMeshPair(const nlohmann::json &body, int &src_id, int &dst_id,
+                        std::string &error) {
+  src_id = -1;
+  dst_id = -1;
+  ReadParam(body, "src", src_id);
+  ReadParam(body, "dst", dst_id);
+  const int mesh_num = static_cast<int>(g_scene.size());
+  if (src_id < 0 || dst_id < 0 || mesh_num <= src_id || mesh_num <= dst_id) {
+    error = "src and dst must be indices of loaded meshes";
+    return false;
   }
+  if (src_id == dst_id) {
+    error = "Source and target must be different";
+    return false;
+  }
+  return true;
 }
 
-void LoadMesh(const std::string &path) {
-  if (4 <= g_meshes.size()) {
-    LOGE("#max_geom is 4\n");
-    return;
+// Paths of load and export jobs. They must be relative without ".." so
+// that clients cannot reach files outside of g_server_data.root.
+bool ResolveServerPath(const nlohmann::json &body, std::string &resolved,
+                       std::string &error) {
+  std::string path;
+  ReadParam(body, "path", path);
+  bool valid = !path.empty() && path[0] != '/' && path[0] != '\\' &&
+               path.find(':') == std::string::npos;
+  for (size_t begin = 0; valid && begin <= path.size();) {
+    size_t end = path.find_first_of("/\\", begin);
+    if (end == std::string::npos) {
+      end = path.size();
+    }
+    valid = path.compare(begin, end - begin, "..") != 0;
+    begin = end + 1;
   }
+  if (!valid) {
+    error = "path must be relative and must not contain \"..\"";
+    return false;
+  }
+  const auto &root = g_server_data.root;
+  resolved = root.empty() ? path : root + "/" + path;
+  return true;
+}
 
-  auto ext = ugu::ExtractExt(path);
-  auto mesh = ugu::RenderableMesh::Create();
-  if (ext == "obj" || ext == "OBJ") {
-    std::string obj_path = path;
-    std::string obj_dir = ExtractDir(obj_path);
-    if (!mesh->LoadObj(obj_path, obj_dir)) {
-      return;
+// Validates a job before it is queued so that bad requests are answered at
+// once. Optional "params" has the layout of "params" in session files.
+bool CheckServerJob(const nlohmann::json &body, const std::string &cmd,
+                    std::string &error) {
+  if (cmd == "load" || cmd == "export") {
+    std::string path;
+    return ResolveServerPath(body, path, error);
+  }
+  std::string method = "icp";
+  ReadParam(body, "method", method);
+  if (cmd == "align" && method != "icp" && method != "global") {
+    error = "Unknown method " + method;
+    return false;
+  }
+  if (!body.contains("params")) {
+    return true;
+  }
+  // Files are only named by "path" of load and export
+  const auto &params = body.at("params");
+  const std::pair<std::string, std::string> path_params[] = {
+      {"nonrigid_icp", "sequence_paths"},
+      {"nonrigid_icp", "sequence_output_dir"},
+      {"textrans", "vertex_channels_path"},
+      {"textrans", "extra_maps"},
+      {"deviation", "export_path"}};
+  for (const auto &[section, key] : path_params) {
+    if (params.is_object() && params.contains(section) &&
+        params.at(section).is_object() && params.at(section).contains(key)) {
+      error = section + "." + key + " cannot be set by server jobs";
+      return false;
     }
+  }
+  return CheckAlgorithmParams(params, true, error);
+}
 
-    auto mat = mesh->materials();
-    if (mat[0].diffuse_tex.empty()) {
-      mat[0].diffuse_tex = Image3b(1, 1);
-      auto &col = mat[0].diffuse_tex.at<Vec3b>(0, 0);
-
-      static uint32_t count = 0;
-      static Vec3b color_table[256] = {
-          {125, 125, 200}, {245, 156, 62}, {118, 184, 0}, {32, 33, 36}};
-      if (count == 0) {
-        size_t seed = 0;
-        std::uniform_int_distribution<int> dist(0, 255);
-        std::default_random_engine engine(static_cast<unsigned int>(seed));
-        for (int i = 4; i < 256; i++) {
-          color_table[i][0] = static_cast<uint8_t>(dist(engine));
-          color_table[i][1] = static_cast<uint8_t>(dist(engine));
-          color_table[i][2] = static_cast<uint8_t>(dist(engine));
-        }
+// Runs a job whose turn has come. Returns true if it was handed to the
+// algorithm thread, false if its result has already been sent.
+bool RunServerJob(const ServerRequest &job) {
+  const auto &body = job.body;
+  std::string cmd;
+  ReadParam(body, "cmd", cmd);
+  std::string error;
+  int src_id = -1;
+  int dst_id = -1;
+
+  if (cmd == "load") {
+    std::string path;
+    bool reload = false;
+    if (!ResolveServerPath(body, path, error)) {
+      SendServerEvent(job, "error", {{"message", error}});
+      return false;
+    }
+    ReadParam(body, "reload", reload);
+    for (size_t i = 0; i < g_scene.size() && !reload; i++) {
+      // Unmodified meshes stay warm with their BVHs and correspondence
+      // indices between jobs
+      if (g_scene.path(i) == path && g_scene.geometry_revision(i) == 0) {
+        SendServerEvent(job, "done",
+                        {{"ok", true}, {"mesh", i}, {"cached", true}});
+        return false;
       }
-      col = color_table[count % 256];
-      count++;
-
-      mat[0].diffuse_texname = "tmp.png";
-      mat[0].diffuse_texpath = "tmp.png";
-      mesh->set_materials(mat);
     }
-
-    g_mesh_names.push_back(ugu::ExtractFilename(obj_path, true));
-    g_mesh_paths.push_back(obj_path);
-    g_meshes.push_back(mesh);
-    g_model_matrices[mesh] = Eigen::Affine3f::Identity();
-    g_update_bvh[mesh] = true;
-    g_selected_positions[mesh] = {};
-    g_ignore_poly_ids[mesh] = {};
-  } else {
-    LOGE("Supported extensiton: .obj\n");
-    return;
+    const size_t org_mesh_num = g_scene.size();
+    LoadMesh(path);
+    if (org_mesh_num < g_scene.size()) {
+      SendServerEvent(
+          job, "done",
+          {{"ok", true}, {"mesh", org_mesh_num}, {"cached", false}});
+      return false;
+    }
+    error = "Failed to load " + path;
+  } else if (cmd == "export") {
+    int mesh_id = -1;
+    std::string path;
+    bool apply_transform = true;
+    ReadParam(body, "mesh", mesh_id);
+    ReadParam(body, "apply_transform", apply_transform);
+    if (!ResolveServerPath(body, path, error)) {
+      // Reported below
+    } else if (mesh_id < 0 || static_cast<int>(g_scene.size()) <= mesh_id) {
+      error = "mesh must be an index of a loaded mesh";
+    } else {
+      auto save_mesh = Mesh::Create(*g_scene.mesh(mesh_id).get());
+      if (apply_transform) {
+        save_mesh->Transform(g_scene.model_matrix(mesh_id));
+      }
+      if (save_mesh->WriteObj(path)) {
+        SendServerEvent(job, "done", {{"ok", true}, {"path", path}});
+        return false;
+      }
+      error = "Failed to write " + path;
+    }
+  } else if (CheckServerJob(body, cmd, error) &&
+             ReadServerMeshPair(body, src_id, dst_id, error) &&
+             (!body.contains("params") ||
+              AlgorithmParamsFromJson(body.at("params"), true, error))) {
+    // Params are committed only here, when the job is about to start
+    std::string method = "icp";
+    ReadParam(body, "method", method);
+    // Shown as selected in the UI
+    g_src_id = src_id;
+    g_dst_id = dst_id;
+    const auto &src_mesh = g_scene.mesh(src_id);
+    const auto &dst_mesh = g_scene.mesh(dst_id);
+    if (cmd == "align" && method == "icp") {
+      std::lock_guard<std::mutex> lock(icp_mtx);
+      PrepareRigidIcp(src_mesh, dst_mesh);
+      g_callback_finished = false;
+      g_icp_run = AlgorithmStatus::STARTED;
+    } else if (cmd == "align") {
+      std::lock_guard<std::mutex> lock(global_align_mtx);
+      g_global_align_data.src_mesh = src_mesh;
+      g_global_align_data.dst_mesh = dst_mesh;
+      g_callback_finished = false;
+      g_global_align_run = AlgorithmStatus::STARTED;
+    } else if (cmd == "nicp") {
+      std::lock_guard<std::mutex> lock(nonrigidicp_mtx);
+      g_nonrigidicp_data.src_mesh = src_mesh;
+      g_nonrigidicp_data.dst_mesh = dst_mesh;
+      g_callback_finished = false;
+      g_nonrigidicp_run = AlgorithmStatus::STARTED;
+    } else {
+      std::lock_guard<std::mutex> lock(textrans_mtx);
+      g_textrans_data.src_mesh = src_mesh;
+      g_textrans_data.dst_mesh = dst_mesh;
+      g_callback_finished = false;
+      g_textrans_run = AlgorithmStatus::STARTED;
+    }
+    return true;
   }
 
-  for (auto &view : g_views) {
-    // Temporary set for visibility
-    view.renderer->SetMesh(mesh, g_model_matrices.at(mesh), false);
-
-    view.ResetGl();
+  SendServerEvent(job, "error", {{"message", error}});
+  return false;
+}
 
-    // Reset camera pos
+// Called every frame on the main thread. status is answered at once. Other
+// requests are queued and run in order, each after the previous one and any
+// algorithm started from the UI have finished. Progress messages of the
+// running job are streamed as they change.
+void ProcessServerRequests() {
+  auto &data = g_server_data;
+  if (data.address.empty()) {
+    return;
+  }
 
-    Eigen::Vector3f bb_max, bb_min;
-    view.renderer->GetMergedBoundingBox(bb_max, bb_min);
-    float z_trans = (bb_max - bb_min).maxCoeff() * 2.0f;
-    view.renderer->SetNearFar(static_cast<float>(z_trans * 0.5f / 10),
-                              static_cast<float>(z_trans * 2.f * 10));
+  std::deque<ServerRequest> requests;
+  {
+    std::lock_guard<std::mutex> lock(server_mtx);
+    requests.swap(data.requests);
+  }
+  for (auto &request : requests) {
+    std::string cmd;
+    try {
+      ReadParam(request.body, "cmd", cmd);
+    } catch (const std::exception &) {
+      // Reported as unknown below
+    }
+    if (cmd == "status") {
+      SendServerEvent(request, "status", ServerStatusJson());
+    } else if (cmd == "load" || cmd == "export" || cmd == "align" ||
+               cmd == "nicp" || cmd == "textrans") {
+      std::string error;
+      bool valid = false;
+      try {
+        valid = CheckServerJob(request.body, cmd, error);
+      } catch (const std::exception &e) {
+        error = e.what();
+      }
+      if (!valid) {
+        SendServerEvent(request, "error", {{"message", error}});
+        continue;
+      }
+      data.jobs.push_back(std::move(request));
+      SendServerEvent(data.jobs.back(), "queued",
+                      {{"position", data.jobs.size()}});
+    } else {
+      SendServerEvent(request, "error",
+                      {{"message", "Unknown cmd \"" + cmd + "\""}});
+    }
+  }
 
-    Eigen::Affine3d c2w = Eigen::Affine3d::Identity();
-    c2w.translation() = Eigen::Vector3d(0, 0, z_trans);
-    view.camera->set_c2w(c2w);
+  if (data.has_active) {
+    if (IsAnyAlgorithmRunning()) {
+      if (g_callback_message != data.reported_message) {
+        data.reported_message = g_callback_message;
+        SendServerEvent(data.active, "progress",
+                        {{"message", g_callback_message}});
+      }
+      return;
+    }
+    // Nobody presses OK on the popup for a server job
+    RefreshChangedMeshes();
+    SendServerEvent(data.active, "done",
+                    {{"ok", g_callback_succeeded},
+                     {"message", g_callback_message}});
+    data.has_active = false;
+  }
 
-    view.SetDefaultDragSpeed();
+  while (!data.jobs.empty() && !IsAnyAlgorithmRunning()) {
+    ServerRequest job = std::move(data.jobs.front());
+    data.jobs.pop_front();
+    SendServerEvent(job, "started");
+    bool started = false;
+    try {
+      started = RunServerJob(job);
+    } catch (const std::exception &e) {
+      SendServerEvent(job, "error", {{"message", e.what()}});
+    }
+    if (started) {
+      data.reported_message = g_callback_message;
+      data.active = std::move(job);
+      data.has_active = true;
+      break;
+    }
   }
 }
 
 void drop_callback(GLFWwindow *window, int count, const char **paths) {
   (void)window;
+  RecordInput(InputEventType::DROP, {static_cast<double>(count), 0.0, 0.0, 0.0},
+              std::vector<std::string>(paths, paths + count));
   for (int i = 0; i < count; i++) {
     std::cout << "Dropped: " << i << "/" << count << " " << paths[i]
               << std::endl;
@@ -911,6 +8648,9 @@ void drop_callback(GLFWwindow *window, int count, const char **paths) {
 
 void window_size_callback(GLFWwindow *window, int width, int height) {
   (void)window;
+  RecordInput(InputEventType::WINDOW_SIZE,
+              {static_cast<double>(width), static_cast<double>(height), 0.0,
+               0.0});
 
   if (width < 1 && height < 1) {
     return;
@@ -926,6 +8666,69 @@ void window_size_callback(GLFWwindow *window, int width, int height) {
   }
 }
 
+// Rebuilds g_views as a cols x rows grid. Existing views keep their cameras
+// and new ones start from the camera of view 0. Must not be called while
+// views_mtx is held, e.g. from DrawImgui().
+void SetViewLayout(uint32_t cols, uint32_t rows) {
+  cols = std::clamp(cols, 1u, MAX_N_VIEW_COLS);
+  rows = std::clamp(rows, 1u, MAX_N_VIEW_ROWS);
+  const size_t view_num = static_cast<size_t>(cols) * rows;
+  if (cols == g_view_cols && rows == g_view_rows &&
+      g_views.size() == view_num) {
+    return;
+  }
+  PROFILE_SCOPE("SetViewLayout");
+
+  for (size_t vidx = view_num; vidx < g_views.size(); vidx++) {
+    g_views[vidx].image_cache.Release();
+    g_views[vidx].selection_overlay.Release();
+  }
+  const size_t org_view_num = g_views.size();
+  g_view_cols = cols;
+  g_view_rows = rows;
+  g_views.resize(view_num);
+
+  for (size_t vidx = org_view_num; vidx < view_num; vidx++) {
+    auto &view = g_views[vidx];
+    view.Init(static_cast<uint32_t>(vidx));
+    // RendererGl keeps GL buffers per instance, so meshes are uploaded again
+    // for this view
+    view.AddMeshesGl(0);
+    if (vidx == 0) {
+      continue;
+    }
+    const auto &src = g_views[0];
+    float near_z, far_z;
+    src.renderer->GetNearFar(near_z, far_z);
+    view.renderer->SetNearFar(near_z, far_z);
+    for (const auto &mesh : g_scene.meshes()) {
+      if (!src.IsShown(mesh)) {
+        view.SetShown(mesh, false);
+      }
+    }
+    for (const auto &mesh : g_scene.meshes()) {
+      if (src.IsShown(mesh)) {
+        view.SetShown(mesh, true);
+      }
+    }
+    view.camera->set_c2w(src.camera->c2w());
+    view.trans_speed = src.trans_speed;
+    view.wheel_speed = src.wheel_speed;
+    view.rotate_speed = src.rotate_speed;
+    view.offset_to_rot_center = src.offset_to_rot_center;
+  }
+
+  for (auto &view : g_views) {
+    auto org_c2w = view.camera->c2w();
+    view.Reset();
+    view.camera->set_c2w(org_c2w);
+  }
+
+  g_subwindow_id = ~0u;
+  g_prev_subwindow_id = ~0u;
+  g_face_select_data.stroking = false;
+}
+
 void framebuffer_size_callback(GLFWwindow *window, int width, int height) {
   (void)width, (void)height;
 
@@ -934,6 +8737,8 @@ void framebuffer_size_callback(GLFWwindow *window, int width, int height) {
 
 void cursor_enter_callback(GLFWwindow *window, int entered) {
   (void)window, (void)entered;
+  RecordInput(InputEventType::CURSOR_ENTER,
+              {static_cast<double>(entered), 0.0, 0.0, 0.0});
 
   g_to_process_drag_l = false;
   g_to_process_drag_r = false;
@@ -942,6 +8747,13 @@ void cursor_enter_callback(GLFWwindow *window, int entered) {
   g_subwindow_id = ~0u;
 }
 
+// Only recorded. Text input is handled by ImGui.
+void char_callback(GLFWwindow *window, unsigned int codepoint) {
+  (void)window;
+  RecordInput(InputEventType::CHAR,
+              {static_cast<double>(codepoint), 0.0, 0.0, 0.0});
+}
+
 void SetupWindow(GLFWwindow *window) {
   if (window == NULL) return;
   glfwMakeContextCurrent(window);
@@ -951,6 +8763,8 @@ void SetupWindow(GLFWwindow *window) {
 
   glfwSetKeyCallback(window, key_callback);
 
+  glfwSetCharCallback(window, char_callback);
+
   glfwSetMouseButtonCallback(window, mouse_button_callback);
 
   glfwSetScrollCallback(window, mouse_wheel_callback);
@@ -963,28 +8777,366 @@ void SetupWindow(GLFWwindow *window) {
   glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 }
 
-void DrawViews() {
-  glViewport(0, 0, g_width, g_height);
+// Dispatches the recorded events of the current frame
+void ReplayInput(GLFWwindow *window) {
+  auto &data = g_input_record;
+  while (data.next_event < data.events.size() &&
+         data.events[data.next_event].frame <= g_frame_count) {
+    const auto &event = data.events[data.next_event++];
+    const auto &a = event.args;
+    switch (event.type) {
+      case InputEventType::CURSOR_POS:
+        ImGui_ImplGlfw_CursorPosCallback(window, a[0], a[1]);
+        break;
+      case InputEventType::MOUSE_BUTTON:
+        ImGui_ImplGlfw_MouseButtonCallback(window, static_cast<int>(a[0]),
+                                           static_cast<int>(a[1]),
+                                           static_cast<int>(a[2]));
+        break;
+      case InputEventType::SCROLL:
+        ImGui_ImplGlfw_ScrollCallback(window, a[0], a[1]);
+        break;
+      case InputEventType::KEY:
+        ImGui_ImplGlfw_KeyCallback(
+            window, static_cast<int>(a[0]), static_cast<int>(a[1]),
+            static_cast<int>(a[2]), static_cast<int>(a[3]));
+        break;
+      case InputEventType::CHAR:
+        ImGui_ImplGlfw_CharCallback(window, static_cast<unsigned int>(a[0]));
+        break;
+      case InputEventType::CURSOR_ENTER:
+        ImGui_ImplGlfw_CursorEnterCallback(window, static_cast<int>(a[0]));
+        break;
+      case InputEventType::DROP: {
+        std::vector<const char *> paths;
+        for (const auto &path : event.paths) {
+          paths.push_back(path.c_str());
+        }
+        if (!paths.empty()) {
+          drop_callback(window, static_cast<int>(paths.size()), paths.data());
+        }
+        break;
+      }
+      case InputEventType::WINDOW_SIZE:
+        window_size_callback(window, static_cast<int>(a[0]),
+                             static_cast<int>(a[1]));
+        break;
+    }
+  }
+}
+
+bool IsReplayFinished() {
+  const auto &data = g_input_record;
+  const uint64_t last_frame =
+      data.events.empty() ? 0 : data.events.back().frame;
+  return data.next_event == data.events.size() &&
+         last_frame + data.settle_frames <= g_frame_count;
+}
+
+// Writes per-frame times and prints a summary. Returns false if the 95th
+// percentile exceeds the budget.
+bool ReportFrameTimes(const InputRecordData &data) {
+  std::ofstream ofs(data.frame_times_path);
+  ofs << "frame,ms" << std::endl;
+  for (size_t i = 0; i < data.frame_ms.size(); i++) {
+    ofs << i << "," << data.frame_ms[i] << std::endl;
+  }
+  if (data.frame_ms.empty()) {
+    return true;
+  }
+
+  std::vector<double> sorted = data.frame_ms;
+  std::sort(sorted.begin(), sorted.end());
+  auto percentile = [&](double p) {
+    return sorted[static_cast<size_t>(p * (sorted.size() - 1))];
+  };
+  const double mean =
+      std::accumulate(sorted.begin(), sorted.end(), 0.0) / sorted.size();
+  const double p95 = percentile(0.95);
+  std::cout << "Replayed " << sorted.size() << " frames. mean " << mean
+            << " ms, p50 " << percentile(0.5) << " ms, p95 " << p95
+            << " ms, max " << sorted.back() << " ms" << std::endl;
+
+  if (0.0 < data.frame_budget_ms && data.frame_budget_ms < p95) {
+    std::cout << "p95 frame time exceeds budget " << data.frame_budget_ms
+              << " ms" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Queues large meshes without up-to-date LOD proxies. Snapshots are taken
+// here so that the worker never reads meshes being edited. Nothing is
+// queued while algorithms may edit vertices.
+void RequestLodProxies() {
+  auto &data = g_lod_data;
+  if (!data.enable || IsAnyAlgorithmRunning()) {
+    return;
+  }
+  for (size_t i = 0; i < g_scene.size(); i++) {
+    const auto &mesh = g_scene.mesh(i);
+    const uint64_t revision = g_scene.geometry_revision(i);
+    if (mesh->vertex_indices().size() <
+        static_cast<size_t>(data.min_face_num)) {
+      continue;
+    }
+    const auto requested = data.requested.find(mesh);
+    if (requested != data.requested.end() && requested->second == revision) {
+      continue;
+    }
+    data.requested[mesh] = revision;
+
+    LodJob job;
+    job.mesh = mesh;
+    job.geometry_revision = revision;
+    job.snapshot = Mesh::Create(*mesh);
+    job.min_level_face_num = data.min_level_face_num;
+    job.max_level_num = data.max_level_num;
+    std::lock_guard<std::mutex> lock(lod_mtx);
+    data.jobs.push_back(std::move(job));
+  }
+}
+
+// Takes finished proxies. Results for meshes removed or edited in the
+// meantime are dropped. Proxies are registered to lod_renderer of a view
+// when it first draws them.
+void CollectLodProxies() {
+  std::vector<std::pair<RenderableMeshPtr, LodProxies>> finished;
+  {
+    std::lock_guard<std::mutex> lock(lod_mtx);
+    finished.swap(g_lod_data.finished);
+  }
+  for (auto &[mesh, lod] : finished) {
+    if (!g_scene.Has(mesh) ||
+        g_scene.geometry_revision(mesh) != lod.geometry_revision ||
+        lod.levels.empty()) {
+      continue;
+    }
+    g_lod_data.proxies[mesh] = std::move(lod);
+  }
+}
+
+void DrawViews() {
+  PROFILE_SCOPE("DrawViews");
+  glViewport(0, 0, g_width, g_height);
+
+  RequestLodProxies();
+  CollectLodProxies();
+  {
+    // ICP and NICP move meshes while running
+    std::lock_guard<std::mutex> lock_update(nonrigidicp_update_mtx);
+    for (size_t j = 0; j < g_scene.size(); j++) {
+      g_scene.RefreshSelectedPoints(j);
+    }
+  }
+
+  for (size_t i = 0; i < g_views.size(); i++) {
+    auto &view = g_views[i];
+
+    for (size_t j = 0; j < g_scene.size(); j++) {
+      if (view.HasSlot(g_scene.mesh(j))) {
+        view.renderer->SetMesh(g_scene.mesh(j), g_scene.model_matrix(j),
+                               g_scene.update_bvh(j));
+      }
+    }
+    view.SyncSelectedPositions();
+    auto [w, h] = GetWidthHeightForView();
+    // GL viewport origin is bottom-left while view offsets are top-left
+    const int gl_x = view.offset.x();
+    const int gl_y =
+        std::max(0, g_height - view.offset.y() - static_cast<int>(h));
+    view.renderer->SetViewport(static_cast<uint32_t>(gl_x),
+                               static_cast<uint32_t>(gl_y), w, h);
+    view.lod_renderer->SetViewport(static_cast<uint32_t>(gl_x),
+                                   static_cast<uint32_t>(gl_y), w, h);
+    const auto lod = view.SelectLod();
+    const uint64_t signature = view.RenderSignature(lod);
+    if (g_view_cache_available && signature == view.drawn_signature &&
+        view.image_cache.IsValid(w, h)) {
+      PROFILE_SCOPE("ViewImageCache::Restore");
+      view.image_cache.Restore(gl_x, gl_y);
+    } else {
+      if (!lod.empty()) {
+        PROFILE_GPU_SCOPE("SplitViewInfo::DrawLod");
+        view.DrawLod(lod);
+      } else {
+        PROFILE_SCOPE("RendererGl::Draw");
+        PROFILE_GPU_SCOPE("RendererGl::Draw");
+        view.renderer->Draw();
+        view.draw_count++;
+      }
+      if (g_view_cache_available) {
+        PROFILE_SCOPE("ViewImageCache::Store");
+        view.image_cache.Store(gl_x, gl_y, w, h);
+        view.drawn_signature = signature;
+      }
+    }
+    view.UpdateSelectionOverlay(!lod.empty());
+  }
+
+  for (size_t j = 0; j < g_scene.size(); j++) {
+    g_scene.update_bvh(j) = false;
+  }
+}
+
+// Sets faces under the pixels accepted by is_inside to the stroke state
+template <typename Func>
+void SelectFacesInRegion(int x0, int y0, int x1, int y1, Func is_inside) {
+  auto &data = g_face_select_data;
+  const auto &gbuf = data.gbuf;
+  const auto &view = g_views[data.view_id];
+  x0 = std::max(x0, 0);
+  y0 = std::max(y0, 0);
+  x1 = std::min(x1, gbuf.face_id.cols - 1);
+  y1 = std::min(y1, gbuf.face_id.rows - 1);
+
+  std::unordered_map<int, RenderableMeshPtr> id2mesh;
+  for (const auto &mesh : g_scene.meshes()) {
+    if (view.IsShown(mesh)) {
+      id2mesh[static_cast<int>(view.renderer->GetMeshId(mesh))] = mesh;
+    }
+  }
+
+  bool changed = false;
+  for (int y = y0; y <= y1; y++) {
+    for (int x = x0; x <= x1; x++) {
+      const int fid = gbuf.face_id.at<int>(y, x);
+      if (fid < 0 || !is_inside(x, y)) {
+        continue;
+      }
+      auto it = id2mesh.find(gbuf.geo_id.at<int>(y, x));
+      if (it == id2mesh.end()) {
+        continue;
+      }
+      auto &mask = g_scene.ignore_faces(it->second);
+      const auto ufid = static_cast<uint32_t>(fid);
+      if (mask.Test(ufid) != !data.erase) {
+        mask.Set(ufid, !data.erase);
+        changed = true;
+      }
+    }
+  }
+
+  if (changed) {
+    data.revision++;
+  }
+}
+
+void StampFaceSelectionBrush(const Eigen::Vector2d &pos) {
+  const int r = g_face_select_data.brush_radius;
+  const int cx = static_cast<int>(pos.x());
+  const int cy = static_cast<int>(pos.y());
+  SelectFacesInRegion(cx - r, cy - r, cx + r, cy + r, [&](int x, int y) {
+    return (x - cx) * (x - cx) + (y - cy) * (y - cy) <= r * r;
+  });
+}
+
+void SelectFacesInLasso() {
+  const auto &lasso = g_face_select_data.lasso;
+  if (lasso.size() < 3) {
+    return;
+  }
+  Eigen::Vector2f bb_min = lasso[0];
+  Eigen::Vector2f bb_max = lasso[0];
+  for (const auto &p : lasso) {
+    bb_min = bb_min.cwiseMin(p);
+    bb_max = bb_max.cwiseMax(p);
+  }
+  // Even-odd rule
+  SelectFacesInRegion(
+      static_cast<int>(bb_min.x()), static_cast<int>(bb_min.y()),
+      static_cast<int>(bb_max.x()) + 1, static_cast<int>(bb_max.y()) + 1,
+      [&](int x, int y) {
+        const float px = x + 0.5f;
+        const float py = y + 0.5f;
+        bool inside = false;
+        for (size_t i = 0, j = lasso.size() - 1; i < lasso.size(); j = i++) {
+          const auto &a = lasso[i];
+          const auto &b = lasso[j];
+          if ((a.y() > py) != (b.y() > py) &&
+              px < (b.x() - a.x()) * (py - a.y()) / (b.y() - a.y()) + a.x()) {
+            inside = !inside;
+          }
+        }
+        return inside;
+      });
+}
+
+// Called after DrawViews() so that the G-buffer holds the current frame.
+// Masks are not edited while algorithms, which read them, are running.
+void ProcessFaceSelection() {
+  PROFILE_SCOPE("ProcessFaceSelection");
+  auto &data = g_face_select_data;
+  if (data.tool == FaceSelectTool::NONE || IsAnyAlgorithmRunning()) {
+    data.stroking = false;
+    data.begin_stroke = false;
+    data.end_stroke = false;
+    return;
+  }
 
-  for (size_t i = 0; i < g_views.size(); i++) {
-    const auto &view = g_views[i];
+  if (data.begin_stroke) {
+    data.begin_stroke = false;
+    if (!ImGui::GetIO().WantCaptureMouse && g_subwindow_id != ~0u) {
+      data.stroking = true;
+      data.view_id = g_subwindow_id;
+      auto &view = g_views[data.view_id];
+      view.renderer->ReadGbuf();
+      view.renderer->GetGbuf(data.gbuf);
+      data.prev_pos = g_cursor_pos - view.offset.cast<double>();
+      data.lasso.clear();
+      if (data.tool == FaceSelectTool::BRUSH) {
+        StampFaceSelectionBrush(data.prev_pos);
+      }
+    }
+  }
 
-    for (const auto &mesh : g_meshes) {
-      view.renderer->SetMesh(mesh, g_model_matrices.at(mesh),
-                             g_update_bvh.at(mesh));
+  if (data.stroking) {
+    const auto &view = g_views[data.view_id];
+    const Eigen::Vector2d pos = g_cursor_pos - view.offset.cast<double>();
+    if (data.tool == FaceSelectTool::BRUSH) {
+      // Stamp along the segment so that fast strokes have no gaps
+      const double step = std::max(1.0, data.brush_radius * 0.5);
+      const double len = (pos - data.prev_pos).norm();
+      for (double t = step; t < len + step; t += step) {
+        StampFaceSelectionBrush(data.prev_pos +
+                                (pos - data.prev_pos) * std::min(t / len, 1.0));
+      }
+    } else if (data.lasso.empty() ||
+               (data.lasso.back() - pos.cast<float>()).norm() > 2.f) {
+      data.lasso.push_back(pos.cast<float>());
+    }
+    data.prev_pos = pos;
+
+    auto *draw_list = ImGui::GetForegroundDrawList();
+    const ImU32 col = IM_COL32(255, 0, 255, 255);
+    const ImVec2 offset(static_cast<float>(view.offset.x()),
+                        static_cast<float>(view.offset.y()));
+    if (data.tool == FaceSelectTool::BRUSH) {
+      draw_list->AddCircle({static_cast<float>(g_cursor_pos.x()),
+                            static_cast<float>(g_cursor_pos.y())},
+                           static_cast<float>(data.brush_radius), col);
+    } else {
+      std::vector<ImVec2> points;
+      for (const auto &p : data.lasso) {
+        points.push_back({p.x() + offset.x, p.y() + offset.y});
+      }
+      draw_list->AddPolyline(points.data(), static_cast<int>(points.size()),
+                             col, ImDrawFlags_Closed, 1.5f);
     }
-    const uint32_t offset_w = g_width / static_cast<uint32_t>(g_views.size());
-    view.renderer->SetViewport(static_cast<uint32_t>(offset_w * i), 0, offset_w,
-                               g_height);
-    view.renderer->Draw();
   }
 
-  for (const auto &mesh : g_meshes) {
-    g_update_bvh[mesh] = false;
+  if (data.end_stroke) {
+    data.end_stroke = false;
+    if (data.stroking && data.tool == FaceSelectTool::LASSO) {
+      SelectFacesInLasso();
+    }
+    data.stroking = false;
+    data.lasso.clear();
   }
 }
 
 void ProcessDrags() {
+  PROFILE_SCOPE("ProcessDrags");
   // std::lock_guard<std::mutex> lock(mouse_mtx);
 
   if (!ImGui::GetIO().WantCaptureMouse) {
@@ -992,6 +9144,12 @@ void ProcessDrags() {
       uint32_t vidx = g_subwindow_id;
       auto &view = g_views[vidx];
 
+      if (g_to_process_drag_l &&
+          g_face_select_data.tool != FaceSelectTool::NONE) {
+        // Consumed by ProcessFaceSelection()
+        g_to_process_drag_l = false;
+      }
+
       if (g_to_process_drag_l) {
         g_to_process_drag_l = false;
         Eigen::Vector2d diff = g_cursor_pos - g_prev_cursor_pos;
@@ -1053,13 +9211,7 @@ void ProcessDrags() {
               view.FindClosestSelectedPoint(g_cursor_pos);
 
           if (result.min_geoid == min_geoid && is_close) {
-            g_selected_positions[g_meshes[min_geoid]][id] = result;
-            for (size_t vidx_ = 0; vidx_ < g_views.size(); vidx_++) {
-              auto &view_ = g_views[vidx_];
-              view_.renderer->AddSelectedPositions(
-                  g_meshes[min_geoid],
-                  ExtractPos(g_selected_positions[g_meshes[min_geoid]]));
-            }
+            g_scene.SetSelectedPosition(min_geoid, id, result);
           } else {
             // std::cout << "Failed " << min_dist << std::endl;
           }
@@ -1081,6 +9233,7 @@ void ProcessDrags() {
 
   // Get visibile selected points
   {
+    PROFILE_SCOPE("VisibleSelectedPoints");
     for (uint32_t vidx = 0; vidx < static_cast<uint32_t>(g_views.size());
          vidx++) {
       auto &view = g_views[vidx];
@@ -1091,13 +9244,15 @@ void ProcessDrags() {
       Eigen::Matrix4f prj_mat = camera->ProjectionMatrixOpenGl(near_z, far_z);
 
       std::vector<TextRendererGl::Text> texts;
-      for (const auto &geo : g_meshes) {
-        if (!view.renderer->GetVisibility(geo)) {
+      for (size_t gidx = 0; gidx < g_scene.size(); gidx++) {
+        const auto &geo = g_scene.mesh(gidx);
+        if (!view.IsShown(geo)) {
           continue;
         }
 
-        for (size_t i = 0; i < g_selected_positions[geo].size(); i++) {
-          const auto &p = GetPos(g_selected_positions[geo][i]);
+        const auto &positions = g_scene.selected_points(gidx);
+        for (size_t i = 0; i < positions.size(); i++) {
+          const auto &p = positions[i];
 
           // p is back of the camera in GL coord (+Z)
           auto cam_p = view.renderer->GetCamera()->w2c().cast<float>() * p;
@@ -1120,7 +9275,7 @@ void ProcessDrags() {
 
           // Hit the target geomtery but on the another surface
           float dist = (GetPos(results[view.renderer->GetMeshId(geo)][0],
-                               view.renderer->GetMeshId(geo)) -
+                               static_cast<uint32_t>(gidx)) -
                         p)
                            .norm();
           if (dist > view.renderer->GetDepthThreshold()) {
@@ -1143,11 +9298,141 @@ void ProcessDrags() {
           texts.push_back(text);
         }
       }
+      uint64_t texts_signature = 14695981039346656037ull;
+      for (const auto &text : texts) {
+        texts_signature = HashBytes(texts_signature, text.body.data(),
+                                    text.body.size());
+        texts_signature = HashValue(texts_signature, text.x);
+        texts_signature = HashValue(texts_signature, text.y);
+      }
+      view.texts_signature = texts_signature;
       view.renderer->SetTexts(texts);
+      view.lod_renderer->SetTexts(texts);
+    }
+  }
+}
+
+void DrawImguiMemory() {
+  const std::array<const char *, 7> headers = {
+      "Mesh", "Geometry", "Textures", "Renderable", "GPU (est.)", "App",
+      "Total"};
+  if (!ImGui::BeginTable("memory_table", static_cast<int>(headers.size()) + 1,
+                         ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg |
+                             ImGuiTableFlags_SizingFixedFit)) {
+    return;
+  }
+  for (const auto &header : headers) {
+    ImGui::TableSetupColumn(header);
+  }
+  ImGui::TableSetupColumn("");
+  ImGui::TableHeadersRow();
+
+  MeshMemory sum;
+  for (size_t i = 0; i < g_scene.size(); i++) {
+    const MeshMemory memory = ComputeMeshMemory(i);
+    sum.geometry += memory.geometry;
+    sum.textures += memory.textures;
+    sum.renderable += memory.renderable;
+    sum.gpu += memory.gpu;
+    sum.app += memory.app;
+
+    ImGui::TableNextRow();
+    ImGui::TableNextColumn();
+    ImGui::Text("%zu : %s", i, g_scene.name(i).c_str());
+    for (const size_t bytes : {memory.geometry, memory.textures,
+                               memory.renderable, memory.gpu, memory.app,
+                               memory.total()}) {
+      ImGui::TableNextColumn();
+      ImGui::Text("%s", FormatBytes(bytes).c_str());
+    }
+    ImGui::TableNextColumn();
+    if (!g_scene.mesh(i)->HasIndepentUv()) {
+      continue;
+    }
+    // Algorithms may hold vertex ids of the mesh
+    if (IsAnyAlgorithmRunning()) {
+      ImGui::TextDisabled("Weld");
+    } else if (ImGui::Button(
+                   ("Weld###weld_mesh" + std::to_string(i)).c_str())) {
+      WeldMesh(i);
+    }
+  }
+
+  ImGui::TableNextRow();
+  ImGui::TableNextColumn();
+  ImGui::Text("Total");
+  for (const size_t bytes : {sum.geometry, sum.textures, sum.renderable,
+                             sum.gpu, sum.app, sum.total()}) {
+    ImGui::TableNextColumn();
+    ImGui::Text("%s", FormatBytes(bytes).c_str());
+  }
+  ImGui::TableNextColumn();
+  ImGui::EndTable();
+
+  ImGui::Text(
+      "Weld: share split-UV vertices except on uv seams. Vertex ids change.");
+}
+
+void DrawImguiLod() {
+  auto &data = g_lod_data;
+  ImGui::Checkbox("Draw proxies while the camera moves###lod_enable",
+                  &data.enable);
+  ImGui::InputInt("Min. faces###lod_min_face_num", &data.min_face_num);
+  ImGui::InputInt("Min. level faces###lod_min_level_face_num",
+                  &data.min_level_face_num);
+  ImGui::SliderInt("Max. levels###lod_max_level_num", &data.max_level_num, 1,
+                   5);
+  ImGui::InputFloat("Faces per pixel###lod_faces_per_pixel",
+                    &data.faces_per_pixel);
+  ImGui::InputFloat("Settle sec.###lod_settle_sec", &data.settle_sec);
+  data.min_face_num = std::max(data.min_face_num, 1);
+  data.min_level_face_num = std::max(data.min_level_face_num, 1);
+
+  bool building = false;
+  {
+    std::lock_guard<std::mutex> lock(lod_mtx);
+    building = data.building || !data.jobs.empty();
+  }
+  if (building) {
+    ImGui::Text("Building...");
+  }
+  for (const auto &[mesh, lod] : data.proxies) {
+    std::string levels;
+    for (const auto &level : lod.levels) {
+      levels += " " + std::to_string(level->vertex_indices().size());
     }
+    ImGui::Text("%s: %zu ->%s", g_scene.name(g_scene.Id(mesh)).c_str(),
+                mesh->vertex_indices().size(), levels.c_str());
+  }
+  // Levels are built once per geometry. Rebuild to apply new settings.
+  if (ImGui::Button("Rebuild###lod_rebuild")) {
+    data.requested.clear();
   }
 }
 
+// Text inputs bound to std::string. The buffer is filled from str every
+// frame so that values set elsewhere, e.g. by LoadSession(), are shown.
+bool InputTextString(const char *label, std::string &str, size_t capacity) {
+  std::vector<char> buf(capacity, '\0');
+  str.copy(buf.data(), std::min(str.size(), capacity - 1));
+  if (!ImGui::InputText(label, buf.data(), capacity)) {
+    return false;
+  }
+  str = buf.data();
+  return true;
+}
+
+bool InputTextMultilineString(const char *label, std::string &str,
+                              size_t capacity, const ImVec2 &size) {
+  std::vector<char> buf(capacity, '\0');
+  str.copy(buf.data(), std::min(str.size(), capacity - 1));
+  if (!ImGui::InputTextMultiline(label, buf.data(), capacity, size)) {
+    return false;
+  }
+  str = buf.data();
+  return true;
+}
+
 void DrawImguiGeneralWindow(bool &reset_points) {
   ImGui::SetNextWindowPos({0.f, 0.f}, ImGuiCond_Once);
   ImGui::SetNextWindowCollapsed(false, ImGuiCond_Once);
@@ -1157,16 +9442,66 @@ void DrawImguiGeneralWindow(bool &reset_points) {
   static char mesh_path[1024] = "";
   ImGui::InputText("Mesh path", mesh_path, 1024u);
   if (ImGui::Button("Load mesh")) {
-    LoadMesh(mesh_path);
+    if (IsAnyAlgorithmRunning()) {
+      ImGui::OpenPopup("Error");
+      g_error_message = "Wait for running algorithms to finish";
+    } else {
+      LoadMesh(mesh_path);
+    }
+  }
+  ImGui::SameLine();
+  ImGui::Checkbox("Weld split-UV vertices###weld_on_load", &g_weld_on_load);
+  ImGui::Checkbox("Decimate while loading to###stream_import",
+                  &g_stream_import_data.enable);
+  ImGui::SameLine();
+  ImGui::InputInt("faces###stream_import_faces",
+                  &g_stream_import_data.target_face_num);
+  g_stream_import_data.target_face_num =
+      std::max(g_stream_import_data.target_face_num, 100);
+
+  static char session_path[1024] = "session.devenir";
+  static bool session_embed = false;
+  ImGui::InputText("Session path", session_path, 1024u);
+  if (ImGui::Button("Save session")) {
+    if (!SaveSession(session_path, session_embed)) {
+      ImGui::OpenPopup("Error");
+      g_error_message = "Failed to save " + std::string(session_path);
+    }
+  }
+  ImGui::SameLine();
+  if (ImGui::Button("Open session")) {
+    if (IsAnyAlgorithmRunning()) {
+      ImGui::OpenPopup("Error");
+      g_error_message = "Wait for running algorithms to finish";
+    } else if (!LoadSession(session_path)) {
+      ImGui::OpenPopup("Error");
+      g_error_message = "Failed to open " + std::string(session_path);
+    }
+  }
+  ImGui::SameLine();
+  ImGui::Checkbox("Embed all meshes###session_embed", &session_embed);
+
+  static int view_layout[2] = {static_cast<int>(g_view_cols),
+                               static_cast<int>(g_view_rows)};
+  ImGui::InputInt2("View columns rows###view_layout", view_layout);
+  view_layout[0] =
+      std::clamp(view_layout[0], 1, static_cast<int>(MAX_N_VIEW_COLS));
+  view_layout[1] =
+      std::clamp(view_layout[1], 1, static_cast<int>(MAX_N_VIEW_ROWS));
+  ImGui::SameLine();
+  if (ImGui::Button("Apply###view_layout_apply")) {
+    // Views are rebuilt outside of DrawImgui() which holds views_mtx
+    g_pending_view_cols = static_cast<uint32_t>(view_layout[0]);
+    g_pending_view_rows = static_cast<uint32_t>(view_layout[1]);
   }
 
-  static int src_id = -1;
-  static int dst_id = -1;
+  int &src_id = g_src_id;
+  int &dst_id = g_dst_id;
   if (ImGui::BeginListBox("source", {50, 50})) {
-    if (g_meshes.empty()) {
+    if (g_scene.empty()) {
       src_id = -1;
     }
-    for (int n = 0; n < static_cast<int>(g_meshes.size()); ++n) {
+    for (int n = 0; n < static_cast<int>(g_scene.size()); ++n) {
       const bool is_selected = (src_id == n);
       if (ImGui::Selectable(std::to_string(n).c_str(), is_selected)) {
         src_id = n;
@@ -1176,10 +9511,10 @@ void DrawImguiGeneralWindow(bool &reset_points) {
   }
 
   if (ImGui::BeginListBox("target", {50, 50})) {
-    if (g_meshes.empty()) {
+    if (g_scene.empty()) {
       dst_id = -1;
     }
-    for (int n = 0; n < static_cast<int>(g_meshes.size()); ++n) {
+    for (int n = 0; n < static_cast<int>(g_scene.size()); ++n) {
       const bool is_selected = (dst_id == n);
       if (ImGui::Selectable(std::to_string(n).c_str(), is_selected)) {
         dst_id = n;
@@ -1202,16 +9537,16 @@ void DrawImguiGeneralWindow(bool &reset_points) {
     return true;
   };
 
-  RenderableMeshPtr src_mesh = 0 <= src_id ? g_meshes[src_id] : nullptr;
-  RenderableMeshPtr dst_mesh = 0 <= dst_id ? g_meshes[dst_id] : nullptr;
+  RenderableMeshPtr src_mesh = 0 <= src_id ? g_scene.mesh(src_id) : nullptr;
+  RenderableMeshPtr dst_mesh = 0 <= dst_id ? g_scene.mesh(dst_id) : nullptr;
 
   static bool with_scale = false;
   ImGui::Text("Alignment by Selected Points");
   ImGui::SameLine();
   if (ImGui::Button("Run####Alignment by Selected Points")) {
     if (validate_func()) {
-      auto src_points = ExtractPos(g_selected_positions[src_mesh]);
-      auto dst_points = ExtractPos(g_selected_positions[dst_mesh]);
+      auto src_points = ExtractPos(g_scene.selected_positions(src_mesh));
+      auto dst_points = ExtractPos(g_scene.selected_positions(dst_mesh));
 
       if (3 <= src_points.size() && src_points.size() == dst_points.size()) {
         Eigen::Affine3d src2dst;
@@ -1223,9 +9558,9 @@ void DrawImguiGeneralWindow(bool &reset_points) {
           src2dst =
               FindRigidTransformFrom3dCorrespondences(src_points, dst_points);
         }
-        g_model_matrices[src_mesh] =
-            src2dst.cast<float>() * g_model_matrices[src_mesh];
-        g_update_bvh[src_mesh] = true;
+        g_scene.model_matrix(src_mesh) =
+            src2dst.cast<float>() * g_scene.model_matrix(src_mesh);
+        g_scene.update_bvh(src_mesh) = true;
 
         reset_points = true;
 
@@ -1245,65 +9580,56 @@ void DrawImguiGeneralWindow(bool &reset_points) {
     ImGui::TreePop();
   }
 
-  ImGui::Text("Rigid ICP");
+  ImGui::Text("Global Alignment");
   ImGui::SameLine();
-  if (ImGui::Button("Run####Rigid ICP")) {
+  if (ImGui::Button("Run####Global Alignment")) {
     if (validate_func()) {
-      auto apply_trans = [&](const std::vector<Eigen::Vector3f> &points,
-                             const Eigen::Affine3f &T, bool is_normal = false) {
-        std::vector<Eigen::Vector3f> transed;
-        Eigen::Affine3f T_ = T;
-        if (is_normal) {
-          // Remove translation
-          T_.matrix().block(0, 3, 3, 1).setConstant(0.f);
-        }
-        for (const auto &p : points) {
-          Eigen::Vector3f t = T_ * p;
-          if (is_normal) {
-            t.normalize();
-          }
-          transed.push_back(t);
-        }
-        return transed;
-      };
-
-      auto transed_src_points =
-          apply_trans(src_mesh->vertices(), g_model_matrices[src_mesh]);
-      auto transed_dst_points =
-          apply_trans(dst_mesh->vertices(), g_model_matrices[dst_mesh]);
+      ImGui::OpenPopup("Algorithm Callback");
+      std::lock_guard<std::mutex> lock(global_align_mtx);
+      g_global_align_data.src_mesh = src_mesh;
+      g_global_align_data.dst_mesh = dst_mesh;
 
-      auto transed_src_normals =
-          apply_trans(src_mesh->normals(), g_model_matrices[src_mesh], true);
-      auto transed_dst_normals =
-          apply_trans(dst_mesh->normals(), g_model_matrices[dst_mesh], true);
+      g_callback_finished = false;
+      g_global_align_run = AlgorithmStatus::STARTED;
+    }
+  }
+  if (ImGui::TreeNodeEx("Option####OptionGlobal Alignment")) {
+    auto &align = g_global_align_data;
+    ImGui::InputFloat("voxel size (<=0: auto)###global_align_voxel",
+                      &align.voxel_size);
+    ImGui::InputFloat("feature radius (x voxel)###global_align_radius",
+                      &align.feature_radius);
+    ImGui::InputFloat("inlier distance (x voxel)###global_align_inlier",
+                      &align.inlier_dist);
+    ImGui::InputInt("RANSAC iter###global_align_ransac_iter",
+                    &align.ransac_iter);
+    ImGui::Checkbox("With scale###global_align_with_scale", &align.with_scale);
+    ImGui::Checkbox("Refine by Rigid ICP###global_align_run_icp",
+                    &align.run_icp);
+    ImGui::TreePop();
+  }
 
+  ImGui::Text("Rigid ICP");
+  ImGui::SameLine();
+  if (ImGui::Button("Run####Rigid ICP")) {
+    if (validate_func()) {
       ImGui::OpenPopup("Algorithm Callback");
       std::lock_guard<std::mutex> lock(icp_mtx);
-      g_icp_data.src_mesh = src_mesh;
-      g_icp_data.src_points = std::move(transed_src_points);
-      g_icp_data.dst_points = std::move(transed_dst_points);
-
-      g_icp_data.src_normals = std::move(transed_src_normals);
-      g_icp_data.dst_normals = std::move(transed_dst_normals);
-
-      g_icp_data.dst_faces = dst_mesh->vertex_indices();
-      g_icp_data.callback = IcpProcessCallback;
-      g_icp_data.output.loss_histroty.clear();
-      g_icp_data.output.transform_histry.clear();
+      PrepareRigidIcp(src_mesh, dst_mesh);
 
       g_callback_finished = false;
       g_icp_run = AlgorithmStatus::STARTED;
     }
   }
   if (ImGui::TreeNodeEx("Option####OptionRigid ICP")) {
-    static int corresp_mode = 1;
+    int corresp_mode = static_cast<int>(g_icp_data.corresp_type);
     ImGui::Text("Correspondence");
     ImGui::RadioButton("Point(Vertex)-to-Surface(Triangle)", &corresp_mode, 1);
     ImGui::SameLine();
     ImGui::RadioButton("Point(Vertex)-to-Point(Vertex)", &corresp_mode, 0);
     g_icp_data.corresp_type = static_cast<IcpCorrespType>(corresp_mode);
 
-    static int loss_mode = 1;
+    int loss_mode = static_cast<int>(g_icp_data.loss_type);
     ImGui::Text("Loss");
     ImGui::RadioButton("Point-to-Plane", &loss_mode, 1);
     ImGui::SameLine();
@@ -1331,6 +9657,52 @@ void DrawImguiGeneralWindow(bool &reset_points) {
             &g_icp_data.corresp_criteria.test_nearest)) {
     }
 
+    int sampling_mode = static_cast<int>(g_icp_data.sampling);
+    ImGui::Text("Source sampling");
+    ImGui::RadioButton("All###rigid_icp_sampling_all", &sampling_mode,
+                       static_cast<int>(IcpSampling::ALL));
+    ImGui::SameLine();
+    ImGui::RadioButton("Uniform###rigid_icp_sampling_uniform", &sampling_mode,
+                       static_cast<int>(IcpSampling::UNIFORM));
+    ImGui::SameLine();
+    ImGui::RadioButton("Normal-space###rigid_icp_sampling_normal",
+                       &sampling_mode,
+                       static_cast<int>(IcpSampling::NORMAL_SPACE));
+    ImGui::SameLine();
+    ImGui::RadioButton("Curvature###rigid_icp_sampling_curvature",
+                       &sampling_mode,
+                       static_cast<int>(IcpSampling::CURVATURE));
+    g_icp_data.sampling = static_cast<IcpSampling>(sampling_mode);
+    if (g_icp_data.sampling != IcpSampling::ALL) {
+      if (ImGui::InputInt("#samples###rigid_icp_sample_num",
+                          &g_icp_data.sample_num)) {
+        g_icp_data.sample_num = std::max(g_icp_data.sample_num, 3);
+      }
+      ImGui::Checkbox("Coarse-to-fine###rigid_icp_coarse_to_fine",
+                      &g_icp_data.coarse_to_fine);
+      if (g_icp_data.coarse_to_fine &&
+          ImGui::InputInt("#levels###rigid_icp_level_num",
+                          &g_icp_data.level_num)) {
+        g_icp_data.level_num = std::max(g_icp_data.level_num, 1);
+      }
+    }
+
+    ImGui::Checkbox("Specialized kernel###rigid_icp_specialized",
+                    &g_icp_data.specialized);
+    ImGui::InputInt("benchmark iter###rigid_icp_benchmark_iter",
+                    &g_icp_data.benchmark_iter);
+    g_icp_data.benchmark_iter = std::max(g_icp_data.benchmark_iter, 1);
+    ImGui::SameLine();
+    if (ImGui::Button("Benchmark###rigid_icp_benchmark") && validate_func()) {
+      ImGui::OpenPopup("Algorithm Callback");
+      std::lock_guard<std::mutex> lock(icp_mtx);
+      PrepareRigidIcp(src_mesh, dst_mesh);
+      g_icp_data.benchmark = true;
+
+      g_callback_finished = false;
+      g_icp_run = AlgorithmStatus::STARTED;
+    }
+
     ImGui::TreePop();
   }
 
@@ -1343,11 +9715,31 @@ void DrawImguiGeneralWindow(bool &reset_points) {
       g_nonrigidicp_data.src_mesh = src_mesh;
       g_nonrigidicp_data.dst_mesh = dst_mesh;
 
+      g_nonrigidicp_halt = false;
       g_callback_finished = false;
       g_nonrigidicp_run = AlgorithmStatus::STARTED;
     }
   }
   if (ImGui::TreeNodeEx("Option####OptionNonrigid ICP")) {
+    int engine_mode = static_cast<int>(g_nonrigidicp_data.engine);
+    ImGui::Text("Engine");
+    ImGui::RadioButton("Per-vertex affine", &engine_mode, 0);
+    ImGui::SameLine();
+    ImGui::RadioButton("Deformation graph", &engine_mode, 1);
+    g_nonrigidicp_data.engine = static_cast<NonrigidIcpEngine>(engine_mode);
+    if (g_nonrigidicp_data.engine == NonrigidIcpEngine::DEFORMATION_GRAPH) {
+      if (ImGui::InputInt("#nodes###nonrigid_icp_graph_node_num",
+                          &g_nonrigidicp_data.graph_node_num)) {
+        g_nonrigidicp_data.graph_node_num =
+            std::max(g_nonrigidicp_data.graph_node_num, 4);
+      }
+      if (ImGui::InputInt("#samples for data term###nonrigid_icp_graph_sample",
+                          &g_nonrigidicp_data.graph_sample_num)) {
+        g_nonrigidicp_data.graph_sample_num =
+            std::max(g_nonrigidicp_data.graph_sample_num, 1);
+      }
+      ImGui::Text("Self intersection and border checks are not used");
+    }
     ImGui::Checkbox("check self intersection",
                     &g_nonrigidicp_data.check_self_itersection);
     ImGui::InputFloat("angle threshold (rad)",
@@ -1366,7 +9758,11 @@ void DrawImguiGeneralWindow(bool &reset_points) {
                     &g_nonrigidicp_data.src_check_geometry_border);
 
     ImGui::InputDouble("max stiffness", &g_nonrigidicp_data.max_alpha);
-    ImGui::InputDouble("min stiffness", &g_nonrigidicp_data.min_alpha);
+    if (ImGui::InputDouble("min stiffness", &g_nonrigidicp_data.min_alpha)) {
+      g_nonrigidicp_data.sequence_max_alpha =
+          std::max(g_nonrigidicp_data.sequence_max_alpha,
+                   g_nonrigidicp_data.min_alpha);
+    }
     ImGui::InputDouble("stiffness factor", &g_nonrigidicp_data.gamma);
     ImGui::InputDouble("landmark weight", &g_nonrigidicp_data.beta);
 
@@ -1377,6 +9773,127 @@ void DrawImguiGeneralWindow(bool &reset_points) {
     ImGui::InputDouble("eps for params per stiffness",
                        &g_nonrigidicp_data.min_frobenius_norm_diff);
 
+    ImGui::Checkbox("Sequence###nonrigid_icp_sequence",
+                    &g_nonrigidicp_data.sequence_mode);
+    if (g_nonrigidicp_data.sequence_mode) {
+      std::string sequence_paths;
+      for (const auto &path : g_nonrigidicp_data.sequence_paths) {
+        sequence_paths += path + "\n";
+      }
+      ImGui::Text("Following target .obj paths (one per line)");
+      if (InputTextMultilineString("###nonrigid_icp_sequence_paths",
+                                   sequence_paths, 16384u, {360, 120})) {
+        g_nonrigidicp_data.sequence_paths.clear();
+        std::istringstream iss(sequence_paths);
+        std::string line;
+        while (std::getline(iss, line)) {
+          if (!line.empty()) {
+            g_nonrigidicp_data.sequence_paths.push_back(line);
+          }
+        }
+      }
+      InputTextString("Output dir###nonrigid_icp_sequence_out",
+                      g_nonrigidicp_data.sequence_output_dir, 1024u);
+      if (ImGui::InputDouble("max stiffness per frame",
+                             &g_nonrigidicp_data.sequence_max_alpha)) {
+        g_nonrigidicp_data.sequence_max_alpha =
+            std::max(g_nonrigidicp_data.sequence_max_alpha,
+                     g_nonrigidicp_data.min_alpha);
+      }
+      if (ImGui::InputInt("steps per frame###nonrigid_icp_sequence_step",
+                          &g_nonrigidicp_data.sequence_step)) {
+        g_nonrigidicp_data.sequence_step =
+            std::max(g_nonrigidicp_data.sequence_step, 1);
+      }
+    }
+
+    ImGui::TreePop();
+  }
+
+  ImGui::Text("Nonrigid ICP sweep");
+  ImGui::SameLine();
+  if (ImGui::Button("Run####Nonrigid ICP sweep")) {
+    if (validate_func()) {
+      ImGui::OpenPopup("Algorithm Callback");
+      std::lock_guard<std::mutex> lock(nonrigidicp_sweep_mtx);
+      g_nonrigidicp_sweep_data.src_mesh = src_mesh;
+      g_nonrigidicp_sweep_data.dst_mesh = dst_mesh;
+
+      g_callback_finished = false;
+      g_nonrigidicp_sweep_run = AlgorithmStatus::STARTED;
+    }
+  }
+  if (ImGui::TreeNodeEx("Option####OptionNonrigid ICP sweep")) {
+    auto &sweep = g_nonrigidicp_sweep_data;
+    ImGui::Text("Comma separated values. Others from Nonrigid ICP options");
+    auto input_values = [](const char *label, std::string &str) {
+      char buf[256];
+      snprintf(buf, sizeof(buf), "%s", str.c_str());
+      if (ImGui::InputText(label, buf, sizeof(buf))) {
+        str = buf;
+      }
+    };
+    input_values("max stiffness###sweep_max_alpha", sweep.max_alphas);
+    input_values("min stiffness###sweep_min_alpha", sweep.min_alphas);
+    input_values("landmark weight###sweep_beta", sweep.betas);
+    input_values("stiffness factor###sweep_gamma", sweep.gammas);
+    input_values("steps###sweep_step", sweep.steps);
+    input_values("#NearestNeighbors###sweep_nn_num", sweep.nn_nums);
+    input_values("angle threshold (rad)###sweep_angle", sweep.angle_rad_ths);
+    input_values("distance threshold###sweep_dist", sweep.dist_ths);
+    if (ImGui::InputInt("#threads###sweep_num_threads", &sweep.num_threads)) {
+      sweep.num_threads = std::max(sweep.num_threads, 1);
+    }
+
+    std::lock_guard<std::mutex> lock_results(sweep.results_mtx);
+    if (!sweep.results.empty() &&
+        ImGui::BeginTable("sweep_results", 8,
+                          ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg |
+                              ImGuiTableFlags_ScrollY,
+                          {0.f, 200.f})) {
+      ImGui::TableSetupColumn("max/min stiffness");
+      ImGui::TableSetupColumn("beta/gamma");
+      ImGui::TableSetupColumn("steps/nn");
+      ImGui::TableSetupColumn("angle/dist th");
+      ImGui::TableSetupColumn("msec");
+      ImGui::TableSetupColumn("landmark rms");
+      ImGui::TableSetupColumn("surface rms/max");
+      ImGui::TableSetupColumn("");
+      ImGui::TableHeadersRow();
+      for (size_t r = 0; r < sweep.results.size(); r++) {
+        const auto &res = sweep.results[r];
+        const auto &p = res.params;
+        ImGui::TableNextRow();
+        ImGui::TableNextColumn();
+        ImGui::Text("%.3f / %.3f", p.max_alpha, p.min_alpha);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.3f / %.3f", p.beta, p.gamma);
+        ImGui::TableNextColumn();
+        ImGui::Text("%d / %d", p.step, p.nn_num);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.3f / %.3f", p.angle_rad_th, p.dist_th);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.0f", res.msec);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.5f", res.landmark_rms);
+        ImGui::TableNextColumn();
+        ImGui::Text("%.5f / %.5f", res.surface_rms, res.surface_max);
+        ImGui::TableNextColumn();
+        // Both workers read g_nonrigidicp_data while running
+        if (g_nonrigidicp_run != AlgorithmStatus::HALTING ||
+            g_nonrigidicp_sweep_run != AlgorithmStatus::HALTING) {
+          ImGui::TextDisabled("Use");
+        } else if (ImGui::Button(
+                       ("Use###sweep_use" + std::to_string(r)).c_str())) {
+          auto src = g_nonrigidicp_data.src_mesh;
+          auto dst = g_nonrigidicp_data.dst_mesh;
+          g_nonrigidicp_data = p;
+          g_nonrigidicp_data.src_mesh = src;
+          g_nonrigidicp_data.dst_mesh = dst;
+        }
+      }
+      ImGui::EndTable();
+    }
     ImGui::TreePop();
   }
 
@@ -1401,19 +9918,162 @@ void DrawImguiGeneralWindow(bool &reset_points) {
       g_textrans_data.dst_size[1] =
           std::clamp(g_textrans_data.dst_size[1], 1, 16000);
     }
+    if (ImGui::InputInt("#NearestNeighbors###textrans_nn_num",
+                        &g_textrans_data.nn_num)) {
+      if (g_textrans_data.nn_num < 1) {
+        g_textrans_data.nn_num = 1;
+      }
+    }
+    ImGui::Checkbox("Per-vertex attributes###textrans_vertex_mode",
+                    &g_textrans_data.vertex_mode);
+    if (g_textrans_data.vertex_mode) {
+      ImGui::Checkbox("colors###textrans_vertex_colors",
+                      &g_textrans_data.vertex_colors);
+      ImGui::SameLine();
+      ImGui::Checkbox("normals###textrans_vertex_normals",
+                      &g_textrans_data.vertex_normals);
+      InputTextString("Float channels json###textrans_vertex_channels",
+                      g_textrans_data.vertex_channels_path, 1024u);
+    }
+    ImGui::Checkbox("Tiled (streams PNM)###textrans_tiled",
+                    &g_textrans_data.tiled);
+    if (g_textrans_data.tiled) {
+      if (ImGui::InputInt("Tile size###textrans_tile_size",
+                          &g_textrans_data.tile_size)) {
+        g_textrans_data.tile_size =
+            std::clamp(g_textrans_data.tile_size, 64, 4096);
+      }
+      if (ImGui::InputInt("Preview size###textrans_preview_size",
+                          &g_textrans_data.preview_size)) {
+        g_textrans_data.preview_size =
+            std::clamp(g_textrans_data.preview_size, 64, 8192);
+      }
+    }
+    int inpaint_mode = static_cast<int>(g_textrans_data.inpaint_method);
+    ImGui::Text("Inpaint");
+    ImGui::RadioButton("ugu::Inpaint", &inpaint_mode, 0);
+    ImGui::SameLine();
+    ImGui::RadioButton("Push-pull (parallel)", &inpaint_mode, 1);
+    g_textrans_data.inpaint_method =
+        static_cast<TextransInpaintMethod>(inpaint_mode);
+    if (g_textrans_data.inpaint_method == TextransInpaintMethod::PUSH_PULL) {
+      ImGui::InputInt("Margin (<=0: all)###textrans_inpaint_margin",
+                      &g_textrans_data.inpaint_margin);
+      ImGui::Checkbox("UV seam aware###textrans_inpaint_seam",
+                      &g_textrans_data.inpaint_seam_aware);
+    }
+    ImGui::Text("Extra maps (name=path_mat0;path_mat1 per line)");
+    InputTextMultilineString("###textrans_extra_maps",
+                             g_textrans_data.extra_maps, 4096u, {360, 80});
+    ImGui::Text("Cached correspondence: %s",
+                g_textrans_data.corresp.src_mesh != nullptr ? "yes" : "no");
+    ImGui::TreePop();
+  }
+
+  ImGui::Text("Deviation");
+  ImGui::SameLine();
+  if (ImGui::Button("Run####Deviation")) {
+    if (validate_func()) {
+      ImGui::OpenPopup("Algorithm Callback");
+      std::lock_guard<std::mutex> lock(deviation_mtx);
+      g_deviation_data.src_mesh = src_mesh;
+      g_deviation_data.dst_mesh = dst_mesh;
+
+      g_callback_finished = false;
+      g_deviation_run = AlgorithmStatus::STARTED;
+    }
+  }
+  if (ImGui::TreeNodeEx("Option####OptionDeviation")) {
+    auto &deviation = g_deviation_data;
+    ImGui::Checkbox("dst to src###deviation_bidirectional",
+                    &deviation.bidirectional);
+    ImGui::Checkbox("Colorize src###deviation_colorize", &deviation.colorize);
+    ImGui::InputFloat("Color max (<=0: p95)###deviation_color_max",
+                      &deviation.color_max);
+    ImGui::Checkbox("Report every Nonrigid ICP step###deviation_track",
+                    &deviation.track_nonrigidicp);
+    InputTextString("Export (empty: none)###deviation_export",
+                    deviation.export_path, 1024u);
+    if (g_deviation_run == AlgorithmStatus::HALTING) {
+      auto draw_stats = [](const char *name, const DeviationStats &stats) {
+        ImGui::Text("%s: rms %f mean %f", name, stats.rms, stats.mean);
+        ImGui::Text("  p50 %f p90 %f p95 %f p99 %f max %f", stats.p50,
+                    stats.p90, stats.p95, stats.p99, stats.max);
+      };
+      if (0 < deviation.src_stats.count) {
+        draw_stats("src->dst", deviation.src_stats);
+      }
+      if (0 < deviation.dst_stats.count) {
+        draw_stats("dst->src", deviation.dst_stats);
+      }
+      if (0 < deviation.src_stats.count) {
+        ImGui::Text("Hausdorff %f (%.1f ms)", deviation.hausdorff,
+                    deviation.msec);
+      }
+      if (deviation.colorized_mesh != nullptr &&
+          ImGui::Button("Restore colors###deviation_restore")) {
+        RestoreDeviationColors();
+      }
+    }
+    ImGui::TreePop();
+  }
+
+  if (ImGui::TreeNodeEx("Level of detail")) {
+    DrawImguiLod();
+    ImGui::TreePop();
+  }
+
+  if (ImGui::TreeNodeEx("Memory")) {
+    DrawImguiMemory();
+    ImGui::TreePop();
   }
 
   if (g_nonrigidicp_run == AlgorithmStatus::RUNNING) {
     std::lock_guard<std::mutex> lock_update(nonrigidicp_update_mtx);
     // OpenGL API must be called in the main thread
+    PROFILE_SCOPE("UpdateMesh");
     g_nonrigidicp_data.src_mesh->UpdateMesh();
+    g_render_revision++;
+  }
+
+  // Cleared before uploading so that a request made meanwhile is kept
+  if (g_textrans_update_mesh.exchange(false)) {
+    std::lock_guard<std::mutex> lock_update(nonrigidicp_update_mtx);
+    PROFILE_SCOPE("UpdateMesh");
+    g_textrans_data.src_mesh->UpdateMesh();
+    g_render_revision++;
   }
 
+  if (g_deviation_update_mesh) {
+    std::lock_guard<std::mutex> lock_update(nonrigidicp_update_mtx);
+    PROFILE_SCOPE("UpdateMesh");
+    g_deviation_data.colorized_mesh->UpdateMesh();
+    g_render_revision++;
+    g_deviation_update_mesh = false;
+  }
+
+  if (g_open_callback_popup) {
+    ImGui::OpenPopup("Algorithm Callback");
+    g_open_callback_popup = false;
+  }
+  if (g_open_error_popup) {
+    ImGui::OpenPopup("Error");
+    g_open_error_popup = false;
+  }
   ImGui::SetNextWindowSize({200.f, 300.f}, ImGuiCond_Once);
   if (ImGui::BeginPopupModal("Algorithm Callback")) {
     // Draw popup contents.
     ImGui::Text(g_callback_message.c_str());
 
+    if (!g_callback_finished && g_nonrigidicp_data.sequence_mode &&
+        g_nonrigidicp_run == AlgorithmStatus::RUNNING) {
+      if (g_nonrigidicp_halt) {
+        ImGui::TextDisabled("Stopping...");
+      } else if (ImGui::Button("Stop before next frame")) {
+        g_nonrigidicp_halt = true;
+      }
+    }
+
     if (g_callback_finished) {
       if (ImGui::Button("OK")) {
         g_callback_finished = true;
@@ -1442,27 +10102,64 @@ void DrawImguiGeneralWindow(bool &reset_points) {
 }
 
 void DrawImguiMeshes(SplitViewInfo &view, bool &reset_points) {
+  PROFILE_SCOPE("DrawImguiMeshes");
   const auto &transed_stats = view.renderer->GetTransedStats();
 
-  for (size_t i = 0; i < g_meshes.size(); i++) {
-    bool v = view.renderer->GetVisibility(g_meshes[i]);
+  {
+    auto &select = g_face_select_data;
+    int tool = static_cast<int>(select.tool);
+    ImGui::Text("Ignore face selection (left drag)");
+    ImGui::RadioButton("Off###face_select_off", &tool,
+                       static_cast<int>(FaceSelectTool::NONE));
+    ImGui::SameLine();
+    ImGui::RadioButton("Brush###face_select_brush", &tool,
+                       static_cast<int>(FaceSelectTool::BRUSH));
+    ImGui::SameLine();
+    ImGui::RadioButton("Lasso###face_select_lasso", &tool,
+                       static_cast<int>(FaceSelectTool::LASSO));
+    select.tool = static_cast<FaceSelectTool>(tool);
+    ImGui::SameLine();
+    ImGui::Checkbox("Erase###face_select_erase", &select.erase);
+    if (select.tool != FaceSelectTool::NONE && IsAnyAlgorithmRunning()) {
+      ImGui::TextDisabled("Paused while algorithms are running");
+    }
+    if (select.tool == FaceSelectTool::BRUSH) {
+      ImGui::SliderInt("Brush radius###face_select_radius",
+                       &select.brush_radius, 1, 200);
+    }
+    ImGui::Checkbox("Show ignored faces###face_select_show", &select.show);
+  }
+
+  for (size_t i = 0; i < g_scene.size(); i++) {
+    bool v = view.IsShown(g_scene.mesh(i));
     std::string label =
-        std::to_string(i) + " " + g_mesh_names[i] + ": " + g_mesh_paths[i];
-    if (ImGui::Checkbox(label.c_str(), &v)) {
-      view.renderer->SetVisibility(g_meshes[i], v);
+        std::to_string(i) + " " + g_scene.name(i) + ": " + g_scene.path(i);
+    if (ImGui::Checkbox(label.c_str(), &v) &&
+        !view.SetShown(g_scene.mesh(i), v)) {
+      g_open_error_popup = true;
+      g_error_message = "View " + std::to_string(view.id) + " shows " +
+                        std::to_string(RENDERER_SLOT_NUM) +
+                        " meshes at most. Hide one first.";
     }
-    Eigen::Vector3f pos_col =
-        view.renderer->GetSelectedPositionColor(g_meshes[i]);
-    if (ImGui::ColorEdit3((label + "select color").c_str(), pos_col.data(),
-                          ImGuiColorEditFlags_NoLabel)) {
-      view.renderer->AddSelectedPositionColor(g_meshes[i], pos_col);
+    // Selection colors are kept by renderer slots
+    if (view.HasSlot(g_scene.mesh(i))) {
+      Eigen::Vector3f pos_col =
+          view.renderer->GetSelectedPositionColor(g_scene.mesh(i));
+      if (ImGui::ColorEdit3((label + "select color").c_str(), pos_col.data(),
+                            ImGuiColorEditFlags_NoLabel)) {
+        view.renderer->AddSelectedPositionColor(g_scene.mesh(i), pos_col);
+      }
     }
 
     if (ImGui::Button(("Focus###focus" + std::to_string(i)).c_str())) {
-      view.SetProperCameraForTargetMesh(g_meshes[i]);
+      view.SetProperCameraForTargetMesh(g_scene.mesh(i));
     }
 
-    const auto &stat = transed_stats.at(g_meshes[i]);
+    const auto stat_it = transed_stats.find(g_scene.mesh(i));
+    const auto stat = stat_it != transed_stats.end()
+                          ? stat_it->second
+                          : g_scene.mesh(i)->GetStatsWithTransform(
+                                g_scene.model_matrix(i));
     ImGui::Text("Bounding Box Max: (%f, %f, %f)", stat.bb_max.x(),
                 stat.bb_max.y(), stat.bb_max.z());
     ImGui::Text("Bounding Box Min: (%f, %f, %f)", stat.bb_min.x(),
@@ -1481,16 +10178,16 @@ void DrawImguiMeshes(SplitViewInfo &view, bool &reset_points) {
     if (ImGui::Button(
             ("Move center to origin###move_center" + std::to_string(i))
                 .c_str())) {
-      Eigen::Affine3f model_mat = g_model_matrices.at(g_meshes[i]);
-      g_model_matrices[g_meshes[i]] =
+      Eigen::Affine3f model_mat = g_scene.model_matrix(i);
+      g_scene.model_matrix(i) =
           Eigen::Translation3f(-stat.center) * model_mat;
 
-      g_update_bvh[g_meshes[i]] = true;
+      g_scene.update_bvh(i) = true;
       reset_points = true;
     }
 
     {
-      auto &model_mat = g_model_matrices.at(g_meshes[i]);
+      auto &model_mat = g_scene.model_matrix(i);
       Eigen::Vector3f t, s;
       Eigen::Matrix3f R;
       DecomposeRts(model_mat, R, t, s);
@@ -1522,16 +10219,17 @@ void DrawImguiMeshes(SplitViewInfo &view, bool &reset_points) {
 
       if (update_rts) {
         model_mat = Eigen::Translation3f(t) * R * Eigen::Scaling(s);
-        g_update_bvh[g_meshes[i]] = true;
+        g_scene.update_bvh(i) = true;
         reset_points = true;
       }
     }
 
     if (ImGui::Button(("Apply transform###apply_transform" + std::to_string(i))
                           .c_str())) {
-      g_meshes[i]->Transform(g_model_matrices[g_meshes[i]]);
-      g_model_matrices[g_meshes[i]] = Eigen::Affine3f::Identity();
-      g_update_bvh[g_meshes[i]] = true;
+      g_scene.mesh(i)->Transform(g_scene.model_matrix(i));
+      g_scene.model_matrix(i) = Eigen::Affine3f::Identity();
+      g_scene.update_bvh(i) = true;
+      g_scene.geometry_revision(i)++;
       reset_points = true;
     }
 
@@ -1545,9 +10243,9 @@ void DrawImguiMeshes(SplitViewInfo &view, bool &reset_points) {
     }
     if (ImGui::Button((std::string("Export###mesh_export") + std::to_string(i))
                           .c_str())) {
-      auto save_mesh = Mesh::Create(*g_meshes[i].get());
+      auto save_mesh = Mesh::Create(*g_scene.mesh(i).get());
       if (apply_transform) {
-        save_mesh->Transform(g_model_matrices[g_meshes[i]]);
+        save_mesh->Transform(g_scene.model_matrix(i));
       }
       save_mesh->WriteObj(std::string(mesh_export_path_buf));
     }
@@ -1556,39 +10254,61 @@ void DrawImguiMeshes(SplitViewInfo &view, bool &reset_points) {
     // ImGui::EndListBox();
     const auto draw_list_size = ImVec2(360, 240);
     // const char *items[RendererGl::MAX_SELECTED_POS];
-    if (view.selected_point_idx.find(g_meshes[i]) ==
+    if (view.selected_point_idx.find(g_scene.mesh(i)) ==
         view.selected_point_idx.end()) {
-      view.selected_point_idx[g_meshes[i]] = 0;
+      view.selected_point_idx[g_scene.mesh(i)] = 0;
     }
-    auto &points = g_selected_positions[g_meshes[i]];
+    const auto &points = g_scene.selected_positions(i);
 
-    if (view.selected_point_idx[g_meshes[i]] >=
+    if (view.selected_point_idx[g_scene.mesh(i)] >=
         static_cast<int>(points.size())) {
-      view.selected_point_idx[g_meshes[i]] = 0;
+      view.selected_point_idx[g_scene.mesh(i)] = 0;
     }
 
-    std::vector<std::string> lines;  // For owership of const char*
-
-    int fill_digits = CalcFillDigits(points.size());
-    for (size_t pidx = 0; pidx < points.size(); pidx++) {
-      auto p_wld = GetPos(points[pidx]);
-      std::string line = ugu::zfill(pidx, fill_digits) + ": (" +
-                         std::to_string(points[pidx].intersection.fid) + ", " +
-                         std::to_string(points[pidx].intersection.u) + ", " +
-                         std::to_string(points[pidx].intersection.v) + ")" +
-                         " (" + std::to_string(p_wld[0]) + ", " +
-                         std::to_string(p_wld[1]) + ", " +
-                         std::to_string(p_wld[2]) + ")";
-      lines.push_back(line);
+    auto &cache = g_scene.point_list_cache(i);
+    {
+      const uint64_t selected_revision =
+          g_scene.selected_revision(i);
+      const uint64_t geometry_revision = g_scene.geometry_revision(i);
+      const Eigen::Matrix4f &model_matrix =
+          g_scene.model_matrix(i).matrix();
+      if (cache.selected_revision != selected_revision ||
+          cache.geometry_revision != geometry_revision ||
+          cache.model_matrix != model_matrix ||
+          cache.rows.size() != points.size()) {
+        cache.selected_revision = selected_revision;
+        cache.geometry_revision = geometry_revision;
+        cache.model_matrix = model_matrix;
+        cache.rows.assign(points.size(), std::string());
+      }
     }
+
     if (ImGui::BeginListBox((std::to_string(i) + " : " +
                              std::string("Points (fid, u, v) (x, y, z)"))
                                 .c_str(),
                             draw_list_size)) {
-      for (int n = 0; n < static_cast<int>(points.size()); ++n) {
-        const bool is_selected = (view.selected_point_idx[g_meshes[i]] == n);
-        if (ImGui::Selectable(lines[n].c_str(), is_selected)) {
-          view.selected_point_idx[g_meshes[i]] = n;
+      // Only visible rows are formatted
+      const int fill_digits = CalcFillDigits(points.size());
+      ImGuiListClipper clipper;
+      clipper.Begin(static_cast<int>(points.size()));
+      while (clipper.Step()) {
+        for (int n = clipper.DisplayStart; n < clipper.DisplayEnd; ++n) {
+          std::string &row = cache.rows[n];
+          if (row.empty()) {
+            const auto &res = points[n];
+            const auto p_wld = GetPos(res);
+            char buf[256];
+            snprintf(buf, sizeof(buf), ": (%d, %f, %f) (%f, %f, %f)",
+                     static_cast<int>(res.intersection.fid),
+                     res.intersection.u, res.intersection.v, p_wld[0],
+                     p_wld[1], p_wld[2]);
+            row = ugu::zfill(n, fill_digits) + buf;
+          }
+          const bool is_selected =
+              (view.selected_point_idx[g_scene.mesh(i)] == n);
+          if (ImGui::Selectable(row.c_str(), is_selected)) {
+            view.selected_point_idx[g_scene.mesh(i)] = n;
+          }
         }
       }
       ImGui::EndListBox();
@@ -1597,10 +10317,10 @@ void DrawImguiMeshes(SplitViewInfo &view, bool &reset_points) {
     if (ImGui::Button((std::string("Remove###remove_point") + std::to_string(i))
                           .c_str())) {
       if (static_cast<int>(points.size()) >
-          view.selected_point_idx[g_meshes[i]]) {
-        points.erase(points.begin() + view.selected_point_idx[g_meshes[i]]);
+          view.selected_point_idx[g_scene.mesh(i)]) {
+        g_scene.RemoveSelectedPosition(
+            i, view.selected_point_idx[g_scene.mesh(i)]);
       }
-      reset_points = true;
     }
 
     static PointOnFaceType pof_type = PointOnFaceType::POINT_ON_TRIANGLE;
@@ -1644,17 +10364,16 @@ void DrawImguiMeshes(SplitViewInfo &view, bool &reset_points) {
         }
 
         if (!pofs.empty()) {
-          g_selected_positions[g_meshes[i]].clear();
+          std::vector<CastRayResult> results;
           for (const auto &pof : pofs) {
             CastRayResult res;
             res.min_geoid = i;
             res.intersection.fid = pof.fid;
             res.intersection.u = pof.u;
             res.intersection.v = pof.v;
-            g_selected_positions[g_meshes[i]].push_back(res);
+            results.push_back(res);
           }
-
-          reset_points = true;
+          g_scene.SetSelectedPositions(i, results);
         }
       }
     }
@@ -1681,6 +10400,38 @@ void DrawImguiMeshes(SplitViewInfo &view, bool &reset_points) {
       }
       WritePoints(std::string(export_path_buf), pofs, pof_type);
     }
+    const auto stream_source =
+        g_stream_import_data.sources.find(g_scene.mesh(i));
+    if (stream_source != g_stream_import_data.sources.end()) {
+      ImGui::SameLine();
+      // Streams the original OBJ again on the algorithm thread
+      if (g_reproject_run != AlgorithmStatus::HALTING) {
+        ImGui::TextDisabled("Export on original");
+      } else if (ImGui::Button(
+                     (std::string("Export on original###export_original") +
+                      std::to_string(i))
+                         .c_str())) {
+        if (g_scene.geometry_revision(i) != 0) {
+          ImGui::OpenPopup("Error");
+          g_error_message = "Vertices were edited after decimation";
+        } else {
+          std::lock_guard<std::mutex> lock(reproject_mtx);
+          auto &data = g_reproject_data;
+          data.source = stream_source->second;
+          data.trans = g_scene.model_matrix(i);
+          data.local_points.clear();
+          for (const auto &p : points) {
+            data.local_points.push_back(data.trans.inverse() * GetPos(p));
+          }
+          data.export_path = export_path_buf;
+          data.pof_type = pof_type;
+
+          g_open_callback_popup = true;
+          g_callback_finished = false;
+          g_reproject_run = AlgorithmStatus::STARTED;
+        }
+      }
+    }
 
     static char ignore_poly_path_buf[1024] = "./ignore_polygons.json";
     ImGui::InputText(
@@ -1688,14 +10439,34 @@ void DrawImguiMeshes(SplitViewInfo &view, bool &reset_points) {
          std::to_string(i))
             .c_str(),
         ignore_poly_path_buf, 1024);
-    if (ImGui::Button((std::string("Import###poly_export") + std::to_string(i))
-                          .c_str())) {
-      g_ignore_poly_ids[g_meshes[i]] = LoadIdsJson(ignore_poly_path_buf);
+    // Algorithms read the masks while running
+    const bool mask_locked = IsAnyAlgorithmRunning();
+    if (mask_locked) {
+      ImGui::TextDisabled("Import");
+    } else if (ImGui::Button(
+                   (std::string("Import###poly_export") + std::to_string(i))
+                       .c_str())) {
+      g_scene.ignore_faces(i).SetIds(
+          LoadIdsJson(ignore_poly_path_buf));
+      g_face_select_data.revision++;
     }
     ImGui::SameLine();
     if (ImGui::Button((std::string("Export###poly_export") + std::to_string(i))
                           .c_str())) {
-      WriteIdsJson(ignore_poly_path_buf, g_ignore_poly_ids[g_meshes[i]]);
+      WriteIdsJson(ignore_poly_path_buf,
+                   g_scene.ignore_faces(i).ToIds());
+    }
+    ImGui::SameLine();
+    ImGui::Text("%d ignored faces",
+                static_cast<int>(g_scene.ignore_faces(i).Count()));
+    ImGui::SameLine();
+    if (mask_locked) {
+      ImGui::TextDisabled("Clear");
+    } else if (ImGui::Button(
+                   (std::string("Clear###poly_clear") + std::to_string(i))
+                       .c_str())) {
+      g_scene.ignore_faces(i).Reset();
+      g_face_select_data.revision++;
     }
   }
 }
@@ -1889,7 +10660,49 @@ void DrawImguiCamera(SplitViewInfo &view) {
   }
 }
 
+#ifdef DEVENIR_USE_PROFILER
+void DrawImguiProfiler() {
+  // Rolling statistics over the last second
+  const auto stats = g_profiler.Stats(1.0, "Frame");
+  ImGui::SetNextWindowPos({10.f, 10.f}, ImGuiCond_Once);
+  ImGui::Begin("Profiler", &g_show_profiler,
+               ImGuiWindowFlags_AlwaysAutoResize |
+                   ImGuiWindowFlags_NoFocusOnAppearing);
+  ImGui::Text("F11: toggle, F12: write %s",
+              "devenir_trace.json (last 10 sec.)");
+  if (!g_profiler.gpu_timer_available()) {
+    ImGui::Text("GPU timer queries are not available");
+  }
+  if (ImGui::BeginTable("profiler_stages", 4,
+                        ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg)) {
+    ImGui::TableSetupColumn("Stage");
+    ImGui::TableSetupColumn("Track");
+    ImGui::TableSetupColumn("ms / frame");
+    ImGui::TableSetupColumn("max ms");
+    ImGui::TableHeadersRow();
+    for (const auto &stat : stats) {
+      ImGui::TableNextRow();
+      ImGui::TableNextColumn();
+      ImGui::Text("%s", stat.name);
+      ImGui::TableNextColumn();
+      if (stat.tid == Profiler::kGpuTid) {
+        ImGui::Text("GPU");
+      } else {
+        ImGui::Text("CPU %u", stat.tid);
+      }
+      ImGui::TableNextColumn();
+      ImGui::Text("%.3f", stat.avg_ms);
+      ImGui::TableNextColumn();
+      ImGui::Text("%.3f", stat.max_ms);
+    }
+    ImGui::EndTable();
+  }
+  ImGui::End();
+}
+#endif
+
 void DrawImgui(GLFWwindow *window) {
+  PROFILE_SCOPE("DrawImgui");
   std::lock_guard<std::mutex> lock(views_mtx);
 
   bool reset_points = false;
@@ -1901,8 +10714,10 @@ void DrawImgui(GLFWwindow *window) {
 
     ImGui::SetNextWindowSize({static_cast<float>(w / 2), static_cast<float>(h)},
                              ImGuiCond_Once);
-    ImGui::SetNextWindowPos({static_cast<float>(w * (j + 0.5)), 50.f},
-                            ImGuiCond_Once);
+    ImGui::SetNextWindowPos(
+        {static_cast<float>(view.offset.x() + w / 2),
+         static_cast<float>(view.offset.y()) + 50.f},
+        ImGuiCond_Once);
     ImGui::SetNextWindowCollapsed(true, ImGuiCond_Once);
 
     ImGui::Begin(title.c_str());
@@ -1922,35 +10737,61 @@ void DrawImgui(GLFWwindow *window) {
   DrawImguiGeneralWindow(reset_points);
 
   if (reset_points) {
-    for (auto &view : g_views) {
-      view.ResetGl();
-    }
-    for (size_t gidx = 0; gidx < g_meshes.size(); gidx++) {
-      for (size_t vidx = 0; vidx < g_views.size(); vidx++) {
-        auto &view = g_views[vidx];
-        view.renderer->AddSelectedPositions(
-            g_meshes[gidx], ExtractPos(g_selected_positions[g_meshes[gidx]]));
-      }
+    RefreshChangedMeshes();
+  }
+
+  // Drawn under the divider lines and ImGui windows
+  auto drawlist = ImGui::GetBackgroundDrawList();
+  for (const auto &view : g_views) {
+    if (!view.selection_overlay.visible) {
+      continue;
     }
+    const ImVec2 p_min(static_cast<float>(view.offset.x()),
+                       static_cast<float>(view.offset.y()));
+    drawlist->AddImage((ImTextureID)(intptr_t)view.selection_overlay.tex,
+                       p_min, {p_min.x + w, p_min.y + h});
   }
 
   // Draw divider lines
-  auto drawlist = ImGui::GetBackgroundDrawList();
-  for (size_t vidx = 0; vidx < g_views.size() - 1; vidx++) {
-    const float thickness = 2.f;
-    float w_c = static_cast<float>((vidx + 1) * w) - thickness / 2;
-    drawlist->AddLine({w_c, 0.f}, {w_c, static_cast<float>(h)},
-                      ImGui::GetColorU32(IM_COL32(50, 50, 50, 255)), thickness);
+  const float thickness = 2.f;
+  const ImU32 divider_col = ImGui::GetColorU32(IM_COL32(50, 50, 50, 255));
+  const float grid_w = static_cast<float>(w * g_view_cols);
+  const float grid_h = static_cast<float>(h * g_view_rows);
+  for (uint32_t col = 1; col < g_view_cols; col++) {
+    float w_c = static_cast<float>(col * w) - thickness / 2;
+    drawlist->AddLine({w_c, 0.f}, {w_c, grid_h}, divider_col, thickness);
+  }
+  for (uint32_t row = 1; row < g_view_rows; row++) {
+    float h_c = static_cast<float>(row * h) - thickness / 2;
+    drawlist->AddLine({0.f, h_c}, {grid_w, h_c}, divider_col, thickness);
+  }
+
+#ifdef DEVENIR_USE_PROFILER
+  if (g_show_profiler) {
+    DrawImguiProfiler();
   }
+#endif
 
   ImGui::Render();
   int display_w, display_h;
   glfwGetFramebufferSize(window, &display_w, &display_h);
   glViewport(0, 0, display_w, display_h);
+  PROFILE_SCOPE("ImGui_ImplOpenGL3_RenderDrawData");
+  PROFILE_GPU_SCOPE("ImGui_ImplOpenGL3_RenderDrawData");
   ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 }
 
 void Draw(GLFWwindow *window) {
+#ifdef DEVENIR_USE_PROFILER
+  g_profiler.CollectGpu();
+#endif
+  PROFILE_SCOPE("Frame");
+  if (g_pending_view_cols != 0 && g_pending_view_rows != 0) {
+    SetViewLayout(g_pending_view_cols, g_pending_view_rows);
+    g_pending_view_cols = 0;
+    g_pending_view_rows = 0;
+  }
+
   glClear(GL_COLOR_BUFFER_BIT);
   // glClearColor(g_views[0].clear_color.x(), g_views[0].clear_color.y(),
   //              g_views[0].clear_color.z(), 1.f);
@@ -1963,6 +10804,7 @@ void Draw(GLFWwindow *window) {
   DrawViews();
 
   ProcessDrags();
+  ProcessFaceSelection();
   glClear(GL_DEPTH_BUFFER_BIT);
 
   DrawImgui(window);
@@ -1970,6 +10812,52 @@ void Draw(GLFWwindow *window) {
   glfwSwapBuffers(window);
 }
 
+// Opened once the views are ready
+std::string g_startup_session_path;
+
+bool ParseArgs(int argc, char **argv) {
+  auto &data = g_input_record;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool has_value = i + 1 < argc;
+    if (arg == "--record" && has_value) {
+      data.recording = true;
+      data.record_path = argv[++i];
+    } else if (arg == "--replay" && has_value) {
+      data.replaying = true;
+      data.replay_path = argv[++i];
+    } else if (arg == "--frame-times" && has_value) {
+      data.frame_times_path = argv[++i];
+    } else if (arg == "--frame-budget-ms" && has_value) {
+      data.frame_budget_ms = std::atof(argv[++i]);
+    } else if (arg == "--session" && has_value) {
+      g_startup_session_path = argv[++i];
+    } else if (arg == "--server" && has_value) {
+      g_server_data.address = argv[++i];
+    } else if (arg == "--server-root" && has_value) {
+      g_server_data.root = argv[++i];
+    } else if (arg == "--views" && has_value) {
+      unsigned int cols = 0, rows = 0;
+      if (std::sscanf(argv[++i], "%ux%u", &cols, &rows) != 2 || cols < 1 ||
+          MAX_N_VIEW_COLS < cols || rows < 1 || MAX_N_VIEW_ROWS < rows) {
+        std::cout << "--views expects CxR, e.g. 2x2, up to "
+                  << MAX_N_VIEW_COLS << "x" << MAX_N_VIEW_ROWS << std::endl;
+        return false;
+      }
+      g_view_cols = cols;
+      g_view_rows = rows;
+    } else {
+      std::cout << "Unknown argument: " << arg << std::endl;
+      return false;
+    }
+  }
+  if (data.recording && data.replaying) {
+    std::cout << "--record and --replay are exclusive" << std::endl;
+    return false;
+  }
+  return true;
+}
+
 void PrintUsage() {
   std::string usage =
       R"(########################### Devenir User Guide #################################
@@ -1981,14 +10869,53 @@ Camera Rotation (pitch, yaw): Left drag
 
 Point Add                   : Right click on a mesh
 Point Move                  : Right drag near a point
-###############################################################################)";
+Ignore Face Brush/Lasso     : Left drag with a selection tool enabled
+
+Open Session                : "Open session" button or --session a.devenir
+View Layout (columns x rows): "View columns rows" or --views 2x2
+
+Job Server                  : --server unix:/tmp/devenir.sock or tcp:7070
+                              (127.0.0.1 unless tcp:<host>:<port>)
+                              One JSON per line, e.g.
+                              {"id":1,"cmd":"load","path":"a.obj"}
+                              cmd: load, align, nicp, textrans, export,
+                              status
+                              Paths are relative to --server-root dir
+                              (working directory by default)
+
+Record Input                : --record input.json
+Replay Input                : --replay input.json [--frame-times frame.csv]
+                              [--frame-budget-ms 33.3]
+)";
+#ifdef DEVENIR_USE_PROFILER
+  usage += R"(
+Profiler Overlay            : F11
+Write Trace (last 10 sec.)  : F12 (devenir_trace.json)
+)";
+#endif
+  usage += std::string(79, '#');
 
   std::cout << usage << std::endl;
 }
 
 }  // namespace
 
-int main(int, char **) {
+int main(int argc, char **argv) {
+  if (!ParseArgs(argc, argv)) {
+    return 1;
+  }
+  if (g_input_record.replaying) {
+    if (!LoadInputRecord(g_input_record.replay_path, g_input_record)) {
+      std::cout << "Failed to load " << g_input_record.replay_path
+                << std::endl;
+      return 1;
+    }
+    g_width = g_input_record.width;
+    g_height = g_input_record.height;
+  }
+  g_input_record.width = g_width;
+  g_input_record.height = g_height;
+
   // Setup window
   glfwSetErrorCallback(glfw_error_callback);
   if (!glfwInit()) return 1;
@@ -2029,12 +10956,21 @@ int main(int, char **) {
 
 #endif
 
+  // Replayed input must not be mixed with live input
+  if (g_input_record.replaying) {
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+  }
+
   // Create window with graphics context
   GLFWwindow *window = glfwCreateWindow(
       g_width, g_height, "Devenir: An Interactive Mesh Retopology Tool", NULL,
       NULL);
 
   SetupWindow(window);
+  if (g_input_record.replaying) {
+    // Frame times are not capped by the display
+    glfwSwapInterval(0);
+  }
 
   // Setup Dear ImGui context
   IMGUI_CHECKVERSION();
@@ -2051,6 +10987,14 @@ int main(int, char **) {
     return 1;
   }
 
+#ifdef DEVENIR_USE_PROFILER
+  g_profiler.SetThreadName("main");
+#if !defined(IMGUI_IMPL_OPENGL_ES2) && !defined(IMGUI_IMPL_OPENGL_ES3)
+  g_profiler.SetGpuTimerAvailable(
+      GLAD_VERSION_MAJOR(version) * 10 + GLAD_VERSION_MINOR(version) >= 33);
+#endif
+#endif
+
   // Setup Dear ImGui style
   ImGui::StyleColorsDark();
   // ImGui::StyleColorsLight();
@@ -2062,14 +11006,31 @@ int main(int, char **) {
 
   glEnable(GL_DEPTH_TEST);
 
-  g_views.resize(MAX_N_SPLIT_WIDTH);
+#if !defined(IMGUI_IMPL_OPENGL_ES2)
+  g_view_cache_available =
+      GLAD_VERSION_MAJOR(version) * 10 + GLAD_VERSION_MINOR(version) >= 30;
+#endif
 
-  for (size_t vidx = 0; vidx < g_views.size(); vidx++) {
-    auto &view = g_views[vidx];
-    view.Init(static_cast<uint32_t>(vidx));
+  SetViewLayout(g_view_cols, g_view_rows);
+
+  if (!g_startup_session_path.empty()) {
+    LoadSession(g_startup_session_path);
+  }
+
+  std::thread server_thread;
+  if (!g_server_data.address.empty()) {
+    const SocketHandle listen_socket = OpenServerSocket(g_server_data.address);
+    if (listen_socket == kInvalidSocket) {
+      std::cout << "Failed to listen on " << g_server_data.address
+                << std::endl;
+      return 1;
+    }
+    std::cout << "Listening on " << g_server_data.address << std::endl;
+    server_thread = std::thread(ServerProcess, listen_socket);
   }
 
   std::thread algorithm_thread(AlgorithmProcess);
+  std::thread lod_thread(LodProcess);
 
   PrintUsage();
 
@@ -2077,12 +11038,40 @@ int main(int, char **) {
   while (!glfwWindowShouldClose(window)) {
     glfwPollEvents();
 
+    // Replayed callbacks run work such as ray casts, so they are timed too
+    const double frame_start = glfwGetTime();
+    if (g_input_record.replaying) {
+      ReplayInput(window);
+    }
+
     glfwMakeContextCurrent(window);
     Draw(window);
 
+    ProcessServerRequests();
+
     glViewport(0, 0, g_width, g_height);
 
+    if (g_input_record.replaying) {
+      g_input_record.frame_ms.push_back((glfwGetTime() - frame_start) * 1e3);
+      if (IsReplayFinished()) {
+        glfwSetWindowShouldClose(window, GLFW_TRUE);
+      }
+    }
+
     g_first_frame = false;
+    g_frame_count++;
+  }
+
+  int ret = 0;
+  if (g_input_record.recording) {
+    if (!WriteInputRecord(g_input_record.record_path, g_input_record)) {
+      std::cout << "Failed to write " << g_input_record.record_path
+                << std::endl;
+      ret = 1;
+    }
+  }
+  if (g_input_record.replaying && !ReportFrameTimes(g_input_record)) {
+    ret = 1;
   }
 
   // Cleanup
@@ -2095,6 +11084,10 @@ int main(int, char **) {
 
   g_algorithm_process_finish = true;
   algorithm_thread.join();
+  lod_thread.join();
+  if (server_thread.joinable()) {
+    server_thread.join();
+  }
 
-  return 0;
+  return ret;
 }